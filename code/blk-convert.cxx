@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "blkstore.h"
+#include <sys/uio.h>
+#include <thread>
+#include <atomic>
+
+// convert a single-object block image to a chunked one (blkstore.h):
+//
+// blk-convert bucket/key prefix [chunk_MB [nthreads]]
+//
+// writes chunks "prefix/%08x" of chunk_MB (default 4) and then
+// "prefix/image". Chunks that are all zeros aren't written. The image
+// header goes last, so a conversion that fails part way through isn't
+// mistaken for an image - run it again.
+
+static std::atomic<int64_t> next_chunk;
+static std::atomic<long> n_written, n_sparse, n_failed;
+
+static bool all_zero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static void convert_thread(s3_target *tt, std::string key, std::string prefix,
+			   ssize_t size, size_t chunk_bytes)
+{
+    std::vector<char> buf(chunk_bytes);
+    int64_t n_chunks = (size + chunk_bytes - 1) / chunk_bytes;
+
+    for (int64_t c = next_chunk++; c < n_chunks; c = next_chunk++) {
+	size_t offset = c * chunk_bytes;
+	size_t len = std::min(chunk_bytes, (size_t)size - offset);
+	struct iovec iov = {buf.data(), len};
+	if (tt->s3_get(key, offset, len, &iov, 1) != S3StatusOK) {
+	    fprintf(stderr, "%s: read failed at %zu\n", key.c_str(), offset);
+	    n_failed++;
+	    continue;
+	}
+	if (all_zero(buf.data(), len)) {
+	    n_sparse++;
+	    continue;
+	}
+	if (tt->s3_put(blk_chunk_key(prefix, c), &iov, 1) != S3StatusOK) {
+	    fprintf(stderr, "%s: write failed\n", blk_chunk_key(prefix, c).c_str());
+	    n_failed++;
+	    continue;
+	}
+	n_written++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    char *bucket, *key;
+    if (argc < 3 || sscanf(argv[1], "%m[^/]/%ms", &bucket, &key) != 2) {
+	printf("usage: blk-convert bucket/key prefix [chunk_MB [nthreads]]\n");
+	exit(1);
+    }
+    std::string prefix(argv[2]);
+    size_t chunk_bytes = (argc > 3 ? atol(argv[3]) : 4) * 1024 * 1024;
+    int nthreads = argc > 4 ? atoi(argv[4]) : 8;
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(2 * nthreads, S3_POOL_SHARE_ALL);
+    auto tt = new s3_target(host, bucket, access, secret, false);
+
+    ssize_t size;
+    S3Status status = tt->s3_head(key, &size);
+    if (status != S3StatusOK) {
+	printf("%s: %s\n", argv[1], S3_get_status_name(status));
+	exit(1);
+    }
+    if (size % 512 != 0 || chunk_bytes == 0) {
+	printf("%s: size %zd isn't a multiple of 512\n", argv[1], size);
+	exit(1);
+    }
+
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+	th.push_back(std::thread(convert_thread, tt, std::string(key), prefix,
+				 size, chunk_bytes));
+    for (auto &t : th)
+	t.join();
+
+    printf("%ld chunks written, %ld sparse, %ld failed\n", n_written.load(),
+	   n_sparse.load(), n_failed.load());
+    if (n_failed > 0)
+	exit(1);
+
+    struct blk_image img = {BLK_IMAGE_MAGIC, BLK_IMAGE_VERSION,
+			    (uint32_t)(chunk_bytes / 512), 0, (uint64_t)size / 512};
+    struct iovec iov = {&img, sizeof(img)};
+    if (tt->s3_put(prefix + "/image", &iov, 1) != S3StatusOK) {
+	printf("%s/image: write failed\n", prefix.c_str());
+	exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "blkstore.h"
+#include "crc32c.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+// import a local image file or block device as a chunked block image
+// (blkstore.h):
+//
+// blk-import file bucket/prefix [chunk_MB [nthreads]]
+//
+// Holes and chunks of zeros aren't uploaded, and a chunk that's the
+// same as one already seen just points at its object, so the result is
+// a version 2 (mapped) image. If an import is interrupted, run it again
+// with the same arguments: "prefix/import" says what's being imported,
+// and chunks already in S3 aren't sent again. The map and then the
+// header go last, so a partial import is never taken for an image.
+
+static std::atomic<int64_t> next_chunk, n_done;
+static std::atomic<long> n_written, n_sparse, n_dup, n_resumed, n_failed;
+static std::atomic<int64_t> bytes_read, bytes_sent, bytes_sparse, bytes_dup;
+
+static std::mutex m;
+static std::unordered_map<std::string,uint32_t> owners;	// sha256 -> chunk
+static std::vector<bool> in_s3;		// from an earlier run
+static std::vector<uint32_t> chunk_map;
+
+static bool all_zero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+// lseek(SEEK_DATA) doesn't work on block devices - then it's all data
+//
+static bool is_hole(int fd, off_t offset, size_t len)
+{
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0)
+	return errno == ENXIO;
+    return data >= offset + (off_t)len;
+}
+
+static void import_thread(int fd, s3_target *tt, std::string prefix, int64_t size,
+			  size_t chunk_bytes)
+{
+    std::vector<char> buf(chunk_bytes);
+    int64_t n_chunks = (size + chunk_bytes - 1) / chunk_bytes;
+
+    for (int64_t c = next_chunk++; c < n_chunks; c = next_chunk++, n_done++) {
+	off_t offset = c * chunk_bytes;
+	size_t len = std::min((int64_t)chunk_bytes, size - offset);
+	if (is_hole(fd, offset, len)) {
+	    n_sparse++;
+	    bytes_sparse += len;
+	    continue;
+	}
+	if (pread(fd, buf.data(), len, offset) != (ssize_t)len) {
+	    fprintf(stderr, "read failed at %ld\n", (long)offset);
+	    n_failed++;
+	    continue;
+	}
+	bytes_read += len;
+	if (all_zero(buf.data(), len)) {
+	    n_sparse++;
+	    bytes_sparse += len;
+	    continue;
+	}
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	EVP_Digest(buf.data(), len, md, &md_len, EVP_sha256(), NULL);
+	std::unique_lock lk(m);
+	auto [it, first] = owners.insert({std::string((char*)md, md_len), c});
+	chunk_map[c] = it->second;
+	lk.unlock();
+	if (!first) {
+	    n_dup++;
+	    bytes_dup += len;
+	    continue;
+	}
+	if (in_s3[c]) {
+	    n_resumed++;
+	    continue;
+	}
+
+	struct iovec iov = {buf.data(), len};
+	uint32_t crc = crc32c(0, buf.data(), len);
+	if (tt->s3_put(blk_chunk_key(prefix, c), &iov, 1, &crc) != S3StatusOK) {
+	    fprintf(stderr, "%s: write failed\n", blk_chunk_key(prefix, c).c_str());
+	    n_failed++;
+	    continue;
+	}
+	n_written++;
+	bytes_sent += len;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    char *bucket, *_prefix;
+    if (argc < 3 || sscanf(argv[2], "%m[^/]/%ms", &bucket, &_prefix) != 2) {
+	printf("usage: blk-import file bucket/prefix [chunk_MB [nthreads]]\n");
+	exit(1);
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+	perror(argv[1]);
+	exit(1);
+    }
+    int64_t size = sb.st_size;
+    uint64_t dev_size;
+    if (S_ISBLK(sb.st_mode) && ioctl(fd, BLKGETSIZE64, &dev_size) == 0)
+	size = dev_size;
+
+    std::string prefix(_prefix);
+    size_t chunk_bytes = (argc > 3 ? atol(argv[3]) : 4) * 1024 * 1024;
+    int nthreads = argc > 4 ? atoi(argv[4]) : 8;
+    if (size % 512 != 0 || size == 0 || chunk_bytes == 0) {
+	printf("%s: size %ld isn't a multiple of 512\n", argv[1], (long)size);
+	exit(1);
+    }
+    int64_t n_chunks = (size + chunk_bytes - 1) / chunk_bytes;
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(2 * nthreads, S3_POOL_SHARE_ALL);
+    auto tt = new s3_target(host, bucket, access, secret, false);
+
+    ssize_t len;
+    if (tt->s3_head(prefix + "/image", &len) == S3StatusOK) {
+	printf("%s/image already exists\n", argv[2]);
+	exit(1);
+    }
+
+    // same import as last time, or a new one?
+    struct blk_image img = {BLK_IMAGE_MAGIC, BLK_IMAGE_MAPPED,
+			    (uint32_t)(chunk_bytes / 512), 0, (uint64_t)size / 512};
+    struct blk_image old;
+    struct iovec iov = {&old, sizeof(old)};
+    in_s3.assign(n_chunks, false);
+    if (tt->s3_get(prefix + "/import", 0, sizeof(old), &iov, 1) == S3StatusOK) {
+	if (memcmp(&old, &img, sizeof(img)) != 0) {
+	    printf("%s: a different import was started here\n", argv[2]);
+	    exit(1);
+	}
+	std::vector<uint32_t> present;
+	if (tt->s3_list_indexes(prefix + "/", present, 4) != S3StatusOK) {
+	    printf("%s: can't list\n", argv[2]);
+	    exit(1);
+	}
+	for (auto c : present)
+	    if (c < n_chunks)
+		in_s3[c] = true;
+	printf("resuming: %zu chunks already in S3\n", present.size());
+    }
+    else {
+	iov = {&img, sizeof(img)};
+	if (tt->s3_put(prefix + "/import", &iov, 1) != S3StatusOK) {
+	    printf("%s/import: write failed\n", argv[2]);
+	    exit(1);
+	}
+    }
+    chunk_map.assign(n_chunks, BLK_CHUNK_ZERO);
+
+    auto start = std::chrono::system_clock::now();
+    auto secs = [&]() {
+	std::chrono::duration<double> t = std::chrono::system_clock::now() - start;
+	return t.count();
+    };
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+	th.push_back(std::thread(import_thread, fd, tt, prefix, size, chunk_bytes));
+    for (int i = 1; n_done < n_chunks; i++) {
+	usleep(100000);
+	if (i % 50 == 0)
+	    printf("%ld/%ld chunks, %.1f MB/s\n", (long)n_done.load(), (long)n_chunks,
+		   (bytes_read + bytes_sparse) / secs() / (1024 * 1024));
+    }
+    for (auto &t : th)
+	t.join();
+    double t = secs();
+
+    printf("%ld MB in %.1f s, %.1f MB/s; %.1f MB uploaded in %ld chunks\n",
+	   (long)(size >> 20), t, size / t / (1024 * 1024),
+	   bytes_sent / (1024.0 * 1024), n_written.load());
+    printf("skipped %.1f%%: %.1f%% zeros (%ld chunks), %.1f%% duplicates (%ld), "
+	   "%ld chunks already uploaded\n",
+	   100.0 * (size - bytes_sent) / size, 100.0 * bytes_sparse / size,
+	   n_sparse.load(), 100.0 * bytes_dup / size, n_dup.load(), n_resumed.load());
+    if (n_failed > 0) {
+	printf("%ld failed - run it again to finish\n", n_failed.load());
+	exit(1);
+    }
+
+    iov = {chunk_map.data(), chunk_map.size() * 4};
+    if (tt->s3_put(prefix + "/map", &iov, 1) != S3StatusOK) {
+	printf("%s/map: write failed\n", prefix.c_str());
+	exit(1);
+    }
+    iov = {&img, sizeof(img)};
+    if (tt->s3_put(prefix + "/image", &iov, 1) != S3StatusOK) {
+	printf("%s/image: write failed\n", prefix.c_str());
+	exit(1);
+    }
+    tt->s3_delete(prefix + "/import");
+    return 0;
+}
@@ -0,0 +1,1315 @@
+//
+// file:        blkstore.cc
+// description: log-structured block device over S3 (for the tcmu handler)
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <list>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <libs3.h>
+
+#include "s3wrap.h"
+#include "iov.h"
+#include "extent.cc"
+#include "blkstore.h"
+
+/* Writes are appended to an in-memory object and recorded in an extent
+ * map, LBA -> (object, offset). A full object, or a flush, seals it,
+ * and a writer thread uploads sealed objects in order. Every
+ * ckpt_interval objects the map is saved in a checkpoint object, so
+ * opening the device reads the latest checkpoint and then just the
+ * headers of the objects after it. Sectors that were never written
+ * come from the base image, or are zero if there isn't one. The base
+ * is either the single object "<prefix>" or a chunked image (see
+ * blkstore.h); a chunk that doesn't exist is zeros and costs nothing.
+ *
+ * Objects (sizes in 512-byte sectors, header padded to a sector):
+ *   data:  blk_hdr, blk_data_entry[n_entries], data
+ *          (one entry per write, data in the same order)
+ *   ckpt:  blk_hdr, blk_obj_entry[n_objs], blk_ckpt_entry[n_entries]
+ *
+ * Nothing is cleaned yet - overwritten data stays in the old objects.
+ *
+ * Reads go through an LRU cache of cache_blk-sector blocks of the
+ * device, dropped when they're written. Each of up to ra_streams
+ * sequential readers gets a readahead window that doubles up to
+ * ra_max, loaded asynchronously at prefetch priority by whichever
+ * read queued it - no threads of its own.
+ *
+ * With a local overlay (blk_overlay) S3 is read-only, and writes go to
+ * a sparse local file instead:
+ *   data:    sectors * 512, rounded up to a page
+ *   header:  one page, struct blk_ov_hdr
+ *   bitmap:  a bit per sector, set if the local copy is the one to read
+ * Reads look at the bitmap first. A fill thread can copy the rest of
+ * the device in from S3 in the background, so eventually nothing is
+ * read remotely.
+ */
+enum {
+    BLK_MAGIC = 0x4b4c4253,	// "SBLK"
+    BLK_VERSION = 1,
+    BLK_DATA = 1,
+    BLK_CKPT = 2,
+};
+
+struct blk_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type;
+    uint32_t seq;		// object index
+    uint32_t hdr_sectors;
+    uint32_t data_sectors;
+    uint32_t n_entries;
+    uint32_t n_objs;		// checkpoint only
+};
+
+struct blk_data_entry {
+    uint64_t lba;
+    uint32_t sectors;
+    uint32_t pad;
+};
+
+struct blk_obj_entry {		// header size of each object in the map
+    uint32_t obj;
+    uint32_t hdr_sectors;
+};
+
+struct blk_ckpt_entry {
+    uint64_t lba;
+    uint64_t offset;		// sectors into the object's data
+    uint32_t sectors;
+    uint32_t obj;
+};
+
+enum {
+    BLK_OV_MAGIC = 0x564f4c42,	// "BLOV"
+    BLK_OV_VERSION = 1,
+};
+
+struct blk_ov_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sectors;
+};
+
+// part of a read that comes from S3
+//
+struct blk_piece {
+    std::string key;
+    int64_t     offset, pos, len;	// bytes
+};
+
+// map extent: LBA range -> sectors of a log object's data
+//
+struct blk_extent {
+    int64_t  base;
+    int64_t  limit;
+    uint32_t obj;
+    int64_t  offset;
+
+    static int adjacent(blk_extent a, blk_extent b) {
+	return a.limit == b.base && a.obj == b.obj &&
+	    a.offset + (a.limit - a.base) == b.offset;
+    }
+    void new_base(int64_t _base) {
+	offset += (_base - base);
+	base = _base;
+    }
+    void new_limit(int64_t _limit) {
+	limit = _limit;
+    }
+};
+
+// an object that isn't in S3 yet - the one being filled, or sealed and
+// waiting for the writer. @hdr is filled in when it's sealed.
+//
+struct blk_obj {
+    uint32_t                    obj;
+    std::vector<char>           hdr;
+    std::vector<char>           data;
+    std::vector<blk_data_entry> entries;
+    blk_obj(uint32_t _obj) : obj(_obj) {}
+};
+
+static const size_t obj_bytes = 8 * 1024 * 1024;
+static const int    ckpt_interval = 64;	// objects
+static const size_t max_sealed = 4;	// then writes wait for the writer
+static const int    put_tries = 10;	// a second apart, then give up
+static const int64_t cache_blk = 128;	// sectors (64KB)
+static const int64_t ra_min = 256;	// sectors (128KB)
+static const int64_t ra_max = 8192;	// sectors (4MB)
+static const int     ra_streams = 16;
+static const int64_t fill_sectors = 8192;	// per fill step (4MB)
+static const size_t  page = 4096;
+
+struct blk_cached {
+    int64_t           blk;
+    std::vector<char> data;
+};
+
+// a cache fill in progress - a write to the range in the meantime
+// means the data it read might be stale
+//
+struct blk_fill {
+    int64_t base, limit;
+    bool    stale = false;
+    std::vector<std::function<void()>> waiters;	// async reads to retry
+};
+
+// an async read done in parts: @cb gets the first error once they've
+// all finished. The caller holds a reference while it starts them.
+//
+struct blk_join {
+    std::atomic<int> left {1};
+    std::atomic<int> rv {0};
+    std::function<void(int)> cb;
+
+    blk_join(std::function<void(int)> _cb) : cb(_cb) {}
+    std::function<void(int)> part(void) {
+	left++;
+	return [this](int _rv) { done(_rv); };
+    }
+    void done(int _rv) {
+	int ok = 0;
+	if (_rv != 0)
+	    rv.compare_exchange_strong(ok, _rv);
+	if (--left == 0) {
+	    cb(rv);
+	    delete this;
+	}
+    }
+};
+
+// a sequential reader
+//
+struct blk_stream {
+    int64_t next = -1;		// where its next read would start
+    int64_t win = 0;
+    int64_t done = 0;		// readahead issued up to here
+};
+
+class blkstore {
+    s3_target   *s3;
+    std::string  prefix;
+    enum {BASE_NONE, BASE_OBJECT, BASE_CHUNKED} base_type = BASE_NONE;
+    int64_t      chunk_sectors = 0;
+    std::vector<uint32_t> chunk_map;	// chunked base: object for each chunk
+
+    std::mutex              m;
+    std::condition_variable cv;
+    extmap<blk_extent>      map;
+    std::map<uint32_t,uint32_t> hdr_sectors;	// every sealed object
+    std::map<uint32_t,std::shared_ptr<blk_obj>> in_memory;
+    std::shared_ptr<blk_obj> cur;
+    std::deque<std::shared_ptr<blk_obj>> sealed;
+    uint32_t     next_obj = 0;
+    int          since_ckpt = 0;
+    int64_t      last_ckpt = -1;
+    bool         stop = false;
+    bool         write_failed = false;	// the log has a hole: no more writes
+    std::thread  writer;
+
+    size_t       cache_max;	// blocks
+    std::list<blk_cached> lru;	// most recent first
+    std::unordered_map<int64_t,std::list<blk_cached>::iterator> cache;
+    std::list<blk_fill*> fills;
+    blk_stream   streams[ra_streams];
+    int          next_stream = 0;
+    std::deque<std::pair<int64_t,int64_t>> ra_queue;
+    int          ra_busy = 0;	// readahead loads in flight
+
+    int          ov_fd = -1;	// local overlay
+    std::mutex   om;		// for the bitmap and writes to the file
+    uint64_t    *ov_bits = nullptr;
+    size_t       ov_map_len = 0;
+    std::thread  fill_thread;
+
+    std::string key(uint32_t obj);
+    bool open_base(void);
+    void base_pieces(int64_t base, int64_t limit, int64_t lba,
+		     std::vector<blk_piece> &pieces, struct iovec *iov, int iov_cnt);
+    std::shared_ptr<blk_obj> new_obj(void);
+    void seal(void);
+    void checkpoint(void);
+    void write_loop(void);
+    bool read_hdr(uint32_t obj, std::vector<char> &buf);
+    void replay(blk_hdr *h);
+    void load_ckpt(blk_hdr *h);
+    void get_pieces(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		    std::vector<blk_piece> &pieces);
+    int fetch(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt);
+    void fetch_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		     std::function<void(int)> cb);
+    void end_fill(blk_fill *f, int64_t b0, int64_t b1, std::vector<char> &buf,
+		  int rv);
+    int load(int64_t b0, int64_t b1, int64_t lba, int64_t n,
+	     struct iovec *iov, int iov_cnt);
+    void load_async(int64_t b0, int64_t b1, int64_t lba, int64_t n,
+		    struct iovec *iov, int iov_cnt, std::function<void(int)> cb);
+    void cached(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		std::vector<std::pair<int64_t,int64_t>> &runs);
+    void readahead(int64_t lba, int64_t n);
+    void ra_start(void);
+    int read_remote(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt);
+    void remote_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		      std::function<void(int)> cb, bool again);
+    bool ov_test(int64_t lba);
+    int64_t ov_run(int64_t lba, int64_t limit);
+    void ov_set(int64_t lba, int64_t n);
+    int ov_write(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt);
+    void fill_loop(void);
+
+public:
+    int64_t      sectors;
+    bool         writable;
+
+    blkstore(s3_target *_s3, const char *_prefix, int64_t _sectors,
+	     bool _writable, size_t cache_bytes) :
+	s3(_s3), prefix(_prefix), cache_max(cache_bytes / (cache_blk * 512)), sectors(_sectors),
+	writable(_writable) {}
+
+    bool open(void);
+    int overlay(const char *path, bool fill);
+    void close(void);
+    int read(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt);
+    void read_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		    std::function<void(int)> cb);
+    int write(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt);
+    int flush(void);
+};
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+// the part of @iov from @offset for @len bytes
+//
+static std::vector<struct iovec> iov_slice(struct iovec *iov, int iov_cnt,
+					   size_t offset, size_t len)
+{
+    std::vector<struct iovec> v;
+    for (int i = 0; i < iov_cnt && len > 0; i++) {
+	if (offset >= iov[i].iov_len) {
+	    offset -= iov[i].iov_len;
+	    continue;
+	}
+	size_t n = std::min(iov[i].iov_len - offset, len);
+	v.push_back({(char*)iov[i].iov_base + offset, n});
+	offset = 0;
+	len -= n;
+    }
+    return v;
+}
+
+static void iov_zero(struct iovec *iov, int iov_cnt, size_t offset, size_t len)
+{
+    static char zeros[64*1024];
+    for (size_t done = 0; done < len; ) {
+	size_t n = std::min(len - done, sizeof(zeros));
+	memcpy_to_iov(iov, iov_cnt, offset + done, zeros, n);
+	done += n;
+    }
+}
+
+// a read of the next bytes of the same object as the last piece is
+// the same GET
+//
+static void add_piece(std::vector<blk_piece> &pieces, blk_piece p)
+{
+    if (!pieces.empty()) {
+	blk_piece &last = pieces.back();
+	if (last.key == p.key && last.offset + last.len == p.offset &&
+	    last.pos + last.len == p.pos) {
+	    last.len += p.len;
+	    return;
+	}
+    }
+    pieces.push_back(p);
+}
+
+std::string blkstore::key(uint32_t obj)
+{
+    char _key[1024];
+    snprintf(_key, sizeof(_key), "%s.%08x", prefix.c_str(), obj);
+    return std::string(_key);
+}
+
+std::shared_ptr<blk_obj> blkstore::new_obj(void)
+{
+    auto o = std::make_shared<blk_obj>(next_obj++);
+    o->data.reserve(obj_bytes);
+    in_memory[o->obj] = o;
+    return o;
+}
+
+// queue the current object for the writer and start a new one. Lock
+// must be held.
+//
+void blkstore::seal(void)
+{
+    if (cur->entries.empty())
+	return;
+    auto o = cur;
+    size_t len = sizeof(blk_hdr) + o->entries.size() * sizeof(blk_data_entry);
+    uint32_t hdr_len = round_up(len, 512) / 512;
+    blk_hdr h = {BLK_MAGIC, BLK_VERSION, BLK_DATA, o->obj, hdr_len,
+		 (uint32_t)(o->data.size() / 512), (uint32_t)o->entries.size(), 0};
+    o->hdr.resize(hdr_len * 512, 0);
+    memcpy(o->hdr.data(), &h, sizeof(h));
+    memcpy(o->hdr.data() + sizeof(h), o->entries.data(),
+	   o->entries.size() * sizeof(blk_data_entry));
+    hdr_sectors[o->obj] = hdr_len;
+    sealed.push_back(o);
+
+    // the map only refers to sealed objects at this point, so this is
+    // the place for a checkpoint
+    if (++since_ckpt >= ckpt_interval)
+	checkpoint();
+    cur = new_obj();
+    cv.notify_all();
+}
+
+void blkstore::checkpoint(void)
+{
+    std::vector<blk_ckpt_entry> exts;
+    std::map<uint32_t,uint32_t> objs;
+    for (auto e = map.first(); e != nullptr; e = map.next(e)) {
+	exts.push_back({(uint64_t)e->base, (uint64_t)e->offset,
+			(uint32_t)(e->limit - e->base), e->obj});
+	objs[e->obj] = hdr_sectors[e->obj];
+    }
+
+    auto o = std::make_shared<blk_obj>(next_obj++);
+    size_t len = sizeof(blk_hdr) + objs.size() * sizeof(blk_obj_entry) +
+	exts.size() * sizeof(blk_ckpt_entry);
+    uint32_t hdr_len = round_up(len, 512) / 512;
+    blk_hdr h = {BLK_MAGIC, BLK_VERSION, BLK_CKPT, o->obj, hdr_len, 0,
+		 (uint32_t)exts.size(), (uint32_t)objs.size()};
+    o->hdr.resize(hdr_len * 512, 0);
+    char *p = o->hdr.data();
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    for (auto [obj, n] : objs) {
+	blk_obj_entry oe = {obj, n};
+	memcpy(p, &oe, sizeof(oe));
+	p += sizeof(oe);
+    }
+    memcpy(p, exts.data(), exts.size() * sizeof(blk_ckpt_entry));
+
+    sealed.push_back(o);
+    since_ckpt = 0;
+}
+
+// upload sealed objects in order. Nothing can be acknowledged out of
+// order, so if an object can't be written after put_tries attempts
+// the writer stops, and writes and flushes fail from then on.
+//
+void blkstore::write_loop(void)
+{
+    s3_set_io_class(S3_IO_FLUSH);
+    std::unique_lock lk(m);
+    for (;;) {
+	while (sealed.empty() && !stop)
+	    cv.wait(lk);
+	if (sealed.empty())
+	    break;
+	auto o = sealed.front();
+	lk.unlock();
+
+	std::string _key = key(o->obj);
+	struct iovec iov[2] = {{o->hdr.data(), o->hdr.size()},
+			       {o->data.data(), o->data.size()}};
+	S3Status st;
+	for (int i = 1; (st = s3->s3_put(_key, iov, 2)) != S3StatusOK &&
+		 i < put_tries; i++) {
+	    fprintf(stderr, "blkstore: %s: write failed, retrying\n", _key.c_str());
+	    sleep(1);
+	}
+	if (st != S3StatusOK) {
+	    fprintf(stderr, "blkstore: %s: write failed: %s, giving up\n",
+		    _key.c_str(), S3_get_status_name(st));
+	    lk.lock();
+	    write_failed = true;
+	    cv.notify_all();
+	    break;
+	}
+	if (((blk_hdr*)o->hdr.data())->type == BLK_CKPT) {
+	    if (last_ckpt >= 0)
+		s3->s3_delete(key(last_ckpt));
+	    last_ckpt = o->obj;
+	}
+
+	lk.lock();
+	sealed.pop_front();
+	in_memory.erase(o->obj);
+	cv.notify_all();
+    }
+}
+
+int blkstore::write(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt)
+{
+    if (ov_fd >= 0)
+	return ov_write(lba, n, iov, iov_cnt);
+    if (!writable)
+	return -EROFS;
+    std::unique_lock lk(m);
+    if (write_failed)
+	return -EIO;
+    for (int64_t b = lba / cache_blk; b <= (lba + n - 1) / cache_blk; b++) {
+	auto it = cache.find(b);
+	if (it != cache.end()) {
+	    lru.erase(it->second);
+	    cache.erase(it);
+	}
+    }
+    for (auto f : fills)
+	if (f->base < lba + n && lba < f->limit)
+	    f->stale = true;
+
+    for (int64_t done = 0; done < n; ) {
+	int64_t room = (obj_bytes - cur->data.size()) / 512;
+	if (room == 0) {
+	    seal();
+	    continue;
+	}
+	int64_t len = std::min(n - done, room);
+	size_t offset = cur->data.size();
+	cur->data.resize(offset + len * 512);
+	memcpy_from_iov(iov, iov_cnt, done * 512, &cur->data[offset], len * 512);
+	cur->entries.push_back({(uint64_t)(lba + done), (uint32_t)len, 0});
+	map.update({lba + done, lba + done + len, cur->obj, (int64_t)offset / 512});
+	done += len;
+    }
+    if (cur->data.size() >= obj_bytes)
+	seal();
+    while (sealed.size() > max_sealed && !write_failed)
+	cv.wait(lk);
+    return 0;
+}
+
+int blkstore::flush(void)
+{
+    if (ov_fd >= 0) {
+	if (fdatasync(ov_fd) < 0 || msync((char*)ov_bits - page, ov_map_len, MS_SYNC) < 0)
+	    return -errno;
+	return 0;
+    }
+    std::unique_lock lk(m);
+    seal();
+    uint32_t target = cur->obj;
+    while (!sealed.empty() && sealed.front()->obj < target && !write_failed)
+	cv.wait(lk);
+    return write_failed ? -EIO : 0;
+}
+
+// sectors [@base,@limit) of the base image, for a read starting at @lba
+//
+void blkstore::base_pieces(int64_t base, int64_t limit, int64_t lba,
+			   std::vector<blk_piece> &pieces,
+			   struct iovec *iov, int iov_cnt)
+{
+    if (base_type == BASE_NONE)
+	iov_zero(iov, iov_cnt, (base - lba) * 512, (limit - base) * 512);
+    if (base_type == BASE_OBJECT)
+	add_piece(pieces, {prefix, base * 512, (base - lba) * 512,
+			   (limit - base) * 512});
+    if (base_type != BASE_CHUNKED)
+	return;
+
+    while (base < limit) {
+	int64_t c = base / chunk_sectors;
+	int64_t end = std::min(limit, (c + 1) * chunk_sectors);
+	if (chunk_map[c] != BLK_CHUNK_ZERO)
+	    add_piece(pieces, {blk_chunk_key(prefix, chunk_map[c]),
+			       (base - c * chunk_sectors) * 512,
+			       (base - lba) * 512, (end - base) * 512});
+	else
+	    iov_zero(iov, iov_cnt, (base - lba) * 512, (end - base) * 512);
+	base = end;
+    }
+}
+
+// the S3 ranges holding [@lba,@lba+@n). Data still in memory is
+// copied to @iov while we hold the lock, and holes zeroed.
+//
+void blkstore::get_pieces(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+			  std::vector<blk_piece> &pieces)
+{
+    std::unique_lock lk(m);
+    auto unmapped = [&](int64_t base, int64_t limit) {
+	if (base < limit)
+	    base_pieces(base, limit, lba, pieces, iov, iov_cnt);
+    };
+    int64_t pos = lba;
+    for (auto &e : map.lookup(lba, lba + n)) {
+	unmapped(pos, e.base);
+	int64_t len = (e.limit - e.base) * 512;
+	auto it = in_memory.find(e.obj);
+	if (it != in_memory.end())
+	    memcpy_to_iov(iov, iov_cnt, (e.base - lba) * 512,
+			  &it->second->data[e.offset * 512], len);
+	else
+	    add_piece(pieces, {key(e.obj), (hdr_sectors[e.obj] + e.offset) * 512,
+			       (e.base - lba) * 512, len});
+	pos = e.limit;
+    }
+    unmapped(pos, lba + n);
+}
+
+/* fetch_async(), waited for: the pieces go out in parallel on the
+ * shared event loops, as many at once as the limiter allows, in this
+ * thread's I/O class.
+ */
+int blkstore::fetch(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt)
+{
+    std::mutex              dm;
+    std::condition_variable dcv;
+    bool done = false;
+    int  rv = 0;
+    fetch_async(lba, n, iov, iov_cnt, [&](int _rv) {
+	    std::unique_lock lk(dm);
+	    rv = _rv;
+	    done = true;
+	    dcv.notify_one();
+	});
+    std::unique_lock lk(dm);
+    while (!done)
+	dcv.wait(lk);
+    return rv;
+}
+
+void blkstore::fetch_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+			   std::function<void(int)> cb)
+{
+    std::vector<blk_piece> pieces;
+    get_pieces(lba, n, iov, iov_cnt, pieces);
+
+    auto j = new blk_join(cb);
+    for (auto &p : pieces) {
+	auto v = std::make_shared<std::vector<struct iovec>>(
+	    iov_slice(iov, iov_cnt, p.pos, p.len));
+	auto done = j->part();
+	s3->s3_get_async(p.key, p.offset, p.len, v->data(), v->size(),
+			 [v, done](S3Status status) {
+			     done(status == S3StatusOK ? 0 : -EIO);
+			 });
+    }
+    j->done(0);
+}
+
+// a fill is over: if it worked, and nothing was written to the range
+// meanwhile, blocks @b0..@b1 from @buf go in the cache. Async reads
+// that were waiting for it get another go.
+//
+void blkstore::end_fill(blk_fill *f, int64_t b0, int64_t b1,
+			std::vector<char> &buf, int rv)
+{
+    std::unique_lock lk(m);
+    fills.remove(f);
+    cv.notify_all();
+    if (rv == 0 && !f->stale) {
+	for (int64_t b = b0; b <= b1; b++) {
+	    if (cache.find(b) != cache.end())
+		continue;
+	    char *p = &buf[(b - b0) * cache_blk * 512];
+	    size_t len = (std::min((b + 1) * cache_blk, sectors) - b * cache_blk) * 512;
+	    lru.push_front({b, std::vector<char>(p, p + len)});
+	    cache[b] = lru.begin();
+	}
+	while (cache.size() > cache_max) {
+	    cache.erase(lru.back().blk);
+	    lru.pop_back();
+	}
+    }
+    auto waiters = std::move(f->waiters);
+    lk.unlock();
+    for (auto &w : waiters)
+	w();
+}
+
+// read cache blocks @b0..@b1 into the cache, copying the part in
+// [@lba,@lba+@n) to @iov if it's not null
+//
+int blkstore::load(int64_t b0, int64_t b1, int64_t lba, int64_t n,
+		   struct iovec *iov, int iov_cnt)
+{
+    blk_fill f = {b0 * cache_blk, std::min((b1 + 1) * cache_blk, sectors)};
+    std::vector<char> buf((f.limit - f.base) * 512);
+    std::unique_lock lk(m);
+    fills.push_back(&f);
+    lk.unlock();
+
+    struct iovec v = {buf.data(), buf.size()};
+    int rv = fetch(f.base, f.limit - f.base, &v, 1);
+    if (rv == 0 && iov != nullptr) {
+	int64_t base = std::max(lba, f.base), limit = std::min(lba + n, f.limit);
+	memcpy_to_iov(iov, iov_cnt, (base - lba) * 512,
+		      &buf[(base - f.base) * 512], (limit - base) * 512);
+    }
+
+    end_fill(&f, b0, b1, buf, rv);
+    return rv;
+}
+
+void blkstore::load_async(int64_t b0, int64_t b1, int64_t lba, int64_t n,
+			  struct iovec *iov, int iov_cnt, std::function<void(int)> cb)
+{
+    auto f = std::make_shared<blk_fill>();
+    f->base = b0 * cache_blk;
+    f->limit = std::min((b1 + 1) * cache_blk, sectors);
+    auto buf = std::make_shared<std::vector<char>>((f->limit - f->base) * 512);
+    auto v = std::make_shared<struct iovec>();
+    *v = {buf->data(), buf->size()};
+    std::unique_lock lk(m);
+    fills.push_back(f.get());
+    lk.unlock();
+
+    fetch_async(f->base, f->limit - f->base, v.get(), 1, [=](int rv) {
+	    if (rv == 0 && iov != nullptr) {
+		int64_t base = std::max(lba, f->base), limit = std::min(lba + n, f->limit);
+		memcpy_to_iov(iov, iov_cnt, (base - lba) * 512,
+			      &(*buf)[(base - f->base) * 512], (limit - base) * 512);
+	    }
+	    end_fill(f.get(), b0, b1, *buf, rv);
+	    cb(rv);
+	    (void)v;
+	});
+}
+
+// called with the lock held. A read that starts where one of the
+// streams' last read ended grows its window. Once less than half the
+// window is ahead of the reader we queue the rest of it, so readahead
+// goes out in large pieces. Anything else takes over a stream slot,
+// round-robin.
+//
+void blkstore::readahead(int64_t lba, int64_t n)
+{
+    blk_stream *st = nullptr;
+    for (auto &s : streams)
+	if (s.next == lba)
+	    st = &s;
+    if (st == nullptr) {
+	st = &streams[next_stream++ % ra_streams];
+	*st = blk_stream();
+    }
+    else
+	st->win = std::min(std::max(st->win * 2, ra_min), ra_max);
+    st->next = lba + n;
+
+    int64_t base = std::max(st->done, lba + n);
+    int64_t limit = std::min(lba + n + st->win, sectors);
+    if (st->win == 0 || base >= limit || base - (lba + n) > st->win / 2)
+	return;
+    ra_queue.push_back({base, limit});
+    st->done = limit;
+}
+
+// called without the lock, after readahead(): start loading what it
+// queued. close() waits for these to finish.
+//
+void blkstore::ra_start(void)
+{
+    std::unique_lock lk(m);
+    while (!ra_queue.empty() && !stop) {
+	auto [base, limit] = ra_queue.front();
+	ra_queue.pop_front();
+
+	// skip what's cached already, load the rest in runs
+	int64_t b0 = -1, b = base / cache_blk, b_last = (limit - 1) / cache_blk;
+	std::vector<std::pair<int64_t,int64_t>> runs;
+	for (; b <= b_last; b++) {
+	    bool hit = cache.find(b) != cache.end();
+	    if (!hit && b0 < 0)
+		b0 = b;
+	    if (hit && b0 >= 0) {
+		runs.push_back({b0, b - 1});
+		b0 = -1;
+	    }
+	}
+	if (b0 >= 0)
+	    runs.push_back({b0, b_last});
+	ra_busy += runs.size();
+	lk.unlock();
+	int cls = s3_set_io_class(S3_IO_PREFETCH);
+	for (auto [r0, r1] : runs)
+	    load_async(r0, r1, 0, 0, nullptr, 0, [this](int rv) {
+		    std::unique_lock lk(m);
+		    if (--ra_busy == 0)
+			cv.notify_all();
+		});
+	s3_set_io_class(cls);
+	lk.lock();
+    }
+}
+
+// cached blocks are copied out under the lock; each run of missing
+// blocks is loaded by a single fetch. If someone (e.g. readahead) is
+// already loading part of the range we wait for them instead.
+//
+int blkstore::read_remote(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt)
+{
+    if (cache_max == 0)
+	return fetch(lba, n, iov, iov_cnt);
+
+    std::vector<std::pair<int64_t,int64_t>> runs;
+    std::unique_lock lk(m);
+    readahead(lba, n);
+    lk.unlock();
+    ra_start();
+    lk.lock();
+    auto loading = [&]() {
+	for (auto f : fills)
+	    if (f->base < lba + n && lba < f->limit)
+		return true;
+	return false;
+    };
+    while (loading())
+	cv.wait(lk);
+    cached(lba, n, iov, iov_cnt, runs);
+    lk.unlock();
+
+    for (auto [r0, r1] : runs) {
+	int rv = load(r0, r1, lba, n, iov, iov_cnt);
+	if (rv != 0)
+	    return rv;
+    }
+    return 0;
+}
+
+// instead of waiting for a fill that overlaps, queue up to try again
+// when it's done (@again - it's not a new read for readahead to see)
+//
+void blkstore::remote_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+			    std::function<void(int)> cb, bool again)
+{
+    if (cache_max == 0)
+	return fetch_async(lba, n, iov, iov_cnt, cb);
+
+    std::vector<std::pair<int64_t,int64_t>> runs;
+    std::unique_lock lk(m);
+    if (!again) {
+	readahead(lba, n);
+	lk.unlock();
+	ra_start();		// before @cb can run, and the device go away
+	lk.lock();
+    }
+    for (auto f : fills)
+	if (f->base < lba + n && lba < f->limit) {
+	    f->waiters.push_back([=]() {
+		    remote_async(lba, n, iov, iov_cnt, cb, true);
+		});
+	    return;
+	}
+    cached(lba, n, iov, iov_cnt, runs);
+    lk.unlock();
+
+    auto j = new blk_join(cb);
+    for (auto [r0, r1] : runs)
+	load_async(r0, r1, lba, n, iov, iov_cnt, j->part());
+    j->done(0);
+}
+
+// called with the lock held: copy out what's in the cache, and return
+// the runs of blocks that aren't
+//
+void blkstore::cached(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+		      std::vector<std::pair<int64_t,int64_t>> &runs)
+{
+    int64_t b0 = -1, b_last = (lba + n - 1) / cache_blk;
+    for (int64_t b = lba / cache_blk; b <= b_last; b++) {
+	auto it = cache.find(b);
+	if (it == cache.end()) {
+	    if (b0 < 0)
+		b0 = b;
+	    continue;
+	}
+	if (b0 >= 0) {
+	    runs.push_back({b0, b - 1});
+	    b0 = -1;
+	}
+	lru.splice(lru.begin(), lru, it->second);
+	int64_t base = std::max(lba, b * cache_blk);
+	int64_t limit = std::min(lba + n, (b + 1) * cache_blk);
+	memcpy_to_iov(iov, iov_cnt, (base - lba) * 512,
+		      &it->second->data[(base - b * cache_blk) * 512],
+		      (limit - base) * 512);
+    }
+    if (b0 >= 0)
+	runs.push_back({b0, b_last});
+}
+
+int blkstore::read(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt)
+{
+    if (ov_fd < 0)
+	return read_remote(lba, n, iov, iov_cnt);
+
+    std::vector<std::pair<int64_t,int64_t>> runs;	// alternating local/remote
+    std::unique_lock lk(om);
+    bool local = ov_test(lba);
+    for (int64_t pos = lba; pos < lba + n; ) {
+	int64_t end = ov_run(pos, lba + n);
+	runs.push_back({pos, end});
+	pos = end;
+    }
+    lk.unlock();
+
+    for (auto [base, limit] : runs) {
+	auto v = iov_slice(iov, iov_cnt, (base - lba) * 512, (limit - base) * 512);
+	if (local) {
+	    ssize_t len = (limit - base) * 512;
+	    if (preadv(ov_fd, v.data(), v.size(), base * 512) != len)
+		return -EIO;
+	}
+	else {
+	    int rv = read_remote(base, limit - base, v.data(), v.size());
+	    if (rv != 0)
+		return rv;
+	}
+	local = !local;
+    }
+    return 0;
+}
+
+// same as read(), but local overlay data is the only thing read
+// before returning
+//
+void blkstore::read_async(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt,
+			  std::function<void(int)> cb)
+{
+    if (ov_fd < 0)
+	return remote_async(lba, n, iov, iov_cnt, cb, false);
+
+    std::vector<std::pair<int64_t,int64_t>> runs;	// alternating local/remote
+    std::unique_lock lk(om);
+    bool local = ov_test(lba);
+    for (int64_t pos = lba; pos < lba + n; ) {
+	int64_t end = ov_run(pos, lba + n);
+	runs.push_back({pos, end});
+	pos = end;
+    }
+    lk.unlock();
+
+    auto j = new blk_join(cb);
+    for (auto [base, limit] : runs) {
+	auto v = std::make_shared<std::vector<struct iovec>>(
+	    iov_slice(iov, iov_cnt, (base - lba) * 512, (limit - base) * 512));
+	if (local) {
+	    ssize_t len = (limit - base) * 512;
+	    if (preadv(ov_fd, v->data(), v->size(), base * 512) != len)
+		j->part()(-EIO);
+	}
+	else {
+	    auto done = j->part();
+	    remote_async(base, limit - base, v->data(), v->size(),
+			 [v, done](int rv) { done(rv); }, false);
+	}
+	local = !local;
+    }
+    j->done(0);
+}
+
+bool blkstore::ov_test(int64_t lba)
+{
+    return (ov_bits[lba / 64] >> (lba % 64)) & 1;
+}
+
+// end of the run of sectors with the same bit as @lba, up to @limit
+//
+int64_t blkstore::ov_run(int64_t lba, int64_t limit)
+{
+    bool val = ov_test(lba);
+    uint64_t all = val ? ~0ull : 0;
+    while (lba < limit) {
+	if (lba % 64 == 0 && limit - lba >= 64 && ov_bits[lba / 64] == all)
+	    lba += 64;
+	else if (ov_test(lba) == val)
+	    lba++;
+	else
+	    break;
+    }
+    return lba;
+}
+
+void blkstore::ov_set(int64_t lba, int64_t n)
+{
+    for (int64_t i = lba; i < lba + n; i++)
+	ov_bits[i / 64] |= (1ull << (i % 64));
+}
+
+// data first, then the bits. A crash before the next flush can lose
+// either.
+//
+int blkstore::ov_write(int64_t lba, int64_t n, struct iovec *iov, int iov_cnt)
+{
+    std::unique_lock lk(om);
+    if (pwritev(ov_fd, iov, iov_cnt, lba * 512) != n * 512)
+	return -EIO;
+    ov_set(lba, n);
+    return 0;
+}
+
+/* Copy whatever isn't local yet in from S3, a piece at a time and at
+ * prefetch priority. Sectors written while we were reading are left
+ * alone, and runs of zeros become holes.
+ */
+void blkstore::fill_loop(void)
+{
+    s3_set_io_class(S3_IO_PREFETCH);
+    std::vector<char> buf(fill_sectors * 512);
+    std::vector<char> zeros(fill_sectors * 512, 0);
+
+    for (int64_t lba = 0; lba < sectors; ) {
+	{
+	    std::unique_lock lk(m);
+	    if (stop)
+		return;
+	}
+	int64_t n = std::min(fill_sectors, sectors - lba);
+	std::unique_lock lk(om);
+	bool done = ov_test(lba) && ov_run(lba, lba + n) == lba + n;
+	lk.unlock();
+	if (done) {
+	    lba += n;
+	    continue;
+	}
+
+	struct iovec iov = {buf.data(), (size_t)n * 512};
+	if (fetch(lba, n, &iov, 1) != 0) {
+	    fprintf(stderr, "blkstore: %s: fill failed at %ld, retrying\n",
+		    prefix.c_str(), (long)lba);
+	    sleep(1);
+	    continue;
+	}
+
+	lk.lock();
+	for (int64_t pos = lba; pos < lba + n; ) {
+	    int64_t end = ov_run(pos, lba + n);
+	    if (!ov_test(pos)) {
+		char *p = &buf[(pos - lba) * 512];
+		size_t len = (end - pos) * 512;
+		if (memcmp(p, zeros.data(), len) == 0)
+		    fallocate(ov_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      pos * 512, len);
+		else if (pwrite(ov_fd, p, len, pos * 512) != (ssize_t)len) {
+		    fprintf(stderr, "blkstore: overlay write failed: %s\n",
+			    strerror(errno));
+		    return;
+		}
+		ov_set(pos, end - pos);
+	    }
+	    pos = end;
+	}
+	lk.unlock();
+	lba += n;
+    }
+    fprintf(stderr, "blkstore: %s: overlay filled\n", prefix.c_str());
+}
+
+// open (or create) the overlay file at @path
+//
+int blkstore::overlay(const char *path, bool fill)
+{
+    if (writable)
+	return -EINVAL;
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+	return -errno;
+
+    off_t hdr_off = round_up(sectors * 512, page);
+    size_t map_len = round_up(page + (sectors + 7) / 8, page);
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (sb.st_size == 0 && ftruncate(fd, hdr_off + map_len) < 0)) {
+	int err = errno;
+	::close(fd);
+	return -err;
+    }
+    // a short file would SIGBUS on the header below
+    if (sb.st_size != 0 && sb.st_size != (off_t)(hdr_off + map_len)) {
+	fprintf(stderr, "blkstore: %s: not an overlay for %ld sectors\n",
+		path, (long)sectors);
+	::close(fd);
+	return -EINVAL;
+    }
+    void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, hdr_off);
+    if (p == MAP_FAILED) {
+	int err = errno;
+	::close(fd);
+	return -err;
+    }
+
+    blk_ov_hdr *h = (blk_ov_hdr*)p;
+    if (sb.st_size == 0)
+	*h = {BLK_OV_MAGIC, BLK_OV_VERSION, (uint64_t)sectors};
+    if (h->magic != BLK_OV_MAGIC || h->version != BLK_OV_VERSION ||
+	h->sectors != (uint64_t)sectors) {
+	fprintf(stderr, "blkstore: %s: not an overlay for %ld sectors\n",
+		path, (long)sectors);
+	munmap(p, map_len);
+	::close(fd);
+	return -EINVAL;
+    }
+
+    ov_fd = fd;
+    ov_bits = (uint64_t*)((char*)p + page);
+    ov_map_len = map_len;
+    if (fill)
+	fill_thread = std::thread(&blkstore::fill_loop, this);
+    return 0;
+}
+
+bool blkstore::read_hdr(uint32_t obj, std::vector<char> &buf)
+{
+    buf.assign(4096, 0);
+    for (;;) {
+	struct iovec iov = {buf.data(), buf.size()};
+	if (s3->s3_get(key(obj), 0, buf.size(), &iov, 1) != S3StatusOK)
+	    return false;
+	blk_hdr *h = (blk_hdr*)buf.data();
+	if (h->magic != BLK_MAGIC || h->version != BLK_VERSION || h->seq != obj)
+	    return false;
+	size_t len = (size_t)h->hdr_sectors * 512;
+	size_t used = sizeof(blk_hdr) + (h->type == BLK_CKPT ?
+					 h->n_objs * sizeof(blk_obj_entry) +
+					 h->n_entries * sizeof(blk_ckpt_entry) :
+					 h->n_entries * sizeof(blk_data_entry));
+	if (used > len)
+	    return false;
+	if (len <= buf.size())
+	    return true;
+	buf.assign(len, 0);
+    }
+}
+
+void blkstore::replay(blk_hdr *h)
+{
+    blk_data_entry *e = (blk_data_entry*)(h + 1);
+    int64_t offset = 0;
+    for (uint32_t i = 0; i < h->n_entries; i++) {
+	int64_t lba = e[i].lba;
+	map.update({lba, lba + e[i].sectors, h->seq, offset});
+	offset += e[i].sectors;
+    }
+    hdr_sectors[h->seq] = h->hdr_sectors;
+}
+
+void blkstore::load_ckpt(blk_hdr *h)
+{
+    blk_obj_entry *oe = (blk_obj_entry*)(h + 1);
+    for (uint32_t i = 0; i < h->n_objs; i++)
+	hdr_sectors[oe[i].obj] = oe[i].hdr_sectors;
+    blk_ckpt_entry *ce = (blk_ckpt_entry*)(oe + h->n_objs);
+    for (uint32_t i = 0; i < h->n_entries; i++) {
+	int64_t lba = ce[i].lba;
+	map.update({lba, lba + ce[i].sectors, ce[i].obj, (int64_t)ce[i].offset});
+    }
+}
+
+static bool not_found(S3Status status)
+{
+    return status == S3StatusHttpErrorNotFound || status == S3StatusErrorNoSuchKey;
+}
+
+// a chunked image, or a single object, or neither. Either way it has
+// to be the size of the device.
+//
+bool blkstore::open_base(void)
+{
+    struct blk_image img;
+    struct iovec iov = {&img, sizeof(img)};
+    S3Status status = s3->s3_get(prefix + "/image", 0, sizeof(img), &iov, 1);
+    if (status == S3StatusOK) {
+	if (img.magic != BLK_IMAGE_MAGIC || img.chunk_sectors == 0 ||
+	    (img.version != BLK_IMAGE_VERSION && img.version != BLK_IMAGE_MAPPED)) {
+	    fprintf(stderr, "blkstore: %s/image: bad image header\n", prefix.c_str());
+	    return false;
+	}
+	if ((int64_t)img.sectors != sectors) {
+	    fprintf(stderr, "blkstore: %s: image is %ld sectors, device %ld\n",
+		    prefix.c_str(), (long)img.sectors, (long)sectors);
+	    return false;
+	}
+	chunk_sectors = img.chunk_sectors;
+	size_t n_chunks = (sectors + chunk_sectors - 1) / chunk_sectors;
+	chunk_map.assign(n_chunks, BLK_CHUNK_ZERO);
+	if (img.version == BLK_IMAGE_MAPPED) {
+	    iov = {chunk_map.data(), n_chunks * 4};
+	    if (s3->s3_get(prefix + "/map", 0, n_chunks * 4, &iov, 1) != S3StatusOK) {
+		fprintf(stderr, "blkstore: %s/map: can't read\n", prefix.c_str());
+		return false;
+	    }
+	}
+	else {
+	    std::vector<uint32_t> present;
+	    if (s3->s3_list_indexes(prefix + "/", present, 4) != S3StatusOK)
+		return false;
+	    for (auto c : present)
+		if (c < n_chunks)
+		    chunk_map[c] = c;
+	}
+	base_type = BASE_CHUNKED;
+	return true;
+    }
+    if (!not_found(status))
+	return false;
+
+    ssize_t len;
+    status = s3->s3_head(prefix, &len);
+    if (status == S3StatusOK) {
+	if (len != sectors * 512) {
+	    fprintf(stderr, "blkstore: %s: image is %ld sectors, device %ld\n",
+		    prefix.c_str(), (long)(len / 512), (long)sectors);
+	    return false;
+	}
+	base_type = BASE_OBJECT;
+	return true;
+    }
+    return not_found(status);
+}
+
+// rebuild the map: the newest checkpoint, then the data objects after it
+//
+bool blkstore::open(void)
+{
+    if (!open_base())
+	return false;
+
+    std::vector<uint32_t> objs;
+    if (s3->s3_list_indexes(prefix + ".", objs, 4) != S3StatusOK)
+	return false;
+    std::sort(objs.begin(), objs.end());
+
+    std::vector<std::vector<char>> hdrs;
+    for (auto it = objs.rbegin(); it != objs.rend(); it++) {
+	std::vector<char> buf;
+	if (!read_hdr(*it, buf))
+	    return false;
+	if (((blk_hdr*)buf.data())->type == BLK_CKPT) {
+	    load_ckpt((blk_hdr*)buf.data());
+	    last_ckpt = *it;
+	    break;
+	}
+	hdrs.push_back(std::move(buf));
+    }
+    for (auto it = hdrs.rbegin(); it != hdrs.rend(); it++)
+	replay((blk_hdr*)it->data());
+
+    next_obj = objs.empty() ? 0 : objs.back() + 1;
+    cur = new_obj();
+    if (writable)
+	writer = std::thread(&blkstore::write_loop, this);
+    return true;
+}
+
+// write out everything, with a checkpoint so the next open is quick
+//
+void blkstore::close(void)
+{
+    std::unique_lock lk(m);
+    if (writable) {
+	seal();
+	if (since_ckpt > 0)
+	    checkpoint();
+    }
+    stop = true;
+    cv.notify_all();
+    while (ra_busy > 0)
+	cv.wait(lk);
+    lk.unlock();
+    if (writer.joinable())
+	writer.join();
+    if (fill_thread.joinable())
+	fill_thread.join();
+    if (ov_fd >= 0) {
+	fdatasync(ov_fd);
+	msync((char*)ov_bits - page, ov_map_len, MS_SYNC);
+	munmap((char*)ov_bits - page, ov_map_len);
+	::close(ov_fd);
+    }
+}
+
+std::string blk_chunk_key(std::string prefix, int64_t chunk)
+{
+    char _key[32];
+    snprintf(_key, sizeof(_key), "/%08x", (uint32_t)chunk);
+    return prefix + _key;
+}
+
+void *blk_open(void *s3, const char *prefix, int64_t sectors, bool writable,
+	       size_t cache_bytes)
+{
+    blkstore *bs = new blkstore((s3_target*)s3, prefix, sectors, writable,
+				cache_bytes);
+    if (!bs->open()) {
+	delete bs;
+	return NULL;
+    }
+    return (void*)bs;
+}
+
+static bool bad_range(int64_t sectors, off_t offset, size_t len)
+{
+    return (offset % 512) != 0 || (len % 512) != 0 || offset < 0 ||
+	(offset + len) / 512 > (size_t)sectors;
+}
+
+int blk_read(void *_bs, off_t offset, size_t len, struct iovec *iov, int iov_cnt)
+{
+    blkstore *bs = (blkstore*)_bs;
+    if (bad_range(bs->sectors, offset, len))
+	return -EINVAL;
+    return bs->read(offset / 512, len / 512, iov, iov_cnt);
+}
+
+int blk_read_async(void *_bs, off_t offset, size_t len, struct iovec *iov,
+		   int iov_cnt, void (*done)(void *arg, int rv), void *arg)
+{
+    blkstore *bs = (blkstore*)_bs;
+    if (bad_range(bs->sectors, offset, len))
+	return -EINVAL;
+    bs->read_async(offset / 512, len / 512, iov, iov_cnt,
+		   [done, arg](int rv) { done(arg, rv); });
+    return 0;
+}
+
+int blk_write(void *_bs, off_t offset, size_t len, struct iovec *iov, int iov_cnt)
+{
+    blkstore *bs = (blkstore*)_bs;
+    if (bad_range(bs->sectors, offset, len))
+	return -EINVAL;
+    return bs->write(offset / 512, len / 512, iov, iov_cnt);
+}
+
+int blk_overlay(void *_bs, const char *path, bool fill)
+{
+    blkstore *bs = (blkstore*)_bs;
+    return bs->overlay(path, fill);
+}
+
+int blk_flush(void *_bs)
+{
+    blkstore *bs = (blkstore*)_bs;
+    return bs->flush();
+}
+
+void blk_close(void *_bs)
+{
+    blkstore *bs = (blkstore*)_bs;
+    bs->close();
+    delete bs;
+}
@@ -0,0 +1,80 @@
+//
+// file:        blkstore.h
+// description: log-structured block device over S3 (for the tcmu handler)
+//
+
+#ifndef __BLKSTORE_H__
+#define __BLKSTORE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A device of @sectors 512-byte sectors stored as an optional base image
+ * (read-only) plus a log of objects "<prefix>.%08x" holding everything
+ * written since. Offsets and lengths are in bytes, multiples of 512.
+ *
+ * The base image is either the single object "<prefix>", or chunked:
+ * a struct blk_image in "<prefix>/image" plus chunk objects
+ * "<prefix>/%08x" (chunk number). Chunks that don't exist are zeros.
+ * Version 2 (BLK_IMAGE_MAPPED) images also have "<prefix>/map", a
+ * uint32_t per chunk giving the number of the object that holds it, or
+ * BLK_CHUNK_ZERO - identical chunks can share an object (blk-import).
+ * The base image has to be the size of the device.
+ *
+ * blk_read/blk_write return 0 or -errno. A write is in memory when
+ * blk_write returns; blk_flush returns once everything written before
+ * it is in S3. If an object still can't be written after several
+ * tries the log can't be continued, and that flush and every write and
+ * flush after it return -EIO. Reads are cached in up to @cache_bytes of memory, with
+ * readahead for sequential reads; 0 turns both off.
+ *
+ * blk_read_async() returns once the read is started, and calls @done
+ * with 0 or -errno from another thread (or this one, if there was
+ * nothing to wait for). It's -EINVAL straight away, without a call to
+ * @done, if the range is bad. All reads have to be done before
+ * blk_close.
+ *
+ * blk_overlay() keeps S3 read-only (open the device with !@writable)
+ * and sends writes to a local sparse file at @path instead, created if
+ * needed, which remembers what has been written. With @fill it also
+ * copies the rest of the device into the file in the background.
+ */
+enum {
+    BLK_IMAGE_MAGIC = 0x474d4953,	/* "SIMG" */
+    BLK_IMAGE_VERSION = 1,
+    BLK_IMAGE_MAPPED = 2,
+};
+
+#define BLK_CHUNK_ZERO 0xffffffffu
+
+struct blk_image {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_sectors;
+    uint32_t pad;
+    uint64_t sectors;
+};
+
+#ifdef __cplusplus
+#include <string>
+std::string blk_chunk_key(std::string prefix, int64_t chunk);
+
+extern "C" {
+#endif
+
+void *blk_open(void *s3, const char *prefix, int64_t sectors, bool writable,
+	       size_t cache_bytes);
+int blk_read(void *bs, off_t offset, size_t len, struct iovec *iov, int iov_cnt);
+int blk_read_async(void *bs, off_t offset, size_t len, struct iovec *iov,
+		   int iov_cnt, void (*done)(void *arg, int rv), void *arg);
+int blk_write(void *bs, off_t offset, size_t len, struct iovec *iov, int iov_cnt);
+int blk_overlay(void *bs, const char *path, bool fill);
+int blk_flush(void *bs);
+void blk_close(void *bs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
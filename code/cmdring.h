@@ -0,0 +1,132 @@
+/*
+ * file:        cmdring.h
+ * description: bounded lock-free MPMC ring of block commands (s3ro.c)
+ */
+
+#ifndef __CMDRING_H__
+#define __CMDRING_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum {OP_READ, OP_WRITE, OP_FLUSH};
+
+struct ring_cmd {
+    int           op;
+    void         *cmd;          /* struct tcmur_cmd */
+    struct iovec *iov;
+    size_t        iov_cnt;
+    size_t        length;
+    off_t         offset;
+};
+
+/* Commands are stored in the cells, so nothing is allocated per
+ * command. Each cell's sequence number says whose turn it is: @pos for
+ * the producer that claims position @pos, @pos+1 once it's filled in
+ * for the consumer, and @pos+size when it's free again for the next
+ * lap. Producers and consumers claim positions with a CAS on @tail
+ * and @head respectively (D. Vyukov's bounded MPMC queue).
+ */
+struct ring_cell {
+    _Atomic size_t  seq;
+    struct ring_cmd c;
+};
+
+struct cmd_ring {
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) size_t mask;
+    struct ring_cell *cells;
+};
+
+/* @size must be a power of 2
+ */
+static inline void ring_init(struct cmd_ring *r, size_t size)
+{
+    r->cells = calloc(size, sizeof(struct ring_cell));
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&r->cells[i].seq, i);
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+}
+
+static inline void ring_free(struct cmd_ring *r)
+{
+    free(r->cells);
+}
+
+/* returns false if the ring is full
+ */
+static inline bool ring_put(struct cmd_ring *r, const struct ring_cmd *c)
+{
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    struct ring_cell *cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        ssize_t dif = (ssize_t)(seq - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+            return false;
+        else
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+    cell->c = *c;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/* take up to @max commands in one go - the run of filled cells at the
+ * head is claimed with a single CAS. Returns the number taken.
+ */
+static inline int ring_get(struct cmd_ring *r, struct ring_cmd *c, int max)
+{
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    int n;
+    for (;;) {
+        for (n = 0; n < max; n++) {
+            struct ring_cell *cell = &r->cells[(pos + n) & r->mask];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            if (seq != pos + n + 1)
+                break;
+        }
+        if (n == 0) {
+            struct ring_cell *cell = &r->cells[pos & r->mask];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            if ((ssize_t)(seq - (pos + 1)) < 0)
+                return 0;               /* empty */
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+            continue;                   /* someone else took it */
+        }
+        if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + n,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            break;
+    }
+    for (int i = 0; i < n; i++) {
+        struct ring_cell *cell = &r->cells[(pos + i) & r->mask];
+        c[i] = cell->c;
+        atomic_store_explicit(&cell->seq, pos + i + r->mask + 1, memory_order_release);
+    }
+    return n;
+}
+
+/* approximate - for deciding how much to take
+ */
+static inline size_t ring_count(struct cmd_ring *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * file:        crc32c.c
+ * description: CRC32C (Castagnoli), using the SSE4.2 crc32 instruction
+ *              when the CPU has it and a table otherwise.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78		/* reversed 0x1EDC6F41 */
+
+static uint32_t table[256];
+static bool table_ready;
+
+static void make_table(void)
+{
+    for (int i = 0; i < 256; i++) {
+	uint32_t c = i;
+	for (int j = 0; j < 8; j++)
+	    c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+	table[i] = c;
+    }
+    table_ready = true;
+}
+
+/* software versions work on the raw (inverted) CRC state. If @dst is
+ * non-NULL the data is copied there as well.
+ */
+static uint32_t sw_crc(uint32_t c, void *dst, const void *src, size_t len)
+{
+    const uint8_t *p = src;
+    if (!table_ready)
+	make_table();
+    if (dst)
+	memcpy(dst, src, len);
+    while (len--)
+	c = table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#if defined(__x86_64__)
+/* one pass over the data: each 8-byte word is loaded once, stored to
+ * @dst (if any) and folded into the CRC.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t hw_crc(uint32_t c, void *dst, const void *src, size_t len)
+{
+    const uint8_t *p = src;
+    uint8_t *q = dst;
+    uint64_t c64 = c;
+
+    for (; len >= 8; len -= 8, p += 8) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	if (q) {
+	    memcpy(q, &v, 8);
+	    q += 8;
+	}
+	c64 = _mm_crc32_u64(c64, v);
+    }
+    c = (uint32_t)c64;
+    for (; len > 0; len--, p++) {
+	if (q)
+	    *q++ = *p;
+	c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+
+static int have_sse42 = -1;
+
+static uint32_t do_crc(uint32_t c, void *dst, const void *src, size_t len)
+{
+    if (have_sse42 < 0)
+	have_sse42 = __builtin_cpu_supports("sse4.2");
+    return have_sse42 ? hw_crc(c, dst, src, len) : sw_crc(c, dst, src, len);
+}
+#else
+#define do_crc sw_crc
+#endif
+
+/* CRC of @len bytes at @buf, continuing from @crc
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~do_crc(~crc, NULL, buf, len);
+}
+
+/* memcpy(@dst, @src, @len), returning the CRC of the copied data
+ * (continuing from @crc) without a second pass over it.
+ */
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return ~do_crc(~crc, dst, src, len);
+}
+
+/* CRC combination, as in zlib's crc32_combine: the CRC of A followed by
+ * B is computed by applying @len2 zero bytes to crc(A) - done as
+ * repeated squaring of the GF(2) "one zero bit" operator - and XORing
+ * in crc(B).
+ */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+	if (vec & 1)
+	    sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+	square[n] = gf2_times(mat, mat[n]);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    uint32_t even[32], odd[32];
+
+    if (len2 == 0)
+	return crc1;
+
+    odd[0] = POLY;		/* operator for one zero bit */
+    for (int n = 1; n < 32; n++)
+	odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);	/* two zero bits */
+    gf2_square(odd, even);	/* four zero bits */
+
+    /* first time through applies one zero byte */
+    do {
+	gf2_square(even, odd);
+	if (len2 & 1)
+	    crc1 = gf2_times(even, crc1);
+	len2 >>= 1;
+	if (len2 == 0)
+	    break;
+	gf2_square(odd, even);
+	if (len2 & 1)
+	    crc1 = gf2_times(odd, crc1);
+	len2 >>= 1;
+    } while (len2 != 0);
+
+    return crc1 ^ crc2;
+}
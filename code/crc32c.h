@@ -0,0 +1,27 @@
+/*
+ * file:        crc32c.h
+ * description: CRC32C (Castagnoli) checksums
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* all of these take and return a finished CRC, starting from 0, so
+ * crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t len);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
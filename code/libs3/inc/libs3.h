@@ -147,6 +147,13 @@ extern "C" {
 #define S3_MAX_KEY_SIZE                    1024
 
 
+/**
+ * S3_MAX_DELETE_KEYS is the maximum number of keys that may be deleted in
+ * a single multiple-object delete request.
+ **/
+#define S3_MAX_DELETE_KEYS                 1000
+
+
 /**
  * S3_MAX_METADATA_SIZE is the maximum number of bytes allowed for
  * x-amz-meta header names and values in any request passed to Amazon S3
@@ -227,6 +234,17 @@ extern "C" {
 #define S3_INIT_VERIFY_PEER                2
 
 
+/**
+ * These constants are used by S3_set_request_pool() to select which curl
+ * caches are shared between all of the curl handles libs3 uses.  Sharing
+ * DNS results and TLS sessions makes setting up a new connection cheaper.
+ **/
+#define S3_POOL_SHARE_DNS                  1
+#define S3_POOL_SHARE_SSL_SESSION          2
+#define S3_POOL_SHARE_ALL                  (S3_POOL_SHARE_DNS | \
+                                            S3_POOL_SHARE_SSL_SESSION)
+
+
 /**
  * This convenience constant is used by the S3_initialize() function to
  * indicate that all libraries required by libs3 should be initialized.
@@ -913,6 +931,14 @@ typedef struct S3PutProperties
      * response has the usesServerSideEncryption flag set.
      **/
     char useServerSideEncryption;
+
+    /**
+     * If present, this is the base64-encoded big-endian CRC32C checksum of
+     * the object data, sent as the x-amz-checksum-crc32c header; S3 rejects
+     * the put if the data it receives does not match.  Only for use with
+     * stores which support additional checksums.
+     **/
+    const char *checksumCRC32C;
 } S3PutProperties;
 
 
@@ -995,6 +1021,32 @@ typedef struct S3ErrorDetails
 } S3ErrorDetails;
 
 
+/**
+ * S3ConnectionStats counts the requests libs3 has performed and the
+ * connections and curl handles it had to create to do so.  With effective
+ * connection re-use, connects stays close to zero as requests grows.
+ **/
+typedef struct S3ConnectionStats
+{
+    /**
+     * Number of requests completed
+     **/
+    uint64_t requests;
+
+    /**
+     * Number of new connections opened by those requests
+     **/
+    uint64_t connects;
+
+    /**
+     * Number of curl handles created and destroyed; handles are destroyed
+     * when the request pool is full
+     **/
+    uint64_t handlesCreated;
+    uint64_t handlesDestroyed;
+} S3ConnectionStats;
+
+
 /** **************************************************************************
  * Callback Signatures
  ************************************************************************** **/
@@ -1101,6 +1153,26 @@ typedef S3Status (S3ListBucketCallback)(int isTruncated,
                                         void *callbackData);
 
 
+/**
+ * This callback is made for each key that a multiple-object delete request
+ * failed to delete.  Keys that were deleted are not reported (the request
+ * is made in "quiet" mode).
+ *
+ * @param key is the key that was not deleted
+ * @param code is the S3 error code, e.g. "AccessDenied"
+ * @param message is the error message returned by S3, or an empty string
+ * @param callbackData is the callback data as specified when the request
+ *        was issued.
+ * @return S3StatusOK to continue processing the request, anything else to
+ *         immediately abort the request with a status which will be
+ *         passed to the S3ResponseCompleteCallback for this request.
+ **/
+typedef S3Status (S3DeleteMultipleObjectsErrorCallback)(const char *key,
+                                                        const char *code,
+                                                        const char *message,
+                                                        void *callbackData);
+
+
 /**
  * This callback is made during a put object operation, to obtain the next
  * chunk of data to put to the S3 service as the contents of the object.  This
@@ -1380,6 +1452,25 @@ typedef struct S3GetObjectHandler
 } S3GetObjectHandler;
 
 
+/**
+ * An S3DeleteMultipleObjectsHandler defines the callbacks which are made
+ * for delete_multiple_objects requests.
+ **/
+typedef struct S3DeleteMultipleObjectsHandler
+{
+    /**
+     * responseHandler provides the properties and complete callback
+     **/
+    S3ResponseHandler responseHandler;
+
+    /**
+     * The errorCallback is called once for each key which could not be
+     * deleted.  It may be NULL.
+     **/
+    S3DeleteMultipleObjectsErrorCallback *errorCallback;
+} S3DeleteMultipleObjectsHandler;
+
+
 typedef struct S3MultipartInitialHandler {
     /**
      * responseHandler provides the properties and complete callback
@@ -1489,6 +1580,38 @@ S3Status S3_initialize(const char *userAgentInfo, int flags,
 void S3_deinitialize();
 
 
+/**
+ * Configures the pool of idle requests that libs3 keeps for re-use.  Each
+ * idle request holds a curl handle and its keep-alive connection, so the
+ * pool should be at least as large as the number of threads (or
+ * outstanding requests) issuing S3 requests concurrently.  The pool is
+ * sharded by thread, so that concurrent threads rarely contend for it.
+ * This function is NOT thread-safe, and should be called before any
+ * requests are made.
+ *
+ * @param maxIdleRequests is the number of idle requests to keep; requests
+ *        released when the pool is full are destroyed, closing their
+ *        connections.  If negative, the default (256) is used.
+ * @param shareFlags is a bitmask of S3_POOL_SHARE_XXX flags, or 0 to share
+ *        nothing between curl handles.
+ * @return One of:
+ *         S3StatusOK on success
+ *         S3StatusOutOfMemory if the curl share handle could not be created
+ *         S3StatusInternalError if curl does not support the requested
+ *             sharing
+ **/
+S3Status S3_set_request_pool(int maxIdleRequests, int shareFlags);
+
+
+/**
+ * Returns the number of requests made, connections opened and curl handles
+ * created and destroyed since the program started.
+ *
+ * @param stats will be filled in with the current counts
+ **/
+void S3_get_connection_stats(S3ConnectionStats *stats);
+
+
 /**
  * Returns a string with the textual name of an S3Status code
  *
@@ -2219,6 +2342,36 @@ void S3_delete_object(const S3BucketContext *bucketContext, const char *key,
                       const S3ResponseHandler *handler, void *callbackData);
 
 
+/**
+ * Deletes up to S3_MAX_DELETE_KEYS objects from a bucket in a single
+ * request (POST ?delete).  Deleting a key that does not exist is not an
+ * error.  Not all S3-compatible services implement this request; those
+ * that don't typically fail it with S3StatusErrorNotImplemented or
+ * S3StatusErrorMethodNotAllowed, and the keys must be deleted one at a
+ * time with S3_delete_object.
+ *
+ * @param bucketContext gives the bucket and associated parameters for this
+ *        request
+ * @param keysCount is the number of keys in the keys parameter, from 1 to
+ *        S3_MAX_DELETE_KEYS
+ * @param keys is an array of the keys of the objects to delete
+ * @param requestContext if non-NULL, gives the S3RequestContext to add this
+ *        request to, and does not perform the request immediately.  If NULL,
+ *        performs the request immediately and synchronously.
+ * @param timeoutMs if not 0 contains total request timeout in milliseconds
+ * @param handler gives the callbacks to call as the request is processed and
+ *        completed
+ * @param callbackData will be passed in as the callbackData parameter to
+ *        all callbacks for this request
+ **/
+void S3_delete_multiple_objects(const S3BucketContext *bucketContext,
+                                int keysCount, const char **keys,
+                                S3RequestContext *requestContext,
+                                int timeoutMs,
+                                const S3DeleteMultipleObjectsHandler *handler,
+                                void *callbackData);
+
+
 /** **************************************************************************
  * Access Control List Functions
  ************************************************************************** **/
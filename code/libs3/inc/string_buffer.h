@@ -34,6 +34,7 @@
 #define STRING_BUFFER_H
 
 #include <stdio.h>
+#include <string.h>
 
 
 // Declare a string_buffer with the given name of the given maximum length
@@ -51,21 +52,27 @@
 
 
 // Append [len] bytes of [str] to [sb], setting [all_fit] to 1 if it fit, and
-// 0 if it did not
+// 0 if it did not.  This is done for every element of every XML response
+// (e.g. ~7 per key in a bucket listing), so it is a plain copy rather than
+// snprintf.
 #define string_buffer_append(sb, str, len, all_fit)                     \
     do {                                                                \
-        sb##Len += snprintf(&(sb[sb##Len]), sizeof(sb) - sb##Len - 1,   \
-                            "%.*s", (int) (len), str);                  \
-        if (sb##Len > (int) (sizeof(sb) - 1)) {                         \
-            sb##Len = sizeof(sb) - 1;                                   \
+        int sbAppendLen = (int) (len);                                  \
+        if (sbAppendLen > ((int) (sizeof(sb) - 1) - sb##Len)) {         \
+            sbAppendLen = (int) (sizeof(sb) - 1) - sb##Len;             \
             all_fit = 0;                                                \
         }                                                               \
         else {                                                          \
             all_fit = 1;                                                \
         }                                                               \
+        memcpy(&(sb[sb##Len]), str, sbAppendLen);                       \
+        sb##Len += sbAppendLen;                                         \
+        sb[sb##Len] = 0;                                                \
     } while (0)
 
 
+
+
 // Declare a string multibuffer with the given name of the given maximum size
 #define string_multibuffer(name, size)                                  \
     char name[size];                                                    \
@@ -89,6 +89,13 @@ int64_t parseIso8601Time(const char *str);
 
 uint64_t parseUnsignedInt(const char *str);
 
+#ifndef __APPLE__
+// Writes the base64 MD5 of [data] into [retBuffer], as needed for a
+// Content-MD5 header; [retBuffer] is set to "" if it is too small
+void generate_content_md5(const char* data, int size,
+                          char* retBuffer, int retBufferSize);
+#endif
+
 // Because Windows seems to be missing isblank(), use our own; it's a very
 // easy function to write in any case
 int is_blank(char c);
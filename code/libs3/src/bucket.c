@@ -290,7 +290,8 @@ void S3_create_bucket(S3Protocol protocol, const char *accessKeyId,
         cannedAcl,                               // cannedAcl
         0,                                       // metaDataCount
         0,                                       // metaData
-        0                                        // useServerSideEncryption
+        0,                                       // useServerSideEncryption
+        0                                        // checksumCRC32C
     };
 
     // Set up the RequestParams
@@ -523,45 +524,44 @@ static S3Status listBucketXmlCallback(const char *elementPath,
 
     int fit;
 
+    // Most of a listing is Contents elements, so match their common prefix
+    // once rather than comparing every full path in turn
+    static const char contentsPath[] = "ListBucketResult/Contents/";
+    const char *field = 0;
+    if (!strncmp(elementPath, contentsPath, sizeof(contentsPath) - 1)) {
+        field = &(elementPath[sizeof(contentsPath) - 1]);
+    }
+
     if (data) {
-        if (!strcmp(elementPath, "ListBucketResult/IsTruncated")) {
-            string_buffer_append(lbData->isTruncated, data, dataLen, fit);
-        }
-        else if (!strcmp(elementPath, "ListBucketResult/NextMarker")) {
-            string_buffer_append(lbData->nextMarker, data, dataLen, fit);
-        }
-        else if (!strcmp(elementPath, "ListBucketResult/Contents/Key")) {
-            ListBucketContents *contents =
-                &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append(contents->key, data, dataLen, fit);
-        }
-        else if (!strcmp(elementPath,
-                         "ListBucketResult/Contents/LastModified")) {
-            ListBucketContents *contents =
-                &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append(contents->lastModified, data, dataLen, fit);
-        }
-        else if (!strcmp(elementPath, "ListBucketResult/Contents/ETag")) {
+        if (field) {
             ListBucketContents *contents =
                 &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append(contents->eTag, data, dataLen, fit);
-        }
-        else if (!strcmp(elementPath, "ListBucketResult/Contents/Size")) {
-            ListBucketContents *contents =
-                &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append(contents->size, data, dataLen, fit);
+            if (!strcmp(field, "Key")) {
+                string_buffer_append(contents->key, data, dataLen, fit);
+            }
+            else if (!strcmp(field, "LastModified")) {
+                string_buffer_append(contents->lastModified, data, dataLen,
+                                     fit);
+            }
+            else if (!strcmp(field, "ETag")) {
+                string_buffer_append(contents->eTag, data, dataLen, fit);
+            }
+            else if (!strcmp(field, "Size")) {
+                string_buffer_append(contents->size, data, dataLen, fit);
+            }
+            else if (!strcmp(field, "Owner/ID")) {
+                string_buffer_append(contents->ownerId, data, dataLen, fit);
+            }
+            else if (!strcmp(field, "Owner/DisplayName")) {
+                string_buffer_append
+                    (contents->ownerDisplayName, data, dataLen, fit);
+            }
         }
-        else if (!strcmp(elementPath, "ListBucketResult/Contents/Owner/ID")) {
-            ListBucketContents *contents =
-                &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append(contents->ownerId, data, dataLen, fit);
+        else if (!strcmp(elementPath, "ListBucketResult/IsTruncated")) {
+            string_buffer_append(lbData->isTruncated, data, dataLen, fit);
         }
-        else if (!strcmp(elementPath,
-                         "ListBucketResult/Contents/Owner/DisplayName")) {
-            ListBucketContents *contents =
-                &(lbData->contents[lbData->contentsCount]);
-            string_buffer_append
-                (contents->ownerDisplayName, data, dataLen, fit);
+        else if (!strcmp(elementPath, "ListBucketResult/NextMarker")) {
+            string_buffer_append(lbData->nextMarker, data, dataLen, fit);
         }
         else if (!strcmp(elementPath,
                          "ListBucketResult/CommonPrefixes/Prefix")) {
@@ -34,6 +34,7 @@
 #include <string.h>
 #include "libs3.h"
 #include "request.h"
+#include "simplexml.h"
 
 
 // put object ----------------------------------------------------------------
@@ -109,10 +110,14 @@ static S3Status copyObjectXmlCallback(const char *elementPath,
     int fit;
 
     if (data) {
-        if (!strcmp(elementPath, "CopyObjectResult/LastModified")) {
+        // A copy of a range into a multipart upload part answers with
+        // CopyPartResult rather than CopyObjectResult
+        if (!strcmp(elementPath, "CopyObjectResult/LastModified") ||
+            !strcmp(elementPath, "CopyPartResult/LastModified")) {
             string_buffer_append(coData->lastModified, data, dataLen, fit);
         }
-        else if (!strcmp(elementPath, "CopyObjectResult/ETag")) {
+        else if (!strcmp(elementPath, "CopyObjectResult/ETag") ||
+                 !strcmp(elementPath, "CopyPartResult/ETag")) {
             if (coData->eTagReturnSize && coData->eTagReturn) {
                 coData->eTagReturnLen +=
                     snprintf(&(coData->eTagReturn[coData->eTagReturnLen]),
@@ -401,3 +406,291 @@ void S3_delete_object(const S3BucketContext *bucketContext, const char *key,
     // Perform the request
     request_perform(&params, requestContext);
 }
+
+
+// delete multiple objects ---------------------------------------------------
+
+typedef struct DeleteMultipleData
+{
+    SimpleXml simpleXml;
+
+    S3ResponsePropertiesCallback *responsePropertiesCallback;
+    S3DeleteMultipleObjectsErrorCallback *errorCallback;
+    S3ResponseCompleteCallback *responseCompleteCallback;
+    void *callbackData;
+
+    char *body;
+    int bodyLen;
+    int bodyWritten;
+
+    string_buffer(key, S3_MAX_KEY_SIZE + 1);
+    string_buffer(code, 256);
+    string_buffer(message, 1024);
+} DeleteMultipleData;
+
+
+static S3Status deleteMultipleXmlCallback(const char *elementPath,
+                                          const char *data, int dataLen,
+                                          void *callbackData)
+{
+    DeleteMultipleData *dmData = (DeleteMultipleData *) callbackData;
+
+    int fit;
+
+    if (data) {
+        if (!strcmp(elementPath, "DeleteResult/Error/Key")) {
+            string_buffer_append(dmData->key, data, dataLen, fit);
+        }
+        else if (!strcmp(elementPath, "DeleteResult/Error/Code")) {
+            string_buffer_append(dmData->code, data, dataLen, fit);
+        }
+        else if (!strcmp(elementPath, "DeleteResult/Error/Message")) {
+            string_buffer_append(dmData->message, data, dataLen, fit);
+        }
+    }
+    else if (!strcmp(elementPath, "DeleteResult/Error")) {
+        // Finished an Error
+        S3Status status = S3StatusOK;
+        if (dmData->errorCallback) {
+            status = (*(dmData->errorCallback))
+                (dmData->key, dmData->code, dmData->message,
+                 dmData->callbackData);
+        }
+        string_buffer_initialize(dmData->key);
+        string_buffer_initialize(dmData->code);
+        string_buffer_initialize(dmData->message);
+        return status;
+    }
+
+    /* Avoid compiler error about variable set but not used */
+    (void) fit;
+
+    return S3StatusOK;
+}
+
+
+static S3Status deleteMultiplePropertiesCallback
+    (const S3ResponseProperties *responseProperties, void *callbackData)
+{
+    DeleteMultipleData *dmData = (DeleteMultipleData *) callbackData;
+
+    if (dmData->responsePropertiesCallback) {
+        return (*(dmData->responsePropertiesCallback))
+            (responseProperties, dmData->callbackData);
+    }
+    return S3StatusOK;
+}
+
+
+static int deleteMultipleToS3Callback(int bufferSize, char *buffer,
+                                      void *callbackData)
+{
+    DeleteMultipleData *dmData = (DeleteMultipleData *) callbackData;
+
+    int remaining = dmData->bodyLen - dmData->bodyWritten;
+    int toCopy = bufferSize > remaining ? remaining : bufferSize;
+
+    memcpy(buffer, &(dmData->body[dmData->bodyWritten]), toCopy);
+    dmData->bodyWritten += toCopy;
+
+    return toCopy;
+}
+
+
+static S3Status deleteMultipleFromS3Callback(int bufferSize,
+                                             const char *buffer,
+                                             void *callbackData)
+{
+    DeleteMultipleData *dmData = (DeleteMultipleData *) callbackData;
+
+    return simplexml_add(&(dmData->simpleXml), buffer, bufferSize);
+}
+
+
+static void deleteMultipleCompleteCallback(S3Status requestStatus,
+                                           const S3ErrorDetails *s3ErrorDetails,
+                                           void *callbackData)
+{
+    DeleteMultipleData *dmData = (DeleteMultipleData *) callbackData;
+
+    (*(dmData->responseCompleteCallback))
+        (requestStatus, s3ErrorDetails, dmData->callbackData);
+
+    simplexml_deinitialize(&(dmData->simpleXml));
+
+    free(dmData->body);
+    free(dmData);
+}
+
+
+// Appends [src] to [dest] with the XML special characters escaped, and
+// returns the number of characters written
+static int xml_escape(char *dest, const char *src)
+{
+    char *d = dest;
+
+    for (; *src; src++) {
+        switch (*src) {
+        case '&':
+            d += sprintf(d, "&amp;");
+            break;
+        case '<':
+            d += sprintf(d, "&lt;");
+            break;
+        case '>':
+            d += sprintf(d, "&gt;");
+            break;
+        case '"':
+            d += sprintf(d, "&quot;");
+            break;
+        case '\'':
+            d += sprintf(d, "&apos;");
+            break;
+        default:
+            *d++ = *src;
+            break;
+        }
+    }
+    *d = 0;
+
+    return d - dest;
+}
+
+
+void S3_delete_multiple_objects(const S3BucketContext *bucketContext,
+                                int keysCount, const char **keys,
+                                S3RequestContext *requestContext,
+                                int timeoutMs,
+                                const S3DeleteMultipleObjectsHandler *handler,
+                                void *callbackData)
+{
+#ifdef __APPLE__
+    /* This request requires calculating MD5 sum, which needs OpenSSL */
+    (*(handler->responseHandler.completeCallback))
+        (S3StatusNotSupported, 0, callbackData);
+    return;
+#else
+    if (keysCount == 0) {
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusOK, 0, callbackData);
+        return;
+    }
+    if (keysCount > S3_MAX_DELETE_KEYS) {
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusXmlDocumentTooLarge, 0, callbackData);
+        return;
+    }
+
+    DeleteMultipleData *dmData =
+        (DeleteMultipleData *) malloc(sizeof(DeleteMultipleData));
+    if (!dmData) {
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusOutOfMemory, 0, callbackData);
+        return;
+    }
+
+    // Worst case every character of every key is escaped as "&quot;"
+    static const char header[] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<Delete><Quiet>true</Quiet>";
+    static const char object[] = "<Object><Key></Key></Object>";
+    static const char trailer[] = "</Delete>";
+    size_t bodySize = sizeof(header) + sizeof(trailer);
+    int i;
+    for (i = 0; i < keysCount; i++) {
+        size_t keyLen = strlen(keys[i]);
+        if (keyLen > S3_MAX_KEY_SIZE) {
+            free(dmData);
+            (*(handler->responseHandler.completeCallback))
+                (S3StatusKeyTooLong, 0, callbackData);
+            return;
+        }
+        bodySize += sizeof(object) + 6 * keyLen;
+    }
+    dmData->body = (char *) malloc(bodySize);
+    if (!dmData->body) {
+        free(dmData);
+        (*(handler->responseHandler.completeCallback))
+            (S3StatusOutOfMemory, 0, callbackData);
+        return;
+    }
+
+    int len = sprintf(dmData->body, "%s", header);
+    for (i = 0; i < keysCount; i++) {
+        len += sprintf(&(dmData->body[len]), "<Object><Key>");
+        len += xml_escape(&(dmData->body[len]), keys[i]);
+        len += sprintf(&(dmData->body[len]), "</Key></Object>");
+    }
+    len += sprintf(&(dmData->body[len]), "%s", trailer);
+    dmData->bodyLen = len;
+    dmData->bodyWritten = 0;
+
+    simplexml_initialize(&(dmData->simpleXml), &deleteMultipleXmlCallback,
+                         dmData);
+
+    dmData->responsePropertiesCallback =
+        handler->responseHandler.propertiesCallback;
+    dmData->errorCallback = handler->errorCallback;
+    dmData->responseCompleteCallback =
+        handler->responseHandler.completeCallback;
+    dmData->callbackData = callbackData;
+
+    string_buffer_initialize(dmData->key);
+    string_buffer_initialize(dmData->code);
+    string_buffer_initialize(dmData->message);
+
+    // S3 requires Content-MD5 on this request
+    char md5Base64[64];
+    generate_content_md5(dmData->body, dmData->bodyLen,
+                         md5Base64, sizeof (md5Base64));
+
+    // Set up S3PutProperties
+    S3PutProperties properties =
+    {
+        0,                                       // contentType
+        md5Base64,                               // md5
+        0,                                       // cacheControl
+        0,                                       // contentDispositionFilename
+        0,                                       // contentEncoding
+       -1,                                       // expires
+        0,                                       // cannedAcl
+        0,                                       // metaDataCount
+        0,                                       // metaData
+        0,                                       // useServerSideEncryption
+        0                                        // checksumCRC32C
+    };
+
+    // Set up the RequestParams
+    RequestParams params =
+    {
+        HttpRequestTypePOST,                          // httpRequestType
+        { bucketContext->hostName,                    // hostName
+          bucketContext->bucketName,                  // bucketName
+          bucketContext->protocol,                    // protocol
+          bucketContext->uriStyle,                    // uriStyle
+          bucketContext->accessKeyId,                 // accessKeyId
+          bucketContext->secretAccessKey,             // secretAccessKey
+          bucketContext->securityToken,               // securityToken
+          bucketContext->authRegion },                // authRegion
+        0,                                            // key
+        0,                                            // queryParams
+        "delete",                                     // subResource
+        0,                                            // copySourceBucketName
+        0,                                            // copySourceKey
+        0,                                            // getConditions
+        0,                                            // startByte
+        0,                                            // byteCount
+        &properties,                                  // putProperties
+        &deleteMultiplePropertiesCallback,            // propertiesCallback
+        &deleteMultipleToS3Callback,                  // toS3Callback
+        dmData->bodyLen,                              // toS3CallbackTotalSize
+        &deleteMultipleFromS3Callback,                // fromS3Callback
+        &deleteMultipleCompleteCallback,              // completeCallback
+        dmData,                                       // callbackData
+        timeoutMs                                     // timeoutMs
+    };
+
+    // Perform the request
+    request_perform(&params, requestContext);
+#endif
+}
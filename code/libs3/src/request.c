@@ -50,8 +50,18 @@
 #endif
 
 #define USER_AGENT_SIZE 256
-#define REQUEST_STACK_SIZE 32
+#define REQUEST_POOL_SHARDS 16
+#define REQUEST_POOL_MAX_SHARD_SIZE 64
+#define REQUEST_POOL_DEFAULT_SHARD_SIZE 16
 #define SIGNATURE_SCOPE_SIZE 64
+#define SIGNING_KEY_CACHE_SIZE 4
+#define SIGNING_KEY_MAX_SECRET_SIZE 128
+#define SIGNING_KEY_MAX_REGION_SIZE 64
+
+// Hex SHA-256 of the empty string, used as the payload hash for requests
+// with no body
+#define EMPTY_PAYLOAD_SHA256 \
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
 
 //#define SIGNATURE_DEBUG
 
@@ -59,14 +69,63 @@ static int verifyPeer;
 
 static char userAgentG[USER_AGENT_SIZE];
 
-static pthread_mutex_t requestStackMutexG;
+// Idle Requests (and so their curl handles and keep-alive connections) are
+// kept in a set of stacks, each with its own lock.  Each thread is assigned
+// a home shard the first time it makes a request, so that with up to
+// REQUEST_POOL_SHARDS threads every thread has its handles to itself, and
+// beyond that the lock is only shared by a few threads.
+typedef struct RequestPoolShard
+{
+    pthread_mutex_t mutex;
+
+    Request *requests[REQUEST_POOL_MAX_SHARD_SIZE];
+
+    int count;
+} RequestPoolShard;
+
+static RequestPoolShard requestPoolG[REQUEST_POOL_SHARDS];
 
-static Request *requestStackG[REQUEST_STACK_SIZE];
+static int requestPoolShardSizeG = REQUEST_POOL_DEFAULT_SHARD_SIZE;
 
-static int requestStackCountG;
+static int requestPoolNextShardG;
+
+static __thread int requestPoolShardT = -1;
+
+// Optional curl share handle for DNS and TLS session caches, and
+// the locks that curl asks us to take on its behalf
+static CURLSH *curlShareG;
+
+static pthread_mutex_t curlShareMutexG[CURL_LOCK_DATA_LAST];
+
+// Connection statistics, updated atomically
+static S3ConnectionStats connectionStatsG;
 
 char defaultHostNameG[S3_MAX_HOSTNAME_SIZE];
 
+// The AWS4 signing key depends only on the secret key, the date, and the
+// region, so it changes at most once a day for a given credential.  The
+// last few derived keys are cached here so that each request costs one
+// HMAC instead of five.
+typedef struct SigningKeyCacheEntry
+{
+    char secretAccessKey[SIGNING_KEY_MAX_SECRET_SIZE];
+
+    char date[9]; // YYYYMMDD
+
+    char region[SIGNING_KEY_MAX_REGION_SIZE];
+
+    unsigned char signingKey[S3_SHA256_DIGEST_LENGTH];
+} SigningKeyCacheEntry;
+
+// Initialized statically, as callers are not required to S3_initialize()
+static pthread_mutex_t signingKeyMutexG = PTHREAD_MUTEX_INITIALIZER;
+
+static SigningKeyCacheEntry signingKeyCacheG[SIGNING_KEY_CACHE_SIZE];
+
+static int signingKeyCacheCountG;
+
+static int signingKeyCacheNextG;
+
 
 typedef struct RequestComputedValues
 {
@@ -384,6 +443,12 @@ static S3Status compose_amz_headers(const RequestParams *params,
             append_amz_header(values, 0, "x-amz-server-side-encryption",
                               "AES256");
         }
+
+        // Add the x-amz-checksum-crc32c header, if necessary
+        if (properties->checksumCRC32C) {
+            append_amz_header(values, 0, "x-amz-checksum-crc32c",
+                              properties->checksumCRC32C);
+        }
     }
 
     // Add the x-amz-date header
@@ -399,11 +464,12 @@ static S3Status compose_amz_headers(const RequestParams *params,
             append_amz_header(values, 0, "x-amz-copy-source", bucketKey);
         }
         // If byteCount != 0 then we're just copying a range, add header
+        // (the range is inclusive, like Range:)
         if (params->byteCount > 0) {
             char byteRange[S3_MAX_METADATA_SIZE];
             snprintf(byteRange, sizeof(byteRange), "bytes=%lld-%lld",
                      (long long)params->startByte,
-                     (long long)params->startByte + params->byteCount);
+                     (long long)params->startByte + params->byteCount - 1);
             append_amz_header(values, 0, "x-amz-copy-source-range", byteRange);
         }
         // And the x-amz-metadata-directive header
@@ -424,17 +490,7 @@ static S3Status compose_amz_headers(const RequestParams *params,
             || params->httpRequestType == HttpRequestTypeDELETE
             || params->httpRequestType == HttpRequestTypeHEAD)) {
         // empty payload
-        unsigned char md[S3_SHA256_DIGEST_LENGTH];
-#ifdef __APPLE__
-        CC_SHA256("", 0, md);
-#else
-        SHA256((const unsigned char*) "", 0, md);
-#endif
-        values->payloadHash[0] = '\0';
-        int i = 0;
-        for (; i < S3_SHA256_DIGEST_LENGTH; i++) {
-            snprintf(&(values->payloadHash[i * 2]), 3, "%02x", md[i]);
-        }
+        strcpy(values->payloadHash, EMPTY_PAYLOAD_SHA256);
     }
     else {
         // TODO: figure out how to manage signed payloads
@@ -950,6 +1006,93 @@ static const char *http_request_type_to_verb(HttpRequestType requestType)
 }
 
 
+// Derives the AWS4 signing key for the given secret key, date (the first 8
+// characters of dateISO8601 are used), and region
+static void compute_signing_key(const char *secretAccessKey,
+                                const char *dateISO8601, const char *awsRegion,
+                                unsigned char *signingKey)
+{
+    char accessKey[strlen(secretAccessKey) + 5];
+    snprintf(accessKey, sizeof(accessKey), "AWS4%s", secretAccessKey);
+
+#ifdef __APPLE__
+    unsigned char dateKey[S3_SHA256_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, accessKey, strlen(accessKey),
+           dateISO8601, 8, dateKey);
+    unsigned char dateRegionKey[S3_SHA256_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, dateKey, S3_SHA256_DIGEST_LENGTH, awsRegion,
+           strlen(awsRegion), dateRegionKey);
+    unsigned char dateRegionServiceKey[S3_SHA256_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, dateRegionKey, S3_SHA256_DIGEST_LENGTH, "s3", 2,
+           dateRegionServiceKey);
+    CCHmac(kCCHmacAlgSHA256, dateRegionServiceKey, S3_SHA256_DIGEST_LENGTH,
+           "aws4_request", strlen("aws4_request"), signingKey);
+#else
+    const EVP_MD *sha256evp = EVP_sha256();
+    unsigned char dateKey[S3_SHA256_DIGEST_LENGTH];
+    HMAC(sha256evp, accessKey, strlen(accessKey),
+         (const unsigned char*) dateISO8601, 8, dateKey, NULL);
+    unsigned char dateRegionKey[S3_SHA256_DIGEST_LENGTH];
+    HMAC(sha256evp, dateKey, S3_SHA256_DIGEST_LENGTH,
+         (const unsigned char*) awsRegion, strlen(awsRegion), dateRegionKey,
+         NULL);
+    unsigned char dateRegionServiceKey[S3_SHA256_DIGEST_LENGTH];
+    HMAC(sha256evp, dateRegionKey, S3_SHA256_DIGEST_LENGTH,
+         (const unsigned char*) "s3", 2, dateRegionServiceKey, NULL);
+    HMAC(sha256evp, dateRegionServiceKey, S3_SHA256_DIGEST_LENGTH,
+         (const unsigned char*) "aws4_request", strlen("aws4_request"),
+         signingKey, NULL);
+#endif
+}
+
+
+// Looks up the signing key in the cache, deriving it (and replacing the
+// oldest cache entry) if it is not there.  Secrets or regions too long for
+// a cache entry are simply never cached.
+static void get_signing_key(const char *secretAccessKey,
+                            const char *dateISO8601, const char *awsRegion,
+                            unsigned char *signingKey)
+{
+    if ((strlen(secretAccessKey) >= SIGNING_KEY_MAX_SECRET_SIZE) ||
+        (strlen(awsRegion) >= SIGNING_KEY_MAX_REGION_SIZE)) {
+        compute_signing_key(secretAccessKey, dateISO8601, awsRegion,
+                            signingKey);
+        return;
+    }
+
+    pthread_mutex_lock(&signingKeyMutexG);
+    int i;
+    for (i = 0; i < signingKeyCacheCountG; i++) {
+        SigningKeyCacheEntry *entry = &(signingKeyCacheG[i]);
+        if (!strncmp(entry->date, dateISO8601, 8) &&
+            !strcmp(entry->region, awsRegion) &&
+            !strcmp(entry->secretAccessKey, secretAccessKey)) {
+            memcpy(signingKey, entry->signingKey, S3_SHA256_DIGEST_LENGTH);
+            pthread_mutex_unlock(&signingKeyMutexG);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&signingKeyMutexG);
+
+    // Derive outside of the lock; two threads missing at once just both
+    // compute the same key
+    compute_signing_key(secretAccessKey, dateISO8601, awsRegion, signingKey);
+
+    pthread_mutex_lock(&signingKeyMutexG);
+    SigningKeyCacheEntry *entry = &(signingKeyCacheG[signingKeyCacheNextG]);
+    snprintf(entry->secretAccessKey, sizeof(entry->secretAccessKey), "%s",
+             secretAccessKey);
+    snprintf(entry->date, sizeof(entry->date), "%.8s", dateISO8601);
+    snprintf(entry->region, sizeof(entry->region), "%s", awsRegion);
+    memcpy(entry->signingKey, signingKey, S3_SHA256_DIGEST_LENGTH);
+    signingKeyCacheNextG = (signingKeyCacheNextG + 1) % SIGNING_KEY_CACHE_SIZE;
+    if (signingKeyCacheCountG < SIGNING_KEY_CACHE_SIZE) {
+        signingKeyCacheCountG++;
+    }
+    pthread_mutex_unlock(&signingKeyMutexG);
+}
+
+
 // Composes the Authorization header for the request
 static S3Status compose_auth_header(const RequestParams *params,
                                     RequestComputedValues *values)
@@ -1016,48 +1159,17 @@ static S3Status compose_auth_header(const RequestParams *params,
     printf("--\nString to Sign:\n%s\n", stringToSign);
 #endif
 
-    const char *secretAccessKey = params->bucketContext.secretAccessKey;
-    char accessKey[strlen(secretAccessKey) + 5];
-    snprintf(accessKey, sizeof(accessKey), "AWS4%s", secretAccessKey);
-
-#ifdef __APPLE__
-    unsigned char dateKey[S3_SHA256_DIGEST_LENGTH];
-    CCHmac(kCCHmacAlgSHA256, accessKey, strlen(accessKey),
-           values->requestDateISO8601, 8, dateKey);
-    unsigned char dateRegionKey[S3_SHA256_DIGEST_LENGTH];
-    CCHmac(kCCHmacAlgSHA256, dateKey, S3_SHA256_DIGEST_LENGTH, awsRegion,
-           strlen(awsRegion), dateRegionKey);
-    unsigned char dateRegionServiceKey[S3_SHA256_DIGEST_LENGTH];
-    CCHmac(kCCHmacAlgSHA256, dateRegionKey, S3_SHA256_DIGEST_LENGTH, "s3", 2,
-           dateRegionServiceKey);
     unsigned char signingKey[S3_SHA256_DIGEST_LENGTH];
-    CCHmac(kCCHmacAlgSHA256, dateRegionServiceKey, S3_SHA256_DIGEST_LENGTH,
-           "aws4_request", strlen("aws4_request"), signingKey);
+    get_signing_key(params->bucketContext.secretAccessKey,
+                    values->requestDateISO8601, awsRegion, signingKey);
 
+#ifdef __APPLE__
     unsigned char finalSignature[S3_SHA256_DIGEST_LENGTH];
     CCHmac(kCCHmacAlgSHA256, signingKey, S3_SHA256_DIGEST_LENGTH, stringToSign,
             strlen(stringToSign), finalSignature);
 #else
-    const EVP_MD *sha256evp = EVP_sha256();
-    unsigned char dateKey[S3_SHA256_DIGEST_LENGTH];
-    HMAC(sha256evp, accessKey, strlen(accessKey),
-         (const unsigned char*) values->requestDateISO8601, 8, dateKey,
-         NULL);
-    unsigned char dateRegionKey[S3_SHA256_DIGEST_LENGTH];
-    HMAC(sha256evp, dateKey, S3_SHA256_DIGEST_LENGTH,
-         (const unsigned char*) awsRegion, strlen(awsRegion), dateRegionKey,
-         NULL);
-    unsigned char dateRegionServiceKey[S3_SHA256_DIGEST_LENGTH];
-    HMAC(sha256evp, dateRegionKey, S3_SHA256_DIGEST_LENGTH,
-         (const unsigned char*) "s3", 2, dateRegionServiceKey, NULL);
-    unsigned char signingKey[S3_SHA256_DIGEST_LENGTH];
-    HMAC(sha256evp, dateRegionServiceKey, S3_SHA256_DIGEST_LENGTH,
-         (const unsigned char*) "aws4_request", strlen("aws4_request"),
-         signingKey,
-         NULL);
-
     unsigned char finalSignature[S3_SHA256_DIGEST_LENGTH];
-    HMAC(sha256evp, signingKey, S3_SHA256_DIGEST_LENGTH,
+    HMAC(EVP_sha256(), signingKey, S3_SHA256_DIGEST_LENGTH,
          (const unsigned char*) stringToSign, strlen(stringToSign),
          finalSignature, NULL);
 #endif
@@ -1192,6 +1304,12 @@ static S3Status setup_curl(Request *request,
     // Turn off Curl's built-in progress meter
     curl_easy_setopt_safe(CURLOPT_NOPROGRESS, 1);
 
+    // Share DNS and TLS session caches between handles, if
+    // S3_set_request_pool asked for it
+    if (curlShareG) {
+        curl_easy_setopt_safe(CURLOPT_SHARE, curlShareG);
+    }
+
     // xxx todo - support setting the proxy for Curl to use (can't use https
     // for proxies though)
 
@@ -1320,6 +1438,19 @@ static void request_deinitialize(Request *request)
 }
 
 
+// Returns this thread's home shard in the request pool, assigning one
+// round-robin on first use
+static int request_pool_shard()
+{
+    if (requestPoolShardT < 0) {
+        requestPoolShardT =
+            __sync_fetch_and_add(&requestPoolNextShardG, 1) %
+            REQUEST_POOL_SHARDS;
+    }
+    return requestPoolShardT;
+}
+
+
 static S3Status request_get(const RequestParams *params,
                             const RequestComputedValues *values,
                             const S3RequestContext *context,
@@ -1327,16 +1458,25 @@ static S3Status request_get(const RequestParams *params,
 {
     Request *request = 0;
 
-    // Try to get one from the request stack.  We hold the lock for the
+    // Try to get one from this thread's shard of the request pool, then
+    // from any other shard that isn't busy.  We hold each lock for the
     // shortest time possible here.
-    pthread_mutex_lock(&requestStackMutexG);
-
-    if (requestStackCountG) {
-        request = requestStackG[--requestStackCountG];
+    int home = request_pool_shard(), i;
+    for (i = 0; i < REQUEST_POOL_SHARDS && !request; i++) {
+        RequestPoolShard *shard =
+            &(requestPoolG[(home + i) % REQUEST_POOL_SHARDS]);
+        if (i == 0) {
+            pthread_mutex_lock(&(shard->mutex));
+        }
+        else if (pthread_mutex_trylock(&(shard->mutex))) {
+            continue;
+        }
+        if (shard->count) {
+            request = shard->requests[--shard->count];
+        }
+        pthread_mutex_unlock(&(shard->mutex));
     }
 
-    pthread_mutex_unlock(&requestStackMutexG);
-
     // If we got one, deinitialize it for re-use
     if (request) {
         request_deinitialize(request);
@@ -1350,6 +1490,7 @@ static S3Status request_get(const RequestParams *params,
             free(request);
             return S3StatusFailedToInitializeRequest;
         }
+        __sync_fetch_and_add(&(connectionStatsG.handlesCreated), 1);
     }
 
     // Initialize the request
@@ -1420,26 +1561,114 @@ static void request_destroy(Request *request)
     request_deinitialize(request);
     curl_easy_cleanup(request->curl);
     free(request);
+    __sync_fetch_and_add(&(connectionStatsG.handlesDestroyed), 1);
 }
 
 
 static void request_release(Request *request)
 {
-    pthread_mutex_lock(&requestStackMutexG);
+    // Put this one at the front of this thread's shard of the request pool;
+    // we do this because we want the most-recently-used curl handle to be
+    // re-used on the next request, to maximize our chances of re-using a TCP
+    // connection before it times out.  If that shard is full, try the
+    // others, and only destroy the request if they are all full (or busy).
+    int home = request_pool_shard(), i;
+    for (i = 0; i < REQUEST_POOL_SHARDS; i++) {
+        RequestPoolShard *shard =
+            &(requestPoolG[(home + i) % REQUEST_POOL_SHARDS]);
+        if (i == 0) {
+            pthread_mutex_lock(&(shard->mutex));
+        }
+        else if (pthread_mutex_trylock(&(shard->mutex))) {
+            continue;
+        }
+        if (shard->count < requestPoolShardSizeG) {
+            shard->requests[shard->count++] = request;
+            pthread_mutex_unlock(&(shard->mutex));
+            return;
+        }
+        pthread_mutex_unlock(&(shard->mutex));
+    }
+
+    request_destroy(request);
+}
+
+
+static void curl_share_lock(CURL *curl, curl_lock_data data,
+                            curl_lock_access access, void *userptr)
+{
+    (void) curl;
+    (void) access;
+    (void) userptr;
+    pthread_mutex_lock(&(curlShareMutexG[data]));
+}
+
+
+static void curl_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+    (void) curl;
+    (void) userptr;
+    pthread_mutex_unlock(&(curlShareMutexG[data]));
+}
+
 
-    // If the request stack is full, destroy this one
-    if (requestStackCountG == REQUEST_STACK_SIZE) {
-        pthread_mutex_unlock(&requestStackMutexG);
-        request_destroy(request);
+S3Status S3_set_request_pool(int maxIdleRequests, int shareFlags)
+{
+    if (maxIdleRequests < 0) {
+        maxIdleRequests = REQUEST_POOL_SHARDS * REQUEST_POOL_DEFAULT_SHARD_SIZE;
     }
-    // Else put this one at the front of the request stack; we do this because
-    // we want the most-recently-used curl handle to be re-used on the next
-    // request, to maximize our chances of re-using a TCP connection before it
-    // times out
-    else {
-        requestStackG[requestStackCountG++] = request;
-        pthread_mutex_unlock(&requestStackMutexG);
+    int shardSize =
+        (maxIdleRequests + REQUEST_POOL_SHARDS - 1) / REQUEST_POOL_SHARDS;
+    if (shardSize > REQUEST_POOL_MAX_SHARD_SIZE) {
+        shardSize = REQUEST_POOL_MAX_SHARD_SIZE;
+    }
+    requestPoolShardSizeG = shardSize;
+
+    if (curlShareG) {
+        curl_share_cleanup(curlShareG);
+        curlShareG = 0;
+    }
+    if (!shareFlags) {
+        return S3StatusOK;
+    }
+
+    if (!(curlShareG = curl_share_init())) {
+        return S3StatusOutOfMemory;
+    }
+    int i;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&(curlShareMutexG[i]), 0);
+    }
+    curl_share_setopt(curlShareG, CURLSHOPT_LOCKFUNC, &curl_share_lock);
+    curl_share_setopt(curlShareG, CURLSHOPT_UNLOCKFUNC, &curl_share_unlock);
+
+    CURLSHcode code = CURLSHE_OK;
+    if (shareFlags & S3_POOL_SHARE_DNS) {
+        code = curl_share_setopt(curlShareG, CURLSHOPT_SHARE,
+                                 CURL_LOCK_DATA_DNS);
+    }
+    if ((code == CURLSHE_OK) && (shareFlags & S3_POOL_SHARE_SSL_SESSION)) {
+        code = curl_share_setopt(curlShareG, CURLSHOPT_SHARE,
+                                 CURL_LOCK_DATA_SSL_SESSION);
     }
+    if (code != CURLSHE_OK) {
+        curl_share_cleanup(curlShareG);
+        curlShareG = 0;
+        return S3StatusInternalError;
+    }
+
+    return S3StatusOK;
+}
+
+
+void S3_get_connection_stats(S3ConnectionStats *stats)
+{
+    stats->requests = __sync_fetch_and_add(&(connectionStatsG.requests), 0);
+    stats->connects = __sync_fetch_and_add(&(connectionStatsG.connects), 0);
+    stats->handlesCreated =
+        __sync_fetch_and_add(&(connectionStatsG.handlesCreated), 0);
+    stats->handlesDestroyed =
+        __sync_fetch_and_add(&(connectionStatsG.handlesDestroyed), 0);
 }
 
 
@@ -1462,9 +1691,11 @@ S3Status request_api_initialize(const char *userAgentInfo, int flags,
         return S3StatusUriTooLong;
     }
 
-    pthread_mutex_init(&requestStackMutexG, 0);
-
-    requestStackCountG = 0;
+    int i;
+    for (i = 0; i < REQUEST_POOL_SHARDS; i++) {
+        pthread_mutex_init(&(requestPoolG[i].mutex), 0);
+        requestPoolG[i].count = 0;
+    }
 
     if (!userAgentInfo || !*userAgentInfo) {
         userAgentInfo = "Unknown";
@@ -1491,11 +1722,20 @@ S3Status request_api_initialize(const char *userAgentInfo, int flags,
 
 void request_api_deinitialize()
 {
-    pthread_mutex_destroy(&requestStackMutexG);
-
     xmlCleanupParser();
-    while (requestStackCountG--) {
-        request_destroy(requestStackG[requestStackCountG]);
+
+    int i;
+    for (i = 0; i < REQUEST_POOL_SHARDS; i++) {
+        RequestPoolShard *shard = &(requestPoolG[i]);
+        while (shard->count) {
+            request_destroy(shard->requests[--shard->count]);
+        }
+        pthread_mutex_destroy(&(shard->mutex));
+    }
+
+    if (curlShareG) {
+        curl_share_cleanup(curlShareG);
+        curlShareG = 0;
     }
 }
 
@@ -1705,6 +1945,13 @@ void request_finish(Request *request)
         }
     }
 
+    // Count the connections this request had to open; when keep-alive is
+    // working this is zero for almost every request
+    long connects = 0;
+    curl_easy_getinfo(request->curl, CURLINFO_NUM_CONNECTS, &connects);
+    __sync_fetch_and_add(&(connectionStatsG.requests), 1);
+    __sync_fetch_and_add(&(connectionStatsG.connects), (uint64_t) connects);
+
     (*(request->completeCallback))
         (request->status, &(request->errorParser.s3ErrorDetails),
          request->callbackData);
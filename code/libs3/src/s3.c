@@ -2403,7 +2403,8 @@ static void put_object(int argc, char **argv, int optindex,
         cannedAcl,
         metaPropertiesCount,
         metaProperties,
-        useServerSideEncryption
+        useServerSideEncryption,
+        0
     };
 
     if (contentLength <= MULTIPART_CHUNK_SIZE) {
@@ -2528,7 +2529,7 @@ upload:
                     int64_t lastModified;
 
                     unsigned long long startOffset = (unsigned long long)MULTIPART_CHUNK_SIZE * (unsigned long long)(seq-1);
-                    unsigned long long count = partContentLength - 1; // Inclusive for copies
+                    unsigned long long count = partContentLength;
                     // The default copy callback tries to set this for us, need to allocate here
                     manager.etags[seq-1] = malloc(512); // TBD - magic #!  Isa there a max etag defined?
                     S3_copy_object_range(&srcBucketContext, srcKey,
@@ -2824,7 +2825,8 @@ static void copy_object(int argc, char **argv, int optindex)
         cannedAcl,
         metaPropertiesCount,
         metaProperties,
-        useServerSideEncryption
+        useServerSideEncryption,
+        0
     };
 
     S3ResponseHandler responseHandler =
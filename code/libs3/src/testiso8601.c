@@ -0,0 +1,122 @@
+/** **************************************************************************
+ * testiso8601.c
+ *
+ * Table tests for parseIso8601Time(), which converts the timestamps in S3
+ * responses without going through mktime().  The date arithmetic is also
+ * checked against timegm() for every day from 1600 to 2400.
+ *
+ * This file is part of libs3.
+ *
+ * libs3 is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, version 3 or above of the License.  You can also
+ * redistribute and/or modify it under the terms of the GNU General Public
+ * License, version 2 or above of the License.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of this library and its programs with the
+ * OpenSSL library, and distribute linked combinations including the two.
+ *
+ * libs3 is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * version 3 along with libs3, in a file named COPYING.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * You should also have received a copy of the GNU General Public License
+ * version 2 along with libs3, in a file named COPYING-GPLv2.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ ************************************************************************** **/
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+
+static const struct {
+    const char *str;
+    int64_t expected;
+} cases[] = {
+    // the epoch, with and without millis
+    { "1970-01-01T00:00:00Z", 0 },
+    { "1970-01-01T00:00:00.000Z", 0 },
+    { "1970-01-01T00:00:00.123456Z", 0 },
+    { "1969-12-31T00:00:00Z", -86400 },
+    // leap days, and the century rules
+    { "2000-02-29T12:34:56Z", 951827696 },
+    { "2024-02-29T23:59:59.999Z", 1709251199 },
+    { "1900-03-01T00:00:00Z", -2203891200LL },
+    { "2100-03-01T00:00:00Z", 4107542400LL },
+    // past 32 bits
+    { "2038-01-19T03:14:08Z", 2147483648LL },
+    { "9999-12-31T23:59:59Z", 253402300799LL },
+    { "1601-01-01T00:00:00Z", -11644473600LL },
+    { "0001-01-01T00:00:00Z", -62135596800LL },
+    // offsets are converted to UTC
+    { "2009-02-11T10:00:00+01:00", 1234342800 },
+    { "2009-02-11T10:00:00-05:30", 1234366200 },
+    { "2009-02-11T10:00:00.5+01:00", 1234342800 },
+    // malformed
+    { "2009-02-11 10:00:00Z", -1 },
+    { "2009-2-11T10:00:00Z", -1 },
+    { "20090211T100000Z", -1 },
+    { "not a time", -1 },
+    { "", -1 },
+};
+
+
+int main(int argc, char **argv)
+{
+    (void) argc;
+    (void) argv;
+
+    int failed = 0;
+
+    for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        int64_t t = parseIso8601Time(cases[i].str);
+        if (t != cases[i].expected) {
+            printf("'%s': %lld (should be %lld)\n", cases[i].str,
+                   (long long) t, (long long) cases[i].expected);
+            failed++;
+        }
+    }
+
+    // every day from 1600-01-01 through 2400-12-31, at a time that moves
+    // through the day as well
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 1600 - 1900;
+    tm.tm_mon = 0;
+    tm.tm_mday = 1;
+    for (int n = 0; tm.tm_year < 2401 - 1900; n++) {
+        tm.tm_hour = n % 24;
+        tm.tm_min = n % 60;
+        tm.tm_sec = (n * 7) % 60;
+        time_t expected = timegm(&tm);      // normalizes tm as well
+        char str[64];
+        snprintf(str, sizeof(str), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                 tm.tm_min, tm.tm_sec, n % 1000);
+        int64_t t = parseIso8601Time(str);
+        if (t != expected) {
+            if (failed++ < 10) {
+                printf("'%s': %lld (timegm says %lld)\n", str, (long long) t,
+                       (long long) expected);
+            }
+        }
+        tm.tm_mday++;
+    }
+
+    if (failed) {
+        printf("FAILED: %d\n", failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -97,6 +97,23 @@ int urlEncode(char *dest, const char *src, int maxSrcSize, int encodeSlash)
 }
 
 
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+// Doing this by hand rather than with mktime() keeps the result in UTC,
+// which is what S3 sends, and avoids glibc re-checking the local time zone
+// on every call - which dominated the cost of parsing bucket listings.
+static int64_t daysFromCivil(int year, int month, int day)
+{
+    year -= (month <= 2);
+    int64_t era = ((year >= 0) ? year : (year - 399)) / 400;
+    unsigned int yearOfEra = (unsigned int) (year - (era * 400));
+    unsigned int dayOfYear =
+        (((153 * (month + ((month > 2) ? -3 : 9))) + 2) / 5) + day - 1;
+    unsigned int dayOfEra = (yearOfEra * 365) + (yearOfEra / 4) -
+        (yearOfEra / 100) + dayOfYear;
+    return (era * 146097) + dayOfEra - 719468;
+}
+
+
 int64_t parseIso8601Time(const char *str)
 {
     // Check to make sure that it has a valid format
@@ -107,32 +124,28 @@ int64_t parseIso8601Time(const char *str)
 #define nextnum() (((*str - '0') * 10) + (*(str + 1) - '0'))
 
     // Convert it
-    struct tm stm;
-    memset(&stm, 0, sizeof(stm));
-
-    stm.tm_year = (nextnum() - 19) * 100;
+    int year = nextnum() * 100;
     str += 2;
-    stm.tm_year += nextnum();
+    year += nextnum();
     str += 3;
 
-    stm.tm_mon = nextnum() - 1;
+    int month = nextnum();
     str += 3;
 
-    stm.tm_mday = nextnum();
+    int day = nextnum();
     str += 3;
 
-    stm.tm_hour = nextnum();
+    int hour = nextnum();
     str += 3;
 
-    stm.tm_min = nextnum();
+    int minute = nextnum();
     str += 3;
 
-    stm.tm_sec = nextnum();
+    int second = nextnum();
     str += 2;
 
-    stm.tm_isdst = -1;
-
-    int64_t ret = mktime(&stm);
+    int64_t ret = (daysFromCivil(year, month, day) * 86400) +
+        (hour * 3600) + (minute * 60) + second;
 
     // Skip the millis
 
@@ -0,0 +1,597 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "stripe.h"
+#include "objfs-scan.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+// copy a whole objfs file system out of its prefix without mounting
+// it, as a tar stream or into a directory:
+//
+// objfs-export [options] bucket/prefix > image.tar
+// objfs-export [options] -C dir bucket/prefix
+// objfs-export [options] -l dir/prefix ...
+//
+// Object headers are fetched by -t threads and replayed in index
+// order, as in fs_init() and objfs-fsck, to get the namespace and
+// every file's extents. Then the output order is fixed: directories,
+// symlinks and empty files first, then files with data in order of
+// the first object they use. Objects are read in the order that
+// needs them - ascending, for an image that was written sequentially
+// or imported - each with one ranged GET covering just its live data,
+// so nothing is read twice however files are spread across objects.
+// A buffer is freed once every extent in it has been written out.
+//
+//   -t N       threads reading objects (16)
+//   -m MB      how much data to read ahead of the output (1024); an
+//              object still needed by a later file stays in memory,
+//              so a badly fragmented image can go over this
+//   -f file    write the tar here instead of standard output
+//   -C dir     write a directory tree under dir instead of a tar
+//   -l         objects are local files: dir/prefix.%08x (as objfs-fsck -l)
+//   -q         no progress or summary
+//
+// The tar is in GNU format (long names, big sizes and ids), with
+// "./" as the root. Sockets are skipped. Records the mount would
+// reject, and data that can't be read (which comes out as zeros), are
+// reported on stderr, and the exit status is then 1.
+//
+
+
+struct {
+    int         nthreads = 16;
+    uint64_t    ahead = 1024ull * 1024 * 1024;
+    const char *tar_file = nullptr;
+    const char *dir = nullptr;
+    bool        local = false;
+    bool        quiet = false;
+} cfg;
+
+static std::atomic<long> n_problems;
+
+static void problem(int64_t index, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (index >= 0)
+	fprintf(stderr, "%08lx: ", (long)index);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    n_problems++;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static objfs_scan scan;
+
+// only what would stop a mount matters here; the rest is for objfs-fsck
+//
+void report(int sev, int64_t index, const char *fmt, ...)
+{
+    if (sev != P_FATAL)
+	return;
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    problem(index, "%s", buf);
+}
+
+// -------------- reading the data
+//
+// need[] is the objects in the order the output first uses them, each
+// with the range of its data section that's live and how many extents
+// are still to be written from it.
+
+struct piece {
+    uint32_t          index;
+    uint64_t          lo = UINT64_MAX, hi = 0;
+    int               refs = 0;
+    std::vector<char> data;
+    bool              ready = false;
+    bool              failed = false;
+};
+
+static std::vector<piece> need;
+static std::unordered_map<uint32_t,size_t> need_pos;	// index -> need[]
+static std::atomic<size_t> next_piece;
+static size_t writer_pos, piece_waiting = SIZE_MAX;
+static uint64_t buffered;
+static int n_fetch_blocked;
+static std::mutex data_m;
+static std::condition_variable data_cv, ahead_cv;
+static std::atomic<uint64_t> data_bytes_read;
+
+// Only the next piece the output needs may go over the read-ahead
+// limit, which is enough to keep things moving.
+//
+static void data_thread(void)
+{
+    for (size_t i = next_piece++; i < need.size(); i = next_piece++) {
+	piece &pc = need[i];
+	size_t len = pc.hi - pc.lo;
+	std::unique_lock lk(data_m);
+	while (buffered + len > cfg.ahead && i > writer_pos) {
+	    n_fetch_blocked++;
+	    ahead_cv.wait(lk);
+	    n_fetch_blocked--;
+	}
+	buffered += len;
+	lk.unlock();
+
+	auto it = scan.obj_pos.find(pc.index);
+	std::string error;
+	size_t got = 0;
+	pc.data.assign(len, 0);
+	if (it == scan.obj_pos.end())
+	    error = "missing object";
+	else {
+	    scan_object &o = scan.objs[it->second];
+	    if (scan.read(o, o.hdr_len + pc.lo, pc.data.data(), len, &got, error) &&
+		got < len)
+		error = "object is short";
+	}
+	if (!error.empty()) {
+	    problem(pc.index, "%s: %lu bytes of data lost", error.c_str(),
+		    (unsigned long)(len - got));
+	    pc.failed = true;
+	}
+	data_bytes_read += got;
+
+	lk.lock();
+	pc.ready = true;
+	if (i == piece_waiting)
+	    data_cv.notify_one();
+    }
+}
+
+static piece &wait_piece(uint32_t index)
+{
+    size_t i = need_pos[index];
+    piece &pc = need[i];
+    std::unique_lock lk(data_m);
+    if (i > writer_pos) {
+	writer_pos = i;
+	if (n_fetch_blocked > 0)
+	    ahead_cv.notify_all();
+    }
+    if (!pc.ready) {
+	piece_waiting = i;
+	while (!pc.ready)
+	    data_cv.wait(lk);
+	piece_waiting = SIZE_MAX;
+    }
+    return pc;
+}
+
+static void done_with(piece &pc)
+{
+    if (--pc.refs > 0)
+	return;
+    std::unique_lock lk(data_m);
+    buffered -= pc.data.size();
+    std::vector<char>().swap(pc.data);
+    if (n_fetch_blocked > 0)
+	ahead_cv.notify_all();
+}
+
+// -------------- output: tar, or a directory tree
+
+static FILE *tar_fp;
+static uint64_t bytes_out;
+static char zeros[64 * 1024];
+
+static void tar_write(const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, tar_fp) != len) {
+	perror(cfg.tar_file ? cfg.tar_file : "stdout");
+	exit(1);
+    }
+    bytes_out += len;
+}
+
+static void tar_zeros(uint64_t len)
+{
+    while (len > 0) {
+	size_t n = std::min(len, (uint64_t)sizeof(zeros));
+	tar_write(zeros, n);
+	len -= n;
+    }
+}
+
+// octal if it fits, base-256 (GNU) if not
+//
+static void tar_num(char *field, size_t width, uint64_t val)
+{
+    if (val < (1ull << (3 * (width - 1)))) {
+	snprintf(field, width, "%0*lo", (int)width - 1, (unsigned long)val);
+	return;
+    }
+    for (size_t i = width - 1; i > 0; i--, val >>= 8)
+	field[i] = val & 0xff;
+    field[0] = 0x80;
+}
+
+struct tar_hdr {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[8];		// "ustar  " - GNU
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static void tar_header(const std::string &name, char type, const node &n, uint64_t size,
+		       const std::string &link)
+{
+    // names that don't fit go in a GNU long name entry first
+    auto longlink = [](char t, const std::string &s) {
+	node none = {};
+	tar_header("././@LongLink", t, none, s.length() + 1, "");
+	tar_write(s.c_str(), s.length() + 1);
+	tar_zeros(-(s.length() + 1) & 511);
+    };
+    if (name.length() > sizeof(tar_hdr::name))
+	longlink('L', name);
+    if (link.length() > sizeof(tar_hdr::linkname))
+	longlink('K', link);
+
+    tar_hdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.name, name.data(), std::min(name.length(), sizeof(h.name)));
+    tar_num(h.mode, sizeof(h.mode), n.mode & 07777);
+    tar_num(h.uid, sizeof(h.uid), n.uid);
+    tar_num(h.gid, sizeof(h.gid), n.gid);
+    tar_num(h.size, sizeof(h.size), size);
+    tar_num(h.mtime, sizeof(h.mtime), std::max((int64_t)n.mtime.tv_sec, (int64_t)0));
+    h.typeflag = type;
+    memcpy(h.linkname, link.data(), std::min(link.length(), sizeof(h.linkname)));
+    memcpy(h.magic, "ustar  ", 8);
+    if (type == '3' || type == '4') {
+	tar_num(h.devmajor, sizeof(h.devmajor), major(n.rdev));
+	tar_num(h.devminor, sizeof(h.devminor), minor(n.rdev));
+    }
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++)
+	sum += ((unsigned char*)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    tar_write(&h, sizeof(h));
+}
+
+static std::vector<std::pair<std::string,node*>> dir_times;	// for -C, set last
+
+static void set_attrs(const std::string &path, const node &n)
+{
+    if (geteuid() == 0)
+	lchown(path.c_str(), n.uid, n.gid);
+    if (!S_ISLNK(n.mode))
+	chmod(path.c_str(), n.mode & 07777);
+    struct timespec tv[2] = {n.mtime, n.mtime};
+    utimensat(AT_FDCWD, path.c_str(), tv, AT_SYMLINK_NOFOLLOW);
+}
+
+// everything but file data
+//
+static void put_entry(const std::string &path, node &n)
+{
+    if (cfg.dir == nullptr) {
+	if (S_ISDIR(n.mode))
+	    tar_header(path + "/", '5', n, 0, "");
+	else if (S_ISLNK(n.mode))
+	    tar_header(path, '2', n, 0, n.target);
+	else if (S_ISCHR(n.mode))
+	    tar_header(path, '3', n, 0, "");
+	else if (S_ISBLK(n.mode))
+	    tar_header(path, '4', n, 0, "");
+	else if (S_ISFIFO(n.mode))
+	    tar_header(path, '6', n, 0, "");
+	return;
+    }
+    std::string full = std::string(cfg.dir) + "/" + path;
+    int rv = 0;
+    if (S_ISDIR(n.mode)) {
+	if ((rv = mkdir(full.c_str(), 0700)) < 0 && errno == EEXIST)
+	    rv = 0;
+	dir_times.push_back({full, &n});
+    }
+    else if (S_ISLNK(n.mode))
+	rv = symlink(n.target.c_str(), full.c_str());
+    else
+	rv = mknod(full.c_str(), n.mode & ~07777, n.rdev);
+    if (rv < 0)
+	problem(-1, "%s: %s", full.c_str(), strerror(errno));
+    else if (!S_ISDIR(n.mode))
+	set_attrs(full, n);
+}
+
+static int out_fd = -1;
+static std::string out_path;
+
+static void file_begin(const std::string &path, node &n)
+{
+    if (cfg.dir == nullptr) {
+	tar_header(path, '0', n, n.size, "");
+	return;
+    }
+    out_path = std::string(cfg.dir) + "/" + path;
+    out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out_fd < 0)
+	problem(-1, "%s: %s", out_path.c_str(), strerror(errno));
+}
+
+// @buf == nullptr for a hole
+//
+static void file_data(const char *buf, uint64_t offset, uint64_t len)
+{
+    if (cfg.dir == nullptr) {
+	if (buf == nullptr)
+	    tar_zeros(len);
+	else
+	    tar_write(buf, len);
+	return;
+    }
+    bytes_out += len;
+    if (out_fd < 0 || buf == nullptr)
+	return;
+    while (len > 0) {
+	ssize_t n = pwrite(out_fd, buf, len, offset);
+	if (n <= 0) {
+	    problem(-1, "%s: %s", out_path.c_str(), strerror(errno));
+	    close(out_fd);
+	    out_fd = -1;
+	    return;
+	}
+	buf += n, offset += n, len -= n;
+    }
+}
+
+static void file_end(node &n)
+{
+    if (cfg.dir == nullptr) {
+	tar_zeros(-n.size & 511);
+	return;
+    }
+    if (out_fd < 0)
+	return;
+    if (ftruncate(out_fd, n.size) < 0)
+	problem(-1, "%s: %s", out_path.c_str(), strerror(errno));
+    close(out_fd);
+    out_fd = -1;
+    set_attrs(out_path, n);
+}
+
+static void write_file(const std::string &path, node &n)
+{
+    file_begin(path, n);
+    int64_t pos = 0;
+    for (auto &[offset, e] : n.extents) {
+	if (offset >= n.size)
+	    break;
+	if (offset > pos)
+	    file_data(nullptr, pos, offset - pos);
+	uint64_t len = std::min((int64_t)e.len, n.size - offset);
+	piece &pc = wait_piece(e.objnum);
+	file_data(pc.failed ? nullptr : pc.data.data() + (e.offset - pc.lo), offset, len);
+	done_with(pc);
+	pos = offset + len;
+    }
+    if (n.size > pos)
+	file_data(nullptr, pos, n.size - pos);
+    file_end(n);
+}
+
+// -------------- main
+
+static void usage(void)
+{
+    printf("usage: objfs-export [-t threads] [-m MB] [-f file | -C dir] [-l] [-q]"
+	   " bucket/prefix|dir/prefix\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:f:C:lq")) != -1) {
+	switch (opt) {
+	case 't': cfg.nthreads = atoi(optarg); break;
+	case 'm': cfg.ahead = atol(optarg) * 1024ull * 1024; break;
+	case 'f': cfg.tar_file = optarg; break;
+	case 'C': cfg.dir = optarg; break;
+	case 'l': cfg.local = true; break;
+	case 'q': cfg.quiet = true; break;
+	default: usage();
+	}
+    }
+    if (optind + 1 != argc || cfg.nthreads < 1 || (cfg.tar_file && cfg.dir))
+	usage();
+    if (cfg.dir == nullptr) {
+	tar_fp = cfg.tar_file ? fopen(cfg.tar_file, "w") : stdout;
+	if (tar_fp == NULL) {
+	    perror(cfg.tar_file);
+	    exit(1);
+	}
+	if (isatty(fileno(tar_fp))) {
+	    fprintf(stderr, "not writing a tar to a terminal\n");
+	    exit(1);
+	}
+	setvbuf(tar_fp, NULL, _IOFBF, 1024 * 1024);
+    }
+    else if (mkdir(cfg.dir, 0755) < 0 && errno != EEXIST) {
+	perror(cfg.dir);
+	exit(1);
+    }
+
+    if (!scan.open(argv[optind], cfg.local, cfg.nthreads))
+	exit(1);
+    auto &objs = scan.objs;
+    auto &nodes = scan.nodes;
+
+    double t0 = now_secs();
+    std::vector<std::pair<uint32_t,int>> found;
+    if (!scan.list(found))
+	exit(1);
+    for (auto [index, t] : found) {
+	if (!objs.empty() && objs.back().index == index)
+	    continue;
+	// whatever was logged in a missing object is lost
+	if (index != (objs.empty() ? 0 : objs.back().index + 1))
+	    problem(index, "objects missing before this one");
+	scan.obj_pos[index] = objs.size();
+	objs.push_back({.index = index, .target = t});
+    }
+    if (objs.empty()) {
+	fprintf(stderr, "%s: no objects\n", argv[optind]);
+	exit(1);
+    }
+
+    // metadata: fetch headers in parallel, replay in order
+    scan.replay(cfg.nthreads, !cfg.quiet);
+    std::vector<std::thread> th;
+    double t_meta = now_secs() - t0;
+
+    node *root = scan.find(1);
+    if (root == nullptr || !S_ISDIR(root->mode)) {
+	fprintf(stderr, "%s: no root directory\n", argv[optind]);
+	exit(1);
+    }
+
+    // output order: the namespace from the root, then files with data
+    // by the first object they use
+    std::vector<std::pair<std::string,uint32_t>> entries = {{".", 1}};
+    std::set<uint32_t> seen = {1};
+    for (size_t i = 0; i < entries.size(); i++) {
+	node &n = nodes[entries[i].second];
+	for (auto &[name, inum] : n.dirents) {
+	    // names come straight from the log and end up in paths under -C
+	    if (name.empty() || name == "." || name == ".." ||
+		name.find('/') != std::string::npos) {
+		problem(-1, "%s: bad entry name '%s' for inode %u, skipped",
+			entries[i].first.c_str(), name.c_str(), inum);
+		continue;
+	    }
+	    if (scan.find(inum) == nullptr) {
+		problem(-1, "%s/%s: entry for missing inode %u", entries[i].first.c_str(),
+			name.c_str(), inum);
+		continue;
+	    }
+	    if (seen.insert(inum).second)
+		entries.push_back({entries[i].first + "/" + name, inum});
+	}
+    }
+    std::vector<std::pair<uint32_t,size_t>> files;	// first object, entries[]
+    uint64_t n_dirs = 0, n_skipped = 0, live_bytes = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+	node &n = nodes[entries[i].second];
+	if (S_ISREG(n.mode))
+	    files.push_back({n.extents.empty() ? 0 : n.extents.begin()->second.objnum, i});
+	else if (S_ISSOCK(n.mode)) {
+	    if (!cfg.quiet)
+		fprintf(stderr, "%s: socket, skipped\n", entries[i].first.c_str());
+	    n_skipped++;
+	}
+	else {
+	    n_dirs += S_ISDIR(n.mode);
+	    put_entry(entries[i].first, n);
+	}
+    }
+    std::stable_sort(files.begin(), files.end(),
+		     [](auto &a, auto &b) { return a.first < b.first; });
+    for (auto [first, i] : files) {
+	node &n = nodes[entries[i].second];
+	ext_trunc(n.extents, n.size);
+	for (auto &[offset, e] : n.extents) {
+	    auto [it, fresh] = need_pos.insert({e.objnum, need.size()});
+	    if (fresh) {
+		need.emplace_back();
+		need.back().index = e.objnum;
+	    }
+	    piece &pc = need[it->second];
+	    pc.lo = std::min(pc.lo, (uint64_t)e.offset);
+	    pc.hi = std::max(pc.hi, (uint64_t)e.offset + e.len);
+	    pc.refs++;
+	    live_bytes += e.len;
+	}
+    }
+
+    double t1 = now_secs(), t_progress = t1;
+    for (int i = 0; i < std::min(cfg.nthreads, (int)need.size()); i++)
+	th.push_back(std::thread(data_thread));
+    for (auto [first, i] : files) {
+	write_file(entries[i].first, nodes[entries[i].second]);
+	if (!cfg.quiet && now_secs() - t_progress > 10) {
+	    t_progress = now_secs();
+	    fprintf(stderr, "%.1f of %.1f MB, %.1f MB/s\n", bytes_out / (1024.0 * 1024),
+		    live_bytes / (1024.0 * 1024),
+		    bytes_out / (1024.0 * 1024) / (t_progress - t1));
+	}
+    }
+    for (auto &t : th)
+	t.join();
+
+    if (cfg.dir == nullptr) {
+	tar_zeros(1024);		// end of archive
+	if (fflush(tar_fp) != 0 || (cfg.tar_file && fclose(tar_fp) != 0)) {
+	    perror(cfg.tar_file ? cfg.tar_file : "stdout");
+	    exit(1);
+	}
+    }
+    else
+	for (auto it = dir_times.rbegin(); it != dir_times.rend(); it++)
+	    set_attrs(it->first, *it->second);
+
+    double secs = now_secs() - t0;
+    if (!cfg.quiet) {
+	fprintf(stderr, "%zu entries (%lu directories, %zu files), %zu objects:"
+		" metadata in %.1f s, then %zu objects read\n", entries.size() - n_skipped,
+		(unsigned long)n_dirs, files.size(), objs.size(), t_meta, need.size());
+	fprintf(stderr, "%.1f MB read for %.1f MB of live data, %.1f MB out in %.1f s"
+		" (%.1f MB/s)\n", data_bytes_read / (1024.0 * 1024),
+		live_bytes / (1024.0 * 1024), bytes_out / (1024.0 * 1024), secs,
+		bytes_out / (1024.0 * 1024) / secs);
+	if (n_problems > 0)
+	    fprintf(stderr, "%ld problems\n", n_problems.load());
+    }
+    return n_problems > 0 ? 1 : 0;
+}
@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "stripe.h"
+#include "objfs-scan.h"
+#include <sys/stat.h>
+#include <time.h>
+
+
+// offline log analyzer and consistency check for an objfs prefix,
+// which grew out of printfs.c:
+//
+// objfs-fsck [options] bucket/prefix
+// objfs-fsck [options] -l dir/prefix
+//
+// Object headers are fetched by -t threads (only the headers - file
+// data is never read) and replayed in index order as they arrive, the
+// way fs_init() does, checking each record. Then the namespace and
+// the extent maps are checked as a whole, and reported on:
+//
+//   - records by type, and namespace totals
+//   - live and dead data bytes in each object, and how much a cleaner
+//     would free by copying out the live data of the emptier objects
+//   - per-file fragmentation (extents, and objects per file)
+//
+// Problems come in three kinds: "fatal" stops a mount at that record
+// (fs_init throws "bad header"), "error" is an inconsistency that
+// loses or misplaces something (missing objects, dangling entries,
+// orphan inodes), and "warn" is odd but harmless.
+//
+//   -t N       threads fetching headers (32)
+//   -l         objects are local files: dir/prefix.%08x (also
+//              dir/N/prefix.%08x with hashed shards, as in the layout)
+//   -g PCT     clean objects under PCT% live in the GC estimate (50)
+//   -n N       most fragmented files to list (10)
+//   -o         list every object's live/dead bytes
+//   -d         dump every record, like printfs
+//   -v         list every problem, not just the first 50
+//   -j         JSON report instead of text
+//
+// Exit status is 0 if no errors were found, 4 if there were (as for
+// fsck(8): errors left uncorrected - this never changes anything),
+// and 8 if the objects couldn't be listed.
+//
+
+
+struct {
+    int    nthreads = 32;
+    bool   local = false;
+    double gc_pct = 50;
+    int    top_n = 10;
+    bool   per_object = false;
+    bool   dump = false;
+    bool   verbose = false;
+    bool   json = false;
+} cfg;
+
+static objfs_scan scan;
+
+// -------------- problems
+
+static const char *sev_names[] = {"warn", "error", "fatal"};
+static const size_t max_kept = 10000;	// messages; the counts are exact
+
+struct problem {
+    int         sev;
+    int64_t     index;		// -1 for the namespace as a whole
+    std::string msg;
+};
+static std::vector<problem> problems;
+static uint64_t n_problems[N_SEVERITY];
+
+void report(int sev, int64_t index, const char *fmt, ...)
+{
+    n_problems[sev]++;
+    if (problems.size() >= max_kept)
+	return;
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    problems.push_back({sev, index, buf});
+}
+
+// -------------- the namespace, and reporting
+
+static std::map<uint32_t,std::pair<uint32_t,std::string>> parent_of; // reachable inodes
+
+static std::string path_of(uint32_t inum)
+{
+    std::string path;
+    while (inum != 1) {
+	auto it = parent_of.find(inum);
+	if (it == parent_of.end())
+	    return "(inode " + std::to_string(inum) + ")" + path;
+	path = "/" + it->second.second + path;
+	inum = it->second.first;
+    }
+    return path.empty() ? "/" : path;
+}
+
+static void check_namespace(void)
+{
+    node *root = scan.find(1);
+    if (root == nullptr || !S_ISDIR(root->mode)) {
+	report(P_FATAL, -1, "no root directory");
+	return;
+    }
+    std::vector<uint32_t> todo = {1};
+    std::set<uint32_t> seen = {1};
+    while (!todo.empty()) {
+	uint32_t dir = todo.back();
+	todo.pop_back();
+	for (auto &[name, inum] : scan.nodes[dir].dirents) {
+	    node *n = scan.find(inum);
+	    if (n == nullptr) {
+		report(P_ERROR, -1, "%s/%s: entry for missing inode %u",
+		       dir == 1 ? "" : path_of(dir).c_str(), name.c_str(), inum);
+		continue;
+	    }
+	    if (!seen.insert(inum).second) {
+		report(P_ERROR, -1, "%s/%s: inode %u is also %s",
+		       dir == 1 ? "" : path_of(dir).c_str(), name.c_str(), inum,
+		       path_of(inum).c_str());
+		continue;
+	    }
+	    parent_of[inum] = {dir, name};
+	    if (S_ISDIR(n->mode))
+		todo.push_back(inum);
+	}
+    }
+    for (auto &[inum, n] : scan.nodes)
+	if (!seen.count(inum))
+	    report(P_ERROR, n.born, "orphan inode %u (%s, %ld bytes)", inum,
+		   type_names[mode_type(n.mode)], (long)n.size);
+}
+
+static std::vector<uint64_t> live;	// bytes, by objs[] position
+
+// extents into objects that aren't there, or past their data, and
+// per-object live bytes
+//
+static void check_extents(void)
+{
+    live.assign(scan.objs.size(), 0);
+    for (auto &[inum, n] : scan.nodes) {
+	int64_t next = 0, hole_bytes = 0;
+	int holes = 0;
+	for (auto &[offset, e] : n.extents) {
+	    if (offset > next) {
+		holes++;
+		hole_bytes += offset - next;
+	    }
+	    next = offset + e.len;
+	    auto it = scan.obj_pos.find(e.objnum);
+	    if (it == scan.obj_pos.end()) {
+		report(P_ERROR, -1, "%s: data at %ld is in missing object %08x",
+		       path_of(inum).c_str(), (long)offset, e.objnum);
+		continue;
+	    }
+	    if ((uint64_t)e.offset + e.len > scan.objs[it->second].data_bytes)
+		report(P_ERROR, e.objnum, "%s: data at %ld is past the end of the object",
+		       path_of(inum).c_str(), (long)offset);
+	    live[it->second] += e.len;
+	}
+	if (S_ISREG(n.mode) && next < n.size && !n.extents.empty()) {
+	    holes++;
+	    hole_bytes += n.size - next;
+	}
+	if (holes > 0)
+	    report(P_WARN, -1, "%s: %d holes, %ld bytes", path_of(inum).c_str(), holes,
+		   (long)hole_bytes);
+    }
+}
+
+struct frag {
+    uint32_t inum;
+    int64_t  size;
+    size_t   extents;		// contiguous runs
+    size_t   objects;
+};
+
+static frag fragmentation(uint32_t inum, node &n)
+{
+    frag f = {inum, n.size, 0, 0};
+    std::set<uint32_t> objects;
+    bool first = true;
+    int64_t prev_end = 0;
+    extent prev = {0, 0, 0};
+    for (auto &[offset, e] : n.extents) {
+	if (first || offset != prev_end || e.objnum != prev.objnum ||
+	    e.offset != prev.offset + prev.len)
+	    f.extents++;
+	first = false;
+	prev = e;
+	prev_end = offset + e.len;
+	objects.insert(e.objnum);
+    }
+    f.objects = objects.size();
+    return f;
+}
+
+static std::string json_str(const std::string &s)
+{
+    std::string out = "\"";
+    for (unsigned char c : s) {
+	if (c == '"' || c == '\\')
+	    out += '\\', out += c;
+	else if (c < 0x20) {
+	    char tmp[8];
+	    snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+	    out += tmp;
+	}
+	else
+	    out += c;
+    }
+    return out + "\"";
+}
+
+static double mb(uint64_t bytes)
+{
+    return bytes / (1024.0 * 1024);
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    printf("usage: objfs-fsck [-t threads] [-l] [-g pct] [-n N] [-o] [-d] [-v] [-j]"
+	   " bucket/prefix|dir/prefix\n");
+    exit(8);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:lg:n:odvj")) != -1) {
+	switch (opt) {
+	case 't': cfg.nthreads = atoi(optarg); break;
+	case 'l': cfg.local = true; break;
+	case 'g': cfg.gc_pct = atof(optarg); break;
+	case 'n': cfg.top_n = atoi(optarg); break;
+	case 'o': cfg.per_object = true; break;
+	case 'd': cfg.dump = true; break;
+	case 'v': cfg.verbose = true; break;
+	case 'j': cfg.json = true; break;
+	default: usage();
+	}
+    }
+    if (optind >= argc || cfg.nthreads < 1)
+	usage();
+    if (cfg.dump)
+	cfg.nthreads = std::min(cfg.nthreads, 4);
+
+    if (!scan.open(argv[optind], cfg.local, cfg.nthreads))
+	exit(8);
+    auto &objs = scan.objs;
+
+    // list everything, on every target
+    double t0 = now_secs();
+    std::vector<std::pair<uint32_t,int>> found;
+    if (!scan.list(found))
+	exit(8);
+    uint64_t gaps = 0;
+    for (auto [index, t] : found) {
+	if (!objs.empty() && objs.back().index == index) {
+	    report(P_ERROR, index, "object is on more than one target");
+	    continue;
+	}
+	if (!cfg.local && scan.stripe->slot(index) != t)
+	    report(P_ERROR, index, "object is on target %d, the layout says %d", t,
+		   scan.stripe->slot(index));
+	// nothing deletes objects yet, so a gap is lost log records
+	if (!objs.empty() && index != objs.back().index + 1) {
+	    gaps += index - objs.back().index - 1;
+	    report(P_ERROR, index, "objects %08x..%08x are missing",
+		   objs.back().index + 1, index - 1);
+	}
+	scan.obj_pos[index] = objs.size();
+	objs.push_back({.index = index, .target = t});
+    }
+    double t_list = now_secs() - t0;
+    if (objs.empty()) {
+	printf("%s: no objects\n", argv[optind]);
+	exit(8);
+    }
+
+    scan.dump = cfg.dump;
+    scan.replay(cfg.nthreads, !cfg.dump);
+    double t_scan = now_secs() - t0;
+
+    check_namespace();
+    check_extents();
+
+    // totals
+    uint64_t n_type[N_TYPES] = {0}, file_bytes = 0, hdr_total = 0, data_total = 0,
+	live_total = 0;
+    for (auto &[inum, n] : scan.nodes) {
+	n_type[mode_type(n.mode)]++;
+	if (S_ISREG(n.mode))
+	    file_bytes += n.size;
+    }
+    for (size_t i = 0; i < objs.size(); i++) {
+	hdr_total += objs[i].hdr_len;
+	data_total += objs[i].data_bytes;
+	live_total += live[i];
+    }
+
+    // objects by live fraction, and what cleaning the emptier ones gets
+    static const double live_limits[] = {0, 10, 25, 50, 75, 100};
+    static const char *live_names[] = {"0%", "<10%", "<25%", "<50%", "<75%", "<100%", "100%"};
+    uint64_t by_live[7] = {0}, gc_objs = 0, gc_freed = 0, gc_copied = 0, gc_meta = 0;
+    for (size_t i = 0; i < objs.size(); i++) {
+	auto &o = objs[i];
+	if (o.data_bytes == 0)
+	    continue;
+	double pct = 100.0 * live[i] / o.data_bytes;
+	int b = 0;
+	if (live[i] > 0)
+	    for (b = 1; b < 6 && pct >= live_limits[b]; b++)
+		;
+	by_live[b]++;
+	if (pct < cfg.gc_pct) {
+	    gc_objs++;
+	    gc_freed += o.data_bytes - live[i];
+	    gc_copied += live[i];
+	    gc_meta += o.hdr_len;
+	}
+    }
+
+    // fragmentation
+    std::vector<frag> frags;
+    for (auto &[inum, n] : scan.nodes)
+	if (S_ISREG(n.mode) && parent_of.count(inum))
+	    frags.push_back(fragmentation(inum, n));
+    static const size_t ext_limits[] = {1, 4, 16, 64, 256, SIZE_MAX};
+    static const char *ext_names[] = {"1", "2-4", "5-16", "17-64", "65-256", ">256"};
+    uint64_t by_ext[6] = {0}, n_extents = 0, ext_bytes = 0;
+    for (auto &f : frags) {
+	int b = 0;
+	while (f.extents > ext_limits[b])
+	    b++;
+	if (f.extents > 0)
+	    by_ext[b]++;
+	n_extents += f.extents;
+	ext_bytes += f.size;
+    }
+    std::sort(frags.begin(), frags.end(), [](const frag &a, const frag &b) {
+	    return a.extents > b.extents || (a.extents == b.extents && a.size > b.size);
+	});
+    if (frags.size() > (size_t)cfg.top_n)
+	frags.resize(cfg.top_n);
+
+    std::stable_sort(problems.begin(), problems.end(), [](const problem &a, const problem &b) {
+	    return a.sev > b.sev;
+	});
+    size_t n_shown = cfg.verbose ? problems.size() : std::min(problems.size(), (size_t)50);
+    uint32_t first = objs.front().index, last = objs.back().index;
+
+    if (cfg.json) {
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "{\"objects\": %zu, \"first\": %u, \"last\": %u, "
+		 "\"missing\": %lu, \"targets\": %zu, \"list_secs\": %.3f, "
+		 "\"scan_secs\": %.3f, \"header_bytes\": %lu, \"data_bytes\": %lu, "
+		 "\"live_bytes\": %lu, \"records\": {", objs.size(), first, last, gaps,
+		 scan.stripe->targets.size(), t_list, t_scan, hdr_total, data_total, live_total);
+	std::string json = tmp;
+	for (int t = 1; t < N_LOG_TYPES; t++) {
+	    snprintf(tmp, sizeof(tmp), "%s\"%s\": {\"n\": %lu, \"bytes\": %lu}",
+		     t > 1 ? ", " : "", t2s(t) + 4, scan.rec_counts[t].n,
+		     scan.rec_counts[t].bytes);
+	    json += tmp;
+	}
+	snprintf(tmp, sizeof(tmp), "}, \"inodes\": {\"dir\": %lu, \"file\": %lu, "
+		 "\"symlink\": %lu, \"other\": %lu}, \"file_bytes\": %lu, \"live\": {",
+		 n_type[N_DIR], n_type[N_FILE], n_type[N_LINK], n_type[N_OTHER], file_bytes);
+	json += tmp;
+	for (int b = 0; b < 7; b++) {
+	    snprintf(tmp, sizeof(tmp), "%s\"%s\": %lu", b ? ", " : "", live_names[b],
+		     by_live[b]);
+	    json += tmp;
+	}
+	snprintf(tmp, sizeof(tmp), "}, \"gc\": {\"below_pct\": %.1f, \"objects\": %lu, "
+		 "\"freed_bytes\": %lu, \"copied_bytes\": %lu, \"metadata_bytes\": %lu}, "
+		 "\"extents\": {", cfg.gc_pct, gc_objs, gc_freed, gc_copied, gc_meta);
+	json += tmp;
+	for (int b = 0; b < 6; b++) {
+	    snprintf(tmp, sizeof(tmp), "%s\"%s\": %lu", b ? ", " : "", ext_names[b],
+		     by_ext[b]);
+	    json += tmp;
+	}
+	json += "}, \"fragmented\": [";
+	for (size_t i = 0; i < frags.size(); i++) {
+	    auto &f = frags[i];
+	    snprintf(tmp, sizeof(tmp), "%s{\"inum\": %u, \"size\": %ld, \"extents\": %zu, "
+		     "\"objects\": %zu, \"path\": ", i ? ", " : "", f.inum, (long)f.size,
+		     f.extents, f.objects);
+	    json += tmp + json_str(path_of(f.inum)) + "}";
+	}
+	if (cfg.per_object) {
+	    json += "], \"per_object\": [";
+	    for (size_t i = 0; i < objs.size(); i++) {
+		snprintf(tmp, sizeof(tmp), "%s{\"index\": %u, \"header\": %lu, "
+			 "\"data\": %lu, \"live\": %lu}", i ? ", " : "", objs[i].index,
+			 objs[i].hdr_len, objs[i].data_bytes, live[i]);
+		json += tmp;
+	    }
+	}
+	snprintf(tmp, sizeof(tmp), "], \"problems\": {\"fatal\": %lu, \"error\": %lu, "
+		 "\"warn\": %lu, \"list\": [", n_problems[P_FATAL], n_problems[P_ERROR],
+		 n_problems[P_WARN]);
+	json += tmp;
+	for (size_t i = 0; i < n_shown; i++) {
+	    auto &p = problems[i];
+	    snprintf(tmp, sizeof(tmp), "%s{\"kind\": \"%s\", \"object\": %ld, \"msg\": ",
+		     i ? ", " : "", sev_names[p.sev], (long)p.index);
+	    json += tmp + json_str(p.msg) + "}";
+	}
+	printf("%s]}}\n", json.c_str());
+    }
+    else {
+	printf("%s: %zu objects (%08x..%08x, %lu missing) on %zu target(s)\n",
+	       argv[optind], objs.size(), first, last, gaps, scan.stripe->targets.size());
+	printf("  listed in %.1f s; %.1f MB of headers scanned in %.1f s (%.0f objects/s)\n",
+	       t_list, mb(scan.hdr_bytes_read), t_scan, objs.size() / t_scan);
+	printf("  %.1f MB of metadata, %.1f MB of data, %.1f MB (%.1f%%) of it live\n\n",
+	       mb(hdr_total), mb(data_total), mb(live_total),
+	       data_total ? 100.0 * live_total / data_total : 0);
+
+	printf("record           count        bytes\n");
+	for (int t = 1; t < N_LOG_TYPES; t++)
+	    printf("%-10s  %10lu  %11lu\n", t2s(t) + 4, scan.rec_counts[t].n,
+		   scan.rec_counts[t].bytes);
+	if (scan.rec_counts[N_LOG_TYPES].n)
+	    printf("%-10s  %10lu\n", "bad", scan.rec_counts[N_LOG_TYPES].n);
+
+	printf("\ninodes: %lu directories, %lu files (%.1f MB), %lu symlinks, %lu other\n",
+	       n_type[N_DIR], n_type[N_FILE], mb(file_bytes), n_type[N_LINK], n_type[N_OTHER]);
+
+	printf("\nobjects by live data:");
+	for (int b = 0; b < 7; b++)
+	    printf(" %s %lu", live_names[b], by_live[b]);
+	printf("\ngc: cleaning the %lu objects under %.0f%% live frees %.1f MB of data"
+	       " by copying %.1f MB,\n    and their %.1f MB of metadata once live"
+	       " metadata is checkpointed\n", gc_objs, cfg.gc_pct, mb(gc_freed),
+	       mb(gc_copied), mb(gc_meta));
+
+	printf("\nfiles by extents:");
+	for (int b = 0; b < 6; b++)
+	    printf(" %s %lu", ext_names[b], by_ext[b]);
+	printf("\n  %lu extents, mean %.1f KB\n", n_extents,
+	       n_extents ? ext_bytes / 1024.0 / n_extents : 0);
+	if (!frags.empty() && frags[0].extents > 1) {
+	    printf("  most fragmented:\n  %8s %8s %12s  path\n", "extents", "objects", "size");
+	    for (auto &f : frags)
+		if (f.extents > 1)
+		    printf("  %8zu %8zu %12ld  %s\n", f.extents, f.objects, (long)f.size,
+			   path_of(f.inum).c_str());
+	}
+
+	if (cfg.per_object) {
+	    printf("\n  object     header         data         live  live%%\n");
+	    for (size_t i = 0; i < objs.size(); i++)
+		printf("  %08x %8lu %12lu %12lu  %5.1f\n", objs[i].index, objs[i].hdr_len,
+		       objs[i].data_bytes, live[i],
+		       objs[i].data_bytes ? 100.0 * live[i] / objs[i].data_bytes : 0);
+	}
+
+	printf("\n%lu fatal, %lu errors, %lu warnings\n", n_problems[P_FATAL],
+	       n_problems[P_ERROR], n_problems[P_WARN]);
+	for (size_t i = 0; i < n_shown; i++) {
+	    auto &p = problems[i];
+	    if (p.index >= 0)
+		printf("  %-5s %08lx: %s\n", sev_names[p.sev], (long)p.index, p.msg.c_str());
+	    else
+		printf("  %-5s %s\n", sev_names[p.sev], p.msg.c_str());
+	}
+	if (n_shown < n_problems[P_FATAL] + n_problems[P_ERROR] + n_problems[P_WARN])
+	    printf("  ... (-v for all)\n");
+    }
+    return n_problems[P_FATAL] + n_problems[P_ERROR] ? 4 : 0;
+}
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "objfs-log.h"
+#include "stripe.h"
+#include "crc32c.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+// build an objfs file system from a local directory tree, without
+// going through FUSE:
+//
+// objfs-import [options] dir bucket/prefix
+//
+// The tree is walked by -t threads, a directory at a time. Then the
+// file data, in the order the files were found, is cut into -O MB log
+// objects, each holding just the LOG_DATA records for the pieces of
+// files in it - so a file gets one extent per object it's in, and lots
+// of small files share an object. Threads read and PUT these in
+// parallel.
+//
+// The namespace - LOG_INODE, LOG_CREATE and LOG_SYMLNK records, each
+// directory's entries after the directory - goes in the objects with
+// the lowest indexes so it's replayed before the data. They are
+// written last, object 0 (the root) very last, so an import that
+// doesn't finish never mounts. objfs has no checkpoint format yet
+// (".ck" objects are read but never written), so these stand in for
+// one: a mount replays them like any other log objects.
+//
+//   -t N       threads (16)
+//   -O MB      data object size (8)
+//   -c         send a CRC32C with each PUT, as objfs-mount -checksum does
+//   -n         walk, read and pack, but don't upload
+//
+// The prefix has to be empty; if "<prefix>.stripe" is there, objects
+// are placed the way it says. Hard links come in as separate files,
+// and symlinks with targets over 255 bytes (the log record limit) are
+// skipped. A file that shrinks while it's being read is zero-filled
+// to the size it had when the tree was walked.
+//
+
+
+struct {
+    int    nthreads = 16;
+    size_t obj_bytes = 8 * 1024 * 1024;
+    bool   checksum = false;
+    bool   dry_run = false;
+} cfg;
+
+static const size_t ns_meta_bytes = 1024 * 1024; // records per namespace object
+
+// -------------- walking the tree
+//
+// entries[inum-1] is inode inum; the root is 1. Each directory's
+// entries are numbered together, when it's read.
+
+struct entry {
+    uint32_t    parent;
+    uint32_t    mode;
+    uint32_t    uid, gid, rdev;
+    struct timespec mtime;
+    int64_t     size;		// files
+    std::string name;
+    std::string target;		// symlinks
+    std::vector<uint32_t> children;
+};
+
+static std::deque<entry> entries;	// deque: appending doesn't move them
+static std::mutex walk_m;
+static std::condition_variable walk_cv;
+static std::vector<std::pair<uint32_t,std::string>> dir_queue; // inum, path
+static int walkers_busy;
+static std::string src_root;
+static std::atomic<long> n_hardlinks, n_skipped, n_unreadable;
+
+static std::string path_of(uint32_t inum)
+{
+    std::string path;
+    while (inum != 1) {
+	entry &e = entries[inum - 1];
+	path = "/" + e.name + path;
+	inum = e.parent;
+    }
+    return src_root + path;
+}
+
+static entry stat_entry(const struct stat &sb)
+{
+    entry e;
+    e.mode = sb.st_mode;
+    e.uid = sb.st_uid;
+    e.gid = sb.st_gid;
+    e.rdev = sb.st_rdev;
+    e.mtime = sb.st_mtim;
+    e.size = S_ISREG(sb.st_mode) ? sb.st_size : 0;
+    return e;
+}
+
+// other walkers append to entries while this runs, so the directory's
+// path comes with it from the queue rather than from path_of().
+//
+static void walk_dir(uint32_t inum, const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    DIR *d = fd < 0 ? NULL : fdopendir(fd);
+    if (d == NULL) {
+	perror(path.c_str());
+	n_unreadable++;
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    std::vector<entry> found;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	struct stat sb;
+	if (fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+	    perror((path + "/" + de->d_name).c_str());
+	    n_unreadable++;
+	    continue;
+	}
+	entry e = stat_entry(sb);
+	e.parent = inum;
+	e.name = de->d_name;
+	if (S_ISLNK(sb.st_mode)) {
+	    char buf[4096];
+	    ssize_t n = readlinkat(fd, de->d_name, buf, sizeof(buf));
+	    if (n < 0 || n > 255) {
+		fprintf(stderr, "%s/%s: %s, skipped\n", path.c_str(), de->d_name,
+			n < 0 ? strerror(errno) : "symlink target too long");
+		n_skipped++;
+		continue;
+	    }
+	    e.target = std::string(buf, n);
+	}
+	if (S_ISREG(sb.st_mode) && sb.st_nlink > 1)
+	    n_hardlinks++;
+	found.push_back(std::move(e));
+    }
+    closedir(d);
+
+    std::unique_lock lk(walk_m);
+    for (auto &e : found) {
+	entries.push_back(std::move(e));
+	uint32_t child = entries.size();
+	entries[inum - 1].children.push_back(child);
+	if (S_ISDIR(entries.back().mode))
+	    dir_queue.push_back({child, path + "/" + entries.back().name});
+    }
+    if (!dir_queue.empty())
+	walk_cv.notify_all();
+}
+
+static void walk_thread(void)
+{
+    std::unique_lock lk(walk_m);
+    for (;;) {
+	while (dir_queue.empty() && walkers_busy > 0)
+	    walk_cv.wait(lk);
+	if (dir_queue.empty())
+	    break;
+	auto [inum, path] = std::move(dir_queue.back());
+	dir_queue.pop_back();
+	walkers_busy++;
+	lk.unlock();
+	walk_dir(inum, path);
+	lk.lock();
+	if (--walkers_busy == 0 && dir_queue.empty())
+	    walk_cv.notify_all();
+    }
+}
+
+// -------------- writing objects
+
+static s3_stripe *stripe;
+static std::atomic<long> n_objects, n_failed;
+static std::atomic<int64_t> bytes_read, bytes_sent;
+
+static void add_record(std::string &meta, int type, const void *rec, size_t len)
+{
+    log_record lr = {.type = (uint16_t)type, .len = (uint16_t)len};
+    meta.append((char*)&lr, sizeof(lr));
+    meta.append((char*)rec, len);
+}
+
+static bool put_object(uint32_t index, const std::string &meta, const char *data,
+		       size_t data_len)
+{
+    obj_header h = {.magic = OBJFS_MAGIC, .version = 1, .type = 1,
+		    .hdr_len = (int)(sizeof(h) + meta.length()),
+		    .this_index = (int)index};
+    struct iovec iov[3] = {{(void*)&h, sizeof(h)},
+			   {(void*)meta.data(), meta.length()},
+			   {(void*)data, data_len}};
+    n_objects++;
+    if (cfg.dry_run)
+	return true;
+    uint32_t crc = 0;
+    if (cfg.checksum) {
+	crc = crc32c(0, &h, sizeof(h));
+	crc = crc32c(crc, meta.data(), meta.length());
+	crc = crc32c(crc, data, data_len);
+    }
+    std::string key = stripe->key(index);
+    if (stripe->target(index)->s3_put(key, iov, 3, cfg.checksum ? &crc : nullptr)
+	!= S3StatusOK) {
+	fprintf(stderr, "%s: write failed\n", key.c_str());
+	n_failed++;
+	return false;
+    }
+    bytes_sent += h.hdr_len + data_len;
+    return true;
+}
+
+// The data is the files in inode order, end to end; data object k is
+// bytes [k*obj_bytes, (k+1)*obj_bytes) of that.
+//
+static std::vector<uint32_t> files;		// inodes with data
+static std::vector<int64_t> file_start;		// where each starts
+static int64_t total_data;
+static uint32_t first_data;			// index of data object 0
+static std::atomic<int64_t> next_data_obj;
+
+static void data_thread(void)
+{
+    std::vector<char> buf(cfg.obj_bytes);
+    int64_t n_data_objs = (total_data + cfg.obj_bytes - 1) / cfg.obj_bytes;
+
+    for (int64_t k = next_data_obj++; k < n_data_objs; k = next_data_obj++) {
+	int64_t start = k * cfg.obj_bytes;
+	int64_t end = std::min(start + (int64_t)cfg.obj_bytes, total_data);
+	size_t i = std::upper_bound(file_start.begin(), file_start.end(), start)
+	    - file_start.begin() - 1;
+	std::string meta;
+
+	for (int64_t pos = start; pos < end; i++) {
+	    entry &e = entries[files[i] - 1];
+	    int64_t f_off = pos - file_start[i];
+	    size_t len = std::min(e.size - f_off, end - pos);
+	    char *p = buf.data() + (pos - start);
+
+	    std::string path = path_of(files[i]);
+	    int fd = open(path.c_str(), O_RDONLY);
+	    ssize_t n = fd < 0 ? -1 : pread(fd, p, len, f_off);
+	    if (fd >= 0)
+		close(fd);
+	    if (n < (ssize_t)len) {
+		fprintf(stderr, "%s: %s at %ld, zero-filled\n", path.c_str(),
+			n < 0 ? strerror(errno) : "short read", (long)f_off);
+		memset(p + std::max(n, (ssize_t)0), 0, len - std::max(n, (ssize_t)0));
+		n_unreadable++;
+	    }
+	    bytes_read += len;
+
+	    log_data d = {.inum = files[i], .obj_offset = (uint32_t)(pos - start),
+			  .file_offset = f_off, .size = f_off + (int64_t)len,
+			  .len = (uint32_t)len};
+	    add_record(meta, LOG_DATA, &d, sizeof(d));
+	    pos += len;
+	}
+	put_object(first_data + k, meta, buf.data(), end - start);
+    }
+}
+
+// a directory's entries, after the directory itself, in as many
+// namespace objects as it takes
+//
+static void namespace_records(std::vector<std::string> &objs)
+{
+    std::string meta;
+    auto add = [&](int type, const void *rec, size_t len) {
+	if (meta.length() + sizeof(log_record) + len > ns_meta_bytes) {
+	    objs.push_back(std::move(meta));
+	    meta.clear();
+	}
+	add_record(meta, type, rec, len);
+    };
+    auto add_inode = [&](uint32_t inum) {
+	entry &e = entries[inum - 1];
+	log_inode in = {.inum = inum, .mode = e.mode, .uid = e.uid, .gid = e.gid,
+			.rdev = e.rdev, .mtime = e.mtime};
+	add(LOG_INODE, &in, sizeof(in));
+    };
+
+    add_inode(1);
+    std::vector<uint32_t> todo = {1};
+    while (!todo.empty()) {
+	uint32_t dir = todo.back();
+	todo.pop_back();
+	for (auto inum : entries[dir - 1].children) {
+	    entry &e = entries[inum - 1];
+	    add_inode(inum);
+	    if (S_ISLNK(e.mode)) {
+		char buf[sizeof(log_symlink) + 256];
+		log_symlink *sl = (log_symlink*)buf;
+		sl->inum = inum;
+		sl->len = e.target.length();
+		memcpy(sl->target, e.target.data(), e.target.length());
+		add(LOG_SYMLNK, buf, sizeof(log_symlink) + e.target.length());
+	    }
+	    char buf[sizeof(log_create) + 256];
+	    log_create *c = (log_create*)buf;
+	    c->parent_inum = dir;
+	    c->inum = inum;
+	    c->namelen = e.name.length();
+	    memcpy(c->name, e.name.data(), e.name.length());
+	    add(LOG_CREATE, buf, sizeof(log_create) + e.name.length());
+	    if (S_ISDIR(e.mode))
+		todo.push_back(inum);
+	}
+    }
+    objs.push_back(std::move(meta));
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+    printf("usage: objfs-import [-t threads] [-O MB] [-c] [-n] dir bucket/prefix\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:O:cn")) != -1) {
+	switch (opt) {
+	case 't': cfg.nthreads = atoi(optarg); break;
+	case 'O': cfg.obj_bytes = atol(optarg) * 1024 * 1024; break;
+	case 'c': cfg.checksum = true; break;
+	case 'n': cfg.dry_run = true; break;
+	default: usage();
+	}
+    }
+    // offsets in a data object are 32 bits
+    if (optind + 2 != argc || cfg.nthreads < 1 || cfg.obj_bytes == 0 ||
+	cfg.obj_bytes > 1024 * 1024 * 1024)
+	usage();
+    src_root = argv[optind];
+    char *bucket, *prefix;
+    if (sscanf(argv[optind+1], "%m[^/]/%ms", &bucket, &prefix) != 2)
+	usage();
+
+    struct stat sb;
+    if (stat(src_root.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+	printf("%s: not a directory\n", src_root.c_str());
+	exit(1);
+    }
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(2 * cfg.nthreads, S3_POOL_SHARE_ALL);
+    s3_concurrency_limits(std::max(1, cfg.nthreads / 4), cfg.nthreads);
+    auto tt = new s3_target(host, bucket, access, secret, false);
+
+    // same layout lookup as fs_init
+    stripe = new s3_stripe(prefix);
+    std::string name = std::string(prefix) + ".stripe";
+    ssize_t len;
+    if (tt->s3_head(name, &len) == S3StatusOK) {
+	std::vector<char> buf(len);
+	struct iovec iov = {buf.data(), (size_t)len};
+	if (tt->s3_get(name, 0, len, &iov, 1) != S3StatusOK ||
+	    !stripe->parse_layout(std::string(buf.data(), len), access, secret)) {
+	    printf("%s: bad stripe layout\n", name.c_str());
+	    exit(1);
+	}
+    }
+    else
+	stripe->add_target(tt, host, bucket);
+    for (auto t : stripe->targets)
+	for (auto pfx : stripe->list_prefixes()) {
+	    std::vector<uint32_t> indexes;
+	    if (t->s3_list_indexes(pfx, indexes, 4) != S3StatusOK) {
+		printf("%s: can't list\n", argv[optind+1]);
+		exit(1);
+	    }
+	    if (!indexes.empty() && !cfg.dry_run) {
+		printf("%s: already has objects\n", argv[optind+1]);
+		exit(1);
+	    }
+	}
+
+    double t0 = now_secs();
+    entry root = stat_entry(sb);
+    root.parent = 0;
+    entries.push_back(root);
+    dir_queue.push_back({1, src_root});
+    std::vector<std::thread> th;
+    for (int i = 0; i < cfg.nthreads; i++)
+	th.push_back(std::thread(walk_thread));
+    for (auto &t : th)
+	t.join();
+    th.clear();
+    double t_walk = now_secs() - t0;
+
+    long n_dirs = 0, n_other = 0;
+    for (uint32_t inum = 1; inum <= entries.size(); inum++) {
+	entry &e = entries[inum - 1];
+	if (S_ISDIR(e.mode))
+	    n_dirs++;
+	else if (S_ISREG(e.mode)) {
+	    if (e.size > 0) {
+		files.push_back(inum);
+		file_start.push_back(total_data);
+		total_data += e.size;
+	    }
+	}
+	else
+	    n_other++;
+    }
+    if (entries.size() > UINT32_MAX - 1) {
+	printf("too many files\n");
+	exit(1);
+    }
+    printf("%zu entries (%ld directories, %zu files with data, %ld other), %.1f MB,"
+	   " walked in %.1f s\n", entries.size(), n_dirs, files.size(), n_other,
+	   total_data / (1024.0 * 1024), t_walk);
+
+    std::vector<std::string> ns_objs;
+    namespace_records(ns_objs);
+    first_data = ns_objs.size();
+
+    // data, with progress every few seconds
+    double t1 = now_secs();
+    for (int i = 0; i < cfg.nthreads; i++)
+	th.push_back(std::thread(data_thread));
+    int64_t n_data_objs = (total_data + cfg.obj_bytes - 1) / cfg.obj_bytes;
+    for (double t = now_secs(); next_data_obj < n_data_objs; ) {
+	usleep(100000);
+	if (now_secs() - t > 5) {
+	    t = now_secs();
+	    printf("%ld of %ld objects, %.1f MB/s\n", n_objects.load(), n_data_objs,
+		   bytes_read / (1024.0 * 1024) / (t - t1));
+	}
+    }
+    for (auto &t : th)
+	t.join();
+    th.clear();
+    double t_data = now_secs() - t1;
+    if (n_failed > 0) {
+	printf("%ld objects failed; the import is incomplete and won't mount\n",
+	       n_failed.load());
+	exit(1);
+    }
+
+    // then the namespace, object 0 last
+    std::atomic<size_t> next_ns(1);
+    for (int i = 0; i < std::min(cfg.nthreads, (int)ns_objs.size()); i++)
+	th.push_back(std::thread([&]() {
+		    for (size_t j = next_ns++; j < ns_objs.size(); j = next_ns++)
+			put_object(j, ns_objs[j], nullptr, 0);
+		}));
+    for (auto &t : th)
+	t.join();
+    if (n_failed == 0)
+	put_object(0, ns_objs[0], nullptr, 0);
+    if (n_failed > 0) {
+	printf("%ld objects failed; the import is incomplete and won't mount\n",
+	       n_failed.load());
+	exit(1);
+    }
+
+    double secs = now_secs() - t0;
+    printf("%ld objects (%zu namespace), %.1f MB read, %.1f MB written, in %.1f s:"
+	   " %.1f MB/s (data %.1f MB/s)\n", n_objects.load(), ns_objs.size(),
+	   bytes_read / (1024.0 * 1024), bytes_sent / (1024.0 * 1024), secs,
+	   bytes_read / (1024.0 * 1024) / secs, bytes_read / (1024.0 * 1024) / t_data);
+    if (n_hardlinks || n_skipped || n_unreadable)
+	printf("%ld files with hard links copied separately, %ld skipped, %ld read errors\n",
+	       n_hardlinks.load(), n_skipped.load(), n_unreadable.load());
+    return n_unreadable > 0 ? 1 : 0;
+}
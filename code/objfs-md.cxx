@@ -0,0 +1,345 @@
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <fuse.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "objfs.h"
+#include "objstats.h"
+#include "responder.h"
+#include <sys/uio.h>
+#include <thread>
+#include <mutex>
+#include <unistd.h>
+#include <time.h>
+
+
+// metadata benchmark in the style of mdtest, calling fs_ops in-process
+// the way libobjfs does - no FUSE or kernel in the way:
+//
+// objfs-md [options] bucket/prefix
+// objfs-md [options] memory
+//
+// Each thread works in its own tree /md.N: -z levels below the top,
+// -b directories in each directory, and -I files in every directory.
+// The phases run in order, all threads starting each one together:
+//
+//   create   mkdir the tree, create (and with -w, write) the files
+//   stat     getattr every directory and file
+//   readdir  list every directory, checking the entry count
+//   rename   rename every file within its directory
+//   unlink   remove the files, then the directories, deepest first
+//
+//   -t N       threads (1)
+//   -b N       directories per directory (4)
+//   -z N       depth (2)
+//   -I N       files per directory (16)
+//   -w SIZE    bytes written to each file (0)
+//   -P LIST    phases to run, e.g. create,stat (all)
+//   -y         fsync after each phase, counted in its time
+//   -L MS      memory backend latency (0)
+//   -j         JSON summary, as the last line of output
+//
+// "memory" is an S3 stand-in in this process that keeps objects in a
+// map, so a run measures objfs and not the network. A bucket prefix
+// with no objects gets an empty file system (what mkfs.py writes). To
+// run phases separately against a bucket, the tree from an earlier
+// "-P create" run has to be there.
+//
+// objfs.cc keeps its state in globals with no locking, so fs_ops calls
+// are made under one lock here. With -t N the latencies include the
+// wait for it.
+
+enum {PH_CREATE, PH_STAT, PH_READDIR, PH_RENAME, PH_UNLINK, N_PHASES};
+static const char *phase_names[] = {"create", "stat", "readdir", "rename", "unlink"};
+
+static struct {
+    int    nthreads = 1;
+    int    fanout = 4;
+    int    depth = 2;
+    int    files = 16;
+    size_t write_size = 0;
+    bool   phases[N_PHASES] = {true, true, true, true, true};
+    bool   sync = false;
+    int    latency_ms = 0;
+    bool   json = false;
+} cfg;
+
+struct alignas(64) thread_stats {
+    lat_hist  lat = {};
+    uint64_t  errors = 0;
+};
+
+// ---- calling objfs
+
+extern struct fuse_operations fs_ops;
+
+static struct objfs fs;
+static struct fuse_context ctx;
+
+struct fuse_context *fuse_get_context(void)
+{
+    ctx.uid = getuid();
+    ctx.gid = getgid();
+    ctx.private_data = &fs;
+    return &ctx;
+}
+
+static std::mutex fs_lock;
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one timed operation - @fn returns 0 or -errno, like fs_ops
+//
+template<typename F> static void timed(thread_stats *st, F fn)
+{
+    double t0 = now_secs();
+    std::unique_lock lk(fs_lock);
+    int rv = fn();
+    lk.unlock();
+    lat_add(&st->lat, (now_secs() - t0) * 1e6);
+    if (rv < 0)
+	st->errors++;
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *sb, off_t off)
+{
+    (*(int*)buf)++;
+    return 0;
+}
+
+// ---- the tree
+
+// a thread's directories, parents before children
+//
+static std::vector<std::string> tree_dirs(int id)
+{
+    std::vector<std::string> dirs = {"/md." + std::to_string(id)};
+    size_t level = 0, end = 1;
+    for (int d = 0; d < cfg.depth; d++) {
+	for (; level < end; level++)
+	    for (int i = 0; i < cfg.fanout; i++)
+		dirs.push_back(dirs[level] + "/d." + std::to_string(i));
+	end = dirs.size();
+    }
+    return dirs;
+}
+
+static std::string file_name(std::string dir, int i, bool renamed)
+{
+    return dir + (renamed ? "/r." : "/f.") + std::to_string(i);
+}
+
+static void phase_thread(int phase, int id, thread_stats *st)
+{
+    auto dirs = tree_dirs(id);
+    size_t n_leaf = pow(cfg.fanout, cfg.depth);
+    bool renamed = cfg.phases[PH_RENAME];
+    std::vector<char> buf(cfg.write_size, 'x');
+    struct fuse_file_info fi = {};
+    struct stat sb;
+
+    switch (phase) {
+    case PH_CREATE:
+	for (auto &d : dirs) {
+	    timed(st, [&]() {return fs_ops.mkdir(d.c_str(), 0755);});
+	    for (int i = 0; i < cfg.files; i++) {
+		std::string f = file_name(d, i, false);
+		timed(st, [&]() {
+			int rv = fs_ops.create(f.c_str(), 0644, &fi);
+			if (rv == 0 && cfg.write_size > 0)
+			    rv = fs_ops.write(f.c_str(), buf.data(), buf.size(), 0, &fi);
+			return rv < 0 ? rv : 0;
+		    });
+	    }
+	}
+	break;
+    case PH_STAT:
+	for (auto &d : dirs) {
+	    timed(st, [&]() {return fs_ops.getattr(d.c_str(), &sb);});
+	    for (int i = 0; i < cfg.files; i++) {
+		std::string f = file_name(d, i, false);
+		timed(st, [&]() {return fs_ops.getattr(f.c_str(), &sb);});
+	    }
+	}
+	break;
+    case PH_READDIR:
+	for (size_t j = 0; j < dirs.size(); j++) {
+	    int want = cfg.files + (j < dirs.size() - n_leaf ? cfg.fanout : 0);
+	    timed(st, [&]() {
+		    int n = 0;
+		    int rv = fs_ops.readdir(dirs[j].c_str(), &n, count_entry, 0, &fi);
+		    return (rv == 0 && n != want) ? -EIO : rv;
+		});
+	}
+	break;
+    case PH_RENAME:
+	for (auto &d : dirs)
+	    for (int i = 0; i < cfg.files; i++) {
+		std::string f1 = file_name(d, i, false), f2 = file_name(d, i, true);
+		timed(st, [&]() {return fs_ops.rename(f1.c_str(), f2.c_str());});
+	    }
+	break;
+    case PH_UNLINK:
+	for (auto d = dirs.rbegin(); d != dirs.rend(); d++) {
+	    for (int i = 0; i < cfg.files; i++) {
+		std::string f = file_name(*d, i, renamed);
+		timed(st, [&]() {return fs_ops.unlink(f.c_str());});
+	    }
+	    timed(st, [&]() {return fs_ops.rmdir(d->c_str());});
+	}
+	break;
+    }
+}
+
+static void usage(void)
+{
+    printf("usage: objfs-md [options] bucket/prefix|memory\n"
+	   "  -t threads  -b fanout  -z depth  -I files_per_dir  -w write_bytes\n"
+	   "  -P create,stat,readdir,rename,unlink  -y (fsync)  -L memory_ms  -j (JSON)\n");
+    exit(1);
+}
+
+static void parse_phases(char *list)
+{
+    for (int p = 0; p < N_PHASES; p++)
+	cfg.phases[p] = false;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+	int p = 0;
+	while (p < N_PHASES && strcmp(name, phase_names[p]) != 0)
+	    p++;
+	if (p == N_PHASES)
+	    usage();
+	cfg.phases[p] = true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:z:I:w:P:yL:j")) != -1) {
+	switch (opt) {
+	case 't': cfg.nthreads = atoi(optarg); break;
+	case 'b': cfg.fanout = atoi(optarg); break;
+	case 'z': cfg.depth = atoi(optarg); break;
+	case 'I': cfg.files = atoi(optarg); break;
+	case 'w': cfg.write_size = atol(optarg); break;
+	case 'P': parse_phases(optarg); break;
+	case 'y': cfg.sync = true; break;
+	case 'L': cfg.latency_ms = atoi(optarg); break;
+	case 'j': cfg.json = true; break;
+	default: usage();
+	}
+    }
+    if (optind >= argc || cfg.nthreads < 1 || cfg.fanout < 1 || cfg.depth < 0 ||
+	cfg.files < 0)
+	usage();
+
+    char *bucket, *prefix, local[64];
+    if (!strcmp(argv[optind], "memory")) {
+	sprintf(local, "127.0.0.1:%d", start_memory_responder(cfg.latency_ms));
+	host = local;
+	access = secret = (char*)"memory";
+	bucket = (char*)"memory";
+	prefix = (char*)"md";
+    }
+    else if (sscanf(argv[optind], "%m[^/]/%ms", &bucket, &prefix) != 2)
+	usage();
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(16, S3_POOL_SHARE_ALL);
+
+    // mkfs if there's nothing there
+    auto tt = new s3_target(host, bucket, access, secret, false);
+    if (const char *msg = objfs_mkfs(tt, prefix)) {
+	printf("%s: %s\n", argv[optind], msg);
+	exit(1);
+    }
+
+    fs = { .bucket = bucket, .prefix = prefix, .host = host, .access = access,
+	   .secret = secret, .use_local = 0, .chunk_size = 1024 * 1024 };
+    try {
+	fs_ops.init(NULL);
+    }
+    catch (const char *msg) {
+	printf("%s: %s\n", argv[optind], msg);
+	exit(1);
+    }
+
+    size_t n_dirs = tree_dirs(0).size();
+    if (!cfg.json)
+	printf("%d threads, each %zu directories and %zu files\n", cfg.nthreads,
+	       n_dirs, n_dirs * cfg.files);
+
+    // objfs prints as it goes, so the JSON waits until the end
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "{\"threads\": %d, \"dirs\": %zu, \"files\": %zu",
+	     cfg.nthreads, n_dirs * cfg.nthreads, n_dirs * cfg.files * cfg.nthreads);
+    std::string json = tmp;
+
+    bool failed = false;
+    for (int p = 0; p < N_PHASES; p++) {
+	if (!cfg.phases[p])
+	    continue;
+	std::vector<thread_stats> st(cfg.nthreads);
+	std::vector<std::thread> th;
+	double t0 = now_secs();
+	for (int i = 0; i < cfg.nthreads; i++)
+	    th.push_back(std::thread(phase_thread, p, i, &st[i]));
+	for (auto &t : th)
+	    t.join();
+	if (cfg.sync)
+	    fs_ops.fsync("/", 0, NULL);
+	double t = now_secs() - t0;
+
+	lat_hist h = {};
+	uint64_t errors = 0;
+	for (auto &s : st) {
+	    lat_sum(&h, &s.lat);
+	    errors += s.errors;
+	}
+	failed = failed || errors > 0;
+	double mean = h.n ? (double)h.sum_us / h.n : 0;
+	if (cfg.json) {
+	    snprintf(tmp, sizeof(tmp), ", \"%s\": {\"ops\": %lu, \"secs\": %.3f, "
+		     "\"ops_per_sec\": %.1f, \"errors\": %lu, \"lat_us\": {\"mean\": %.1f, "
+		     "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}",
+		     phase_names[p], h.n, t, h.n / t, errors, mean,
+		     lat_percentile(&h, 50), lat_percentile(&h, 90), lat_percentile(&h, 99),
+		     lat_percentile(&h, 99.9), lat_percentile(&h, 100));
+	    json += tmp;
+	}
+	else
+	    printf("%-8s %lu ops in %.3f s: %.1f/s, %lu errors\n"
+		   "  latency us: mean %.1f p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+		   phase_names[p], h.n, t, h.n / t, errors, mean,
+		   lat_percentile(&h, 50), lat_percentile(&h, 90), lat_percentile(&h, 99),
+		   lat_percentile(&h, 99.9), lat_percentile(&h, 100));
+    }
+
+    fs_ops.fsync("/", 0, NULL);
+    fs_teardown();
+    if (cfg.json)
+	printf("%s}\n", json.c_str());
+    return failed ? 1 : 0;
+}
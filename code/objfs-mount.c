@@ -21,17 +21,30 @@
 #include "libs3.h"
 #include "s3wrap.h"
 #include "objfs.h"
+#include "optrace.h"
+#include "objstats.h"
 
 /* usage: objfs-mount prefix /dir
  */
 static struct fuse_opt opts[] = {
     {"size=%d",   -1, 0 },      /* object size to write */
+    {"checksum",  -1, 0 },      /* send CRC32C with object PUTs */
+    {"targets=%s", -1, 0 },     /* stripe over host/bucket,host/bucket,... */
+    {"hash",      -1, 0 },      /* stripe by hash instead of round-robin */
+    {"shards=%d", -1, 0 },      /* hashed shard prefix on object keys */
+    {"max_inflight=%d", -1, 0 }, /* ceiling for adaptive S3 concurrency */
+    {"trace=%s",  -1, 0 },      /* record operations for objfs-replay */
     FUSE_OPT_END
 };
 
 const char *prefix;
 const char *bucket;
 int size = 1*1024*1024;
+int checksum = 0;
+const char *targets;
+int stripe_hash = 0;
+int shards = 0;
+const char *trace;
 
 /* the first non-option argument is the prefix
  */
@@ -46,6 +59,30 @@ static int myfs_opt_proc(void *data, const char *arg,
         size = atoi(arg+6);
         return 0;
     }
+    if (key == FUSE_OPT_KEY_OPT && !strcmp(arg, "-checksum")) {
+        checksum = 1;
+        return 0;
+    }
+    if (key == FUSE_OPT_KEY_OPT && !strncmp(arg, "-targets=", 9)) {
+        targets = strdup(arg+9);
+        return 0;
+    }
+    if (key == FUSE_OPT_KEY_OPT && !strcmp(arg, "-hash")) {
+        stripe_hash = 1;
+        return 0;
+    }
+    if (key == FUSE_OPT_KEY_OPT && !strncmp(arg, "-shards=", 8)) {
+        shards = atoi(arg+8);
+        return 0;
+    }
+    if (key == FUSE_OPT_KEY_OPT && !strncmp(arg, "-max_inflight=", 14)) {
+        s3_concurrency_limits(1, atoi(arg+14));
+        return 0;
+    }
+    if (key == FUSE_OPT_KEY_OPT && !strncmp(arg, "-trace=", 7)) {
+        trace = strdup(arg+7);
+        return 0;
+    }
     return 1;
 }
 
@@ -70,10 +107,21 @@ int main(int argc, char **argv)
     struct objfs fs = { .bucket = bucket, .prefix = prefix,
         .host = getenv("S3_HOSTNAME"), .access = getenv("S3_ACCESS_KEY_ID"),
         .secret = getenv("S3_SECRET_ACCESS_KEY"), .use_local = 0,
-        .chunk_size = size};
+        .chunk_size = size, .checksum = checksum, .targets = targets,
+        .stripe_hash = stripe_hash, .shards = shards};
+
+    /* counting goes outside tracing, so reading the stats files
+     * doesn't show up in traces
+     */
+    struct fuse_operations *ops = &fs_ops;
+    if (trace != NULL && (ops = optrace_ops(&fs_ops, trace)) == NULL) {
+        perror(trace);
+        exit(1);
+    }
+    ops = objstats_ops(ops);
 
     /* TODO: run using low-level FUSE interface
      */
-    return fuse_main(args.argc, args.argv, &fs_ops, &fs);
+    return fuse_main(args.argc, args.argv, ops, &fs);
 }
 
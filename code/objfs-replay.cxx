@@ -0,0 +1,355 @@
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fuse.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "objfs.h"
+#include "objstats.h"
+#include "responder.h"
+#include "optrace.h"
+#include <sys/uio.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <time.h>
+
+
+// replay a trace from "objfs-mount -otrace=FILE" (optrace.h), calling
+// fs_ops in-process:
+//
+// objfs-replay [options] trace bucket/prefix
+// objfs-replay [options] trace memory
+//
+//   -s SPEED   1 = at the traced times, 2 = twice as fast, ...
+//              0 = as fast as the ordering allows (default)
+//   -L MS      memory backend latency (0)
+//   -j         JSON summary, as the last line of output
+//
+// Each traced thread gets a replay thread of its own, issuing its calls
+// in order. A call also waits for every call (on any thread) that had
+// finished before it started in the trace, so the replay sees the same
+// orderings the traced workload depended on, and calls that overlapped
+// are free to overlap again. Writes are of 'x's, the right length.
+//
+// The replay should start from the file system the trace did: a copy
+// of the traced prefix, or for "memory" (an S3 stand-in in this
+// process - see responder.h) an empty one. Calls whose result isn't the
+// traced one are counted per op.
+//
+// objfs.cc keeps its state in globals with no locking, so fs_ops calls
+// are made under one lock here, and latencies include the wait for it.
+
+static struct {
+    double speed = 0;
+    int    latency_ms = 0;
+    bool   json = false;
+} cfg;
+
+struct trace_op {
+    struct optrace_rec r;
+    std::string path, path2;
+};
+
+static std::vector<trace_op> ops;
+static std::vector<std::vector<size_t>> by_thread;	// in start order
+static std::vector<size_t> need;	// ops (in end order) to wait for
+static std::vector<size_t> end_rank;
+
+struct alignas(64) thread_stats {
+    lat_hist  lat[N_TRACE_OPS] = {};
+    uint64_t  differ[N_TRACE_OPS] = {};
+};
+
+// ---- calling objfs
+
+extern struct fuse_operations fs_ops;
+
+static struct objfs fs;
+static struct fuse_context ctx;
+
+struct fuse_context *fuse_get_context(void)
+{
+    ctx.uid = getuid();
+    ctx.gid = getgid();
+    ctx.private_data = &fs;
+    return &ctx;
+}
+
+static std::mutex fs_lock;
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts = {(time_t)t, (long)((t - (time_t)t) * 1e9)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *sb, off_t off)
+{
+    return 0;
+}
+
+static int replay_one(trace_op &o, std::vector<char> &buf)
+{
+    const char *path = o.path.c_str(), *path2 = o.path2.c_str();
+    struct fuse_file_info fi = {};
+    struct stat sb;
+    struct statvfs sv;
+    struct timespec tv[2] = {{(time_t)o.r.offset, 0}, {(time_t)o.r.size, 0}};
+
+    if ((o.r.op == TR_READ || o.r.op == TR_WRITE || o.r.op == TR_READLINK) &&
+	buf.size() < o.r.size)
+	buf.resize(o.r.size, 'x');
+
+    std::unique_lock lk(fs_lock);
+    switch (o.r.op) {
+    case TR_GETATTR:  return fs_ops.getattr(path, &sb);
+    case TR_READLINK: return fs_ops.readlink(path, buf.data(), o.r.size);
+    case TR_MKDIR:    return fs_ops.mkdir(path, o.r.mode);
+    case TR_UNLINK:   return fs_ops.unlink(path);
+    case TR_RMDIR:    return fs_ops.rmdir(path);
+    case TR_SYMLINK:  return fs_ops.symlink(path, path2);
+    case TR_RENAME:   return fs_ops.rename(path, path2);
+    case TR_CHMOD:    return fs_ops.chmod(path, o.r.mode);
+    case TR_TRUNCATE: return fs_ops.truncate(path, o.r.offset);
+    case TR_READ:     return fs_ops.read(path, buf.data(), o.r.size, o.r.offset, &fi);
+    case TR_WRITE:    return fs_ops.write(path, buf.data(), o.r.size, o.r.offset, &fi);
+    case TR_STATFS:   return fs_ops.statfs(path, &sv);
+    case TR_FSYNC:    return fs_ops.fsync(path, o.r.offset, &fi);
+    case TR_READDIR:  return fs_ops.readdir(path, NULL, count_entry, o.r.offset, &fi);
+    case TR_CREATE:   return fs_ops.create(path, o.r.mode, &fi);
+    case TR_UTIMENS:  return fs_ops.utimens(path, tv);
+    }
+    return -ENOSYS;
+}
+
+// ops finish out of order; @done_prefix counts the ops (in traced end
+// order) that have all finished
+//
+static std::mutex dm;
+static std::condition_variable dcv;
+static std::vector<bool> done;
+static size_t done_prefix;
+
+static void wait_for(size_t n)
+{
+    std::unique_lock lk(dm);
+    while (done_prefix < n)
+	dcv.wait(lk);
+}
+
+static void finished(size_t i)
+{
+    std::unique_lock lk(dm);
+    done[end_rank[i]] = true;
+    size_t before = done_prefix;
+    while (done_prefix < done.size() && done[done_prefix])
+	done_prefix++;
+    if (done_prefix != before)
+	dcv.notify_all();
+}
+
+static void replay_thread(int id, thread_stats *st, double t0)
+{
+    std::vector<char> buf;
+    for (auto i : by_thread[id]) {
+	trace_op &o = ops[i];
+	wait_for(need[i]);
+	if (cfg.speed > 0)
+	    sleep_until(t0 + o.r.start / 1e9 / cfg.speed);
+	double t = now_secs();
+	int rv = replay_one(o, buf);
+	lat_add(&st->lat[o.r.op], (now_secs() - t) * 1e6);
+	if (rv != o.r.result)
+	    st->differ[o.r.op]++;
+	finished(i);
+    }
+}
+
+static void load_trace(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    struct optrace_hdr h;
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1) {
+	perror(file);
+	exit(1);
+    }
+    if (h.magic != OPTRACE_MAGIC || h.version != OPTRACE_VERSION) {
+	printf("%s: not a trace\n", file);
+	exit(1);
+    }
+    trace_op o;
+    char tmp[65536];
+    while (fread(&o.r, sizeof(o.r), 1, fp) == 1) {
+	if (fread(tmp, 1, o.r.len, fp) != o.r.len)
+	    break;
+	o.path.assign(tmp, o.r.len);
+	if (fread(tmp, 1, o.r.len2, fp) != o.r.len2)
+	    break;
+	o.path2.assign(tmp, o.r.len2);
+	if (o.r.op >= N_TRACE_OPS)
+	    continue;
+	ops.push_back(o);
+	if (o.r.thread >= by_thread.size())
+	    by_thread.resize(o.r.thread + 1);
+	by_thread[o.r.thread].push_back(ops.size() - 1);
+    }
+    fclose(fp);
+
+    for (auto &v : by_thread)
+	std::sort(v.begin(), v.end(), [](size_t a, size_t b) {
+		return ops[a].r.start < ops[b].r.start;});
+
+    std::vector<size_t> by_end(ops.size());
+    for (size_t i = 0; i < ops.size(); i++)
+	by_end[i] = i;
+    std::sort(by_end.begin(), by_end.end(), [](size_t a, size_t b) {
+	    return ops[a].r.end < ops[b].r.end;});
+    std::vector<uint64_t> ends;
+    end_rank.resize(ops.size());
+    for (size_t j = 0; j < by_end.size(); j++) {
+	ends.push_back(ops[by_end[j]].r.end);
+	end_rank[by_end[j]] = j;
+    }
+    for (auto &o : ops)
+	need.push_back(std::upper_bound(ends.begin(), ends.end(), o.r.start) - ends.begin());
+    done.assign(ops.size(), false);
+}
+
+static void usage(void)
+{
+    printf("usage: objfs-replay [options] trace bucket/prefix|memory\n"
+	   "  -s speed (0 = as fast as possible)  -L memory_ms  -j (JSON)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:L:j")) != -1) {
+	switch (opt) {
+	case 's': cfg.speed = atof(optarg); break;
+	case 'L': cfg.latency_ms = atoi(optarg); break;
+	case 'j': cfg.json = true; break;
+	default: usage();
+	}
+    }
+    if (optind + 2 > argc || cfg.speed < 0)
+	usage();
+    load_trace(argv[optind]);
+
+    char *bucket, *prefix, local[64], *target = argv[optind+1];
+    if (!strcmp(target, "memory")) {
+	sprintf(local, "127.0.0.1:%d", start_memory_responder(cfg.latency_ms));
+	host = local;
+	access = secret = (char*)"memory";
+	bucket = (char*)"memory";
+	prefix = (char*)"md";
+    }
+    else if (sscanf(target, "%m[^/]/%ms", &bucket, &prefix) != 2)
+	usage();
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(16, S3_POOL_SHARE_ALL);
+
+    // mkfs if there's nothing there
+    auto tt = new s3_target(host, bucket, access, secret, false);
+    if (const char *msg = objfs_mkfs(tt, prefix)) {
+	printf("%s: %s\n", target, msg);
+	exit(1);
+    }
+
+    fs = { .bucket = bucket, .prefix = prefix, .host = host, .access = access,
+	   .secret = secret, .use_local = 0, .chunk_size = 1024 * 1024 };
+    try {
+	fs_ops.init(NULL);
+    }
+    catch (const char *msg) {
+	printf("%s: %s\n", target, msg);
+	exit(1);
+    }
+
+    int nthreads = by_thread.size();
+    std::vector<thread_stats> st(nthreads);
+    std::vector<std::thread> th;
+    double t0 = now_secs();
+    for (int i = 0; i < nthreads; i++)
+	th.push_back(std::thread(replay_thread, i, &st[i], t0));
+    for (auto &t : th)
+	t.join();
+    double t = now_secs() - t0;
+    double traced = 0;
+    for (auto &o : ops)
+	traced = std::max(traced, o.r.end / 1e9);
+
+    // objfs prints as it goes, so the JSON waits until the end
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "{\"ops\": %zu, \"threads\": %d, \"secs\": %.3f, "
+	     "\"traced_secs\": %.3f, \"ops_per_sec\": %.1f", ops.size(), nthreads,
+	     t, traced, ops.size() / t);
+    std::string json = tmp;
+    if (!cfg.json)
+	printf("%zu ops on %d threads in %.3f s (traced %.3f s): %.1f/s\n"
+	       "latency us  %27s %27s\n", ops.size(), nthreads, t, traced,
+	       ops.size() / t, "replay mean/p50/p99/max", "traced mean/p50/p99/max");
+
+    for (int op = 0; op < N_TRACE_OPS; op++) {
+	lat_hist h = {}, h0 = {};
+	uint64_t differ = 0;
+	for (auto &s : st) {
+	    lat_sum(&h, &s.lat[op]);
+	    differ += s.differ[op];
+	}
+	if (h.n == 0)
+	    continue;
+	for (auto &o : ops)
+	    if (o.r.op == op)
+		lat_add(&h0, (o.r.end - o.r.start) / 1000);
+	if (cfg.json) {
+	    snprintf(tmp, sizeof(tmp), ", \"%s\": {\"ops\": %lu, \"differ\": %lu, "
+		     "\"lat_us\": {\"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"max\": %lu}, "
+		     "\"traced_us\": {\"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"max\": %lu}}",
+		     optrace_op_names[op], h.n, differ, (double)h.sum_us / h.n,
+		     lat_percentile(&h, 50), lat_percentile(&h, 99), lat_percentile(&h, 100),
+		     (double)h0.sum_us / h0.n, lat_percentile(&h0, 50),
+		     lat_percentile(&h0, 99), lat_percentile(&h0, 100));
+	    json += tmp;
+	}
+	else
+	    printf("%-8s %8lu  %7.1f %6lu %6lu %6lu  %7.1f %6lu %6lu %6lu  %lu differ\n",
+		   optrace_op_names[op], h.n, (double)h.sum_us / h.n,
+		   lat_percentile(&h, 50), lat_percentile(&h, 99), lat_percentile(&h, 100),
+		   (double)h0.sum_us / h0.n, lat_percentile(&h0, 50),
+		   lat_percentile(&h0, 99), lat_percentile(&h0, 100), differ);
+    }
+
+    fs_ops.fsync("/", 0, NULL);
+    fs_teardown();
+    if (cfg.json)
+	printf("%s}\n", json.c_str());
+    return 0;
+}
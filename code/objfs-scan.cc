@@ -0,0 +1,615 @@
+//
+// file:        objfs-scan.cc
+// description: offline replay of an objfs prefix (see objfs-scan.h)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "stripe.h"
+#include "objfs-scan.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <thread>
+#include <chrono>
+
+static const size_t first_read = 64 * 1024;	// most headers fit
+static const size_t max_hdr = 16 * 1024 * 1024;	// anything bigger is junk
+
+// smallest legal length of each record type, names not included
+static const size_t min_len[N_LOG_TYPES] = {
+    0, sizeof(log_inode), sizeof(log_trunc), sizeof(log_delete),
+    sizeof(log_symlink), sizeof(log_rename), sizeof(log_data),
+    sizeof(log_create), 0
+};
+
+const char *type_names[] = {"dir", "file", "symlink", "other"};
+
+int mode_type(uint32_t mode)
+{
+    if (S_ISDIR(mode))
+	return N_DIR;
+    if (S_ISREG(mode))
+	return N_FILE;
+    if (S_ISLNK(mode))
+	return N_LINK;
+    return N_OTHER;
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -------------- finding and reading the objects
+
+// the stripe layout, if any, is "<prefix>.stripe" (stripe.h)
+//
+bool objfs_scan::open(const char *arg, bool is_local, int nthreads)
+{
+    name = arg;
+    local = is_local;
+    if (local) {
+	size_t slash = name.rfind('/');
+	local_dir = slash == std::string::npos ? "." : name.substr(0, slash);
+	stripe = new s3_stripe(name.substr(slash == std::string::npos ? 0 : slash + 1));
+	// with several targets, their objects all go in the one directory
+	FILE *fp = fopen((name + ".stripe").c_str(), "r");
+	if (fp == NULL)
+	    stripe->add_target(nullptr, "local", local_dir);
+	else {
+	    char buf[4096];
+	    size_t n = fread(buf, 1, sizeof(buf), fp);
+	    fclose(fp);
+	    if (!stripe->parse_layout(std::string(buf, n), "", "")) {
+		fprintf(stderr, "%s.stripe: bad stripe layout\n", arg);
+		return false;
+	    }
+	}
+	return true;
+    }
+
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+    char *bucket, *prefix;
+    if (sscanf(arg, "%m[^/]/%ms", &bucket, &prefix) != 2) {
+	fprintf(stderr, "%s: not bucket/prefix\n", arg);
+	return false;
+    }
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(2 * nthreads, S3_POOL_SHARE_ALL);
+    s3_concurrency_limits(std::max(1, nthreads / 4), nthreads);
+    auto tt = new s3_target(host, bucket, access, secret, false);
+    stripe = new s3_stripe(prefix);
+    ssize_t len;
+    std::string layout = std::string(prefix) + ".stripe";
+    if (tt->s3_head(layout, &len) == S3StatusOK) {
+	std::vector<char> buf(len);
+	struct iovec iov = {buf.data(), (size_t)len};
+	if (tt->s3_get(layout, 0, len, &iov, 1) != S3StatusOK ||
+	    !stripe->parse_layout(std::string(buf.data(), len), access, secret)) {
+	    fprintf(stderr, "%s: bad stripe layout\n", layout.c_str());
+	    return false;
+	}
+    }
+    else
+	stripe->add_target(tt, host, bucket);
+    return true;
+}
+
+// strict version of parse_index() in s3wrap.cc: 8 hex digits, nothing after
+//
+static bool parse_index(const char *hex, uint32_t *index)
+{
+    if (strlen(hex) != 8 || strspn(hex, "0123456789abcdef") != 8)
+	return false;
+    *index = strtoul(hex, NULL, 16);
+    return true;
+}
+
+bool objfs_scan::list_local(std::vector<std::pair<uint32_t,int>> &found)
+{
+    for (auto pfx : stripe->list_prefixes()) {
+	std::string dir = local_dir, name = pfx;
+	size_t slash = pfx.rfind('/');
+	if (slash != std::string::npos) {
+	    dir += "/" + pfx.substr(0, slash);
+	    name = pfx.substr(slash + 1);
+	}
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+	    if (errno == ENOENT && slash != std::string::npos)
+		continue;		// empty shard
+	    perror(dir.c_str());
+	    return false;
+	}
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+	    uint32_t index;
+	    if (!strncmp(de->d_name, name.c_str(), name.length()) &&
+		parse_index(de->d_name + name.length(), &index))
+		found.push_back({index, 0});
+	}
+	closedir(d);
+    }
+    return true;
+}
+
+// everything, on every target
+//
+bool objfs_scan::list(std::vector<std::pair<uint32_t,int>> &found)
+{
+    if (local) {
+	if (!list_local(found))
+	    return false;
+    }
+    else
+	for (size_t t = 0; t < stripe->targets.size(); t++)
+	    for (auto pfx : stripe->list_prefixes()) {
+		std::vector<uint32_t> indexes;
+		if (stripe->targets[t]->s3_list_indexes(pfx, indexes, 8) != S3StatusOK) {
+		    fprintf(stderr, "%s: can't list %s\n", name.c_str(), pfx.c_str());
+		    return false;
+		}
+		for (auto i : indexes)
+		    found.push_back({i, (int)t});
+	    }
+    std::sort(found.begin(), found.end());
+    return true;
+}
+
+std::string objfs_scan::local_path(uint32_t index)
+{
+    return local_dir + "/" + stripe->key(index);
+}
+
+// @len bytes at @offset, or fewer if the object is short; *@got says
+// how many. A range past the end of a short S3 object just comes back
+// short, into a zeroed buffer, so it's all "got" - a header that
+// claims more than is there fails the record checks later.
+//
+bool objfs_scan::read(const scan_object &o, uint64_t offset, char *buf, size_t len,
+		      size_t *got, std::string &error)
+{
+    if (local) {
+	std::string path = local_path(o.index);
+	int fd = ::open(path.c_str(), O_RDONLY);
+	ssize_t n = fd < 0 ? -1 : pread(fd, buf, len, offset);
+	if (n < 0)
+	    error = path + ": " + strerror(errno);
+	if (fd >= 0)
+	    close(fd);
+	*got = std::max(n, (ssize_t)0);
+	return n >= 0;
+    }
+    std::string key = stripe->key(o.index);
+    struct iovec iov = {buf, len};
+    memset(buf, 0, len);
+    S3Status status = stripe->targets[o.target]->s3_get(key, offset, len, &iov, 1);
+    if (status != S3StatusOK) {
+	error = key + ": " + S3_get_status_name(status);
+	return false;
+    }
+    *got = len;
+    return true;
+}
+
+void objfs_scan::fetch_thread(void)
+{
+    for (size_t i = next_obj++; i < objs.size(); i = next_obj++) {
+	std::unique_lock lk(fetch_m);
+	while (i >= n_replayed + window) {
+	    n_blocked++;
+	    window_cv.wait(lk);
+	    n_blocked--;
+	}
+	lk.unlock();
+
+	scan_object &o = objs[i];
+	struct stat sb;
+	if (local && stat(local_path(o.index).c_str(), &sb) == 0)
+	    o.size = sb.st_size;
+	size_t got = 0;
+	o.hdr.assign(first_read, 0);
+	o.readable = read(o, 0, o.hdr.data(), first_read, &got, o.error);
+	if (o.readable && got >= sizeof(obj_header)) {
+	    size_t hdr_len = ((obj_header*)o.hdr.data())->hdr_len;
+	    if (hdr_len > first_read && hdr_len <= max_hdr) {
+		o.hdr.assign(hdr_len, 0);
+		o.readable = read(o, 0, o.hdr.data(), hdr_len, &got, o.error);
+	    }
+	    if (hdr_len >= sizeof(obj_header) && hdr_len < o.hdr.size()) {
+		o.hdr.resize(hdr_len);
+		o.hdr.shrink_to_fit();
+	    }
+	}
+	if (o.readable && got < o.hdr.size())
+	    o.hdr.resize(got);
+	hdr_bytes_read += o.hdr.size();
+
+	lk.lock();
+	fetched[i] = true;
+	if (i == waiting_for)
+	    replay_cv.notify_one();
+    }
+}
+
+// fetch in parallel, replay in order as they come in. Each side only
+// wakes the other when it's waiting - the replay for one object,
+// fetchers for the window.
+//
+void objfs_scan::replay(int nthreads, bool progress)
+{
+    fetched = std::vector<std::atomic<bool>>(objs.size());
+    window = 64 * nthreads;
+    std::vector<std::thread> th;
+    for (int i = 0; i < nthreads; i++)
+	th.push_back(std::thread(&objfs_scan::fetch_thread, this));
+
+    double t_progress = now_secs();
+    for (size_t i = 0; i < objs.size(); i++) {
+	std::unique_lock lk(fetch_m, std::defer_lock);
+	if (!fetched[i]) {
+	    lk.lock();
+	    waiting_for = i;
+	    while (!fetched[i]) {
+		replay_cv.wait_for(lk, std::chrono::seconds(1));
+		if (progress && now_secs() - t_progress > 10) {
+		    t_progress = now_secs();
+		    fprintf(stderr, "%zu of %zu objects, %.1f MB of headers\n", i,
+			    objs.size(), hdr_bytes_read / (1024.0 * 1024));
+		}
+	    }
+	    waiting_for = SIZE_MAX;
+	    lk.unlock();
+	}
+	replay_object(objs[i]);
+	if ((i + 1) % 64 == 0) {
+	    lk.lock();
+	    n_replayed = i + 1;
+	    if (n_blocked > 0)
+		window_cv.notify_all();
+	    lk.unlock();
+	}
+    }
+    for (auto &t : th)
+	t.join();
+}
+
+// -------------- replay
+
+node *objfs_scan::find(uint32_t inum)
+{
+    auto it = nodes.find(inum);
+    return it == nodes.end() ? nullptr : &it->second;
+}
+
+// later writes replace whatever they overlap
+//
+void ext_write(std::map<int64_t,extent> &m, int64_t offset, extent e)
+{
+    if (e.len == 0)
+	return;
+    int64_t end = offset + e.len;
+    auto it = m.lower_bound(offset);
+    if (it != m.begin()) {
+	auto prev = std::prev(it);
+	int64_t prev_end = prev->first + prev->second.len;
+	if (prev_end > offset) {
+	    extent tail = prev->second;
+	    prev->second.len = offset - prev->first;
+	    if (prev_end > end) {
+		tail.offset += end - prev->first;
+		tail.len = prev_end - end;
+		m[end] = tail;
+	    }
+	}
+    }
+    while (it != m.end() && it->first < end) {
+	int64_t it_end = it->first + it->second.len;
+	if (it_end > end) {
+	    extent tail = it->second;
+	    tail.offset += end - it->first;
+	    tail.len = it_end - end;
+	    m.erase(it);
+	    m[end] = tail;
+	    break;
+	}
+	it = m.erase(it);
+    }
+    m[offset] = e;
+}
+
+void ext_trunc(std::map<int64_t,extent> &m, int64_t new_size)
+{
+    auto it = m.lower_bound(new_size);
+    if (it != m.begin()) {
+	auto prev = std::prev(it);
+	if (prev->first + prev->second.len > new_size)
+	    prev->second.len = new_size - prev->first;
+    }
+    m.erase(it, m.end());
+}
+
+// like printfs
+//
+static void print_record(log_record *rec)
+{
+    printf("type: %d (%s) len: %d\n", rec->type, t2s(rec->type), rec->len);
+    switch (rec->type) {
+    case LOG_DATA: {
+	log_data *l = (log_data*)rec->data;
+	printf(" inum %d\n obj_offset %d\n file_offset %ld\n size %ld\n len %d\n",
+	       l->inum, l->obj_offset, (long)l->file_offset, (long)l->size, l->len);
+	break;
+    }
+    case LOG_INODE: {
+	log_inode *in = (log_inode*)rec->data;
+	printf(" inum %d\n mode %o\n uid,gid %d %d\n rdev %d\n mtime %ld.%09ld\n",
+	       in->inum, in->mode, in->uid, in->gid, in->rdev,
+	       (long)in->mtime.tv_sec, (long)in->mtime.tv_nsec);
+	break;
+    }
+    case LOG_TRUNC: {
+	log_trunc *t = (log_trunc*)rec->data;
+	printf(" inum %d\n size %ld\n", t->inum, (long)t->new_size);
+	break;
+    }
+    case LOG_DELETE: {
+	log_delete *d = (log_delete*)rec->data;
+	printf(" parent %d\n inum %d\n name %.*s\n", d->parent, d->inum,
+	       d->namelen, d->name);
+	break;
+    }
+    case LOG_SYMLNK: {
+	log_symlink *s = (log_symlink*)rec->data;
+	printf(" inum %d\n target %.*s\n", s->inum, s->len, s->target);
+	break;
+    }
+    case LOG_RENAME: {
+	log_rename *r = (log_rename*)rec->data;
+	printf(" inum %d\n srci %d\n dsti %d\n src %.*s\n dst %.*s\n",
+	       r->inum, r->parent1, r->parent2, r->name1_len, r->name,
+	       r->name2_len, &r->name[r->name1_len]);
+	break;
+    }
+    case LOG_CREATE: {
+	log_create *c = (log_create*)rec->data;
+	printf(" parent %d\n inum %d\n name %.*s\n", c->parent_inum, c->inum,
+	       c->namelen, c->name);
+	break;
+    }
+    case LOG_NULL:
+	printf("null\n");
+	break;
+    default:
+	printf("bad\n");
+    }
+}
+
+void objfs_scan::replay_record(uint32_t idx, log_record *rec, uint64_t &data_off)
+{
+    switch (rec->type) {
+    case LOG_INODE: {
+	log_inode *in = (log_inode*)rec->data;
+	node *n = find(in->inum);
+	if (n == nullptr) {
+	    n = &nodes[in->inum];
+	    n->born = idx;
+	}
+	else if (mode_type(in->mode) != mode_type(n->mode))
+	    report(P_ERROR, idx, "inode %u changes type from %s to %s", in->inum,
+		   type_names[mode_type(n->mode)], type_names[mode_type(in->mode)]);
+	n->mode = in->mode;
+	n->uid = in->uid;
+	n->gid = in->gid;
+	n->rdev = in->rdev;
+	n->mtime = in->mtime;
+	break;
+    }
+    case LOG_TRUNC: {
+	log_trunc *tr = (log_trunc*)rec->data;
+	node *n = find(tr->inum);
+	if (n == nullptr) {
+	    report(P_FATAL, idx, "truncate of missing inode %u", tr->inum);
+	    break;
+	}
+	if (mode_type(n->mode) != N_FILE)
+	    report(P_ERROR, idx, "truncate of %s inode %u", type_names[mode_type(n->mode)],
+		   tr->inum);
+	if (n->size < tr->new_size) {
+	    report(P_FATAL, idx, "truncate of inode %u from %ld up to %ld", tr->inum,
+		   (long)n->size, (long)tr->new_size);
+	    break;
+	}
+	ext_trunc(n->extents, tr->new_size);
+	n->size = tr->new_size;
+	break;
+    }
+    case LOG_DELETE: {
+	log_delete *rm = (log_delete*)rec->data;
+	node *parent = find(rm->parent), *n = find(rm->inum);
+	std::string name(rm->name, rm->namelen);
+	if (parent == nullptr || n == nullptr) {
+	    report(P_FATAL, idx, "delete of \"%s\" (inode %u): missing %s inode %u",
+		   name.c_str(), rm->inum, parent ? "target" : "parent",
+		   parent ? rm->inum : rm->parent);
+	    break;
+	}
+	auto it = parent->dirents.find(name);
+	if (it == parent->dirents.end() || it->second != rm->inum)
+	    report(P_ERROR, idx, "delete of inode %u as \"%s\" in %u, which %s",
+		   rm->inum, name.c_str(), rm->parent,
+		   it == parent->dirents.end() ? "has no such entry" : "names another inode");
+	if (S_ISDIR(n->mode) && !n->dirents.empty())
+	    report(P_ERROR, idx, "delete of directory %u with %zu entries", rm->inum,
+		   n->dirents.size());
+	if (S_ISREG(n->mode) && !n->extents.empty())
+	    report(P_WARN, idx, "delete of file %u without truncating it", rm->inum);
+	parent->dirents.erase(name);
+	nodes.erase(rm->inum);
+	break;
+    }
+    case LOG_SYMLNK: {
+	log_symlink *sl = (log_symlink*)rec->data;
+	node *n = find(sl->inum);
+	if (n == nullptr) {
+	    report(P_FATAL, idx, "symlink target for missing inode %u", sl->inum);
+	    break;
+	}
+	if (!S_ISLNK(n->mode))
+	    report(P_ERROR, idx, "symlink target for %s inode %u",
+		   type_names[mode_type(n->mode)], sl->inum);
+	n->target = std::string(sl->target, sl->len);
+	break;
+    }
+    case LOG_RENAME: {
+	log_rename *mv = (log_rename*)rec->data;
+	node *p1 = find(mv->parent1), *p2 = find(mv->parent2);
+	std::string name1(&mv->name[0], mv->name1_len);
+	std::string name2(&mv->name[mv->name1_len], mv->name2_len);
+	if (p1 == nullptr || p2 == nullptr) {
+	    report(P_FATAL, idx, "rename of \"%s\": missing directory %u", name1.c_str(),
+		   p1 ? mv->parent2 : mv->parent1);
+	    break;
+	}
+	auto it = p1->dirents.find(name1);
+	if (it == p1->dirents.end() || it->second != mv->inum) {
+	    report(P_FATAL, idx, "rename of inode %u from \"%s\" in %u, which %s",
+		   mv->inum, name1.c_str(), mv->parent1,
+		   it == p1->dirents.end() ? "has no such entry" : "names another inode");
+	    break;
+	}
+	if (p2->dirents.find(name2) != p2->dirents.end()) {
+	    report(P_FATAL, idx, "rename of inode %u onto existing \"%s\" in %u",
+		   mv->inum, name2.c_str(), mv->parent2);
+	    break;
+	}
+	p1->dirents.erase(name1);
+	p2->dirents[name2] = mv->inum;
+	break;
+    }
+    case LOG_DATA: {
+	log_data *d = (log_data*)rec->data;
+	if (d->obj_offset != data_off)
+	    report(P_ERROR, idx, "data for inode %u at object offset %u, expected %lu",
+		   d->inum, d->obj_offset, (unsigned long)data_off);
+	data_off = std::max(data_off, (uint64_t)d->obj_offset + d->len);
+	node *n = find(d->inum);
+	if (n == nullptr) {
+	    report(P_FATAL, idx, "data for missing inode %u", d->inum);
+	    break;
+	}
+	if (!S_ISREG(n->mode))
+	    report(P_ERROR, idx, "data for %s inode %u", type_names[mode_type(n->mode)],
+		   d->inum);
+	if (d->size < d->file_offset + d->len)
+	    report(P_ERROR, idx, "data for inode %u ends at %ld, past its size %ld",
+		   d->inum, (long)(d->file_offset + d->len), (long)d->size);
+	ext_write(n->extents, d->file_offset, {idx, d->obj_offset, d->len});
+	n->size = d->size;
+	break;
+    }
+    case LOG_CREATE: {
+	log_create *c = (log_create*)rec->data;
+	node *parent = find(c->parent_inum);
+	std::string name(c->name, c->namelen);
+	if (parent == nullptr) {
+	    report(P_FATAL, idx, "create of \"%s\" in missing directory %u",
+		   name.c_str(), c->parent_inum);
+	    break;
+	}
+	if (!S_ISDIR(parent->mode))
+	    report(P_ERROR, idx, "create of \"%s\" in %s inode %u", name.c_str(),
+		   type_names[mode_type(parent->mode)], c->parent_inum);
+	auto it = parent->dirents.find(name);
+	if (it != parent->dirents.end())
+	    report(P_ERROR, idx, "create of \"%s\" in %u replaces inode %u",
+		   name.c_str(), c->parent_inum, it->second);
+	if (find(c->inum) == nullptr)
+	    report(P_WARN, idx, "create of \"%s\" before inode %u exists", name.c_str(),
+		   c->inum);
+	parent->dirents[name] = c->inum;
+	break;
+    }
+    }
+}
+
+void objfs_scan::replay_object(scan_object &o)
+{
+    uint32_t idx = o.index;
+    if (!o.readable) {
+	report(P_FATAL, idx, "can't read: %s", o.error.c_str());
+	return;
+    }
+    if (o.hdr.size() < sizeof(obj_header)) {
+	report(P_FATAL, idx, "object is only %zu bytes", o.hdr.size());
+	return;
+    }
+    obj_header *oh = (obj_header*)o.hdr.data();
+    if (oh->magic != OBJFS_MAGIC || oh->version != 1 || oh->type != 1) {
+	report(P_FATAL, idx, "bad header: magic %x version %d type %d", oh->magic,
+	       oh->version, oh->type);
+	return;
+    }
+    if ((size_t)oh->hdr_len < sizeof(obj_header) || (size_t)oh->hdr_len > o.hdr.size()) {
+	report(P_FATAL, idx, "header length %d, but only %zu bytes read", oh->hdr_len,
+	       o.hdr.size());
+	return;
+    }
+    if ((uint32_t)oh->this_index != idx)
+	report(P_ERROR, idx, "header says it's object %08x", oh->this_index);
+    o.hdr_len = oh->hdr_len;
+    if (dump)
+	printf("object %08x\nmagic %x\nversion %d\ntype %d\nhdr_len %d\nindex %d\n",
+	       idx, oh->magic, oh->version, oh->type, oh->hdr_len, oh->this_index);
+
+    char *p = &oh->data[0], *end = o.hdr.data() + oh->hdr_len;
+    uint64_t data_off = 0;
+    while (p < end) {
+	log_record *rec = (log_record*)p;
+	if (p + sizeof(log_record) > end || p + sizeof(log_record) + rec->len > end) {
+	    report(P_FATAL, idx, "record at %ld runs past the header",
+		   (long)(p - o.hdr.data()));
+	    break;
+	}
+	if (dump)
+	    print_record(rec);
+	int t = rec->type;
+	if (t == 0 || t >= N_LOG_TYPES) {
+	    rec_counts[N_LOG_TYPES].n++;
+	    report(P_FATAL, idx, "bad record type %d at %ld", t, (long)(p - o.hdr.data()));
+	    break;
+	}
+	rec_counts[t].n++;
+	rec_counts[t].bytes += sizeof(log_record) + rec->len;
+	if (rec->len < min_len[t]) {
+	    report(P_FATAL, idx, "%s record of %d bytes", t2s(t), rec->len);
+	    break;
+	}
+	replay_record(idx, rec, data_off);
+	p += sizeof(log_record) + rec->len;
+    }
+    o.data_bytes = data_off;
+    if (o.size >= 0 && (uint64_t)o.size != o.hdr_len + data_off)
+	report(P_ERROR, idx, "object is %ld bytes, records account for %lu", (long)o.size,
+	       (unsigned long)(o.hdr_len + data_off));
+
+    std::vector<char>().swap(o.hdr);
+}
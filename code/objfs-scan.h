@@ -0,0 +1,113 @@
+//
+// file:        objfs-scan.h
+// description: offline replay of an objfs prefix, for the objfs-* tools
+//
+
+#ifndef __OBJFS_SCAN_H__
+#define __OBJFS_SCAN_H__
+
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "objfs-log.h"
+
+/* Lists the objects of a prefix - in S3 through its stripe layout, or
+ * local files dir/prefix.%08x (also dir/N/prefix.%08x with hashed
+ * shards) - fetches their headers with a pool of threads, and replays
+ * them in index order the way fs_init() does, into a map of nodes.
+ * Fetching stays within a window of the replay, so only that many
+ * headers are held at once.
+ *
+ * Problems go to report(), which the tool defines. P_FATAL is where
+ * the read_log_* functions in objfs.cc return -1 and the mount fails;
+ * the record is skipped and the replay carries on as best it can.
+ * P_ERROR is an inconsistency that loses or misplaces something, and
+ * P_WARN is odd but harmless.
+ */
+enum { P_WARN, P_ERROR, P_FATAL, N_SEVERITY };
+void report(int sev, int64_t index, const char *fmt, ...);
+
+struct scan_object {
+    uint32_t          index;
+    int               target;	 // where it was listed
+    std::vector<char> hdr;	 // header and metadata, until replayed
+    int64_t           size = -1; // whole object, if known (local)
+    uint64_t          hdr_len = 0;
+    uint64_t          data_bytes = 0;	// data section, from the records
+    bool              readable = false;
+    std::string       error;
+};
+
+struct extent {
+    uint32_t objnum;
+    uint32_t offset;		// in the object's data section
+    uint32_t len;
+};
+
+enum { N_DIR, N_FILE, N_LINK, N_OTHER, N_TYPES };
+extern const char *type_names[];
+int mode_type(uint32_t mode);
+
+struct node {
+    uint32_t                         mode;
+    uint32_t                         uid, gid, rdev;
+    struct timespec                  mtime;
+    int64_t                          size = 0;
+    uint32_t                         born;	// object of its first record
+    std::map<int64_t,extent>         extents;	// by file offset
+    std::map<std::string,uint32_t>   dirents;
+    std::string                      target;
+};
+
+void ext_write(std::map<int64_t,extent> &m, int64_t offset, extent e);
+void ext_trunc(std::map<int64_t,extent> &m, int64_t new_size);
+
+struct rec_count {
+    uint64_t n, bytes;
+};
+
+struct s3_stripe;
+
+struct objfs_scan {
+    std::string                         name;	// as given
+    bool                                local = false;
+    std::string                         local_dir;
+    s3_stripe                          *stripe = nullptr;
+    bool                                dump = false;	// print every record
+    std::vector<scan_object>            objs;		// in index order
+    std::map<uint32_t,size_t>           obj_pos;	// index -> objs[]
+    std::unordered_map<uint32_t,node>   nodes;
+    rec_count                           rec_counts[N_LOG_TYPES + 1] = {}; // last: bad
+    std::atomic<uint64_t>               hdr_bytes_read = 0;
+
+    // "bucket/prefix", or "dir/prefix" if @is_local
+    bool open(const char *arg, bool is_local, int nthreads);
+    // (index, target) of every object, sorted
+    bool list(std::vector<std::pair<uint32_t,int>> &found);
+    // fill in objs[] and obj_pos first
+    void replay(int nthreads, bool progress);
+    node *find(uint32_t inum);
+    std::string local_path(uint32_t index);
+    bool read(const scan_object &o, uint64_t offset, char *buf, size_t len,
+	      size_t *got, std::string &error);
+
+private:
+    std::atomic<size_t>                 next_obj = 0;
+    std::vector<std::atomic<bool>>      fetched;
+    size_t                              n_replayed = 0, window = 0;
+    size_t                              waiting_for = SIZE_MAX;
+    int                                 n_blocked = 0;
+    std::mutex                          fetch_m;
+    std::condition_variable             replay_cv, window_cv;
+
+    bool list_local(std::vector<std::pair<uint32_t,int>> &found);
+    void fetch_thread(void);
+    void replay_object(scan_object &o);
+    void replay_record(uint32_t idx, log_record *rec, uint64_t &data_off);
+};
+
+#endif
@@ -49,6 +49,10 @@
 #include <libs3.h>
 #include "s3wrap.h"
 #include "objfs.h"
+#include "objfs-log.h"
+#include "crc32c.h"
+#include "stripe.h"
+#include "objprobes.h"
 
 //typedef int (*fuse_fill_dir_t) (void *buf, const char *name,
 //                                const struct stat *stbuf, off_t off);
@@ -427,103 +431,6 @@ size_t fs_link::serialize(std::ostream &s)
 }
 
 
-/****************
- * file header format
- */
-
-/* data update
-*/
-struct log_data {
-    uint32_t inum;		// is 32 enough?
-    uint32_t obj_offset;	// bytes from start of file data
-    int64_t  file_offset;	// in bytes
-    int64_t  size;		// file size after this write
-    uint32_t len;		// bytes
-} __attribute__((packed,aligned(1)));
-
-/* inode update. Note that this is all that's needed for special
- * files. 
- */
-struct log_inode {
-    uint32_t        inum;
-    uint32_t        mode;
-    uint32_t        uid, gid;
-    uint32_t        rdev;
-    struct timespec mtime;
-} __attribute__((packed,aligned(1)));
-
-/* truncate a file. maybe require truncate->0 before delete?
- */
-struct log_trunc {
-    uint32_t inum;
-    int64_t  new_size;		// must be <= existing
-} __attribute__((packed,aligned(1)));
-
-// need a log_create
-
-struct log_delete {
-    uint32_t parent;
-    uint32_t inum;
-    uint8_t  namelen;
-    char     name[];
-} __attribute__((packed,aligned(1)));
-
-struct log_symlink {
-    uint32_t inum;
-    uint8_t  len;
-    char     target[];
-} __attribute__((packed,aligned(1)));
-
-/* cross-directory rename is handled by specifying both source and
- * destination parent directory.
- */
-struct log_rename {
-    uint32_t inum;		// of entity to rename
-    uint32_t parent1;		// inode number (source)
-    uint32_t parent2;		//              (dest)
-    uint8_t  name1_len;
-    uint8_t  name2_len;
-    char     name[];
-} __attribute__((packed,aligned(1)));
-
-/* create a new name
- */
-struct log_create {
-    uint32_t  parent_inum;
-    uint32_t  inum;
-    uint8_t   namelen;
-    char      name[];
-} __attribute__((packed,aligned(1)));
-
-
-enum log_rec_type {
-    LOG_INODE = 1,
-    LOG_TRUNC,
-    LOG_DELETE,
-    LOG_SYMLNK,
-    LOG_RENAME,
-    LOG_DATA,
-    LOG_CREATE,
-    LOG_NULL,			// fill space for alignment
-};
-
-struct log_record {
-    uint16_t type : 4;
-    uint16_t len : 12;
-    char data[];
-} __attribute__((packed,aligned(1)));
-
-//#define OBJFS_MAGIC 0x4f424653	// "OBFS"
-#define OBJFS_MAGIC 0x5346424f	// "OBFS"
-
-struct obj_header {
-    int32_t magic;
-    int32_t version;
-    int32_t type;		// 1 == data, 2 == metadata
-    int32_t hdr_len;
-    int32_t this_index;
-    char    data[];
-};
 
 /* until we add metadata objects this is enough global state
  */
@@ -752,7 +659,9 @@ size_t read_hdr(int idx, void *data, size_t len)
     log_record *end = (log_record*)&oh->data[meta_bytes];
     log_record *rec = (log_record*)&oh->data[0];
 
+    OBJ_PROBE2(objfs, replay_object, idx, oh->hdr_len);
     while (rec < end) {
+	OBJ_PROBE3(objfs, replay_record, idx, (int)rec->type, (int)rec->len);
 	switch (rec->type) {
 	case LOG_INODE:
 	    if (read_log_inode((log_inode*)&rec->data[0]) < 0)
@@ -886,6 +795,17 @@ void  *data_log_head;
 void  *data_log_tail;
 size_t data_log_len;
 
+/* CRC32C of the data log so far, computed as data is copied in (only
+ * if use_checksum is set) so that the object checksum doesn't need
+ * another pass over the data.
+ */
+bool     use_checksum;
+uint32_t data_log_crc;
+
+/* where each object goes - see stripe.h
+ */
+s3_stripe *stripe;
+
 size_t data_offset(void)
 {
     return (char*)data_log_tail - (char*)data_log_head;
@@ -920,16 +840,35 @@ void printout(void *hdr, int hdrlen)
     printf("\n");
 }
 
+// log counters for /.objfs/stats (objstats.h)
+static per_thread<fs_log_stats> log_stats;
+static thread_local per_thread<fs_log_stats>::ref my_log_stats(log_stats);
+
+void fs_get_log_stats(struct fs_log_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    log_stats.each([&](fs_log_stats *t) {
+	    lat_sum(&st->flush, &t->flush);
+	    st->flush_bytes += stat_get(&t->flush_bytes);
+	    st->fsyncs += stat_get(&t->fsyncs);
+	    st->log_reads += stat_get(&t->log_reads);
+	    st->s3_reads += stat_get(&t->s3_reads);
+	    st->hdr_hits += stat_get(&t->hdr_hits);
+	    st->hdr_misses += stat_get(&t->hdr_misses);
+	});
+}
+
 void write_everything_out(struct objfs *fs)
 {
+    uint64_t t0 = stat_now_us();
+    OBJ_PROBE2(objfs, flush_start, this_index, dirty_inodes.size());
     for (auto it = dirty_inodes.begin(); it != dirty_inodes.end();
 	 it = dirty_inodes.erase(it)) {
 	write_inode(*it);
     }
 
-    char _key[1024];
-    sprintf(_key, "%s.%08x", fs->prefix, this_index);
-    std::string key(_key);
+    std::string key = stripe->key(this_index);
+    s3_target *s3 = stripe->target(this_index);
     
     obj_header h = {
 	.magic = OBJFS_MAGIC,
@@ -938,6 +877,7 @@ void write_everything_out(struct objfs *fs)
 	.hdr_len = (int)(meta_offset() + sizeof(obj_header)),
 	.this_index = this_index,
     };
+    OBJ_PROBE3(objfs, flush_inodes_done, h.this_index, meta_offset(), data_offset());
     this_index++;
 
     struct iovec iov[3] = {{.iov_base = (void*)&h, .iov_len = sizeof(h)},
@@ -948,24 +888,46 @@ void write_everything_out(struct objfs *fs)
     printout((void*)&h, sizeof(h));
     printout((void*)meta_log_head, meta_offset());
 
-    if (S3StatusOK != fs->s3->s3_put(key, iov, 3))
+    // header and metadata are small, so it's OK to checksum them here
+    uint32_t crc = 0;
+    if (use_checksum) {
+	crc = crc32c(0, &h, sizeof(h));
+	crc = crc32c(crc, meta_log_head, meta_offset());
+	crc = crc32c_combine(crc, data_log_crc, data_offset());
+    }
+
+    OBJ_PROBE2(objfs, flush_put, h.this_index, key.c_str());
+    if (S3StatusOK != s3->s3_put(key, iov, 3, use_checksum ? &crc : nullptr))
 	throw "put failed";
+    OBJ_PROBE1(objfs, flush_done, h.this_index);
+    lat_add(&my_log_stats->flush, stat_now_us() - t0);
+    stat_add(&my_log_stats->flush_bytes, sizeof(h) + meta_offset() + data_offset());
     
     meta_log_tail = meta_log_head;
     data_log_tail = data_log_head;
+    data_log_crc = 0;
 }
 
 void fs_sync(void)
 {
     struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
+    int cls = s3_set_io_class(S3_IO_FSYNC);
+    stat_add(&my_log_stats->fsyncs, 1);
     write_everything_out(fs);
+    s3_set_io_class(cls);
 }
 
+// log is full - nobody is waiting on this write in particular, so it
+// goes in the background flush class
+//
 void maybe_write(struct objfs *fs)
 {
     if ((meta_offset() > meta_log_len) ||
-	(data_offset() > data_log_len))
+	(data_offset() > data_log_len)) {
+	int cls = s3_set_io_class(S3_IO_FLUSH);
 	write_everything_out(fs);
+	s3_set_io_class(cls);
+    }
 }
 
 void make_record(const void *hdr, size_t hdrlen,
@@ -976,7 +938,10 @@ void make_record(const void *hdr, size_t hdrlen,
     memcpy(meta_log_tail, hdr, hdrlen);
     meta_log_tail = hdrlen + (char*)meta_log_tail;
     if (datalen > 0) {
-	memcpy(data_log_tail, data, datalen);
+	if (use_checksum)
+	    data_log_crc = crc32c_copy(data_log_crc, data_log_tail, data, datalen);
+	else
+	    memcpy(data_log_tail, data, datalen);
 	data_log_tail = datalen + (char*)data_log_tail;
     }
 }
@@ -987,10 +952,9 @@ std::map<int,int> data_offsets;
 //
 int do_read(struct objfs *fs, int index, void *buf, size_t len, size_t offset, bool ckpt)
 {
-    char key[256];
-    sprintf(key, "%s.%08x%s", fs->prefix, index, ckpt ? ".ck" : "");
+    std::string key = stripe->key(index, ckpt ? ".ck" : "");
     struct iovec iov = {.iov_base = buf, .iov_len = (size_t)len};
-    if (S3StatusOK != fs->s3->s3_get(key, offset, len, &iov, 1))
+    if (S3StatusOK != stripe->target(index)->s3_get(key, offset, len, &iov, 1))
 	return -1;
     return len;
 }
@@ -1016,8 +980,13 @@ fs_obj *load_obj(struct objfs *fs, int index, uint32_t offset, size_t len)
 // plus the header length. Get header length for object @index
 int get_offset(struct objfs *fs, int index, bool ckpt)
 {
-    if (data_offsets.find(index) != data_offsets.end())
+    if (data_offsets.find(index) != data_offsets.end()) {
+	stat_add(&my_log_stats->hdr_hits, 1);
+	OBJ_PROBE2(objfs, hdr_lookup, index, 1);
 	return data_offsets[index];
+    }
+    stat_add(&my_log_stats->hdr_misses, 1);
+    OBJ_PROBE2(objfs, hdr_lookup, index, 0);
 
     obj_header h;
     ssize_t len = do_read(fs, index, &h, sizeof(h), 0, ckpt);
@@ -1034,14 +1003,20 @@ int get_offset(struct objfs *fs, int index, bool ckpt)
 int read_data(struct objfs *fs, void *buf, int index, off_t offset, size_t len)
 {
     if (index == this_index) {
+	stat_add(&my_log_stats->log_reads, 1);
 	len = std::min(len, data_offset() - offset);
+	OBJ_PROBE4(objfs, read_data, index, offset, len, 1);
 	memcpy(buf, offset + (char*)data_log_head, len);
 	return len;
     }
+    stat_add(&my_log_stats->s3_reads, 1);
+    OBJ_PROBE4(objfs, read_data, index, offset, len, 0);
     size_t n = get_offset(fs, index, false);
     if (n < 0)
 	return n;
-    return do_read(fs, index, buf, len, offset + n, false);
+    int rv = do_read(fs, index, buf, len, offset + n, false);
+    OBJ_PROBE2(objfs, read_data_done, index, rv);
+    return rv;
 }
 
 static std::vector<std::string> split(const std::string& s, char delimiter)
@@ -1156,10 +1131,9 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 
 // -------------------------------
 
-int fs_write(const char *path, const char *buf, size_t len,
-	     off_t offset, struct fuse_file_info *fi)
+static int write_file(struct objfs *fs, const char *path, const char *buf,
+		      size_t len, off_t offset)
 {
-    struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
     int inum = path_2_inum(path);
     if (inum < 0)
 	return inum;
@@ -1198,6 +1172,16 @@ int fs_write(const char *path, const char *buf, size_t len,
     return len;
 }
 
+int fs_write(const char *path, const char *buf, size_t len,
+	     off_t offset, struct fuse_file_info *fi)
+{
+    struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
+    OBJ_PROBE3(objfs, write_start, path, len, offset);
+    int rv = write_file(fs, path, buf, len, offset);
+    OBJ_PROBE2(objfs, write_done, path, rv);
+    return rv;
+}
+
 void write_inode(fs_obj *f)
 {
     size_t len = sizeof(log_record) + sizeof(log_inode);
@@ -1539,11 +1523,9 @@ int fs_utimens(const char *path, const struct timespec tv[2])
 }
 
 
-int fs_read(const char *path, char *buf, size_t len, off_t offset,
-	    struct fuse_file_info *fi)
+static int read_file(struct objfs *fs, const char *path, char *buf,
+		     size_t len, off_t offset)
 {
-    struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
-
     int inum = path_2_inum(path);
     if (inum < 0)
 	return inum;
@@ -1581,6 +1563,16 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     return bytes;
 }
 
+int fs_read(const char *path, char *buf, size_t len, off_t offset,
+	    struct fuse_file_info *fi)
+{
+    struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
+    OBJ_PROBE3(objfs, read_start, path, len, offset);
+    int rv = read_file(fs, path, buf, len, offset);
+    OBJ_PROBE2(objfs, read_done, path, rv);
+    return rv;
+}
+
 void write_symlink(int inum, std::string target)
 {
     size_t len = sizeof(log_record) + sizeof(log_symlink) + target.length();
@@ -1678,10 +1670,65 @@ int fs_statfs(const char *path, struct statvfs *st)
 int fs_fsync(const char * path, int, struct fuse_file_info *fi)
 {
     struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
+    int cls = s3_set_io_class(S3_IO_FSYNC);
+    stat_add(&my_log_stats->fsyncs, 1);
     write_everything_out(fs);
+    s3_set_io_class(cls);
     return 0;
 }
 
+// large prefixes are listed in this many key ranges at once
+const int list_threads = 8;
+
+// the layout saved in "<prefix>.stripe" on the primary target wins;
+// otherwise take it from the mount options and save it, or fall back
+// to everything in the primary bucket. A prefix that already has
+// objects but no saved layout was written with the fallback, so only
+// a layout that puts everything in the same place can be adopted.
+//
+static void setup_stripe(struct objfs *fs)
+{
+    std::string name = std::string(fs->prefix) + ".stripe";
+    stripe = new s3_stripe(fs->prefix);
+
+    ssize_t len;
+    if (S3StatusOK == fs->s3->s3_head(name, &len)) {
+	char buf[len];
+	struct iovec iov = {.iov_base = buf, .iov_len = (size_t)len};
+	if (S3StatusOK != fs->s3->s3_get(name, 0, len, &iov, 1) ||
+	    !stripe->parse_layout(std::string(buf, len), fs->access, fs->secret))
+	    throw "bad stripe layout";
+	if (fs->targets != NULL)
+	    printf("using saved layout from %s\n", name.c_str());
+    }
+    else if (fs->targets != NULL || fs->shards > 0) {
+	stripe->hashed = fs->stripe_hash != 0;
+	stripe->shards = fs->shards;
+	if (fs->targets == NULL)
+	    stripe->add_target(fs->host, fs->bucket, fs->access, fs->secret);
+	else if (!stripe->parse_config(fs->targets, fs->access, fs->secret))
+	    throw "bad stripe targets";
+	std::vector<uint32_t> existing;
+	if (S3StatusOK != fs->s3->s3_list_indexes(std::string(fs->prefix) + ".",
+						  existing))
+	    throw "bucket list failed";
+	auto primary = std::make_pair(std::string(fs->host), std::string(fs->bucket));
+	if (!existing.empty() && (stripe->shards != 0 || stripe->names.size() != 1 ||
+				  stripe->names[0] != primary)) {
+	    printf("%s: %zu objects already written without a stripe layout\n",
+		   fs->prefix, existing.size());
+	    throw "layout doesn't match existing objects";
+	}
+	std::string text = stripe->layout();
+	struct iovec iov = {.iov_base = (void*)text.c_str(), .iov_len = text.length()};
+	if (S3StatusOK != fs->s3->s3_put(name, &iov, 1))
+	    throw "can't save stripe layout";
+    }
+    else {
+	stripe->add_target(fs->s3, fs->host, fs->bucket);
+    }
+}
+
 void *fs_init(struct fuse_conn_info *conn)
 {
     struct objfs *fs = (struct objfs*) fuse_get_context()->private_data;
@@ -1693,22 +1740,28 @@ void *fs_init(struct fuse_conn_info *conn)
     data_log_head = data_log_tail = malloc(data_log_len);
 
     fs->s3 = new s3_target(fs->host, fs->bucket, fs->access, fs->secret, false);
+    use_checksum = fs->checksum != 0;
+    data_log_crc = 0;
+
+    setup_stripe(fs);
+
+    // objects may be spread over several targets, so gather the
+    // indexes and replay them in order
+    std::vector<uint32_t> indexes;
+    for (auto t : stripe->targets) {
+	for (auto pfx : stripe->list_prefixes())
+	    if (S3StatusOK != t->s3_list_indexes(pfx, indexes, list_threads))
+		throw "bucket list failed";
+    }
+    std::sort(indexes.begin(), indexes.end());
 
-    std::list<std::string> keys;
-    if (S3StatusOK != fs->s3->s3_list(fs->prefix, keys))
-	throw "bucket list failed";
-
-    for (auto it = keys.begin(); it != keys.end(); it++) {
-	int n;
-	printf("key: %s\n", it->c_str());
-	sscanf(it->c_str(), "%*[^.].%d", &n);
+    for (auto n : indexes) {
 	ssize_t offset = get_offset(fs, n, false);
 
 	if (offset < 0)
 	    throw "bad object";
 	void *buf = malloc(offset);
-	struct iovec iov[] = {{.iov_base = buf, .iov_len = (size_t)offset}};
-	if (S3StatusOK != fs->s3->s3_get(it->c_str(), 0, offset, iov, 1))
+	if (do_read(fs, n, buf, offset, 0, false) < 0)
 	    throw "can't read header";
 	if (read_hdr(n, buf, offset) < 0)
 	    throw "bad header";
@@ -1720,6 +1773,8 @@ void *fs_init(struct fuse_conn_info *conn)
 
 void fs_teardown(void)
 {
+    delete stripe;		// waits for pending deletes
+    stripe = nullptr;
     for (auto it = inode_map.begin(); it != inode_map.end();
 	 it = inode_map.erase(it)) ;
     this_index = 0;
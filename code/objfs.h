@@ -13,6 +13,10 @@ struct objfs {
     int         use_local;      /* prefix is a file path */
     s3_target  *s3;
     size_t      chunk_size;
+    int         checksum;       /* send CRC32C with each object PUT */
+    const char *targets;        /* "host/bucket,..." to stripe objects over */
+    int         stripe_hash;    /* place objects by hash, not round-robin */
+    int         shards;         /* hashed key prefixes, 0 = none */
 };
 
 #ifdef __cplusplus
@@ -40,6 +44,7 @@ extern "C" int fs_initialize(const char*);
 extern "C" int fs_mkfs(const char*);
 extern "C" void fs_sync(void);
 extern "C" void fs_teardown(void);
+extern "C" void fs_get_log_stats(struct fs_log_stats *st);
 #endif
 
 #endif
@@ -0,0 +1,60 @@
+/*
+ * file:        objprobes.h
+ * description: static (USDT) tracepoints, for bpftrace - see bpf/
+ */
+
+#ifndef __OBJPROBES_H__
+#define __OBJPROBES_H__
+
+/* With <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) each
+ * probe is a single nop plus an ELF note saying where its arguments
+ * are; nothing happens at run time until a tracer attaches. Without
+ * it, or with -DOBJFS_NO_PROBES, probes compile to nothing and their
+ * arguments aren't evaluated. Either way keep arguments to values that
+ * are already at hand.
+ *
+ * Providers are "objfs" (objfs.cc) and "s3wrap" (s3wrap.cc), e.g.
+ *   bpftrace -e 'usdt:./objfs-mount:objfs:read_done { @[arg1] = count(); }'
+ *
+ * objfs:
+ *   read_start, write_start   path, len, offset
+ *   read_done, write_done     path, result
+ *   read_data                 object, offset, len, 1 if from the log
+ *   read_data_done            object, result (S3 reads only)
+ *   hdr_lookup                object, 1 if header length was cached
+ *   flush_start               object, dirty inodes
+ *   flush_inodes_done         object, metadata bytes, data bytes
+ *   flush_put, flush_done     object [, key]
+ *   replay_object             object, header length
+ *   replay_record             object, type (enum log_rec_type), length
+ * s3wrap:
+ *   acquire, admit            request type (S3_REQ_*) [, bytes] - before
+ *                             and after waiting on the limiter
+ *   request                   type, status, bytes - each attempt
+ *   retry                     type, status
+ *   get_start, put_start      key, offset, len / key, len
+ *   get_done, put_done        key, status [, bytes]
+ *   get_async_start/_done     as for get_start/get_done
+ */
+#if !defined(OBJFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define OBJFS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef OBJFS_HAVE_PROBES
+#include <sys/sdt.h>
+#define OBJ_PROBE0(p, n)                 DTRACE_PROBE(p, n)
+#define OBJ_PROBE1(p, n, a)              DTRACE_PROBE1(p, n, a)
+#define OBJ_PROBE2(p, n, a, b)           DTRACE_PROBE2(p, n, a, b)
+#define OBJ_PROBE3(p, n, a, b, c)        DTRACE_PROBE3(p, n, a, b, c)
+#define OBJ_PROBE4(p, n, a, b, c, d)     DTRACE_PROBE4(p, n, a, b, c, d)
+#else
+#define OBJ_PROBE0(p, n)                 do {} while (0)
+#define OBJ_PROBE1(p, n, a)              do {} while (0)
+#define OBJ_PROBE2(p, n, a, b)           do {} while (0)
+#define OBJ_PROBE3(p, n, a, b, c)        do {} while (0)
+#define OBJ_PROBE4(p, n, a, b, c, d)     do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,524 @@
+//
+// file:        objstats.cc
+// description: per-op counts and latencies, served in /.objfs
+//
+
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <libs3.h>
+
+#include "s3wrap.h"
+#include "objfs.h"
+#include "optrace.h"
+#include "objstats.h"
+
+/* Every call through objstats_ops() is counted and timed, except those
+ * for the stats files:
+ *
+ *   /.objfs/stats        text
+ *   /.objfs/stats.json   the same, as JSON
+ *
+ * along with the S3 requests (s3_request_stats), their queueing by
+ * I/O class (s3_io_class_stats), log activity (fs_get_log_stats) and
+ * s3_assemble relocation (s3_relocation_stats) behind them. An open takes a snapshot, so reads see one consistent
+ * copy however they're split up. Writing to or truncating either file
+ * ("echo > .objfs/stats") resets the counts; a reset just saves the
+ * totals so far, to be subtracted, and the counting threads never
+ * know. /.objfs isn't listed in the root.
+ *
+ * Ops are numbered as in optrace.h.
+ */
+
+static struct fuse_operations inner, wrapped;
+
+struct op_stats {
+    struct lat_hist lat[N_TRACE_OPS];
+    uint64_t errors[N_TRACE_OPS];
+    uint64_t bytes[N_TRACE_OPS];	// read, write
+};
+
+static per_thread<op_stats> op_totals;
+static thread_local per_thread<op_stats>::ref my_ops(op_totals);
+
+static int count(int op, uint64_t t0, int rv, bool io = false)
+{
+    op_stats *st = my_ops.get();
+    lat_add(&st->lat[op], stat_now_us() - t0);
+    if (rv < 0)
+	stat_add(&st->errors[op], 1);
+    else if (io)
+	stat_add(&st->bytes[op], rv);
+    return rv;
+}
+
+// ---- snapshots
+
+static const char *req_names[] = {"GET", "PUT", "HEAD", "LIST", "DELETE", "multipart"};
+static const char *class_names[] = {"read", "fsync", "flush", "prefetch", "gc"};
+
+struct snapshot {
+    uint64_t     t_us;
+    op_stats     ops;
+    s3_req_stats reqs[S3_REQ_NTYPES];
+    s3_io_stats  io[S3_IO_NCLASSES];	// max and queued aren't reset
+    fs_log_stats log;
+    s3_copy_stats copy;
+};
+
+static std::mutex base_m;
+static std::unique_ptr<snapshot> base;	// totals at the last reset
+
+static void take(snapshot *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->t_us = stat_now_us();
+    op_totals.each([&](op_stats *t) {
+	    for (int op = 0; op < N_TRACE_OPS; op++) {
+		lat_sum(&s->ops.lat[op], &t->lat[op]);
+		s->ops.errors[op] += stat_get(&t->errors[op]);
+		s->ops.bytes[op] += stat_get(&t->bytes[op]);
+	    }
+	});
+    for (int r = 0; r < S3_REQ_NTYPES; r++)
+	s3_request_stats(r, &s->reqs[r]);
+    for (int c = 0; c < S3_IO_NCLASSES; c++)
+	s3_io_class_stats(c, &s->io[c]);
+    fs_get_log_stats(&s->log);
+    s3_relocation_stats(&s->copy);
+}
+
+// since the last reset
+//
+static std::unique_ptr<snapshot> since_reset(void)
+{
+    auto s = std::make_unique<snapshot>();
+    take(s.get());
+    std::unique_lock lk(base_m);
+    snapshot *b = base.get();
+    s->t_us -= b->t_us;
+    for (int op = 0; op < N_TRACE_OPS; op++) {
+	lat_diff(&s->ops.lat[op], &b->ops.lat[op]);
+	s->ops.errors[op] -= b->ops.errors[op];
+	s->ops.bytes[op] -= b->ops.bytes[op];
+    }
+    for (int r = 0; r < S3_REQ_NTYPES; r++) {
+	lat_diff(&s->reqs[r].lat, &b->reqs[r].lat);
+	s->reqs[r].bytes -= b->reqs[r].bytes;
+	s->reqs[r].retries -= b->reqs[r].retries;
+	s->reqs[r].errors -= b->reqs[r].errors;
+    }
+    for (int c = 0; c < S3_IO_NCLASSES; c++) {
+	s->io[c].requests -= b->io[c].requests;
+	s->io[c].bytes -= b->io[c].bytes;
+	s->io[c].queue_ms -= b->io[c].queue_ms;
+    }
+    lat_diff(&s->log.flush, &b->log.flush);
+    s->log.flush_bytes -= b->log.flush_bytes;
+    s->log.fsyncs -= b->log.fsyncs;
+    s->log.log_reads -= b->log.log_reads;
+    s->log.s3_reads -= b->log.s3_reads;
+    s->log.hdr_hits -= b->log.hdr_hits;
+    s->log.hdr_misses -= b->log.hdr_misses;
+    s->copy.objects -= b->copy.objects;
+    s->copy.relocated -= b->copy.relocated;
+    s->copy.copied -= b->copy.copied;
+    s->copy.downloaded -= b->copy.downloaded;
+    s->copy.uploaded -= b->copy.uploaded;
+    return s;
+}
+
+static void reset(void)
+{
+    auto s = std::make_unique<snapshot>();
+    take(s.get());
+    std::unique_lock lk(base_m);
+    base = std::move(s);
+}
+
+// ---- formatting
+
+static std::string fmt(const char *f, ...)
+{
+    char buf[512];
+    va_list ap;
+    va_start(ap, f);
+    vsnprintf(buf, sizeof(buf), f, ap);
+    va_end(ap);
+    return buf;
+}
+
+// client traffic per byte relocated: 2.0 if it all went through here
+//
+static double client_per_byte(const s3_copy_stats *c)
+{
+    return c->relocated ? (double)(c->downloaded + c->uploaded) / c->relocated : 0.0;
+}
+
+static std::string lat_text(const lat_hist *h)
+{
+    return fmt("%9.1f %8lu %8lu %8lu %8lu", h->n ? (double)h->sum_us / h->n : 0.0,
+	       lat_percentile(h, 50), lat_percentile(h, 90), lat_percentile(h, 99),
+	       lat_percentile(h, 100));
+}
+
+static std::string lat_json(const lat_hist *h)
+{
+    return fmt("{\"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu}",
+	       h->n ? (double)h->sum_us / h->n : 0.0, lat_percentile(h, 50),
+	       lat_percentile(h, 90), lat_percentile(h, 99), lat_percentile(h, 100));
+}
+
+static std::string render_text(snapshot *s)
+{
+    std::string out = fmt("%.1f seconds since reset\n\n", s->t_us / 1e6);
+    out += fmt("%-10s %9s %7s %12s %9s %8s %8s %8s %8s\n", "op", "calls", "errors",
+	       "bytes", "mean_us", "p50", "p90", "p99", "max");
+    for (int op = 0; op < N_TRACE_OPS; op++)
+	if (s->ops.lat[op].n > 0)
+	    out += fmt("%-10s %9lu %7lu %12lu ", optrace_op_names[op], s->ops.lat[op].n,
+		       s->ops.errors[op], s->ops.bytes[op]) + lat_text(&s->ops.lat[op]) + "\n";
+
+    out += fmt("\n%-10s %9s %7s %12s %9s %8s %8s %8s %8s\n", "s3", "requests",
+	       "retries", "bytes", "mean_us", "p50", "p90", "p99", "max");
+    for (int r = 0; r < S3_REQ_NTYPES; r++)
+	if (s->reqs[r].lat.n > 0)
+	    out += fmt("%-10s %9lu %7lu %12lu ", req_names[r], s->reqs[r].lat.n,
+		       s->reqs[r].retries, s->reqs[r].bytes) + lat_text(&s->reqs[r].lat) +
+		(s->reqs[r].errors ? fmt("  %lu errors", s->reqs[r].errors) : "") + "\n";
+
+    out += fmt("\n%-10s %9s %7s %12s %9s %8s\n", "io class", "requests", "queued",
+	       "bytes", "wait_ms", "max_ms");
+    for (int c = 0; c < S3_IO_NCLASSES; c++)
+	if (s->io[c].requests > 0 || s->io[c].queued > 0)
+	    out += fmt("%-10s %9lu %7d %12lu %9.2f %8.1f\n", class_names[c],
+		       s->io[c].requests, s->io[c].queued, s->io[c].bytes,
+		       s->io[c].requests ? s->io[c].queue_ms / s->io[c].requests : 0.0,
+		       s->io[c].max_queue_ms);
+
+    out += fmt("\n%-10s %9s %7s %12s %9s %8s %8s %8s %8s\n", "log", "flushes", "fsyncs",
+	       "bytes", "mean_us", "p50", "p90", "p99", "max");
+    out += fmt("%-10s %9lu %7lu %12lu ", "", s->log.flush.n, s->log.fsyncs,
+	       s->log.flush_bytes) + lat_text(&s->log.flush) + "\n";
+    out += fmt("reads: %lu from the log in memory, %lu from S3; object headers: "
+	       "%lu cached, %lu read\n", s->log.log_reads, s->log.s3_reads,
+	       s->log.hdr_hits, s->log.hdr_misses);
+    if (s->copy.objects > 0)
+	out += fmt("relocation: %lu objects, %lu bytes relocated (%lu copied by S3), "
+		   "%lu downloaded, %lu uploaded: %.3f client bytes per byte relocated\n",
+		   s->copy.objects, s->copy.relocated, s->copy.copied,
+		   s->copy.downloaded, s->copy.uploaded, client_per_byte(&s->copy));
+
+    struct s3_limit_stats lim;
+    s3_concurrency_stats(&lim);
+    out += fmt("s3 limit: %.1f, %d in flight\n", lim.limit, lim.inflight);
+    return out;
+}
+
+static std::string render_json(snapshot *s)
+{
+    std::string out = fmt("{\"secs\": %.3f, \"ops\": {", s->t_us / 1e6);
+    const char *sep = "";
+    for (int op = 0; op < N_TRACE_OPS; op++) {
+	if (s->ops.lat[op].n == 0)
+	    continue;
+	out += fmt("%s\"%s\": {\"calls\": %lu, \"errors\": %lu, \"bytes\": %lu, \"lat_us\": ",
+		   sep, optrace_op_names[op], s->ops.lat[op].n, s->ops.errors[op],
+		   s->ops.bytes[op]) + lat_json(&s->ops.lat[op]) + "}";
+	sep = ", ";
+    }
+    out += "}, \"s3\": {";
+    sep = "";
+    for (int r = 0; r < S3_REQ_NTYPES; r++) {
+	std::string name = req_names[r];
+	for (auto &c : name)
+	    c = tolower(c);
+	out += fmt("%s\"%s\": {\"requests\": %lu, \"retries\": %lu, \"errors\": %lu, "
+		   "\"bytes\": %lu, \"lat_us\": ", sep, name.c_str(), s->reqs[r].lat.n,
+		   s->reqs[r].retries, s->reqs[r].errors, s->reqs[r].bytes) +
+	    lat_json(&s->reqs[r].lat) + "}";
+	sep = ", ";
+    }
+    out += "}, \"io_classes\": {";
+    sep = "";
+    for (int c = 0; c < S3_IO_NCLASSES; c++) {
+	out += fmt("%s\"%s\": {\"requests\": %lu, \"queued\": %d, \"bytes\": %lu, "
+		   "\"wait_ms\": %.3f, \"max_wait_ms\": %.3f}", sep, class_names[c],
+		   s->io[c].requests, s->io[c].queued, s->io[c].bytes,
+		   s->io[c].requests ? s->io[c].queue_ms / s->io[c].requests : 0.0,
+		   s->io[c].max_queue_ms);
+	sep = ", ";
+    }
+    out += fmt("}, \"log\": {\"flushes\": %lu, \"fsyncs\": %lu, \"bytes\": %lu, "
+	       "\"lat_us\": ", s->log.flush.n, s->log.fsyncs, s->log.flush_bytes) +
+	lat_json(&s->log.flush) +
+	fmt(", \"log_reads\": %lu, \"s3_reads\": %lu, \"hdr_hits\": %lu, "
+	    "\"hdr_misses\": %lu}", s->log.log_reads, s->log.s3_reads,
+	    s->log.hdr_hits, s->log.hdr_misses);
+    out += fmt(", \"relocation\": {\"objects\": %lu, \"relocated\": %lu, \"copied\": %lu, "
+	       "\"downloaded\": %lu, \"uploaded\": %lu, \"client_per_byte\": %.3f}",
+	       s->copy.objects, s->copy.relocated, s->copy.copied, s->copy.downloaded,
+	       s->copy.uploaded, client_per_byte(&s->copy));
+
+    struct s3_limit_stats lim;
+    s3_concurrency_stats(&lim);
+    out += fmt(", \"s3_limit\": {\"limit\": %.1f, \"inflight\": %d}}\n", lim.limit,
+	       lim.inflight);
+    return out;
+}
+
+// ---- the /.objfs files
+
+enum {NOT_STATS = 0, STATS_DIR, STATS_TEXT, STATS_JSON, STATS_NONE};
+
+static int stats_file(const char *path)
+{
+    if (strncmp(path, "/.objfs", 7) != 0 || (path[7] != 0 && path[7] != '/'))
+	return NOT_STATS;
+    if (path[7] == 0)
+	return STATS_DIR;
+    if (!strcmp(path + 7, "/stats"))
+	return STATS_TEXT;
+    if (!strcmp(path + 7, "/stats.json"))
+	return STATS_JSON;
+    return STATS_NONE;
+}
+
+static std::string render(int f)
+{
+    auto s = since_reset();
+    return (f == STATS_JSON) ? render_json(s.get()) : render_text(s.get());
+}
+
+static int stats_getattr(int f, struct stat *sb)
+{
+    if (f == STATS_NONE)
+	return -ENOENT;
+    memset(sb, 0, sizeof(*sb));
+    clock_gettime(CLOCK_REALTIME, &sb->st_mtim);
+    sb->st_atim = sb->st_ctim = sb->st_mtim;
+    sb->st_uid = getuid();
+    sb->st_gid = getgid();
+    if (f == STATS_DIR) {
+	sb->st_mode = S_IFDIR | 0555;
+	sb->st_nlink = 2;
+    }
+    else {
+	sb->st_mode = S_IFREG | 0644;
+	sb->st_nlink = 1;
+	sb->st_size = render(f).length();	// reads are direct_io anyway
+    }
+    return 0;
+}
+
+// ---- the wrappers
+
+static int st_getattr(const char *path, struct stat *sb)
+{
+    if (int f = stats_file(path))
+	return stats_getattr(f, sb);
+    uint64_t t = stat_now_us();
+    return count(TR_GETATTR, t, inner.getattr(path, sb));
+}
+
+static int st_readlink(const char *path, char *buf, size_t len)
+{
+    if (stats_file(path))
+	return -EINVAL;
+    uint64_t t = stat_now_us();
+    return count(TR_READLINK, t, inner.readlink(path, buf, len));
+}
+
+static int st_mkdir(const char *path, mode_t mode)
+{
+    if (stats_file(path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_MKDIR, t, inner.mkdir(path, mode));
+}
+
+static int st_unlink(const char *path)
+{
+    if (stats_file(path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_UNLINK, t, inner.unlink(path));
+}
+
+static int st_rmdir(const char *path)
+{
+    if (stats_file(path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_RMDIR, t, inner.rmdir(path));
+}
+
+static int st_symlink(const char *path, const char *contents)
+{
+    if (stats_file(path) || stats_file(contents))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_SYMLINK, t, inner.symlink(path, contents));
+}
+
+static int st_rename(const char *src_path, const char *dst_path)
+{
+    if (stats_file(src_path) || stats_file(dst_path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_RENAME, t, inner.rename(src_path, dst_path));
+}
+
+static int st_chmod(const char *path, mode_t mode)
+{
+    if (stats_file(path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_CHMOD, t, inner.chmod(path, mode));
+}
+
+static int st_truncate(const char *path, off_t len)
+{
+    if (int f = stats_file(path)) {
+	if (f != STATS_TEXT && f != STATS_JSON)
+	    return -EPERM;
+	reset();
+	return 0;
+    }
+    uint64_t t = stat_now_us();
+    return count(TR_TRUNCATE, t, inner.truncate(path, len));
+}
+
+static int st_open(const char *path, struct fuse_file_info *fi)
+{
+    if (int f = stats_file(path)) {
+	if (f == STATS_NONE)
+	    return -ENOENT;
+	fi->fh = (uint64_t)new std::string(render(f));
+	fi->direct_io = 1;
+	return 0;
+    }
+    return inner.open ? inner.open(path, fi) : 0;
+}
+
+static int st_read(const char *path, char *buf, size_t len, off_t offset,
+		   struct fuse_file_info *fi)
+{
+    if (stats_file(path)) {
+	std::string *s = (std::string*)fi->fh;
+	if (s == nullptr || offset >= (off_t)s->length())
+	    return 0;
+	len = std::min(len, s->length() - offset);
+	memcpy(buf, s->data() + offset, len);
+	return len;
+    }
+    uint64_t t = stat_now_us();
+    return count(TR_READ, t, inner.read(path, buf, len, offset, fi), true);
+}
+
+static int st_write(const char *path, const char *buf, size_t len, off_t offset,
+		    struct fuse_file_info *fi)
+{
+    if (stats_file(path)) {
+	reset();
+	return len;
+    }
+    uint64_t t = stat_now_us();
+    return count(TR_WRITE, t, inner.write(path, buf, len, offset, fi), true);
+}
+
+static int st_statfs(const char *path, struct statvfs *st)
+{
+    uint64_t t = stat_now_us();
+    return count(TR_STATFS, t, inner.statfs(path, st));
+}
+
+static int st_release(const char *path, struct fuse_file_info *fi)
+{
+    if (stats_file(path)) {
+	delete (std::string*)fi->fh;
+	fi->fh = 0;
+	return 0;
+    }
+    return inner.release ? inner.release(path, fi) : 0;
+}
+
+static int st_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (stats_file(path))
+	return 0;
+    uint64_t t = stat_now_us();
+    return count(TR_FSYNC, t, inner.fsync(path, datasync, fi));
+}
+
+static int st_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi)
+{
+    if (int f = stats_file(path)) {
+	if (f != STATS_DIR)
+	    return -ENOTDIR;
+	for (auto name : {".", "..", "stats", "stats.json"})
+	    filler(ptr, name, NULL, 0);
+	return 0;
+    }
+    uint64_t t = stat_now_us();
+    return count(TR_READDIR, t, inner.readdir(path, ptr, filler, offset, fi));
+}
+
+static int st_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    if (stats_file(path))
+	return -EPERM;
+    uint64_t t = stat_now_us();
+    return count(TR_CREATE, t, inner.create(path, mode, fi));
+}
+
+static int st_utimens(const char *path, const struct timespec tv[2])
+{
+    if (stats_file(path))
+	return 0;
+    uint64_t t = stat_now_us();
+    return count(TR_UTIMENS, t, inner.utimens(path, tv));
+}
+
+struct fuse_operations *objstats_ops(const struct fuse_operations *ops)
+{
+    inner = wrapped = *ops;
+    reset();
+
+    // the stats files need these whether or not objfs has them
+    wrapped.getattr = st_getattr;
+    wrapped.truncate = st_truncate;
+    wrapped.open = st_open;
+    wrapped.read = st_read;
+    wrapped.write = st_write;
+    wrapped.release = st_release;
+    wrapped.readdir = st_readdir;
+#define WRAP(op) if (inner.op) wrapped.op = st_ ## op
+    WRAP(readlink);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(chmod);
+    WRAP(statfs);
+    WRAP(fsync);
+    WRAP(create);
+    WRAP(utimens);
+#undef WRAP
+    return &wrapped;
+}
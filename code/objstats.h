@@ -0,0 +1,185 @@
+/*
+ * file:        objstats.h
+ * description: counters and latency histograms for the hot paths
+ */
+
+#ifndef __OBJSTATS_H__
+#define __OBJSTATS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Each thread updates its own copy of a set of counters (per_thread,
+ * below) and readers add up every thread's, so an update is a plain
+ * load and store - relaxed atomics only so that a reader never sees a
+ * torn value.
+ *
+ * Latency histograms are log-linear: a bucket per microsecond below
+ * 32us, then 16 buckets per power of 2, so values are within 6%.
+ */
+#define LAT_SUB     16
+#define LAT_BUCKETS (38 * LAT_SUB)
+
+struct lat_hist {
+    uint64_t n;
+    uint64_t sum_us;
+    uint64_t counts[LAT_BUCKETS];
+};
+
+static inline void stat_add(uint64_t *p, uint64_t v)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static inline int lat_bucket(uint64_t us)
+{
+    if (us < 2 * LAT_SUB)
+	return us;
+    int b = 63 - __builtin_clzll(us) - 4;	/* 4 = log2(LAT_SUB) */
+    int i = b * LAT_SUB + (us >> b);
+    return i < LAT_BUCKETS ? i : LAT_BUCKETS - 1;
+}
+
+/* smallest value in bucket @i */
+static inline uint64_t lat_value(int i)
+{
+    if (i < 2 * LAT_SUB)
+	return i;
+    int b = i / LAT_SUB - 1;
+    return (uint64_t)(i - b * LAT_SUB) << b;
+}
+
+static inline void lat_add(struct lat_hist *h, uint64_t us)
+{
+    stat_add(&h->counts[lat_bucket(us)], 1);
+    stat_add(&h->n, 1);
+    stat_add(&h->sum_us, us);
+}
+
+/* @dst += @src, where @src may be changing underneath */
+static inline void lat_sum(struct lat_hist *dst, const struct lat_hist *src)
+{
+    dst->n += stat_get(&src->n);
+    dst->sum_us += stat_get(&src->sum_us);
+    for (int i = 0; i < LAT_BUCKETS; i++)
+	dst->counts[i] += stat_get(&src->counts[i]);
+}
+
+/* @h -= @base, to get what happened since @base was taken */
+static inline void lat_diff(struct lat_hist *h, const struct lat_hist *base)
+{
+    h->n -= base->n;
+    h->sum_us -= base->sum_us;
+    for (int i = 0; i < LAT_BUCKETS; i++)
+	h->counts[i] -= base->counts[i];
+}
+
+/* @p = 100 gives the (bucket-rounded) maximum */
+static inline uint64_t lat_percentile(const struct lat_hist *h, double p)
+{
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++)
+	total += h->counts[i];
+    uint64_t want = (uint64_t)(total * p / 100);
+    if (want == 0)
+	want = 1;
+    int last = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+	if (h->counts[i] == 0)
+	    continue;
+	last = i;
+	if ((seen += h->counts[i]) >= want)
+	    return lat_value(i);
+    }
+    return lat_value(last);
+}
+
+/* log activity in objfs.cc - see fs_get_log_stats()
+ */
+struct fs_log_stats {
+    struct lat_hist flush;      /* objects written */
+    uint64_t flush_bytes;
+    uint64_t fsyncs;            /* flushes someone waited for */
+    uint64_t log_reads;         /* reads from the log not yet written */
+    uint64_t s3_reads;
+    uint64_t hdr_hits;          /* object header lengths already known */
+    uint64_t hdr_misses;
+};
+
+struct fuse_operations;
+
+#ifdef __cplusplus
+#include <mutex>
+#include <vector>
+
+/* a T for each thread, zeroed at first use: take one through a
+ * thread_local per_thread<T>::ref. A thread's block outlives it (and
+ * goes to the next new thread), so nothing counted is lost.
+ */
+template<typename T> class per_thread {
+    std::mutex      m;
+    std::vector<T*> all, idle;
+
+    T *take(void) {
+	std::unique_lock lk(m);
+	if (!idle.empty()) {
+	    T *p = idle.back();
+	    idle.pop_back();
+	    return p;
+	}
+	all.push_back(new T());
+	return all.back();
+    }
+    void give_back(T *p) {
+	std::unique_lock lk(m);
+	idle.push_back(p);
+    }
+
+public:
+    class ref {
+	per_thread &owner;
+	T          *p = nullptr;
+    public:
+	ref(per_thread &_owner) : owner(_owner) {}
+	~ref() {
+	    if (p != nullptr)
+		owner.give_back(p);
+	}
+	T *operator->() {
+	    if (p == nullptr)
+		p = owner.take();
+	    return p;
+	}
+	T *get(void) {
+	    return operator->();
+	}
+    };
+
+    // @fn on every block, live or not
+    template<typename F> void each(F fn) {
+	std::unique_lock lk(m);
+	for (auto p : all)
+	    fn(p);
+    }
+};
+
+extern "C"
+#endif
+/* a copy of @ops that keeps counts and latencies for every call and
+ * serves them in /.objfs/stats and /.objfs/stats.json (objstats.cc)
+ */
+struct fuse_operations *objstats_ops(const struct fuse_operations *ops);
+
+#endif
@@ -0,0 +1,248 @@
+//
+// file:        optrace.cc
+// description: record fs_ops calls to a binary trace (optrace.h)
+//
+
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+#include <mutex>
+#include <atomic>
+
+#include "optrace.h"
+
+static struct fuse_operations inner, traced;
+static FILE *trace_fp;
+static std::mutex trace_m;
+static uint64_t t_base, last_flush;
+static std::atomic<int> n_threads;
+static thread_local int this_thread = -1;
+
+static uint64_t now_ns(clockid_t clk = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// records go through stdio under one lock, and are flushed every
+// second or so, so a trace cut short by a crash loses little
+//
+static void record(int op, uint64_t start, int result, const char *path,
+		   const char *path2 = "", uint64_t offset = 0, uint64_t size = 0,
+		   uint32_t mode = 0)
+{
+    uint64_t end = now_ns();
+    if (this_thread < 0)
+	this_thread = n_threads++;
+    size_t len = strnlen(path, 65535), len2 = strnlen(path2, 65535);
+    struct optrace_rec r = {.start = start - t_base, .end = end - t_base,
+			    .offset = offset, .size = size, .result = result,
+			    .mode = mode, .op = (uint16_t)op,
+			    .thread = (uint16_t)this_thread, .len = (uint16_t)len,
+			    .len2 = (uint16_t)len2};
+
+    std::unique_lock lk(trace_m);
+    fwrite(&r, sizeof(r), 1, trace_fp);
+    fwrite(path, len, 1, trace_fp);
+    fwrite(path2, len2, 1, trace_fp);
+    if (end - last_flush > 1000000000) {
+	fflush(trace_fp);
+	last_flush = end;
+    }
+}
+
+static int tr_getattr(const char *path, struct stat *sb)
+{
+    uint64_t t = now_ns();
+    int rv = inner.getattr(path, sb);
+    record(TR_GETATTR, t, rv, path);
+    return rv;
+}
+
+static int tr_readlink(const char *path, char *buf, size_t len)
+{
+    uint64_t t = now_ns();
+    int rv = inner.readlink(path, buf, len);
+    record(TR_READLINK, t, rv, path, "", 0, len);
+    return rv;
+}
+
+static int tr_mkdir(const char *path, mode_t mode)
+{
+    uint64_t t = now_ns();
+    int rv = inner.mkdir(path, mode);
+    record(TR_MKDIR, t, rv, path, "", 0, 0, mode);
+    return rv;
+}
+
+static int tr_unlink(const char *path)
+{
+    uint64_t t = now_ns();
+    int rv = inner.unlink(path);
+    record(TR_UNLINK, t, rv, path);
+    return rv;
+}
+
+static int tr_rmdir(const char *path)
+{
+    uint64_t t = now_ns();
+    int rv = inner.rmdir(path);
+    record(TR_RMDIR, t, rv, path);
+    return rv;
+}
+
+static int tr_symlink(const char *path, const char *contents)
+{
+    uint64_t t = now_ns();
+    int rv = inner.symlink(path, contents);
+    record(TR_SYMLINK, t, rv, path, contents);
+    return rv;
+}
+
+static int tr_rename(const char *src_path, const char *dst_path)
+{
+    uint64_t t = now_ns();
+    int rv = inner.rename(src_path, dst_path);
+    record(TR_RENAME, t, rv, src_path, dst_path);
+    return rv;
+}
+
+static int tr_chmod(const char *path, mode_t mode)
+{
+    uint64_t t = now_ns();
+    int rv = inner.chmod(path, mode);
+    record(TR_CHMOD, t, rv, path, "", 0, 0, mode);
+    return rv;
+}
+
+static int tr_truncate(const char *path, off_t len)
+{
+    uint64_t t = now_ns();
+    int rv = inner.truncate(path, len);
+    record(TR_TRUNCATE, t, rv, path, "", len);
+    return rv;
+}
+
+static int tr_read(const char *path, char *buf, size_t len, off_t offset,
+		   struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int rv = inner.read(path, buf, len, offset, fi);
+    record(TR_READ, t, rv, path, "", offset, len);
+    return rv;
+}
+
+static int tr_write(const char *path, const char *buf, size_t len, off_t offset,
+		    struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int rv = inner.write(path, buf, len, offset, fi);
+    record(TR_WRITE, t, rv, path, "", offset, len);
+    return rv;
+}
+
+static int tr_statfs(const char *path, struct statvfs *st)
+{
+    uint64_t t = now_ns();
+    int rv = inner.statfs(path, st);
+    record(TR_STATFS, t, rv, path);
+    return rv;
+}
+
+static int tr_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int rv = inner.fsync(path, datasync, fi);
+    record(TR_FSYNC, t, rv, path, "", datasync);
+    return rv;
+}
+
+// count the entries on their way to the real filler
+//
+struct count_fill {
+    void           *buf;
+    fuse_fill_dir_t filler;
+    uint64_t        n;
+};
+
+static int tr_filler(void *buf, const char *name, const struct stat *sb, off_t off)
+{
+    struct count_fill *c = (struct count_fill*)buf;
+    c->n++;
+    return c->filler(c->buf, name, sb, off);
+}
+
+static int tr_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi)
+{
+    struct count_fill c = {ptr, filler, 0};
+    uint64_t t = now_ns();
+    int rv = inner.readdir(path, &c, tr_filler, offset, fi);
+    record(TR_READDIR, t, rv, path, "", offset, c.n);
+    return rv;
+}
+
+static int tr_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    uint64_t t = now_ns();
+    int rv = inner.create(path, mode, fi);
+    record(TR_CREATE, t, rv, path, "", 0, 0, mode);
+    return rv;
+}
+
+static int tr_utimens(const char *path, const struct timespec tv[2])
+{
+    uint64_t t = now_ns();
+    int rv = inner.utimens(path, tv);
+    record(TR_UTIMENS, t, rv, path, "", tv[0].tv_sec, tv[1].tv_sec);
+    return rv;
+}
+
+static void tr_destroy(void *data)
+{
+    if (inner.destroy)
+	inner.destroy(data);
+    std::unique_lock lk(trace_m);
+    fflush(trace_fp);
+}
+
+struct fuse_operations *optrace_ops(const struct fuse_operations *ops,
+				    const char *file)
+{
+    if (trace_fp != NULL || (trace_fp = fopen(file, "w")) == NULL)
+	return NULL;
+    setvbuf(trace_fp, NULL, _IOFBF, 1024 * 1024);
+    struct optrace_hdr h = {OPTRACE_MAGIC, OPTRACE_VERSION, now_ns(CLOCK_REALTIME)};
+    fwrite(&h, sizeof(h), 1, trace_fp);
+    fflush(trace_fp);
+    t_base = last_flush = now_ns();
+
+    // anything objfs doesn't implement stays NULL
+    inner = traced = *ops;
+#define TRACE(op) if (inner.op) traced.op = tr_ ## op
+    TRACE(getattr);
+    TRACE(readlink);
+    TRACE(mkdir);
+    TRACE(unlink);
+    TRACE(rmdir);
+    TRACE(symlink);
+    TRACE(rename);
+    TRACE(chmod);
+    TRACE(truncate);
+    TRACE(read);
+    TRACE(write);
+    TRACE(statfs);
+    TRACE(fsync);
+    TRACE(readdir);
+    TRACE(create);
+    TRACE(utimens);
+#undef TRACE
+    traced.destroy = tr_destroy;
+    return &traced;
+}
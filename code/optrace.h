@@ -0,0 +1,68 @@
+/*
+ * file:        optrace.h
+ * description: binary traces of fs_ops calls, for objfs-replay
+ */
+
+#ifndef __OPTRACE_H__
+#define __OPTRACE_H__
+
+#include <stdint.h>
+
+/* A trace is a header and then one record per call, each followed by
+ * its path and (for rename and symlink) second path, without NULs.
+ * Times are nanoseconds from the start of the trace, and @thread
+ * numbers the calling threads in order of their first call.
+ *
+ * What's in offset/size depends on the op:
+ *   read, write    file offset, length (result is the byte count)
+ *   truncate       new length
+ *   readdir        entries returned, in size
+ *   readlink       buffer size
+ *   fsync          datasync flag, in offset
+ *   utimens        atime, mtime (seconds)
+ * and mode is the mode for mkdir, create and chmod.
+ */
+#define OPTRACE_MAGIC   0x5254424f	/* "OBTR" */
+#define OPTRACE_VERSION 1
+
+struct optrace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start;		/* CLOCK_REALTIME ns, for reference */
+};
+
+enum {
+    TR_GETATTR, TR_READLINK, TR_MKDIR, TR_UNLINK, TR_RMDIR, TR_SYMLINK,
+    TR_RENAME, TR_CHMOD, TR_TRUNCATE, TR_READ, TR_WRITE, TR_STATFS,
+    TR_FSYNC, TR_READDIR, TR_CREATE, TR_UTIMENS, N_TRACE_OPS
+};
+
+static const char *const optrace_op_names[] = {
+    "getattr", "readlink", "mkdir", "unlink", "rmdir", "symlink",
+    "rename", "chmod", "truncate", "read", "write", "statfs",
+    "fsync", "readdir", "create", "utimens"
+};
+
+struct optrace_rec {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    uint64_t size;
+    int32_t  result;
+    uint32_t mode;
+    uint16_t op;
+    uint16_t thread;
+    uint16_t len;		/* path */
+    uint16_t len2;		/* second path */
+};
+
+#ifdef __cplusplus
+extern "C"
+#endif
+/* a copy of @ops that logs every call to @file, or NULL if it can't be
+ * created. One trace per process.
+ */
+struct fuse_operations *optrace_ops(const struct fuse_operations *ops,
+				    const char *file);
+
+#endif
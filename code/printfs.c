@@ -2,99 +2,8 @@
 #include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
+#include "objfs-log.h"
 
-struct log_data {
-    uint32_t inum;		// is 32 enough?
-    uint32_t obj_offset;	// bytes from start of file data
-    int64_t  file_offset;	// in bytes
-    int64_t  size;		// file size after this write
-    uint32_t len;		// bytes
-}__attribute__((packed,aligned(1)));
-
-struct log_inode {
-    uint32_t        inum;
-    uint32_t        mode;
-    uint32_t        uid, gid;
-    uint32_t        rdev;
-    struct timespec mtime;
-}__attribute__((packed,aligned(1)));
-
-struct log_trunc {
-    uint32_t inum;
-    int64_t  new_size;		// must be <= existing
-}__attribute__((packed,aligned(1)));
-
-struct log_delete {
-    uint32_t parent;
-    uint32_t inum;
-    uint8_t  namelen;
-    char     name[];
-}__attribute__((packed,aligned(1)));
-
-struct log_symlink {
-    uint32_t inum;
-    uint8_t  len;
-    char     target[];
-}__attribute__((packed,aligned(1)));
-
-struct log_rename {
-    uint32_t inum;		// of entity to rename
-    uint32_t parent1;		// inode number (source)
-    uint32_t parent2;		//              (dest)
-    uint8_t  name1_len;
-    uint8_t  name2_len;
-    char     name[];
-}__attribute__((packed,aligned(1)));
-
-struct log_create {
-    uint32_t  parent_inum;
-    uint32_t  inum;
-    uint8_t   namelen;
-    char      name[];
-}__attribute__((packed,aligned(1)));
-
-enum log_rec_type {
-    LOG_INODE = 1,
-    LOG_TRUNC,
-    LOG_DELETE,
-    LOG_SYMLNK,
-    LOG_RENAME,
-    LOG_DATA,
-    LOG_CREATE,
-    LOG_NULL,			// fill space for alignment
-};
-
-char *t2s(int type)
-{
-    switch (type) {
-    case LOG_INODE: return "LOG_INODE";
-    case LOG_TRUNC: return "LOG_TRUNC";
-    case LOG_DELETE: return "LOG_DELETE";
-    case LOG_SYMLNK: return "LOG_SYMLNK";
-    case LOG_RENAME: return "LOG_RENAME";
-    case LOG_DATA: return "LOG_DATA";
-    case LOG_CREATE: return "LOG_CREATE";
-    case LOG_NULL: return "LOG_NULL";
-    }
-    return "*unknown*";
-}
-
-struct log_record {
-    uint16_t type : 4;
-    uint16_t len : 12;
-    char data[];
-}__attribute__((packed,aligned(1)));
-
-#define OBJFS_MAGIC 0x5346424f	// "OBFS"
-
-struct obj_header {
-    int32_t magic;
-    int32_t version;
-    int32_t type;		// 1 == data, 2 == metadata
-    int32_t hdr_len;
-    int32_t this_index;
-    char    data[];
-};
 
 void read_log_data(void *ptr)
 {
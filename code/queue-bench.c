@@ -0,0 +1,271 @@
+/*
+ * file:        queue-bench.c
+ * description: s3ro.c command queue throughput vs. number of workers
+ *
+ * queue-bench ndevs secs op_usecs [nworkers...]
+ *
+ * Each device has a submit thread keeping 128 commands outstanding, as
+ * tcmu-runner would. Workers "execute" each command by spinning for
+ * op_usecs (0 measures just the queue), completing them in batches the
+ * way s3ro.c does. Two queues:
+ *   list: the old one - global mutex/condvar list, calloc per command
+ *   ring: per-device cmdring.h rings, shared worker pool, batch dequeue
+ *
+ * gcc -O2 -o queue-bench queue-bench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "cmdring.h"
+
+#ifndef DEPTH
+#define DEPTH 128
+#endif
+#define MAX_DEVS 64
+#define MAX_WORKERS 256
+#define MAX_BATCH 16
+
+struct dev {
+    _Atomic long    outstanding;
+    _Atomic long    completed;
+    struct cmd_ring ring;
+};
+
+static struct dev devs[MAX_DEVS];
+static int n_devs, n_workers, op_usecs;
+static atomic_bool stop;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void execute(struct dev *d)
+{
+    if (op_usecs > 0)
+        usleep(op_usecs);
+    d->completed++;
+    d->outstanding--;
+}
+
+/* the old queue */
+
+struct queued_op {
+    struct queued_op *next;
+    struct dev *dev;
+    off_t offset;
+};
+
+static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  C = PTHREAD_COND_INITIALIZER;
+static struct queued_op *q_head, *q_tail;
+
+static void *list_worker(void *arg)
+{
+    while (1) {
+        pthread_mutex_lock(&m);
+        while (q_head == NULL && !stop)
+            pthread_cond_wait(&C, &m);
+        if (stop) {
+            pthread_mutex_unlock(&m);
+            return NULL;
+        }
+        struct queued_op *r = q_head;
+        q_head = r->next;
+        pthread_mutex_unlock(&m);
+        execute(r->dev);
+        free(r);
+    }
+}
+
+static void list_submit(struct dev *d, off_t offset)
+{
+    struct queued_op *q = calloc(1, sizeof(*q));
+    *q = (struct queued_op){.next = NULL, .dev = d, .offset = offset};
+    pthread_mutex_lock(&m);
+    if (q_head == NULL)
+        q_head = q_tail = q;
+    else {
+        q_tail->next = q;
+        q_tail = q;
+    }
+    pthread_cond_signal(&C);
+    pthread_mutex_unlock(&m);
+}
+
+/* the new one */
+
+static sem_t work;
+static _Atomic int idle, searching;
+
+static void wake(void)
+{
+    int n = atomic_load(&idle);
+    while (n > 0)
+        if (atomic_compare_exchange_weak(&idle, &n, n - 1)) {
+            sem_post(&work);
+            return;
+        }
+}
+
+static bool pending(void)
+{
+    for (int i = 0; i < n_devs; i++)
+        if (ring_count(&devs[i].ring) > 0)
+            return true;
+    return false;
+}
+
+static int take_batch(int *slot, struct ring_cmd *batch)
+{
+    for (int i = 1; i <= n_devs; i++) {
+        int s = (*slot + i) % n_devs;
+        int max = ring_count(&devs[s].ring) / n_workers;
+        max = max < 1 ? 1 : (max > MAX_BATCH ? MAX_BATCH : max);
+        int n = ring_get(&devs[s].ring, batch, max);
+        if (n > 0) {
+            *slot = s;
+            return n;
+        }
+    }
+    return 0;
+}
+
+static void *ring_worker(void *arg)
+{
+    int slot = (long)arg % n_devs;
+    struct ring_cmd batch[MAX_BATCH];
+
+    atomic_fetch_add(&searching, 1);
+    while (!stop) {
+        int n = take_batch(&slot, batch);
+        if (n == 0) {
+            atomic_fetch_add(&idle, 1);
+            atomic_fetch_sub(&searching, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if ((n = take_batch(&slot, batch)) == 0) {
+                sem_wait(&work);
+                atomic_fetch_add(&searching, 1);
+                continue;
+            }
+            int i = atomic_load(&idle);
+            while (i > 0 && !atomic_compare_exchange_weak(&idle, &i, i - 1))
+                ;
+            atomic_fetch_add(&searching, 1);
+        }
+        if (atomic_fetch_sub(&searching, 1) == 1 && pending())
+            wake();
+        for (int j = 0; j < n; j++)
+            execute(&devs[slot]);
+        atomic_fetch_add(&searching, 1);
+    }
+    return NULL;
+}
+
+static void ring_submit(struct dev *d, off_t offset)
+{
+    struct ring_cmd c = {.op = OP_READ, .offset = offset, .length = 4096};
+    while (!ring_put(&d->ring, &c))
+        sched_yield();
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&searching) == 0)
+        wake();
+}
+
+static void (*submit)(struct dev*, off_t);
+
+static void *submitter(void *arg)
+{
+    struct dev *d = arg;
+    off_t offset = 0;
+    while (!stop) {
+        if (d->outstanding >= DEPTH) {
+            sched_yield();
+            continue;
+        }
+        d->outstanding++;
+        submit(d, offset);
+        offset += 4096;
+    }
+    return NULL;
+}
+
+static double run(const char *queue, int secs)
+{
+    pthread_t w[MAX_WORKERS], s[MAX_DEVS];
+    bool ring = !strcmp(queue, "ring");
+
+    stop = false;
+    submit = ring ? ring_submit : list_submit;
+    sem_init(&work, 0, 0);
+    idle = searching = 0;
+    for (int i = 0; i < n_devs; i++) {
+        devs[i].outstanding = devs[i].completed = 0;
+        ring_init(&devs[i].ring, 1024);
+    }
+    for (int i = 0; i < n_workers; i++)
+        pthread_create(&w[i], NULL, ring ? ring_worker : list_worker, (void*)(long)i);
+    for (int i = 0; i < n_devs; i++)
+        pthread_create(&s[i], NULL, submitter, &devs[i]);
+
+    double t0 = now();
+    sleep(secs);
+    stop = true;
+    double t = now() - t0;
+
+    long total = 0;
+    for (int i = 0; i < n_devs; i++) {
+        pthread_join(s[i], NULL);
+        total += devs[i].completed;
+    }
+    pthread_mutex_lock(&m);
+    pthread_cond_broadcast(&C);
+    pthread_mutex_unlock(&m);
+    for (int i = 0; i < n_workers; i++)
+        sem_post(&work);
+    for (int i = 0; i < n_workers; i++)
+        pthread_join(w[i], NULL);
+
+    while (q_head != NULL) {
+        struct queued_op *q = q_head;
+        q_head = q->next;
+        free(q);
+    }
+    for (int i = 0; i < n_devs; i++)
+        ring_free(&devs[i].ring);
+    sem_destroy(&work);
+    return total / t;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        printf("usage: queue-bench ndevs secs op_usecs [nworkers...]\n");
+        exit(1);
+    }
+    n_devs = atoi(argv[1]);
+    int secs = atoi(argv[2]);
+    op_usecs = atoi(argv[3]);
+
+    int default_workers[] = {1, 2, 4, 8, 16, 30, 64};
+    int n = argc > 4 ? argc - 4 : 7;
+    printf("%d devices, %d us/op\n%8s %12s %12s\n", n_devs, op_usecs,
+           "workers", "list IOPS", "ring IOPS");
+    for (int i = 0; i < n; i++) {
+        n_workers = argc > 4 ? atoi(argv[4 + i]) : default_workers[i];
+        double list = run("list", secs);
+        double ring = run("ring", secs);
+        printf("%8d %12.0f %12.0f\n", n_workers, list, ring);
+    }
+    return 0;
+}
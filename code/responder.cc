@@ -0,0 +1,243 @@
+//
+// file:        responder.cc
+// description: in-process S3 stand-ins for the benchmark tools
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "responder.h"
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+std::string url_decode(std::string enc)
+{
+    std::string val;
+    for (size_t j = 0; j < enc.length(); j++) {
+	if (enc[j] == '%' && j+2 < enc.length()) {
+	    val += (char)strtol(enc.substr(j+1, 2).c_str(), NULL, 16);
+	    j += 2;
+	}
+	else
+	    val += enc[j];
+    }
+    return val;
+}
+
+std::string query_arg(std::string q, std::string name)
+{
+    size_t i = ("&" + q).find("&" + name + "=");
+    if (i == std::string::npos)
+	return "";
+    i += name.length() + 1;
+    return url_decode(q.substr(i, q.find('&', i) - i));
+}
+
+std::string http_req::header(std::string name)
+{
+    size_t i = hdrs.find("\r\n" + name + ":");
+    if (i == std::string::npos)
+	return "";
+    i += name.length() + 3;
+    while (hdrs[i] == ' ')
+	i++;
+    return hdrs.substr(i, hdrs.find("\r\n", i) - i);
+}
+
+static bool write_all(int fd, std::string out)
+{
+    for (size_t done = 0; done < out.length(); ) {
+	ssize_t len = write(fd, out.data() + done, out.length() - done);
+	if (len <= 0)
+	    return false;
+	done += len;
+    }
+    return true;
+}
+
+// answer requests on one connection until the client closes it
+//
+static void serve(int fd, std::string bucket, http_handler fn, int latency_ms)
+{
+    std::string in;
+    std::vector<char> buf(64 * 1024);
+    std::string top = "/" + bucket + "/";
+    for (;;) {
+	size_t end;
+	while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+	    ssize_t len = read(fd, buf.data(), buf.size());
+	    if (len <= 0) {
+		close(fd);
+		return;
+	    }
+	    in.append(buf.data(), len);
+	}
+	http_req r;
+	r.hdrs = in.substr(0, end + 2);
+	in.erase(0, end + 4);
+	r.method = r.hdrs.substr(0, r.hdrs.find(' '));
+	std::string path = r.hdrs.substr(r.hdrs.find(' ') + 1);
+	path = path.substr(0, path.find(' '));
+	size_t q = path.find('?');
+	r.query = (q == std::string::npos) ? "" : path.substr(q + 1);
+	r.key = url_decode(path.substr(0, q));
+	r.key = (r.key.length() > top.length()) ? r.key.substr(top.length()) : "";
+
+	if (r.method == "PUT") {
+	    if (r.header("Expect") == "100-continue" &&
+		!write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n"))
+		break;
+	    size_t want = atol(r.header("Content-Length").c_str());
+	    while (in.length() < want) {
+		ssize_t len = read(fd, buf.data(), std::min(buf.size(), want - in.length()));
+		if (len <= 0) {
+		    close(fd);
+		    return;
+		}
+		in.append(buf.data(), len);
+	    }
+	    r.body = in.substr(0, want);
+	    in.erase(0, want);
+	}
+	std::string out = fn(r);
+	if (latency_ms > 0)
+	    usleep(latency_ms * 1000);
+	if (!write_all(fd, out))
+	    break;
+    }
+    close(fd);
+}
+
+// returns the port it's listening on
+//
+int start_responder(std::string bucket, http_handler fn, int latency_ms)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(sock, (struct sockaddr*)&addr, len) < 0 || listen(sock, 256) < 0 ||
+	getsockname(sock, (struct sockaddr*)&addr, &len) < 0) {
+	perror("responder");
+	exit(1);
+    }
+    std::thread([=]() {
+	    for (;;) {
+		int fd = accept(sock, NULL, NULL);
+		if (fd >= 0)
+		    std::thread(serve, fd, bucket, fn, latency_ms).detach();
+	    }
+	}).detach();
+    return ntohs(addr.sin_port);
+}
+
+// ---- the memory backend
+
+static std::mutex store_m;
+static std::map<std::string,std::string> store;
+
+static std::string list_body(std::string query)
+{
+    std::string prefix = query_arg(query, "prefix");
+    std::string marker = query_arg(query, "marker");
+    std::string mk = query_arg(query, "max-keys");
+    size_t max_keys = (mk == "") ? 1000 : atoi(mk.c_str());
+
+    std::string contents;
+    size_t count = 0;
+    std::unique_lock lk(store_m);
+    auto it = (marker >= prefix) ? store.upper_bound(marker) : store.lower_bound(prefix);
+    for (; it != store.end() && count < max_keys; it++, count++) {
+	if (it->first.compare(0, prefix.length(), prefix) != 0)
+	    break;
+	contents += "<Contents><Key>" + it->first + "</Key>"
+	    "<LastModified>2021-06-01T12:34:56.000Z</LastModified>"
+	    "<ETag>&quot;d41d8cd98f00b204e9800998ecf8427e&quot;</ETag>"
+	    "<Size>" + std::to_string(it->second.length()) + "</Size>"
+	    "<StorageClass>STANDARD</StorageClass></Contents>";
+    }
+    bool truncated = (it != store.end() &&
+		      it->first.compare(0, prefix.length(), prefix) == 0);
+    return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+	"<Name>memory</Name><Prefix>" + prefix + "</Prefix>"
+	"<MaxKeys>" + std::to_string(max_keys) + "</MaxKeys>"
+	"<IsTruncated>" + (truncated ? "true" : "false") + "</IsTruncated>" +
+	contents + "</ListBucketResult>";
+}
+
+static std::string memory_op(http_req &r)
+{
+    if (r.method == "PUT") {
+	std::unique_lock lk(store_m);
+	store[r.key] = std::move(r.body);
+	return "HTTP/1.1 200 OK\r\nETag: \"d41d8cd98f00b204e9800998ecf8427e\"\r\n"
+	    "Content-Length: 0\r\n\r\n";
+    }
+    if (r.method == "DELETE") {
+	std::unique_lock lk(store_m);
+	store.erase(r.key);
+	return "HTTP/1.1 204 No Content\r\n\r\n";
+    }
+    if (r.key == "") {
+	std::string body = list_body(r.query);
+	return "HTTP/1.1 200 OK\r\nContent-Type: application/xml\r\n"
+	    "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+    }
+
+    std::unique_lock lk(store_m);
+    auto it = store.find(r.key);
+    if (it == store.end())
+	return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    if (r.method == "HEAD")
+	return "HTTP/1.1 200 OK\r\nContent-Length: " +
+	    std::to_string(it->second.length()) + "\r\n\r\n";
+    int64_t first = 0, last = it->second.length() - 1;
+    std::string range = r.header("Range");
+    sscanf(range.c_str(), "bytes=%ld-%ld", &first, &last);
+    std::string body = it->second.substr(first, last + 1 - first);
+    return std::string(range == "" ? "HTTP/1.1 200 OK\r\n" :
+		       "HTTP/1.1 206 Partial Content\r\n") +
+	"Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+}
+
+int start_memory_responder(int latency_ms)
+{
+    return start_responder("memory", memory_op, latency_ms);
+}
+
+// an empty file system - the same bytes as mkfs.py
+//
+static const unsigned char mkfs_obj[] = {
+    0x4f, 0x42, 0x46, 0x53, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3e, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x81, 0x02, 0x01, 0x00, 0x00, 0x00, 0xe4, 0x41, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x94, 0xd1,
+    0x3a, 0x60, 0x00, 0x00, 0x00, 0x00, 0x71, 0x47, 0xfa, 0x2e, 0x00, 0x00, 0x00, 0x00};
+
+// mkfs if there's nothing there; returns NULL or what went wrong
+//
+const char *objfs_mkfs(s3_target *tt, std::string prefix)
+{
+    std::vector<uint32_t> indexes;
+    if (tt->s3_list_indexes(prefix + ".", indexes, 1) != S3StatusOK)
+	return "can't list";
+    if (indexes.empty()) {
+	struct iovec iov = {(void*)mkfs_obj, sizeof(mkfs_obj)};
+	if (tt->s3_put(prefix + ".00000000", &iov, 1) != S3StatusOK)
+	    return "can't create file system";
+    }
+    return NULL;
+}
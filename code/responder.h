@@ -0,0 +1,43 @@
+//
+// file:        responder.h
+// description: in-process S3 stand-ins for the benchmark tools
+//
+
+#ifndef __RESPONDER_H__
+#define __RESPONDER_H__
+
+#include <string>
+#include <functional>
+
+/* A responder listens on a loopback port and answers path-style S3
+ * requests for one bucket, a thread per connection. The handler gets
+ * each request - for a PUT with its body already read - and returns
+ * the whole HTTP response. @latency_ms is added before every response.
+ *
+ * The "memory" responder keeps objects in a map: PUT, GET (with
+ * Range), HEAD, DELETE and listings by prefix/marker/max-keys, which
+ * is everything objfs uses. It starts empty; objfs_mkfs() puts an
+ * empty file system there (the same bytes as mkfs.py), if there's
+ * nothing under the prefix already.
+ */
+struct http_req {
+    std::string method;		// "GET", "PUT", ...
+    std::string key;		// decoded, without the bucket
+    std::string query;		// after '?', still encoded
+    std::string hdrs;		// request line and headers
+    std::string body;
+    std::string header(std::string name);
+};
+
+typedef std::function<std::string(http_req &)> http_handler;
+
+std::string url_decode(std::string enc);
+std::string query_arg(std::string q, std::string name);
+
+int start_responder(std::string bucket, http_handler fn, int latency_ms);
+int start_memory_responder(int latency_ms);
+
+struct s3_target;
+const char *objfs_mkfs(s3_target *tt, std::string prefix);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "blkstore.h"
+#include "responder.h"
+#include <sys/uio.h>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+
+// block store read benchmark, the fio jobs in s3ro.fio without the
+// kernel and tcmu-runner in the way:
+//
+// s3-blk bucket/prefix MB rand|seq bs nthreads|qDEPTH secs cache_mb
+// s3-blk synthetic MB rand|seq bs nthreads|qDEPTH secs cache_mb [latency_ms]
+//
+// qDEPTH: one thread keeping DEPTH reads going with blk_read_async()
+// instead of a thread per read.
+//
+// synthetic serves a base image of MB megabytes (each 8-byte word holds
+// its own offset, so reads are checked) from memory, with latency_ms
+// (default 20) added to every GET to look more like S3. Each seq
+// thread reads its own part of the device from start to end.
+
+static std::atomic<long> n_gets, n_reads, n_bytes, n_bad;
+static bool stop;
+
+static std::string synthetic_op(http_req &r, int64_t size, int latency_ms)
+{
+    std::string out, body;
+    bool head = (r.method == "HEAD");
+    if (r.query != "") {			// listing: empty log
+	body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	    "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+	    "<Name>synthetic</Name><IsTruncated>false</IsTruncated>"
+	    "</ListBucketResult>";
+	out = "HTTP/1.1 200 OK\r\nContent-Type: application/xml\r\n";
+    }
+    else if (r.key != "img")
+	out = "HTTP/1.1 404 Not Found\r\n";
+    else if (head)
+	return "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(size) +
+	    "\r\n\r\n";
+    else {
+	int64_t first = 0, last = size - 1;
+	sscanf(r.header("Range").c_str(), "bytes=%ld-%ld", &first, &last);
+	body.resize(last + 1 - first);
+	for (int64_t i = first & ~7; i <= last; i += 8)
+	    for (int j = 0; j < 8; j++)
+		if (i + j >= first && i + j <= last)
+		    body[i + j - first] = ((char*)&i)[j];
+	n_gets++;
+	usleep(latency_ms * 1000);
+	out = "HTTP/1.1 206 Partial Content\r\n";
+    }
+    return out + "Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+}
+
+static void read_thread(void *bs, int64_t size, bool rand, size_t bs_len,
+			int i, int nthreads, bool check)
+{
+    std::vector<char> buf(bs_len);
+    struct iovec iov = {buf.data(), bs_len};
+    int64_t nblks = size / bs_len, part = nblks / nthreads;
+    int64_t blk = part * i - 1;
+    unsigned seed = i;
+
+    while (!stop) {
+	if (rand)
+	    blk = rand_r(&seed) % nblks;
+	else if (++blk >= part * (i + 1))
+	    blk = part * i;
+	off_t offset = blk * bs_len;
+	if (blk_read(bs, offset, bs_len, &iov, 1) != 0)
+	    n_bad++;
+	else if (check)
+	    for (size_t j = 0; j < bs_len; j += 512)
+		if (*(int64_t*)&buf[j] != offset + (int64_t)j)
+		    n_bad++;
+	n_reads++;
+	n_bytes += bs_len;
+    }
+}
+
+struct async_read {
+    std::vector<char> buf;
+    struct iovec iov;
+    off_t offset;
+};
+
+static std::mutex m;
+static std::condition_variable cv;
+static std::vector<async_read*> done_list;
+
+static void read_done(void *arg, int rv)
+{
+    if (rv != 0)
+	n_bad++;
+    std::unique_lock lk(m);
+    done_list.push_back((async_read*)arg);
+    cv.notify_one();
+}
+
+static void async_thread(void *bs, int64_t size, bool rand, size_t bs_len,
+			 int depth, bool check)
+{
+    int64_t nblks = size / bs_len, blk = -1;
+    unsigned seed = 0;
+    std::vector<async_read*> free_list;
+    for (int i = 0; i < depth; i++) {
+	auto r = new async_read;
+	r->buf.resize(bs_len);
+	r->iov = {r->buf.data(), bs_len};
+	free_list.push_back(r);
+    }
+
+    int outstanding = 0;
+    while (!stop || outstanding > 0) {
+	while (!stop && !free_list.empty()) {
+	    auto r = free_list.back();
+	    free_list.pop_back();
+	    blk = rand ? rand_r(&seed) % nblks : (blk + 1) % nblks;
+	    r->offset = blk * bs_len;
+	    outstanding++;
+	    blk_read_async(bs, r->offset, bs_len, &r->iov, 1, read_done, r);
+	}
+	std::unique_lock lk(m);
+	while (done_list.empty())
+	    cv.wait(lk);
+	auto done = std::move(done_list);
+	done_list.clear();
+	lk.unlock();
+	for (auto r : done) {
+	    if (check)
+		for (size_t j = 0; j < bs_len; j += 512)
+		    if (*(int64_t*)&r->buf[j] != r->offset + (int64_t)j)
+			n_bad++;
+	    n_reads++;
+	    n_bytes += bs_len;
+	    outstanding--;
+	    free_list.push_back(r);
+	}
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    if (argc < 8) {
+	printf("usage: s3-blk bucket/prefix MB rand|seq bs nthreads|qDEPTH secs cache_mb\n"
+	       "       s3-blk synthetic MB rand|seq bs nthreads|qDEPTH secs cache_mb [latency_ms]\n");
+	exit(1);
+    }
+
+    int64_t size = atol(argv[2]) * 1024 * 1024;
+    bool rand = !strcmp(argv[3], "rand");
+    size_t bs_len = atol(argv[4]) * (strchr(argv[4], 'k') ? 1024 : 1);
+    int depth = (argv[5][0] == 'q') ? atoi(argv[5] + 1) : 0;
+    int nthreads = depth ? 1 : atoi(argv[5]);
+    int n_secs = atoi(argv[6]);
+    size_t cache = atol(argv[7]) * 1024 * 1024;
+
+    char *bucket, *prefix, local[64];
+    bool synthetic = !strcmp(argv[1], "synthetic");
+    if (synthetic) {
+	int latency_ms = (argc > 8) ? atoi(argv[8]) : 20;
+	int port = start_responder("synthetic", [=](http_req &r) {
+		return synthetic_op(r, size, latency_ms);}, 0);
+	sprintf(local, "127.0.0.1:%d", port);
+	host = local;
+	access = secret = (char*)"synthetic";
+	bucket = (char*)"synthetic";
+	prefix = (char*)"img";
+    }
+    else
+	sscanf(argv[1], "%m[^/]/%ms", &bucket, &prefix);
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    S3_set_request_pool(2 * std::max(nthreads, depth) + 8, S3_POOL_SHARE_ALL);
+    auto tt = new s3_target(host, bucket, access, secret, false);
+    void *bs = blk_open(tt, prefix, size / 512, false, cache);
+    if (bs == NULL) {
+	printf("can't open %s\n", argv[1]);
+	exit(1);
+    }
+
+    std::thread th[nthreads];
+    if (depth)
+	th[0] = std::thread(async_thread, bs, size, rand, bs_len, depth, synthetic);
+    else
+	for (int i = 0; i < nthreads; i++)
+	    th[i] = std::thread(read_thread, bs, size, rand, bs_len, i, nthreads,
+				synthetic);
+
+    auto start = std::chrono::system_clock::now();
+    sleep(n_secs);
+    stop = true;
+    for (int i = 0; i < nthreads; i++)
+	th[i].join();
+    std::chrono::duration<double> t = std::chrono::system_clock::now() - start;
+    blk_close(bs);
+
+    printf("%s %s %s cache %zuMB: %.0f IOPS, %.1f MB/s",
+	   argv[3], argv[4], argv[5], cache >> 20, n_reads / t.count(),
+	   n_bytes / t.count() / (1024 * 1024));
+    if (synthetic)
+	printf(", %.0f GETs/s (%.2f per read)", n_gets / t.count(),
+	       1.0 * n_gets / std::max(n_reads.load(), 1L));
+    printf("\n");
+    if (n_bad > 0)
+	printf("%ld BAD READS\n", n_bad.load());
+    return 0;
+}
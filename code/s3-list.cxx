@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "responder.h"
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <unistd.h>
+#include <atomic>
+#include <time.h>
+
+
+// listing benchmark: time (wall and CPU) to get the object indexes
+// under a prefix three ways -
+//   list:    std::list<std::string> of keys, then sscanf each one
+//   keys:    streaming callback, std::string + sscanf per key
+//   indexes: s3_list_indexes(), decoded in the response parser
+//
+// s3-list bucket/prefix nthreads      - list a real bucket
+// s3-list synthetic N nthreads        - N keys "img.%08x" served from
+//                                       memory by a local responder
+//
+// the synthetic listing costs the client the same as a real one, but
+// needs no store (and no N puts to fill it). CPU time building the
+// responses isn't counted; writing them to the socket is.
+
+static double cpu_secs(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// CPU time used by the responder, to take out of the totals
+//
+static std::atomic<uint64_t> responder_ns;
+
+static uint64_t thread_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// first index whose key "img.%08x" sorts after @marker
+//
+static uint64_t first_after(std::string marker)
+{
+    std::string prefix = "img.";
+    if (marker.compare(0, prefix.length(), prefix) != 0)
+	return marker < prefix ? 0 : UINT32_MAX + 1ull;
+    std::string hex = marker.substr(prefix.length(), 8);
+    bool exact = (hex.length() == 8);
+    hex.resize(8, '0');
+    return strtoull(hex.c_str(), NULL, 16) + (exact ? 1 : 0);
+}
+
+// answer a bucket listing of img.00000000 ... img.%08x (n-1)
+//
+static std::string list_op(http_req &r, uint32_t n)
+{
+    uint64_t t0 = thread_ns();
+    std::string prefix = query_arg(r.query, "prefix");
+    std::string mk = query_arg(r.query, "max-keys");
+    uint32_t max_keys = (mk == "") ? 1000 : atoi(mk.c_str());
+
+    std::string contents;
+    uint32_t count = 0;
+    uint64_t i = first_after(query_arg(r.query, "marker"));
+    char key[64];
+    for (; i < n && count < max_keys; i++) {
+	snprintf(key, sizeof(key), "img.%08x", (uint32_t)i);
+	if (strncmp(key, prefix.c_str(), prefix.length()) != 0) {
+	    if (strcmp(key, prefix.c_str()) < 0)
+		continue;
+	    i = n;
+	    break;
+	}
+	contents += std::string("<Contents><Key>") + key + "</Key>"
+	    "<LastModified>2021-06-01T12:34:56.000Z</LastModified>"
+	    "<ETag>&quot;d41d8cd98f00b204e9800998ecf8427e&quot;</ETag>"
+	    "<Size>8388608</Size><Owner><ID>75aa57f09aa0c8caeab4f8c24e99d10f"
+	    "8e7faeebf76c078efc7c6caea54ba06a</ID><DisplayName>objfs</DisplayName>"
+	    "</Owner><StorageClass>STANDARD</StorageClass></Contents>";
+	count++;
+    }
+    bool truncated = (i < n);
+    std::string body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+	"<Name>synthetic</Name><Prefix>" + prefix + "</Prefix>"
+	"<MaxKeys>" + std::to_string(max_keys) + "</MaxKeys>"
+	"<IsTruncated>" + (truncated ? "true" : "false") + "</IsTruncated>" +
+	contents + "</ListBucketResult>";
+
+    std::string out = "HTTP/1.1 200 OK\r\nContent-Type: application/xml\r\n"
+	"Content-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+    responder_ns += thread_ns() - t0;
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    char *host = getenv("S3_HOSTNAME");
+    char *access = getenv("S3_ACCESS_KEY_ID");
+    char *secret = getenv("S3_SECRET_ACCESS_KEY");
+
+    if (argc < 3) {
+	printf("usage: s3-list bucket/prefix nthreads\n"
+	       "       s3-list synthetic N nthreads\n");
+	exit(1);
+    }
+
+    char *bucket, *prefix;
+    int nthreads;
+    char local[64];
+    if (!strcmp(argv[1], "synthetic") && argc > 3) {
+	uint32_t n = atol(argv[2]);
+	int port = start_responder("synthetic", [n](http_req &r) {
+		return list_op(r, n);}, 0);
+	sprintf(local, "127.0.0.1:%d", port);
+	host = local;
+	access = secret = (char*)"synthetic";
+	bucket = (char*)"synthetic";
+	prefix = (char*)"img.";
+	nthreads = atoi(argv[3]);
+    }
+    else {
+	sscanf(argv[1], "%m[^/]/%ms", &bucket, &prefix);
+	nthreads = atoi(argv[2]);
+    }
+    std::string s_prefix(prefix);
+
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    auto tt = s3_target(host, bucket, access, secret, false);
+
+    std::string fmt = s_prefix + "%x";
+    auto parse = [&](const char *key, std::vector<uint32_t> &v) {
+	unsigned n;
+	if (sscanf(key, fmt.c_str(), &n) == 1)
+	    v.push_back(n);
+    };
+
+    for (const char *method : {"list", "keys", "indexes"}) {
+	std::vector<uint32_t> indexes;
+	auto start = std::chrono::system_clock::now();
+	double cpu0 = cpu_secs() - responder_ns / 1e9;
+	S3Status status;
+
+	if (!strcmp(method, "list")) {
+	    std::list<std::string> keys;
+	    status = tt.s3_list(s_prefix, keys);
+	    for (auto k : keys)
+		parse(k.c_str(), indexes);
+	}
+	else if (!strcmp(method, "keys")) {
+	    auto fn = [&](const char *key) {
+		std::string k(key);
+		parse(k.c_str(), indexes);
+	    };
+	    status = tt.s3_list(s_prefix, fn, nthreads);
+	}
+	else
+	    status = tt.s3_list_indexes(s_prefix, indexes, nthreads);
+
+	std::chrono::duration<double> t = std::chrono::system_clock::now() - start;
+	double cpu = cpu_secs() - responder_ns / 1e9 - cpu0;
+	if (status != S3StatusOK) {
+	    printf("%s: %s\n", method, S3_get_status_name(status));
+	    exit(1);
+	}
+	printf("%-8s %zu keys in %.2f s (%.0f/sec), cpu %.2f s (%.2f us/key)\n",
+	       method, indexes.size(), t.count(), indexes.size() / t.count(),
+	       cpu, 1e6 * cpu / std::max(indexes.size(), (size_t)1));
+    }
+
+    return 0;
+}
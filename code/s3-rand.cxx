@@ -1,40 +1,294 @@
+#include <stdio.h>
 #include <stdlib.h>
-#include <mutex>
-#include <condition_variable>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
 #include <list>
+#include <vector>
+#include <string>
+#include <random>
 #include <libs3.h>
 #include "s3wrap.h"
+#include "objstats.h"
+#include "responder.h"
 #include <sys/uio.h>
 #include <chrono>
 #include <thread>
-#include <iostream>
+#include <atomic>
 #include <unistd.h>
+#include <time.h>
 
 
-// maybe consider using https://github.com/p-ranav/argparse
+// S3 load generator
+//
+// s3-rand [options] bucket/prefix
+// s3-rand [options] synthetic
+//
+// Requests go to objects "prefix.%08x" for 0..N-1 (-n N), or with -n 0
+// to the single object "prefix", sized by HEAD (or -S) - that's what
+// s3-rand used to do. "synthetic" is a local responder that answers
+// GETs, PUTs and HEADs from memory, after -L ms.
+//
+//   -t N        threads (16)
+//   -d SECS     run time (10)
+//   -n N        number of objects (0)
+//   -S SIZE     size of the single object, if not from HEAD
+//   -O SIZE     object size, or MIN-MAX for a log-uniform spread (4m)
+//   -b SIZE     GET size, or MIN-MAX (4k)
+//   -w PCT      share of writes - PUTs of a whole object (0, needs -n)
+//   -a rand|seq|zipf[:THETA]  access pattern (rand, theta 0.99)
+//   -R RATE     open loop at RATE requests/sec in all (default closed)
+//   -c          create the objects first
+//   -L MS       synthetic responder latency (0)
+//   -j          JSON summary
+//
+// The access pattern picks the object, then the GET is at a random
+// (seq: the next) offset in it; with a single object the pattern picks
+// the offset. Zipf ranks are in index order, so the hot objects are the
+// first ones. Sizes are in bytes, with k/m/g suffixes; object sizes
+// come from the index, so they're the same from one run to the next.
+//
+// In open loop each thread starts its requests on a fixed schedule,
+// and latency is from when a request was due, not when it went out, so
+// a stall shows up in the percentiles instead of just slowing the load.
 
-long n_complete;
-std::mutex m;
-bool stop;
+enum {OP_GET, OP_PUT, N_OPS};
+static const char *op_names[] = {"get", "put"};
 
-void read_thread(s3_target *tgt, std::string key, ssize_t size)
+// sizes: "4k", or "4k-1m" for powers of 2 picked uniformly in between
+//
+struct size_dist {
+    size_t min, max;
+
+    static size_t parse_one(const char *s) {
+	char *end;
+	double v = strtod(s, &end);
+	switch (*end) {
+	case 'g': case 'G': v *= 1024;	// fall through
+	case 'm': case 'M': v *= 1024;	// fall through
+	case 'k': case 'K': v *= 1024;
+	}
+	return v;
+    }
+    void parse(const char *s) {
+	min = max = parse_one(s);
+	if (const char *dash = strchr(s, '-'))
+	    max = parse_one(dash + 1);
+    }
+    size_t pick(uint64_t r) {
+	if (min == max)
+	    return min;
+	int steps = log2(max / min) + 1;
+	return std::min(min << (r % steps), max);
+    }
+};
+
+// Gray et al., "Quickly generating billion-record synthetic
+// databases" - O(n) to set up, O(1) per item
+//
+struct zipf_dist {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+
+    void init(uint64_t _n, double _theta) {
+	n = _n;
+	theta = _theta;
+	alpha = 1 / (1 - theta);
+	zetan = 0;
+	for (uint64_t i = 1; i <= n; i++)
+	    zetan += 1 / pow(i, theta);
+	double zeta2 = 1 + 1 / pow(2, theta);
+	eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+    uint64_t pick(double u) {
+	double uz = u * zetan;
+	if (uz < 1)
+	    return 0;
+	if (uz < 1 + pow(0.5, theta))
+	    return 1;
+	return std::min((uint64_t)(n * pow(eta * u - eta + 1, alpha)), n - 1);
+    }
+};
+
+static struct {
+    int       nthreads = 16;
+    int       secs = 10;
+    uint32_t  n_objs = 0;
+    ssize_t   single_size = 0;
+    size_dist obj_size = {4 << 20, 4 << 20};
+    size_dist req_size = {4096, 4096};
+    int       write_pct = 0;
+    enum {RAND, SEQ, ZIPF} pattern = RAND;
+    double    theta = 0.99;
+    double    rate = 0;
+    bool      create = false;
+    int       latency_ms = 0;
+    bool      json = false;
+} cfg;
+
+static std::string prefix;
+static zipf_dist zipf;
+static std::atomic<bool> stop;
+
+// each thread's own, so nothing is shared on the fast path; the
+// once-a-second report reads the counters without locking
+//
+struct alignas(64) thread_stats {
+    std::atomic<uint64_t> ops[N_OPS], bytes[N_OPS], errors[N_OPS];
+    lat_hist lat[N_OPS] = {};
+};
+
+static std::string obj_key(uint32_t i)
+{
+    if (cfg.n_objs == 0)
+	return prefix;
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%08x", i);
+    return prefix + buf;
+}
+
+static size_t obj_size(uint32_t i)
 {
-    ssize_t npages = size / 4096;
-    char buf[4096];
-    struct iovec iov[] = {{.iov_base = (void*)buf, .iov_len = sizeof(buf)}};
+    if (cfg.n_objs == 0)
+	return cfg.single_size;
+    return cfg.obj_size.pick(std::hash<uint64_t>()(i * 0x9e3779b97f4a7c15ull));
+}
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+    struct timespec ts = {(time_t)t, (long)((t - (time_t)t) * 1e9)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void load_thread(s3_target *tt, int id, thread_stats *st, double t0)
+{
+    std::mt19937_64 rng(id + 1);
+    std::uniform_real_distribution<double> unif(0, 1);
+    std::vector<char> buf(cfg.req_size.max);
+    std::vector<char> wbuf(cfg.obj_size.max, 'x');
+
+    // the pattern picks an object, or with a single one, a block of the
+    // largest request size
+    size_t blk = cfg.req_size.max;
+    uint64_t n_items = cfg.n_objs ? cfg.n_objs : std::max(obj_size(0) / blk, (size_t)1);
+    uint64_t part = std::max(n_items / cfg.nthreads, (uint64_t)1);
+    uint64_t seq_item = (part * id) % n_items;
+    size_t seq_offset = 0;
+    double interval = cfg.rate > 0 ? cfg.nthreads / cfg.rate : 0;
+    double due = t0 + id * interval / cfg.nthreads;
 
     while (!stop) {
-	long pg = random() % npages;
-	ssize_t offset = pg * 4096;
-	tgt->s3_get(key, offset, 4096, iov, 1);
-	m.lock();
-	n_complete++;
-	m.unlock();
+	if (interval > 0) {
+	    sleep_until(due);
+	    if (stop)
+		break;
+	}
+	double start = interval > 0 ? due : now_secs();
+	due += interval;
+
+	uint64_t item = 0;
+	if (cfg.pattern == cfg.ZIPF)
+	    item = zipf.pick(unif(rng));
+	else if (cfg.pattern == cfg.RAND)
+	    item = rng() % n_items;
+	else
+	    item = seq_item;
+
+	int op = (cfg.write_pct > 0 && (int)(rng() % 100) < cfg.write_pct) ? OP_PUT : OP_GET;
+	uint32_t obj = cfg.n_objs ? item : 0;
+	size_t size = obj_size(obj), len;
+	S3Status status;
+	if (op == OP_PUT) {
+	    len = size;
+	    struct iovec iov = {wbuf.data(), len};
+	    status = tt->s3_put(obj_key(obj), &iov, 1);
+	}
+	else {
+	    len = std::min(cfg.req_size.pick(rng()), size);
+	    size_t offset;
+	    if (cfg.n_objs == 0)
+		offset = std::min(item * blk, size - len);
+	    else if (cfg.pattern == cfg.SEQ) {
+		if (seq_offset + len > size)
+		    seq_offset = 0;
+		offset = seq_offset;
+	    }
+	    else
+		offset = (rng() % (size / len)) * len;
+	    struct iovec iov = {buf.data(), len};
+	    status = tt->s3_get(obj_key(obj), offset, len, &iov, 1);
+	    seq_offset = offset + len;
+	}
+	if (cfg.pattern == cfg.SEQ && (op == OP_PUT || cfg.n_objs == 0 ||
+				       seq_offset + cfg.req_size.min > size)) {
+	    seq_item = (seq_item + 1) % n_items;
+	    seq_offset = 0;
+	}
+
+	lat_add(&st->lat[op], (now_secs() - start) * 1e6);
+	st->ops[op].fetch_add(1, std::memory_order_relaxed);
+	if (status == S3StatusOK)
+	    st->bytes[op].fetch_add(len, std::memory_order_relaxed);
+	else
+	    st->errors[op].fetch_add(1, std::memory_order_relaxed);
     }
 }
 
+static void create_objects(s3_target *tt)
+{
+    std::atomic<uint32_t> next = 0;
+    std::atomic<long> failed = 0;
+    std::vector<std::thread> th;
+    for (int i = 0; i < cfg.nthreads; i++)
+	th.push_back(std::thread([&]() {
+		    std::vector<char> buf(cfg.obj_size.max, 'x');
+		    for (uint32_t j = next++; j < cfg.n_objs; j = next++) {
+			struct iovec iov = {buf.data(), obj_size(j)};
+			if (tt->s3_put(obj_key(j), &iov, 1) != S3StatusOK)
+			    failed++;
+		    }
+		}));
+    for (auto &t : th)
+	t.join();
+    if (failed > 0) {
+	fprintf(stderr, "%ld objects couldn't be created\n", failed.load());
+	exit(1);
+    }
+}
 
-// s3-rand bucket/key nthreads seconds
+// the synthetic store: GETs get zeros, PUTs are thrown away, every
+// object is @size bytes
+//
+static std::string synthetic_op(http_req &r, ssize_t size)
+{
+    if (r.method == "PUT")
+	return "HTTP/1.1 200 OK\r\nETag: \"d41d8cd98f00b204e9800998ecf8427e\"\r\n"
+	    "Content-Length: 0\r\n\r\n";
+    if (r.method == "HEAD")
+	return "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(size) + "\r\n\r\n";
+    int64_t first = 0, last = size - 1;
+    sscanf(r.header("Range").c_str(), "bytes=%ld-%ld", &first, &last);
+    std::string body(last + 1 - first, 0);
+    return "HTTP/1.1 206 Partial Content\r\nContent-Length: " +
+	std::to_string(body.length()) + "\r\n\r\n" + body;
+}
+
+static void usage(void)
+{
+    printf("usage: s3-rand [options] bucket/prefix|synthetic\n"
+	   "  -t threads  -d secs  -n objects  -S single_size  -O obj_size[-max]\n"
+	   "  -b get_size[-max]  -w write_pct  -a rand|seq|zipf[:theta]\n"
+	   "  -R rate (open loop)  -c (create objects)  -L synthetic_ms  -j (JSON)\n");
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
@@ -42,50 +296,148 @@ int main(int argc, char **argv)
     char *access = getenv("S3_ACCESS_KEY_ID");
     char *secret = getenv("S3_SECRET_ACCESS_KEY");
 
-    char *bucket, *key;
-    sscanf(argv[1], "%m[^/]/%ms", &bucket, &key);
-    std::string s_key(key);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:n:S:O:b:w:a:R:cL:j")) != -1) {
+	switch (opt) {
+	case 't': cfg.nthreads = atoi(optarg); break;
+	case 'd': cfg.secs = atoi(optarg); break;
+	case 'n': cfg.n_objs = atol(optarg); break;
+	case 'S': cfg.single_size = size_dist::parse_one(optarg); break;
+	case 'O': cfg.obj_size.parse(optarg); break;
+	case 'b': cfg.req_size.parse(optarg); break;
+	case 'w': cfg.write_pct = atoi(optarg); break;
+	case 'a':
+	    if (!strncmp(optarg, "zipf", 4)) {
+		cfg.pattern = cfg.ZIPF;
+		if (optarg[4] == ':')
+		    cfg.theta = atof(optarg + 5);
+	    }
+	    else if (!strcmp(optarg, "seq"))
+		cfg.pattern = cfg.SEQ;
+	    else if (!strcmp(optarg, "rand"))
+		cfg.pattern = cfg.RAND;
+	    else
+		usage();
+	    break;
+	case 'R': cfg.rate = atof(optarg); break;
+	case 'c': cfg.create = true; break;
+	case 'L': cfg.latency_ms = atoi(optarg); break;
+	case 'j': cfg.json = true; break;
+	default: usage();
+	}
+    }
+    if (optind >= argc || cfg.nthreads < 1 || cfg.req_size.min == 0 ||
+	cfg.obj_size.min == 0)
+	usage();
+    if ((cfg.write_pct > 0 || cfg.create) && cfg.n_objs == 0) {
+	printf("-w and -c need -n\n");
+	exit(1);
+    }
 
-    int nthreads = atoi(argv[2]);
-    int n_secs = atoi(argv[3]);
+    char *bucket, *key, local[64];
+    if (!strcmp(argv[optind], "synthetic")) {
+	if (cfg.single_size == 0)
+	    cfg.single_size = 1ll << 30;
+	ssize_t size = cfg.single_size;
+	int port = start_responder("synthetic", [size](http_req &r) {
+		return synthetic_op(r, size);}, cfg.latency_ms);
+	sprintf(local, "127.0.0.1:%d", port);
+	host = local;
+	access = secret = (char*)"synthetic";
+	bucket = (char*)"synthetic";
+	key = (char*)"obj";
+    }
+    else if (sscanf(argv[optind], "%m[^/]/%ms", &bucket, &key) != 2)
+	usage();
+    prefix = key;
 
-    auto tt = s3_target(host, bucket, access, secret, false);
+    S3_initialize(NULL, S3_INIT_ALL, NULL);
+    // keep an idle handle (and connection) for every thread, and share
+    // DNS / TLS session caches to make any reconnects cheaper
+    S3_set_request_pool(2 * cfg.nthreads, S3_POOL_SHARE_ALL);
+    // the load is what we say it is, not what the limiter thinks
+    s3_concurrency_limits(cfg.nthreads, cfg.nthreads);
+    auto tt = new s3_target(host, bucket, access, secret, false);
 
-    ssize_t obj_size;
-    if (argc > 4)
-	obj_size = atol(argv[4]);
-    else if (tt.s3_head(s_key, &obj_size) != S3StatusOK) {
-	printf("error\n");
+    if (cfg.n_objs == 0 && cfg.single_size == 0 &&
+	tt->s3_head(prefix, &cfg.single_size) != S3StatusOK) {
+	fprintf(stderr, "%s: can't get size\n", argv[optind]);
 	exit(1);
     }
-    std::thread th[nthreads];
-    std::cout << "bytes: " << obj_size << "\n";
-    
-    for (int i = 0; i < nthreads; i++) {
-	auto t = new s3_target(host, bucket, access, secret, false);
-	th[i] = std::thread(read_thread, t, s_key, obj_size);
+    if (cfg.create)
+	create_objects(tt);
+    if (cfg.pattern == cfg.ZIPF) {
+	size_t n_items = cfg.n_objs ? cfg.n_objs : cfg.single_size / cfg.req_size.max;
+	zipf.init(std::max(n_items, (size_t)1), cfg.theta);
     }
 
-    auto start = std::chrono::system_clock::now();
-    long to_date = 0;
+    S3ConnectionStats stats0;
+    S3_get_connection_stats(&stats0);
+    std::vector<thread_stats> st(cfg.nthreads);
+    std::vector<std::thread> th;
+    double t0 = now_secs();
+    for (int i = 0; i < cfg.nthreads; i++)
+	th.push_back(std::thread(load_thread, tt, i, &st[i], t0));
 
-//    std::cout << "now<end: " << (now<end) << "\n";
-    for (int i = 0; i < n_secs; i++) {
-	usleep(1000000);
-	long tmp = n_complete;
-	printf("%ld\n", tmp - to_date);
-	to_date = tmp;
+    FILE *fp = cfg.json ? stderr : stdout;
+    uint64_t last_ops = 0, last_bytes = 0;
+    for (int i = 1; i <= cfg.secs; i++) {
+	sleep_until(t0 + i);
+	uint64_t ops = 0, bytes = 0, errors = 0;
+	for (auto &s : st)
+	    for (int op = 0; op < N_OPS; op++) {
+		ops += s.ops[op].load(std::memory_order_relaxed);
+		bytes += s.bytes[op].load(std::memory_order_relaxed);
+		errors += s.errors[op].load(std::memory_order_relaxed);
+	    }
+	fprintf(fp, "%3d %8lu ops/s %8.1f MB/s %6lu errors\n", i,
+		ops - last_ops, (bytes - last_bytes) / (1024.0 * 1024), errors);
+	last_ops = ops;
+	last_bytes = bytes;
     }
-
     stop = true;
-    for (int i = 0; i < nthreads; i++)
-	th[i].join();
+    for (auto &t : th)
+	t.join();
+    double t = now_secs() - t0;
 
-    auto end = std::chrono::system_clock::now();
-    
-    std::chrono::duration<double> t = end-start;
-    
-    printf("%ld in %.2f: %.2f/sec\n", n_complete, t.count(), 1.0 * n_complete / t.count());
+    S3ConnectionStats stats;
+    S3_get_connection_stats(&stats);
+    long connects = stats.connects - stats0.connects;
+    long requests = stats.requests - stats0.requests;
 
+    if (cfg.json)
+	printf("{\"threads\": %d, \"secs\": %.2f, \"rate\": %.0f, \"connects\": %ld, "
+	       "\"requests\": %ld", cfg.nthreads, t, cfg.rate, connects, requests);
+    for (int op = 0; op < N_OPS; op++) {
+	lat_hist h = {};
+	uint64_t ops = 0, bytes = 0, errors = 0;
+	for (auto &s : st) {
+	    lat_sum(&h, &s.lat[op]);
+	    ops += s.ops[op];
+	    bytes += s.bytes[op];
+	    errors += s.errors[op];
+	}
+	if (ops == 0)
+	    continue;
+	double mean = (double)h.sum_us / h.n;
+	if (cfg.json)
+	    printf(", \"%s\": {\"ops\": %lu, \"iops\": %.1f, \"MBps\": %.2f, "
+		   "\"errors\": %lu, \"lat_us\": {\"mean\": %.0f, \"p50\": %lu, "
+		   "\"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}",
+		   op_names[op], ops, ops / t, bytes / t / (1024 * 1024), errors, mean,
+		   lat_percentile(&h, 50), lat_percentile(&h, 90), lat_percentile(&h, 99),
+		   lat_percentile(&h, 99.9), lat_percentile(&h, 100));
+	else
+	    printf("%s: %lu in %.2f s: %.1f/s, %.1f MB/s, %lu errors\n"
+		   "  latency us: mean %.0f p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+		   op_names[op], ops, t, ops / t, bytes / t / (1024 * 1024), errors, mean,
+		   lat_percentile(&h, 50), lat_percentile(&h, 90), lat_percentile(&h, 99),
+		   lat_percentile(&h, 99.9), lat_percentile(&h, 100));
+    }
+    if (cfg.json)
+	printf("}\n");
+    else
+	printf("%ld connects: %.2f/sec (%.2f%% reuse)\n", connects, connects / t,
+	       100.0 - 100.0 * connects / std::max(requests, 1L));
     return 0;
 }
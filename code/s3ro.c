@@ -17,6 +17,7 @@
 #include <endian.h>
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <scsi/scsi.h>
 
 #include "darray.h"
@@ -29,18 +30,76 @@ typedef int S3Status;
 enum {S3StatusOK = 0};
 
 #include "s3wrap.h"
+#include "blkstore.h"
+#include "iov.h"
+#include "cmdring.h"
 
-#define NR_THREADS 30
+#define DEFAULT_THREADS 2       /* workers added per device */
+#define MAX_WORKERS 128
+#define MAX_DEVS 64
+#define DEFAULT_DEPTH 1024      /* commands queued per device */
+#define MAX_BATCH 16
+#define DEFAULT_CACHE_MB 64
+#define MAX_MERGE (4*1024*1024)
 
 struct tcmu_s3_state {
     void *s3;
     char *prefix;
     int   sectors;
-    pthread_t th[NR_THREADS];
+    bool  rw;
+    char *overlay;              /* local file for writes, or NULL */
+    bool  fill;
+    long  cache_mb;
+    int   threads;
+    int   added;                /* workers this device added to the pool */
+    int   depth;
+    void *blk;
+    struct tcmu_device *dev;
+    int   slot;                 /* in devs[] */
+    _Atomic int users;          /* workers looking at the ring */
+    struct cmd_ring ring;
 };
 
+/* Workers are shared by all devices. Each one goes round the devices,
+ * taking a batch from the next one with anything queued, so a busy
+ * device gets the whole pool.
+ *
+ * Waking a worker for every command would cost a syscall each, so
+ * @searching counts workers that are awake and looking for work and a
+ * sleeper (one of @idle, waiting on @work) is only woken if there are
+ * none. The last searcher to find work wakes another if there's more.
+ * A worker going to sleep looks at the rings once more after joining
+ * @idle, so either it sees a new command or the submitter sees it.
+ *
+ * Closing a device takes its workers back out: @retiring of them
+ * leave the next time round, the same way, and mark themselves @done
+ * for whoever holds pool_lock next to join.
+ */
+static struct tcmu_s3_state *_Atomic devs[MAX_DEVS];
+static sem_t work;
+static _Atomic int idle, searching;
+static pthread_t pool[MAX_WORKERS];
+static bool running[MAX_WORKERS];       /* pool[i] not joined yet */
+static atomic_bool done[MAX_WORKERS];
+static _Atomic int n_workers, retiring;
+static atomic_bool stopping;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 extern const char *S3_get_status_name(S3Status status);
 static void *worker(void *tmp);
+static void wake_one(void);
+
+/* join workers that have retired. Call with pool_lock held
+ */
+static void reap_workers(void)
+{
+    for (int i = 0; i < MAX_WORKERS; i++)
+        if (running[i] && atomic_load(&done[i])) {
+            pthread_join(pool[i], NULL);
+            running[i] = false;
+            atomic_store(&done[i], false);
+        }
+}
 
 static int tcmu_s3_open(struct tcmu_device *dev, bool reopen)
 {
@@ -60,6 +119,9 @@ static int tcmu_s3_open(struct tcmu_device *dev, bool reopen)
     char *bucket = strtok(cfg, "/");
     state->prefix = strtok(NULL, ";");
     char *host = NULL, *access = NULL, *secret = NULL;
+    state->cache_mb = DEFAULT_CACHE_MB;
+    state->threads = DEFAULT_THREADS;
+    state->depth = DEFAULT_DEPTH;
 
     for (char *tmp = strtok(NULL, ";"); tmp != NULL; tmp = strtok(NULL, ";")) {
         if (!strncmp(tmp, "host=", 5)) {
@@ -71,6 +133,18 @@ static int tcmu_s3_open(struct tcmu_device *dev, bool reopen)
             secret = tmp+7;
         else if (!strncmp(tmp, "access=", 7))
             access = tmp+7;
+        else if (!strcmp(tmp, "rw"))
+            state->rw = true;
+        else if (!strncmp(tmp, "overlay=", 8))
+            state->overlay = tmp+8;
+        else if (!strcmp(tmp, "fill"))
+            state->fill = true;
+        else if (!strncmp(tmp, "cache=", 6))
+            state->cache_mb = atol(tmp+6);
+        else if (!strncmp(tmp, "threads=", 8))
+            state->threads = atoi(tmp+8);
+        else if (!strncmp(tmp, "depth=", 6))
+            state->depth = atoi(tmp+6);
         else {
             fprintf(fp, "bad cfg: %s\n", tmp);
             fclose(fp);
@@ -78,6 +152,12 @@ static int tcmu_s3_open(struct tcmu_device *dev, bool reopen)
             return -EINVAL;
         }
     }
+    if (state->rw && state->overlay) {
+        fprintf(fp, "bad cfg: rw and overlay\n");
+        fclose(fp);
+        tcmu_dev_err(dev, "bad cfg: rw and overlay\n");
+        return -EINVAL;
+    }
     fprintf(fp, "bucket '%s' host '%s' access '%s' secret '%s'\n", bucket, host, access, secret);
     if (host && access && secret) {
         state->s3 = s3_init(bucket, host, access, secret);
@@ -91,92 +171,356 @@ static int tcmu_s3_open(struct tcmu_device *dev, bool reopen)
         return -EINVAL;
     }
         
-    ssize_t len;
-    S3Status status = s3_len(state->s3, state->prefix, &len);
-    if (status != S3StatusOK) {
-        tcmu_dev_err(dev, "%s/%s: %s\n", bucket, state->prefix, S3_get_status_name(status));
-        fprintf(fp, "%s/%s: %s\n", bucket, state->prefix, S3_get_status_name(status));
+    /* finds the base image (a single object or chunks, see blkstore.h)
+     * if there is one, and checks its size
+     */
+    state->blk = blk_open(state->s3, state->prefix, tcmu_dev_get_num_lbas(dev),
+                          state->rw, state->cache_mb * 1024 * 1024);
+    if (state->blk == NULL) {
+        tcmu_dev_err(dev, "%s/%s: can't open image\n", bucket, state->prefix);
+        fprintf(fp, "%s/%s: can't open image\n", bucket, state->prefix);
         fclose(fp);
         return -EINVAL;
     }
+    if (state->overlay) {
+        int rv = blk_overlay(state->blk, state->overlay, state->fill);
+        if (rv < 0) {
+            tcmu_dev_err(dev, "%s: %s\n", state->overlay, strerror(-rv));
+            fprintf(fp, "%s: %s\n", state->overlay, strerror(-rv));
+            fclose(fp);
+            blk_close(state->blk);
+            return rv;
+        }
+    }
+    fclose(fp);
 
-
-    if (len/512 != tcmu_dev_get_num_lbas(dev)) {
-        tcmu_dev_err(dev, "bad #LBAs: %lu (cfg) %ld (s3)\n", tcmu_dev_get_num_lbas(dev), len/512);
-        fprintf(fp, "bad #LBAs: %lu (cfg) %ld (s3)\n", tcmu_dev_get_num_lbas(dev), len/512);
-        fclose(fp);
+    state->dev = dev;
+    int size = 16;
+    while (size < state->depth)
+        size *= 2;
+    ring_init(&state->ring, size);
+    for (state->slot = 0; state->slot < MAX_DEVS; state->slot++) {
+        struct tcmu_s3_state *empty = NULL;
+        if (atomic_compare_exchange_strong(&devs[state->slot], &empty, state))
+            break;
+    }
+    if (state->slot == MAX_DEVS) {
+        tcmu_dev_err(dev, "too many devices\n");
+        blk_close(state->blk);
+        ring_free(&state->ring);
         return -EINVAL;
     }
 
-    for (int i = 0; i < NR_THREADS; i++)
-        pthread_create(&state->th[i], NULL, worker, NULL);
+    pthread_mutex_lock(&pool_lock);
+    reap_workers();
+    for (int i = 0; i < MAX_WORKERS && state->added < state->threads; i++)
+        if (!running[i]) {
+            pthread_create(&pool[i], NULL, worker, (void*)(long)i);
+            running[i] = true;
+            state->added++;
+        }
+    atomic_fetch_add(&n_workers, state->added);
+    pthread_mutex_unlock(&pool_lock);
     
     tcmu_dev_set_write_cache_enabled(dev, 1);
     return 0;
 }
 
+/* commands have all completed by now (reads too - they're completed
+ * after blkstore is done with them), but a worker could still be
+ * looking at the (empty) ring
+ */
 static void tcmu_s3_close(struct tcmu_device *dev)
 {
     struct tcmu_s3_state *state = tcmur_dev_get_private(dev);
-    for (int i = 0; i < NR_THREADS; i++) 
-        pthread_cancel(state->th[i]);
-//    for (int i = 0; i < NR_THREADS; i++) 
-//        pthread_join(state->th[i], NULL);
+    atomic_store(&devs[state->slot], NULL);
+    while (atomic_load(&state->users) > 0)
+        usleep(1000);
+    blk_close(state->blk);	/* writes out anything still in memory */
+    ring_free(&state->ring);
+
+    pthread_mutex_lock(&pool_lock);
+    atomic_fetch_sub(&n_workers, state->added);
+    atomic_fetch_add(&retiring, state->added);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < state->added; i++)
+        wake_one();
+    reap_workers();
+    pthread_mutex_unlock(&pool_lock);
     printf("close complete\n");
     free(state);
 }
 
-struct queued_read {
-    struct queued_read *next;
-    struct tcmu_device *dev;
-    struct tcmur_cmd *tcmur_cmd;
-    struct iovec *iov;
-    size_t iov_cnt;
-    size_t length;
-    off_t offset;
+/* Reads don't tie up a worker: the worker starts one read for the
+ * whole range and the commands are completed from blkstore's callback,
+ * so the number of reads in flight is up to the ring, not the pool.
+ */
+struct read_op {
+    struct read_op *next;       /* in op_cache[home] */
+    int    home;
+    struct tcmu_s3_state *state;
+    int    n;
+    off_t  start;
+    bool   merged;
+    char  *buf;                 /* for merged reads, kept with the op */
+    size_t buf_len;
+    struct iovec iov;
+    struct ring_cmd cmds[MAX_BATCH];
 };
 
-static pthread_mutex_t m;
-static pthread_cond_t  C;
-static struct queued_read *q_head, *q_tail;
+/* read_ops are reused, so there's still nothing allocated per command
+ * once the pool is warm. Each worker slot has its own: read_done puts
+ * an op back on @returned from whatever thread it runs in, and only
+ * the worker takes them off, all at once.
+ */
+struct op_cache {
+    struct read_op *_Atomic returned;
+    struct read_op *free;
+};
+static struct op_cache op_cache[MAX_WORKERS];
 
-static void *worker(void *tmp)
+static struct read_op *get_op(int id)
 {
-    while (1) {
-        pthread_mutex_lock(&m);
-        while (q_head == NULL)
-            pthread_cond_wait(&C, &m);
-        struct queued_read *r = q_head;
-        q_head = r->next;
-        pthread_mutex_unlock(&m);
-        
-        struct tcmu_s3_state *state = tcmur_dev_get_private(r->dev);
-        S3Status status = s3_read(state->s3, state->prefix, r->offset, r->length, r->iov, r->iov_cnt);
-        tcmur_cmd_complete(r->dev, r->tcmur_cmd, TCMU_STS_OK);
+    struct op_cache *c = &op_cache[id];
+    if (c->free == NULL)
+        c->free = atomic_exchange(&c->returned, NULL);
+    struct read_op *r = c->free;
+    if (r == NULL) {
+        r = calloc(1, sizeof(*r));
+        r->home = id;
     }
-    return NULL;
+    else
+        c->free = r->next;
+    return r;
 }
 
-static int tcmu_s3_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
-                        struct iovec *iov, size_t iov_cnt, size_t length,
-                        off_t offset)
+static void put_op(struct read_op *r)
+{
+    struct op_cache *c = &op_cache[r->home];
+    r->next = atomic_load(&c->returned);
+    while (!atomic_compare_exchange_weak(&c->returned, &r->next, r))
+        ;
+}
+
+static void read_done(void *arg, int rv)
+{
+    struct read_op *r = arg;
+    int sts = (rv < 0) ? TCMU_STS_RD_ERR : TCMU_STS_OK;
+    for (int i = 0; i < r->n && r->merged && sts == TCMU_STS_OK; i++)
+        memcpy_to_iov(r->cmds[i].iov, r->cmds[i].iov_cnt, 0,
+                      r->buf + (r->cmds[i].offset - r->start), r->cmds[i].length);
+    for (int i = 0; i < r->n; i++)
+        tcmur_cmd_complete(r->state->dev, r->cmds[i].cmd, sts);
+    put_op(r);
+}
+
+/* one read for the whole range, copied out to each command
+ */
+static void do_reads(int id, struct tcmu_s3_state *state, struct ring_cmd **reads,
+                     int n, off_t start, off_t end)
 {
-    struct queued_read *q = calloc(1, sizeof(*q));
-    *q = (struct queued_read){.next = NULL, .dev = dev, .tcmur_cmd = tcmur_cmd, .iov = iov,
-                              .iov_cnt = iov_cnt, .length = length, .offset = offset};
-    pthread_mutex_lock(&m);
-    if (q_head == NULL)
-        q_head = q_tail = q;
+    struct read_op *r = get_op(id);
+    r->state = state;
+    r->n = n;
+    r->start = start;
+    r->merged = n > 1;
+    for (int i = 0; i < n; i++)
+        r->cmds[i] = *reads[i];
+
+    int rv;
+    if (n == 1)
+        rv = blk_read_async(state->blk, start, end - start, r->cmds[0].iov,
+                            r->cmds[0].iov_cnt, read_done, r);
     else {
-        q_tail->next = q;
-        q_tail = q;
+        if (r->buf_len < end - start) {
+            free(r->buf);
+            r->buf_len = end - start;
+            r->buf = malloc(r->buf_len);
+        }
+        r->iov = (struct iovec){.iov_base = r->buf, .iov_len = end - start};
+        rv = blk_read_async(state->blk, start, end - start, &r->iov, 1, read_done, r);
+    }
+    if (rv < 0)
+        read_done(r, rv);
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+    off_t x = (*(struct ring_cmd**)a)->offset, y = (*(struct ring_cmd**)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+/* writes and flushes in order, then the reads - sorted, and runs that
+ * overlap or touch (up to MAX_MERGE) done as a single read
+ */
+static void run_batch(int id, struct tcmu_s3_state *state, struct ring_cmd *c, int n)
+{
+    struct ring_cmd *reads[MAX_BATCH];
+    int n_reads = 0;
+
+    for (int i = 0; i < n; i++) {
+        int sts = TCMU_STS_OK;
+        switch (c[i].op) {
+        case OP_READ:
+            reads[n_reads++] = &c[i];
+            continue;
+        case OP_WRITE:
+            if (blk_write(state->blk, c[i].offset, c[i].length, c[i].iov, c[i].iov_cnt) < 0)
+                sts = TCMU_STS_WR_ERR;
+            break;
+        case OP_FLUSH:
+            if (blk_flush(state->blk) < 0)
+                sts = TCMU_STS_WR_ERR;
+            break;
+        }
+        tcmur_cmd_complete(state->dev, c[i].cmd, sts);
     }
-    pthread_cond_signal(&C);
-    pthread_mutex_unlock(&m);
 
+    qsort(reads, n_reads, sizeof(reads[0]), cmp_offset);
+    for (int i = 0, j; i < n_reads; i = j) {
+        off_t start = reads[i]->offset, end = start + reads[i]->length;
+        for (j = i + 1; j < n_reads && reads[j]->offset <= end; j++) {
+            off_t e = reads[j]->offset + reads[j]->length;
+            if (e > end && e - start > MAX_MERGE)
+                break;
+            if (e > end)
+                end = e;
+        }
+        do_reads(id, state, &reads[i], j - i, start, end);
+    }
+}
+
+/* take a fair share of what's queued: with a deep queue we get
+ * adjacent reads to merge, with a shallow one the other workers get
+ * something to do
+ */
+static int batch_size(struct tcmu_s3_state *state)
+{
+    int w = atomic_load(&n_workers);
+    int n = ring_count(&state->ring) / (w < 1 ? 1 : w);
+    return n < 1 ? 1 : (n > MAX_BATCH ? MAX_BATCH : n);
+}
+
+static void wake_one(void)
+{
+    int n = atomic_load(&idle);
+    while (n > 0)
+        if (atomic_compare_exchange_weak(&idle, &n, n - 1)) {
+            sem_post(&work);
+            return;
+        }
+}
+
+static bool pending(void)
+{
+    for (int i = 0; i < MAX_DEVS; i++) {
+        struct tcmu_s3_state *state = atomic_load(&devs[i]);
+        if (state != NULL && ring_count(&state->ring) > 0)
+            return true;
+    }
+    return false;
+}
+
+/* the next device after *@slot with anything queued. Returns the
+ * number of commands taken, and the device in *@p_state with its
+ * users count held if it's not zero.
+ */
+static int take_batch(int *slot, struct ring_cmd *batch, struct tcmu_s3_state **p_state)
+{
+    for (int i = 1; i <= MAX_DEVS; i++) {
+        int s = (*slot + i) % MAX_DEVS;
+        struct tcmu_s3_state *state = atomic_load(&devs[s]);
+        if (state == NULL)
+            continue;
+        atomic_fetch_add(&state->users, 1);
+        if (atomic_load(&devs[s]) == state) {           /* not closing */
+            int n = ring_get(&state->ring, batch, batch_size(state));
+            if (n > 0) {
+                *slot = s;
+                *p_state = state;
+                return n;
+            }
+        }
+        atomic_fetch_sub(&state->users, 1);
+    }
+    return 0;
+}
+
+static bool retire(void)
+{
+    int n = atomic_load(&retiring);
+    while (n > 0)
+        if (atomic_compare_exchange_weak(&retiring, &n, n - 1))
+            return true;
+    return false;
+}
+
+static void *worker(void *arg)
+{
+    long id = (long)arg;
+    int slot = id % MAX_DEVS;
+    struct ring_cmd batch[MAX_BATCH];
+    struct tcmu_s3_state *state;
+
+    atomic_fetch_add(&searching, 1);
+    while (!atomic_load(&stopping)) {
+        if (retire()) {
+            if (atomic_fetch_sub(&searching, 1) == 1 && pending())
+                wake_one();
+            atomic_store(&done[id], true);
+            break;
+        }
+        int n = take_batch(&slot, batch, &state);
+        if (n == 0) {
+            atomic_fetch_add(&idle, 1);
+            atomic_fetch_sub(&searching, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&retiring) == 0 &&
+                (n = take_batch(&slot, batch, &state)) == 0) {
+                sem_wait(&work);
+                atomic_fetch_add(&searching, 1);
+                continue;
+            }
+            int i = atomic_load(&idle);         /* not sleeping after all */
+            while (i > 0 && !atomic_compare_exchange_weak(&idle, &i, i - 1))
+                ;
+            atomic_fetch_add(&searching, 1);
+            if (n == 0)
+                continue;                       /* to retire */
+        }
+        if (atomic_fetch_sub(&searching, 1) == 1 && pending())
+            wake_one();
+        run_batch(id, state, batch, n);
+        atomic_fetch_sub(&state->users, 1);
+        atomic_fetch_add(&searching, 1);
+    }
+    return NULL;
+}
+
+/* the command is copied into the ring, so nothing to allocate. If the
+ * ring is full the initiator gets BUSY and retries.
+ */
+static int queue_op(int op, struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+                    struct iovec *iov, size_t iov_cnt, size_t length, off_t offset)
+{
+    struct tcmu_s3_state *state = tcmur_dev_get_private(dev);
+    struct ring_cmd c = {.op = op, .cmd = tcmur_cmd, .iov = iov, .iov_cnt = iov_cnt,
+                         .length = length, .offset = offset};
+    if (!ring_put(&state->ring, &c))
+        return TCMU_STS_NO_RESOURCE;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&searching) == 0)
+        wake_one();
     return TCMU_STS_OK;
 }
 
+static int tcmu_s3_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
+                        struct iovec *iov, size_t iov_cnt, size_t length,
+                        off_t offset)
+{
+    return queue_op(OP_READ, dev, tcmur_cmd, iov, iov_cnt, length, offset);
+}
+
 #if 0
 static int tcmu_s3_read(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
                         struct iovec *iov, size_t iov_cnt, size_t length,
@@ -192,26 +536,59 @@ static int tcmu_s3_write(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd,
                          struct iovec *iov, size_t iov_cnt, size_t length,
                          off_t offset)
 {
-    return TCMU_STS_WR_ERR;
+    struct tcmu_s3_state *state = tcmur_dev_get_private(dev);
+    if (!state->rw && !state->overlay)
+        return TCMU_STS_WR_ERR;
+    return queue_op(OP_WRITE, dev, tcmur_cmd, iov, iov_cnt, length, offset);
 }
 
+/* returning TCMU_STS_OK means we'll complete it later, so even a
+ * read-only flush has to go through the queue
+ */
 static int tcmu_s3_flush(struct tcmu_device *dev, struct tcmur_cmd *tcmur_cmd)
 {
-    return TCMU_STS_OK;
+    return queue_op(OP_FLUSH, dev, tcmur_cmd, NULL, 0, 0, 0);
 }
 
 static int tcmu_s3_init(void)
 {
-    return 0;
+    return sem_init(&work, 0, 0);
 }
 
 static void tcmu_s3_destroy(void)
 {
+    atomic_store(&stopping, true);
+    for (int i = 0; i < MAX_WORKERS; i++)
+        if (running[i])
+            sem_post(&work);
+    for (int i = 0; i < MAX_WORKERS; i++)
+        if (running[i])
+            pthread_join(pool[i], NULL);
+
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        struct read_op *lists[2] = {op_cache[i].free, atomic_load(&op_cache[i].returned)};
+        for (int j = 0; j < 2; j++)
+            for (struct read_op *r = lists[j], *next; r != NULL; r = next) {
+                next = r->next;
+                free(r->buf);
+                free(r);
+            }
+    }
 }
 
 static const char tcmu_s3_cfg_desc[] =
     "S3 config string is of the form:\n"
-    "bucket/prefix;host=HOST;access=KEY;secret=SECRET\n";
+    "bucket/prefix;host=HOST;access=KEY;secret=SECRET[;rw|;overlay=FILE[;fill]]\n"
+    "[;cache=MB][;threads=N][;depth=N]\n"
+    "The base image is the object 'prefix' or chunks 'prefix/NNNNNNNN'\n"
+    "(see blk-convert, blk-import), or none;\n"
+    "with rw, writes are logged to objects 'prefix.NNNNNNNN';\n"
+    "with overlay, S3 is left alone and writes go to a local sparse FILE,\n"
+    "which fill copies the rest of the image into in the background.\n"
+    "cache=0 turns off the read cache and readahead (default 64MB).\n"
+    "Each device adds threads=N workers to the shared pool (default 2)\n"
+    "while it's open;\n"
+    "reads complete asynchronously, up to depth=N queued (default 1024)\n";
 
 struct tcmur_handler tcmu_s3_handler = {
         .name          = "S3 BlockDev handler",
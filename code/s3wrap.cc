@@ -17,9 +17,19 @@
 #include <sstream>
 #include <sys/uio.h>
 #include <string.h>
+#include <time.h>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <map>
+#include <fcntl.h>
+#include <sys/select.h>
 
 #include "s3wrap.h"
 #include "iov.h"
+#include "objprobes.h"
 
 
 void *s3_init(char *bucket, char *host, char *access, char *secret)
@@ -48,12 +58,371 @@ S3Status s3_len(void *_t, char *key, ssize_t *p_len)
 
 
 
+/* Adaptive (AIMD) limit on requests in flight to the object store,
+ * shared by every s3_target in the process - foreground reads,
+ * uploads, prefetch and GC all queue here. The limit grows by one per
+ * window of successful requests while latency stays near its baseline,
+ * and is cut on a SlowDown/503 or when latency jumps. Only one cut per
+ * window: a request started before the last cut can't cause another.
+ *
+ * When a slot frees up it goes to the waiting request with the lowest
+ * virtual finish time (weighted fair queuing over the I/O classes, see
+ * s3wrap.h), so a GC burst gets its share without starving reads.
+ * Classes can also be rate limited in bytes/sec and requests/sec, by
+ * token buckets that may go into debt by one request.
+ *
+ * Asynchronous requests (s3_get_async) wait in the same queues, but
+ * instead of a thread blocked in acquire() they have a callback that's
+ * run when they get a slot.
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static bool is_throttle(S3Status status)
+{
+    return status == S3StatusErrorSlowDown ||
+	status == S3StatusErrorServiceUnavailable;
+}
+
+static __thread int thread_io_class = S3_IO_READ;
+
+int s3_set_io_class(int cls)
+{
+    if (cls < 0 || cls >= S3_IO_NCLASSES)
+	return -1;
+    int old = thread_io_class;
+    thread_io_class = cls;
+    return old;
+}
+
+// WFQ cost of a request is its size plus this much, so small requests
+// (HEAD, LIST, tiny GETs) aren't free
+const double request_overhead = 64 * 1024;
+
+class s3_limiter {
+    struct waiter {
+	int    cls;
+	double finish;		// virtual finish time
+	double t_queued;
+	size_t bytes;
+	std::function<void(uint64_t)> go;	// async only
+    };
+    struct io_class {
+	double weight;
+	double last_finish;
+	double byte_rate, iop_rate;	// 0 = unlimited
+	double byte_tokens, iop_tokens;
+	double t_refill;
+	std::list<waiter*> queue;
+	struct s3_io_stats stats;
+    };
+
+    std::mutex              m;
+    std::condition_variable cv;
+    double    limit = 16;
+    int       min_limit = 1, max_limit = 256;
+    int       inflight = 0;
+    uint64_t  cut_gen = 0;	// bumped on every decrease
+    double    base_ms[48];	// min latency seen, by log2(bytes)
+    double    ratio = 1;	// smoothed latency / baseline
+    struct s3_limit_stats stats = {};
+    double    vtime = 0;
+    io_class  classes[S3_IO_NCLASSES];
+    std::atomic<int> n_async {0};	// async waiters
+
+    // refill, and return ms until @c can go again (0 = now)
+    double tokens_wait(io_class *c, double now) {
+	double dt = (now - c->t_refill) / 1e3;
+	c->t_refill = now;
+	double wait = 0;
+	if (c->byte_rate > 0) {
+	    c->byte_tokens = std::min(c->byte_tokens + dt * c->byte_rate, c->byte_rate);
+	    if (c->byte_tokens < 0)
+		wait = -c->byte_tokens / c->byte_rate * 1e3;
+	}
+	if (c->iop_rate > 0) {
+	    c->iop_tokens = std::min(c->iop_tokens + dt * c->iop_rate, c->iop_rate);
+	    if (c->iop_tokens < 0)
+		wait = std::max(wait, -c->iop_tokens / c->iop_rate * 1e3);
+	}
+	return wait;
+    }
+
+    // next request to go, and how long until a rate-limited one could
+    waiter *pick(double now, double *p_wait) {
+	waiter *best = nullptr;
+	*p_wait = 0;
+	for (auto &c : classes) {
+	    if (c.queue.empty())
+		continue;
+	    double wait = tokens_wait(&c, now);
+	    if (wait > 0) {
+		if (*p_wait == 0 || wait < *p_wait)
+		    *p_wait = wait;
+		continue;
+	    }
+	    if (best == nullptr || c.queue.front()->finish < best->finish)
+		best = c.queue.front();
+	}
+	return best;
+    }
+
+    void enqueue(waiter *w) {
+	io_class *c = &classes[w->cls];
+	w->finish = std::max(vtime, c->last_finish) +
+	    (w->bytes + request_overhead) / c->weight;
+	c->last_finish = w->finish;
+	c->queue.push_back(w);
+    }
+
+    // it's @w's turn: take it off the queue and give it a slot
+    uint64_t take(waiter *w) {
+	io_class *c = &classes[w->cls];
+	c->queue.pop_front();
+	vtime = w->finish;
+	if (c->byte_rate > 0)
+	    c->byte_tokens -= w->bytes;
+	if (c->iop_rate > 0)
+	    c->iop_tokens -= 1;
+
+	double delay = now_ms() - w->t_queued;
+	c->stats.requests++;
+	c->stats.bytes += w->bytes;
+	c->stats.queue_ms += delay;
+	c->stats.max_queue_ms = std::max(c->stats.max_queue_ms, delay);
+
+	inflight++;
+	stats.requests++;
+	return cut_gen;
+    }
+
+    // start any async waiters at the head of the line. Their callbacks
+    // run with the lock held, so they mustn't block.
+    void grant(void) {
+	double wait;
+	waiter *w;
+	bool granted = false;
+	while (inflight < (int)limit && (w = pick(now_ms(), &wait)) != nullptr &&
+	       w->go) {
+	    uint64_t gen = take(w);
+	    w->go(gen);
+	    delete w;
+	    n_async--;
+	    granted = true;
+	}
+	if (granted)		// a thread may be next now
+	    cv.notify_all();
+    }
+
+    void account(uint64_t gen, double ms, size_t bytes, S3Status status) {
+	int i = 0;
+	while (bytes >>= 1)
+	    i++;
+	// baseline creeps up slowly so it follows a store that got slower;
+	// single samples are noisy, so it's the smoothed ratio to the
+	// baseline that has to double.
+	double base = base_ms[i];
+	base_ms[i] = (base == 0 || ms < base) ? ms : base * 1.001;
+	if (base > 0)
+	    ratio = 0.9 * ratio + 0.1 * (ms / base);
+
+	// latency is the softer signal, so it gets a smaller cut
+	double cut = 1;
+	if (is_throttle(status)) {
+	    stats.throttles++;
+	    cut = 0.7;
+	}
+	else if (ratio > 2) {
+	    stats.latency_cuts++;
+	    cut = 0.9;
+	}
+	if (cut < 1 && gen == cut_gen) {
+	    limit = std::max(limit * cut, (double)min_limit);
+	    cut_gen++;
+	    ratio = 1;
+	    stats.decreases++;
+	}
+	else if (cut == 1 && status == S3StatusOK && inflight + 1 >= (int)limit)
+	    limit = std::min(limit + 1 / limit, (double)max_limit);
+    }
+
+public:
+    s3_limiter() {
+	for (auto &b : base_ms)
+	    b = 0;
+	double weights[] = {16, 8, 4, 2, 1};
+	for (int i = 0; i < S3_IO_NCLASSES; i++) {
+	    classes[i].weight = weights[i];
+	    classes[i].last_finish = 0;
+	    classes[i].byte_rate = classes[i].iop_rate = 0;
+	    classes[i].byte_tokens = classes[i].iop_tokens = 0;
+	    classes[i].t_refill = 0;
+	    classes[i].stats = {};
+	}
+    }
+    void set(int _min, int _max) {
+	std::unique_lock lk(m);
+	min_limit = std::max(_min, 1);
+	max_limit = std::max(_max, min_limit);
+	limit = std::min(std::max(limit, (double)min_limit), (double)max_limit);
+	cv.notify_all();
+    }
+    void get(struct s3_limit_stats *st) {
+	std::unique_lock lk(m);
+	*st = stats;
+	st->limit = limit;
+	st->inflight = inflight;
+    }
+    void set_class(int cls, double weight, double bytes_sec, double iops) {
+	std::unique_lock lk(m);
+	io_class *c = &classes[cls];
+	if (weight > 0)
+	    c->weight = weight;
+	c->byte_rate = bytes_sec;
+	c->iop_rate = iops;
+	c->byte_tokens = bytes_sec;
+	c->iop_tokens = iops;
+	grant();
+	cv.notify_all();
+    }
+    void get_class(int cls, struct s3_io_stats *st) {
+	std::unique_lock lk(m);
+	*st = classes[cls].stats;
+	st->queued = classes[cls].queue.size();
+    }
+
+    uint64_t acquire(int cls, size_t bytes) {
+	std::unique_lock lk(m);
+	waiter w = {cls, 0, now_ms(), bytes, nullptr};
+	enqueue(&w);
+
+	for (;;) {
+	    grant();
+	    double wait;
+	    waiter *next = pick(now_ms(), &wait);
+	    if (next == &w && inflight < (int)limit)
+		break;
+	    if (next == nullptr && wait > 0)
+		cv.wait_for(lk, std::chrono::microseconds((long)(wait * 1e3) + 1));
+	    else
+		cv.wait(lk);
+	}
+	uint64_t gen = take(&w);
+	// someone else may be next in line
+	cv.notify_all();
+	return gen;
+    }
+
+    // @go gets the generation acquire() would have returned
+    void acquire_async(int cls, size_t bytes, std::function<void(uint64_t)> go) {
+	std::unique_lock lk(m);
+	enqueue(new waiter {cls, 0, now_ms(), bytes, go});
+	n_async++;
+	grant();
+    }
+
+    // async waiters held back by a rate limit need someone to look
+    // again later - the event loops do it
+    bool async_waiting(void) {
+	return n_async > 0;
+    }
+    void poll(void) {
+	std::unique_lock lk(m);
+	grant();
+    }
+
+    void release(uint64_t gen, double ms, size_t bytes, S3Status status) {
+	std::unique_lock lk(m);
+	inflight--;
+	account(gen, ms, bytes, status);
+	grant();
+	cv.notify_all();
+    }
+
+    // a failed request that's going to be retried keeps its slot
+    uint64_t retry(uint64_t gen, double ms, size_t bytes, S3Status status) {
+	std::unique_lock lk(m);
+	inflight--;
+	account(gen, ms, bytes, status);
+	inflight++;
+	return cut_gen;
+    }
+};
+
+static s3_limiter limiter;
+
+void s3_concurrency_limits(int min, int max)
+{
+    limiter.set(min, max);
+}
+
+void s3_concurrency_stats(struct s3_limit_stats *st)
+{
+    limiter.get(st);
+}
+
+void s3_io_class_limits(int cls, double weight, double bytes_sec, double iops)
+{
+    if (cls < 0 || cls >= S3_IO_NCLASSES)
+	return;
+    limiter.set_class(cls, weight, bytes_sec, iops);
+}
+
+void s3_io_class_stats(int cls, struct s3_io_stats *st)
+{
+    if (cls < 0 || cls >= S3_IO_NCLASSES) {
+	memset(st, 0, sizeof(*st));
+	return;
+    }
+    limiter.get_class(cls, st);
+}
+
+/* request counts and latencies, kept per thread (objstats.h)
+ */
+struct s3_thread_stats {
+    struct s3_req_stats req[S3_REQ_NTYPES];
+};
+
+static per_thread<s3_thread_stats> req_stats;
+static thread_local per_thread<s3_thread_stats>::ref my_req_stats(req_stats);
+
+static void count_request(int type, double ms, size_t bytes, S3Status status)
+{
+    struct s3_req_stats *st = &my_req_stats->req[type];
+    lat_add(&st->lat, ms * 1000);
+    stat_add(&st->bytes, bytes);
+    if (status != S3StatusOK)
+	stat_add(&st->errors, 1);
+}
+
+static void count_retry(int type)
+{
+    stat_add(&my_req_stats->req[type].retries, 1);
+}
+
+void s3_request_stats(int type, struct s3_req_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    req_stats.each([&](s3_thread_stats *t) {
+	    struct s3_req_stats *r = &t->req[type];
+	    st->bytes += stat_get(&r->bytes);
+	    st->retries += stat_get(&r->retries);
+	    st->errors += stat_get(&r->errors);
+	    lat_sum(&st->lat, &r->lat);
+	});
+}
+
 class s3_context {
 public:
     S3Status        status;
     off_t           content_length;
     int             retries;
-    int             t_sleep;
+    int             t_sleep;	// ms
+    int             req;	// S3_REQ_GET etc., for the stats
 
     struct iovec   *iov;
     int             iov_cnt;
@@ -61,16 +430,50 @@ public:
     size_t          bytes_xfered; //   and write
 
     std::list<std::string> *keys;
+    std::function<void(const char*)> *key_fn;
+    std::vector<uint32_t> *indexes;
+    size_t prefix_len;
+    const char *list_end;
     bool truncated;
-    char next_marker[256];
+    char next_marker[1024];
     
     std::string msg;
+    std::string etag;		// multipart upload
+    std::string upload_id;
+
+    uint64_t        gen;	// for the limiter
+    double          t_start;
     
-    s3_context() : retries (5), t_sleep (1), iov_cnt (0), bytes_xfered (0), status (S3StatusOK),
-		   truncated (false) {next_marker[0] = 0;}
+    s3_context() : retries (5), t_sleep (50), req (S3_REQ_GET), iov_cnt (0), bytes_wanted (0), bytes_xfered (0), status (S3StatusOK),
+		   key_fn (nullptr), indexes (nullptr), prefix_len (0), list_end (nullptr), truncated (false) {next_marker[0] = 0;}
+
+    // every request goes between begin() and end()
+    // (probes: acquire..admit is time waiting on the limiter,
+    // admit..request the request itself)
+    void begin(void) {
+	OBJ_PROBE2(s3wrap, acquire, req, bytes_wanted);
+	gen = limiter.acquire(thread_io_class, bytes_wanted);
+	OBJ_PROBE1(s3wrap, admit, req);
+	t_start = now_ms();
+    }
+    void end(void) {
+	double ms = now_ms() - t_start;
+	limiter.release(gen, ms, bytes_wanted, status);
+	count_request(req, ms, bytes_xfered, status);
+	OBJ_PROBE3(s3wrap, request, req, status, bytes_xfered);
+    }
+
+    // throttling is retried too - the limiter has already backed off,
+    // so the sleep here is short and jittered (up to 50ms, 100ms, ...)
     bool should_retry(void) {
+	if (!S3_status_is_retryable(status) && !is_throttle(status))
+	    return false;
 	if (retries--) {
-	    sleep(t_sleep++);
+	    count_retry(req);
+	    OBJ_PROBE2(s3wrap, retry, req, status);
+	    usleep(1000 * (random() % t_sleep + 1));
+	    t_sleep *= 2;
+	    bytes_xfered = 0;
 	    return true;
 	}
 	return false;
@@ -91,6 +494,8 @@ S3Status response_properties(const S3ResponseProperties *p, void *data)
 {
     s3_context *ctx = (s3_context*)data;
     ctx->content_length = p->contentLength;
+    if (p->eTag != NULL)
+	ctx->etag = p->eTag;
     return S3StatusOK;
 }
 
@@ -144,7 +549,9 @@ S3Status s3_target::s3_get(std::string key, ssize_t offset, ssize_t len,
 				S3UriStylePath, access.c_str(), secret.c_str(),
 				0,   /* security token */
 				0 }; /* authRegion */    
+    OBJ_PROBE3(s3wrap, get_start, key.c_str(), offset, len);
     do {
+        ctx.begin();
         S3_get_object(&bkt_ctx,
                       key.c_str(),
                       NULL,     /* no conditions */
@@ -154,12 +561,178 @@ S3Status s3_target::s3_get(std::string key, ssize_t offset, ssize_t len,
                       0,        /* timeoutMs */
                       &h,
                       (void*)&ctx);
-    } while (S3_status_is_retryable(ctx.status) && ctx.should_retry());
+        ctx.end();
+    } while (ctx.should_retry());
+    OBJ_PROBE3(s3wrap, get_done, key.c_str(), ctx.status, ctx.bytes_xfered);
 
     // TODO throw exception if status != S3StatusOK
     return ctx.status;
 }
 
+/* Asynchronous GETs, for callers that would otherwise need a thread
+ * per outstanding read: a few event loop threads each drive a libs3
+ * request context (a curl multi handle), and the completion callback
+ * runs on the loop thread. Requests still go through the limiter - the
+ * callback it gets posts the request to a loop - and retries wait on
+ * the loop's timer list rather than in usleep().
+ */
+static const int n_loops = 2;
+
+class s3_loop;
+
+struct s3_async_get : public s3_context {
+    std::string     key;
+    ssize_t         offset;
+    S3BucketContext bkt_ctx;
+    s3_loop        *loop;
+    std::function<void(S3Status)> done;
+};
+
+class s3_loop {
+    std::mutex                   m;
+    std::vector<s3_async_get*>   queue;		// ready to start
+    std::multimap<double, s3_async_get*> retries; // by time; loop thread only
+    int                          wake_fd[2];
+    S3RequestContext            *rctx;
+
+    void start(s3_async_get *g);
+    void run(void);
+
+public:
+    s3_loop() {
+	if (pipe2(wake_fd, O_NONBLOCK | O_CLOEXEC) < 0 ||
+	    S3_create_request_context(&rctx) != S3StatusOK)
+	    abort();
+	std::thread(&s3_loop::run, this).detach();
+    }
+    void post(s3_async_get *g);
+    void complete(s3_async_get *g);
+};
+
+static std::atomic<int> next_loop;
+
+static s3_loop *get_loop(void)
+{
+    static s3_loop *loops = new s3_loop[n_loops];
+    return &loops[next_loop++ % n_loops];
+}
+
+extern "C" void async_complete(S3Status status, const S3ErrorDetails *error, void *data);
+void async_complete(S3Status status, const S3ErrorDetails *error, void *data)
+{
+    s3_async_get *g = (s3_async_get*)data;
+    g->status = status;
+    g->loop->complete(g);
+}
+
+void s3_loop::post(s3_async_get *g)
+{
+    std::unique_lock lk(m);
+    queue.push_back(g);
+    if (queue.size() == 1 && write(wake_fd[1], "", 1) < 0)
+	;			// pipe full, so it's awake anyway
+}
+
+void s3_loop::start(s3_async_get *g)
+{
+    static S3GetObjectHandler h = {{response_properties, async_complete},
+				   recv_data_callback};
+    g->t_start = now_ms();
+    S3_get_object(&g->bkt_ctx, g->key.c_str(), NULL, g->offset, g->bytes_wanted,
+		  rctx, 0, &h, (void*)g);
+}
+
+// on the loop thread, from S3_runonce_request_context()
+//
+void s3_loop::complete(s3_async_get *g)
+{
+    double ms = now_ms() - g->t_start;
+    count_request(S3_REQ_GET, ms, g->bytes_xfered, g->status);
+    OBJ_PROBE3(s3wrap, request, S3_REQ_GET, g->status, g->bytes_xfered);
+    bool retry = S3_status_is_retryable(g->status) || is_throttle(g->status);
+    if (retry && g->retries--) {
+	count_retry(S3_REQ_GET);
+	OBJ_PROBE2(s3wrap, retry, S3_REQ_GET, g->status);
+	g->gen = limiter.retry(g->gen, ms, g->bytes_wanted, g->status);
+	retries.insert({now_ms() + random() % g->t_sleep + 1, g});
+	g->t_sleep *= 2;
+	g->bytes_xfered = 0;
+	return;
+    }
+    limiter.release(g->gen, ms, g->bytes_wanted, g->status);
+    OBJ_PROBE3(s3wrap, get_async_done, g->key.c_str(), g->status, g->bytes_xfered);
+    g->done(g->status);
+    delete g;
+}
+
+void s3_loop::run(void)
+{
+    for (;;) {
+	char buf[64];
+	while (read(wake_fd[0], buf, sizeof(buf)) > 0)
+	    ;
+	std::vector<s3_async_get*> ready;
+	std::unique_lock lk(m);
+	ready.swap(queue);
+	lk.unlock();
+	for (auto g : ready)
+	    start(g);
+	double now = now_ms();
+	while (!retries.empty() && retries.begin()->first <= now) {
+	    auto g = retries.begin()->second;
+	    retries.erase(retries.begin());
+	    start(g);
+	}
+	if (limiter.async_waiting())
+	    limiter.poll();
+
+	int running = 0;
+	S3_runonce_request_context(rctx, &running);
+
+	fd_set rfds, wfds, efds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	int maxfd = -1;
+	S3_get_request_context_fdsets(rctx, &rfds, &wfds, &efds, &maxfd);
+	// curl has no sockets yet for a request that's just starting
+	int64_t timeout = 1000;
+	if (running > 0) {
+	    int64_t t = S3_get_request_context_timeout(rctx);
+	    timeout = (maxfd < 0) ? 1 : (t < 0 ? timeout : t);
+	}
+	if (!retries.empty())
+	    timeout = std::min(timeout, (int64_t)(retries.begin()->first - now) + 1);
+	if (limiter.async_waiting())
+	    timeout = std::min(timeout, (int64_t)10);
+	FD_SET(wake_fd[0], &rfds);
+	maxfd = std::max(maxfd, wake_fd[0]);
+	struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+	select(maxfd + 1, &rfds, &wfds, &efds, &tv);
+    }
+}
+
+void s3_target::s3_get_async(std::string key, ssize_t offset, ssize_t len,
+			     struct iovec *iov, int iov_cnt,
+			     std::function<void(S3Status)> done)
+{
+    s3_async_get *g = new s3_async_get;
+    g->key = key;
+    g->offset = offset;
+    g->iov = iov;
+    g->iov_cnt = iov_cnt;
+    g->bytes_wanted = len;
+    g->bkt_ctx = { host.c_str(), bucket.c_str(), protocol, S3UriStylePath,
+		   access.c_str(), secret.c_str(), 0, 0 };
+    g->loop = get_loop();
+    g->done = done;
+    OBJ_PROBE3(s3wrap, get_async_start, g->key.c_str(), offset, len);
+    limiter.acquire_async(thread_io_class, len, [g](uint64_t gen) {
+	    g->gen = gen;
+	    g->loop->post(g);
+	});
+}
+
 int put_data_callback(int size, char *buf, void *data)
 {
     s3_context *ctx = (s3_context*)data;
@@ -170,7 +743,27 @@ int put_data_callback(int size, char *buf, void *data)
     return size;
 }
 
-S3Status s3_target::s3_put(std::string key, struct iovec *iov, int iov_cnt)
+// base64 of the big-endian CRC, as x-amz-checksum-crc32c wants it
+static void crc_to_base64(uint32_t crc, char *buf)
+{
+    static const char b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint8_t b[4] = {(uint8_t)(crc >> 24), (uint8_t)(crc >> 16),
+		    (uint8_t)(crc >> 8), (uint8_t)crc};
+    buf[0] = b64[b[0] >> 2];
+    buf[1] = b64[((b[0] & 3) << 4) | (b[1] >> 4)];
+    buf[2] = b64[((b[1] & 15) << 2) | (b[2] >> 6)];
+    buf[3] = b64[b[2] & 63];
+    buf[4] = b64[b[3] >> 2];
+    buf[5] = b64[(b[3] & 3) << 4];
+    buf[6] = buf[7] = '=';
+    buf[8] = 0;
+}
+
+// if @crc32c is given, the store verifies the data against it
+//
+S3Status s3_target::s3_put(std::string key, struct iovec *iov, int iov_cnt,
+			   const uint32_t *crc32c)
 {
     S3PutObjectHandler h;
     h.responseHandler.propertiesCallback = response_properties;
@@ -178,6 +771,7 @@ S3Status s3_target::s3_put(std::string key, struct iovec *iov, int iov_cnt)
     h.putObjectDataCallback = put_data_callback;
 
     s3_context ctx;
+    ctx.req = S3_REQ_PUT;
     ctx.iov = iov;
     ctx.iov_cnt = iov_cnt;
     size_t len = ctx.bytes_wanted = iov_sum(iov, iov_cnt);
@@ -196,9 +790,18 @@ S3Status s3_target::s3_put(std::string key, struct iovec *iov, int iov_cnt)
 				 S3CannedAclPrivate,
 				 0,    // metaproperties count 
 				 NULL, // metaproperty list 
-				 0};   // use server encryption 
+				 0,    // use server encryption 
+				 NULL}; // CRC32C 
 
+    char crc_b64[12];
+    if (crc32c != nullptr) {
+	crc_to_base64(*crc32c, crc_b64);
+	put_prop.checksumCRC32C = crc_b64;
+    }
+
+    OBJ_PROBE2(s3wrap, put_start, key.c_str(), len);
     do {
+        ctx.begin();
         S3_put_object(&bkt_ctx,
                       key.c_str(),
                       len,
@@ -207,7 +810,9 @@ S3Status s3_target::s3_put(std::string key, struct iovec *iov, int iov_cnt)
                       0,        /* timeoutMs */
                       &h,
                       (void*)&ctx);
-    } while (S3_status_is_retryable(ctx.status) && ctx.should_retry());
+        ctx.end();
+    } while (ctx.should_retry());
+    OBJ_PROBE2(s3wrap, put_done, key.c_str(), ctx.status);
 
     return ctx.status;
 }
@@ -219,30 +824,232 @@ S3Status s3_target::s3_head(std::string key, ssize_t *p_len)
     h.completeCallback = response_complete;
 
     s3_context ctx;
+    ctx.req = S3_REQ_HEAD;
     S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
 				S3UriStylePath, access.c_str(), secret.c_str(),
 				0,   /* security token */
 				0 }; /* authRegion */    
 
     do {
+        ctx.begin();
         S3_head_object(&bkt_ctx,
 		       key.c_str(),
 		       0,        /* requestContext */
 		       0,        /* timeoutMs */
 		       &h, 
 		       (void*)&ctx);
-    } while (S3_status_is_retryable(ctx.status) && ctx.should_retry());
+        ctx.end();
+    } while (ctx.should_retry());
 
     // TODO throw exception if status != S3StatusOK
     *p_len = ctx.content_length;
     return ctx.status;
 }
 
+S3Status s3_target::s3_delete(std::string key)
+{
+    S3ResponseHandler h;
+    h.propertiesCallback = response_properties;
+    h.completeCallback = response_complete;
+
+    s3_context ctx;
+    ctx.req = S3_REQ_DELETE;
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+
+    do {
+        ctx.begin();
+        S3_delete_object(&bkt_ctx,
+			 key.c_str(),
+			 0,        /* requestContext */
+			 0,        /* timeoutMs */
+			 &h,
+			 (void*)&ctx);
+        ctx.end();
+    } while (ctx.should_retry());
+
+    return ctx.status;
+}
+
+extern "C" S3Status delete_error_callback(const char *key, const char *code,
+					  const char *message, void *data);
+S3Status delete_error_callback(const char *key, const char *code,
+			       const char *message, void *data)
+{
+    s3_context *ctx = (s3_context*)data;
+    ctx->keys->push_back(std::string(key));
+    return S3StatusOK;
+}
+
+/* Delete @keys, S3_MAX_DELETE_KEYS at a time with multi-object delete.
+ * Keys it reports as failed get a single DELETE each, which gives us a
+ * real status. If the store doesn't do multi-object delete at all (Not
+ * Implemented or Method Not Allowed) we remember that and delete them
+ * all one at a time; any other failure goes back to the caller, so a
+ * transient proxy error doesn't switch it off for good.
+ */
+S3Status s3_target::s3_delete(std::vector<std::string> &keys)
+{
+    S3DeleteMultipleObjectsHandler h;
+    h.responseHandler.propertiesCallback = response_properties;
+    h.responseHandler.completeCallback = response_complete;
+    h.errorCallback = delete_error_callback;
+
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+
+    std::list<std::string> singles;
+    for (size_t i = 0; i < keys.size(); i += S3_MAX_DELETE_KEYS) {
+	size_t n = std::min(keys.size() - i, (size_t)S3_MAX_DELETE_KEYS);
+	if (no_multi_delete) {
+	    singles.insert(singles.end(), keys.begin() + i, keys.begin() + i + n);
+	    continue;
+	}
+	std::vector<const char*> batch;
+	for (size_t j = i; j < i + n; j++)
+	    batch.push_back(keys[j].c_str());
+
+	std::list<std::string> failed;
+	s3_context ctx;
+	ctx.req = S3_REQ_DELETE;
+	ctx.keys = &failed;
+	do {
+	    failed.clear();
+	    ctx.begin();
+	    S3_delete_multiple_objects(&bkt_ctx,
+				       n,
+				       batch.data(),
+				       0,        /* requestContext */
+				       0,        /* timeoutMs */
+				       &h,
+				       (void*)&ctx);
+	    ctx.end();
+	} while (ctx.should_retry());
+
+	if (ctx.status == S3StatusErrorNotImplemented ||
+	    ctx.status == S3StatusErrorMethodNotAllowed) {
+	    no_multi_delete = true;
+	    singles.insert(singles.end(), keys.begin() + i, keys.begin() + i + n);
+	}
+	else if (ctx.status != S3StatusOK)
+	    return ctx.status;
+	else
+	    singles.splice(singles.end(), failed);
+    }
+
+    S3Status status = S3StatusOK;
+    for (auto key : singles) {
+	S3Status st = s3_delete(key);
+	if (st != S3StatusOK && st != S3StatusHttpErrorNotFound)
+	    status = st;
+    }
+    return status;
+}
+
+/* Background deletion of retired objects: keys are queued by retire()
+ * and deleted in batches, in the GC I/O class, once a full batch has
+ * built up or the oldest has waited @delay_ms.
+ */
+s3_deleter::s3_deleter(s3_target *_target, int _delay_ms) :
+    target(_target), delay_ms(_delay_ms)
+{
+    thread = std::thread(&s3_deleter::worker, this);
+}
+
+s3_deleter::~s3_deleter()
+{
+    drain();
+    {
+	std::unique_lock lk(m);
+	stop = true;
+	cv.notify_all();
+    }
+    thread.join();
+}
+
+void s3_deleter::retire(std::string key)
+{
+    std::unique_lock lk(m);
+    pending.push_back(key);
+    if (pending.size() >= S3_MAX_DELETE_KEYS)
+	cv.notify_all();
+}
+
+// wait until everything retired so far has been deleted
+//
+void s3_deleter::drain(void)
+{
+    std::unique_lock lk(m);
+    flush_now = true;
+    cv.notify_all();
+    while (!pending.empty() || busy)
+	done_cv.wait(lk);
+    flush_now = false;
+}
+
+void s3_deleter::worker(void)
+{
+    s3_set_io_class(S3_IO_GC);
+    std::unique_lock lk(m);
+    while (!stop) {
+	if (pending.empty()) {
+	    cv.wait(lk);
+	    continue;
+	}
+	// give a partial batch a chance to fill up
+	if (pending.size() < S3_MAX_DELETE_KEYS && !flush_now && !stop)
+	    cv.wait_for(lk, std::chrono::milliseconds(delay_ms));
+	std::vector<std::string> batch;
+	size_t n = std::min(pending.size(), (size_t)S3_MAX_DELETE_KEYS);
+	batch.assign(pending.begin(), pending.begin() + n);
+	pending.erase(pending.begin(), pending.begin() + n);
+	busy = true;
+
+	lk.unlock();
+	S3Status status = target->s3_delete(batch);
+	lk.lock();
+
+	busy = false;
+	stats.requests++;
+	if (status == S3StatusOK)
+	    stats.deleted += n;
+	else
+	    stats.failed += n;
+	done_cv.notify_all();
+    }
+}
+
 // TODO: need to handle exceptions properly
 
+// exactly 8 lowercase hex digits, i.e. what "%08x" produces
+//
+static bool parse_index(const char *hex, uint32_t *index)
+{
+    uint32_t val = 0;
+    for (int i = 0; i < 8; i++) {
+	char c = hex[i];
+	if (c >= '0' && c <= '9')
+	    val = (val << 4) | (c - '0');
+	else if (c >= 'a' && c <= 'f')
+	    val = (val << 4) | (c - 'a' + 10);
+	else
+	    return false;
+    }
+    *index = val;
+    return hex[8] == 0;
+}
+
 extern "C" S3Status list_callback(int, const char *, int, const S3ListBucketContent *,
 				  int, const char **, void *);
 
+// keys go to ctx->indexes (decoded), ctx->key_fn, or ctx->keys,
+// whichever is set first. A key at or past ctx->list_end (if set) ends
+// the listing.
+//
 S3Status list_callback(int isTruncated, const char *nextMarker,
 		       int contentsCount,
 		       const S3ListBucketContent *contents,
@@ -252,28 +1059,47 @@ S3Status list_callback(int isTruncated, const char *nextMarker,
 {
     s3_context *ctx = (s3_context *)callbackData;
     ctx->truncated = isTruncated != 0;
-    if (nextMarker)
-	snprintf(ctx->next_marker, sizeof(ctx->next_marker), "%s", nextMarker);
-    else
-	ctx->next_marker[0] = 0;
-    
+
     for (int i = 0; i < contentsCount; i++) {
-	std::string tmp(contents[i].key);
-	ctx->keys->push_back(tmp);
+	const char *key = contents[i].key;
+	if (ctx->list_end != nullptr && strcmp(key, ctx->list_end) >= 0) {
+	    ctx->truncated = false;
+	    return S3StatusOK;
+	}
+	uint32_t index;
+	if (ctx->indexes != nullptr) {
+	    if (parse_index(key + ctx->prefix_len, &index))
+		ctx->indexes->push_back(index);
+	}
+	else if (ctx->key_fn != nullptr)
+	    (*ctx->key_fn)(key);
+	else
+	    ctx->keys->push_back(std::string(key));
     }
+
+    // without a delimiter, S3 doesn't send NextMarker - the next page
+    // starts after the last key
+    if (nextMarker && nextMarker[0])
+	snprintf(ctx->next_marker, sizeof(ctx->next_marker), "%s", nextMarker);
+    else if (contentsCount > 0)
+	snprintf(ctx->next_marker, sizeof(ctx->next_marker), "%s",
+		 contents[contentsCount-1].key);
     return S3StatusOK;
 }
 
-S3Status s3_target::s3_list(std::string prefix, std::list<std::string> &keys)
+// list from ctx->next_marker until the end of @prefix or ctx->list_end,
+// @maxkeys per request (0 = the store's default). If @one_page, stop
+// after the first page.
+//
+S3Status s3_target::list_pages(std::string prefix, s3_context *ctx,
+			       int maxkeys, bool one_page)
 {
+    ctx->req = S3_REQ_LIST;
     S3ListBucketHandler h;
     h.responseHandler.propertiesCallback = response_properties;
     h.responseHandler.completeCallback = response_complete;
     h.listBucketCallback = list_callback;
 
-    s3_context ctx;
-    ctx.keys = &keys;
-    
     S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
 				S3UriStylePath, access.c_str(), secret.c_str(),
 				0,   /* security token */
@@ -281,19 +1107,544 @@ S3Status s3_target::s3_list(std::string prefix, std::list<std::string> &keys)
 
     do {
         do {
+            ctx->begin();
             S3_list_bucket(&bkt_ctx,
 			   prefix.c_str(),
-			   ctx.next_marker,
+			   ctx->next_marker,
                            0,   // delimiter
-			   0,	// maxkeys
+			   maxkeys,
 			   0,	// request context
 			   0,	// timeout ms
 			   &h,
-			   (void*) &ctx);
-        } while (S3_status_is_retryable(ctx.status) && ctx.should_retry());
-    } while (ctx.truncated && ctx.status == S3StatusOK);
+			   (void*) ctx);
+            ctx->end();
+        } while (ctx->should_retry());
+    } while (ctx->truncated && ctx->status == S3StatusOK && !one_page);
 
     // TODO throw exception if status != S3StatusOK
+    return ctx->status;
+}
+
+S3Status s3_target::s3_list(std::string prefix, std::list<std::string> &keys)
+{
+    s3_context ctx;
+    ctx.keys = &keys;
+    return list_pages(prefix, &ctx, 0, false);
+}
+
+/* Object keys are "<prefix>%08x[suffix]", and the indexes are dense
+ * from zero, so the ranges are cut by index value. A range starting at
+ * index @i (a multiple of 16) lists from the marker "<prefix>" + hex(i)
+ * with the trailing zeros stripped: that sorts after every key with a
+ * lower index, and before every key with index >= i.
+ */
+static std::string range_marker(std::string prefix, uint32_t i)
+{
+    char hex[16];
+    sprintf(hex, "%08x", i);
+    int n = 8;
+    while (n > 0 && hex[n-1] == '0')
+	n--;
+    return prefix + std::string(hex, n);
+}
+
+// the index in "<prefix>%08x[suffix]", or -1
+//
+static int64_t key_index(std::string prefix, std::string key)
+{
+    if (key.length() < prefix.length() + 8)
+	return -1;
+    char *end;
+    std::string hex = key.substr(prefix.length(), 8);
+    int64_t val = strtoul(hex.c_str(), &end, 16);
+    return (*end == 0 && hex.find_first_of("ABCDEF") == std::string::npos) ? val : -1;
+}
+
+// index of the first key at or after index @i (a multiple of 16), or -1
+//
+int64_t s3_target::probe_index(std::string prefix, uint32_t i)
+{
+    std::string key;
+    std::function<void(const char*)> fn = [&](const char *k) {
+	if (key == "")
+	    key = k;
+    };
+    s3_context ctx;
+    ctx.key_fn = &fn;
+    snprintf(ctx.next_marker, sizeof(ctx.next_marker), "%s",
+	     range_marker(prefix, i).c_str());
+    if (list_pages(prefix, &ctx, 1, true) != S3StatusOK)
+	return -1;
+    return key_index(prefix, key);
+}
+
+/* List @prefix in @nthreads ranges at once, calling @setup(i, ctx) to
+ * say where range i's keys go before it starts.
+ *
+ * The first page is listed on its own, into range 0; if it's the whole
+ * prefix (most are) that's all. Otherwise the highest index is found
+ * by probing with single-key listings, @nthreads at a time, each round
+ * cutting the interval it's in by nthreads+1. Then the rest of the key
+ * space, after the first page, is split into @nthreads ranges listed
+ * concurrently. The last range is open-ended, so keys that aren't
+ * "<prefix>%08x..." are still seen.
+ */
+S3Status s3_target::list_ranges(std::string prefix, int nthreads,
+				std::function<void(int, s3_context*)> setup)
+{
+    s3_context first;
+    setup(0, &first);
+    if (nthreads <= 1)
+	return list_pages(prefix, &first, 0, false);
+
+    S3Status st = list_pages(prefix, &first, 0, true);
+    if (st != S3StatusOK || !first.truncated)
+	return st;
+
+    int cls = thread_io_class;
+    int64_t lo = key_index(prefix, first.next_marker);	// an index that exists
+    int64_t top = 1ll << 32;	// no index >= top
+    if (lo < 0)
+	top = 0;		// past the indexes already, finish in range 0
+
+    // stop once the top is known to within 1/(8*nthreads)
+    while (top - lo > 16 && (top - lo) * 8 * nthreads > top) {
+	std::vector<uint32_t> at;
+	for (int i = 1; i <= nthreads; i++) {
+	    uint32_t p = (lo + (top - lo) * i / (nthreads + 1)) & ~15ll;
+	    if (p > lo && (at.empty() || p > at.back()))
+		at.push_back(p);
+	}
+	if (at.empty())
+	    break;
+	std::vector<int64_t> next(at.size());
+	std::vector<std::thread> probes;
+	for (size_t i = 0; i < at.size(); i++)
+	    probes.push_back(std::thread([&, i]() {
+			s3_set_io_class(cls);
+			next[i] = probe_index(prefix, at[i]);
+		    }));
+	for (auto &t : probes)
+	    t.join();
+	for (size_t i = 0; i < at.size(); i++)
+	    if (next[i] >= 0)
+		lo = std::max(lo, next[i]);
+	    else {
+		top = at[i];
+		break;
+	    }
+    }
+
+    // ranges start after the first page, rounded up to a multiple of 16
+    int64_t base = key_index(prefix, first.next_marker) + 1;
+    int64_t hi = std::min(top, (int64_t)0xfffffff0);
+    if (base <= 0 || hi - base < 16ll * nthreads)
+	nthreads = 1;
+
+    std::vector<std::string> bounds;	// marker for each range
+    for (int i = 0; i < nthreads; i++)
+	bounds.push_back(range_marker(prefix, ((base + (hi - base) * i / nthreads) + 15) & ~15ll));
+
+    std::vector<S3Status> status(nthreads, S3StatusOK);
+    auto list_one = [&](int i) {
+	s3_set_io_class(cls);
+	s3_context ctx;
+	s3_context *c = &first;		// range 0 carries on after the first page
+	if (i > 0) {
+	    c = &ctx;
+	    setup(i, c);
+	    snprintf(c->next_marker, sizeof(c->next_marker), "%s", bounds[i].c_str());
+	}
+	if (i < nthreads-1)
+	    c->list_end = bounds[i+1].c_str();
+	status[i] = list_pages(prefix, c, 0, false);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nthreads; i++)
+	threads.push_back(std::thread(list_one, i));
+    list_one(0);
+    for (auto &t : threads)
+	t.join();
+
+    for (auto st : status)
+	if (st != S3StatusOK)
+	    return st;
+    return S3StatusOK;
+}
+
+/* Streaming list - @fn is called for each key, one call at a time but
+ * from any thread, in order within each range but not overall.
+ */
+S3Status s3_target::s3_list(std::string prefix, std::function<void(const char*)> fn,
+			    int nthreads)
+{
+    std::mutex m;
+    std::function<void(const char*)> locked_fn = [&](const char *key) {
+	std::unique_lock lk(m);
+	fn(key);
+    };
+    return list_ranges(prefix, nthreads, [&](int i, s3_context *ctx) {
+	    ctx->key_fn = (nthreads > 1) ? &locked_fn : &fn;
+	});
+}
+
+/* Object indexes under @prefix, in order: keys that are exactly
+ * "<prefix>%08x" are decoded as they come out of the response parser,
+ * anything else is skipped. Nothing is allocated per key - each range
+ * fills its own vector, and they're joined at the end.
+ */
+S3Status s3_target::s3_list_indexes(std::string prefix, std::vector<uint32_t> &indexes,
+				    int nthreads)
+{
+    std::vector<std::vector<uint32_t>> ranges(std::max(nthreads, 1));
+    S3Status status = list_ranges(prefix, nthreads, [&](int i, s3_context *ctx) {
+	    ctx->indexes = &ranges[i];
+	    ctx->prefix_len = prefix.length();
+	});
+    if (status != S3StatusOK)
+	return status;
+    for (auto &r : ranges)
+	indexes.insert(indexes.end(), r.begin(), r.end());
+    return S3StatusOK;
+}
+
+/* Multipart upload pieces for s3_assemble(). Parts are numbered from 1.
+ */
+extern "C" S3Status initiate_callback(const char *upload_id, void *data);
+S3Status initiate_callback(const char *upload_id, void *data)
+{
+    s3_context *ctx = (s3_context*)data;
+    ctx->upload_id = upload_id;
+    return S3StatusOK;
+}
+
+extern "C" S3Status commit_callback(const char *location, const char *etag, void *data);
+S3Status commit_callback(const char *location, const char *etag, void *data)
+{
+    return S3StatusOK;
+}
+
+S3Status s3_target::mp_begin(std::string key, std::string &upload_id)
+{
+    S3MultipartInitialHandler h;
+    h.responseHandler.propertiesCallback = response_properties;
+    h.responseHandler.completeCallback = response_complete;
+    h.responseXmlCallback = initiate_callback;
+
+    s3_context ctx;
+    ctx.req = S3_REQ_MULTIPART;
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+
+    do {
+        ctx.begin();
+        S3_initiate_multipart(&bkt_ctx,
+			      key.c_str(),
+			      NULL,     /* putProperties */
+			      &h,
+			      0,        /* requestContext */
+			      0,        /* timeoutMs */
+			      (void*)&ctx);
+        ctx.end();
+    } while (ctx.should_retry());
+
+    upload_id = ctx.upload_id;
+    if (ctx.status == S3StatusOK && upload_id == "")
+	return S3StatusHttpErrorUnknown;
+    return ctx.status;
+}
+
+S3Status s3_target::mp_part(std::string key, std::string upload_id, int n,
+			    struct iovec *iov, int iov_cnt, std::string &etag)
+{
+    S3PutObjectHandler h;
+    h.responseHandler.propertiesCallback = response_properties;
+    h.responseHandler.completeCallback = response_complete;
+    h.putObjectDataCallback = put_data_callback;
+
+    s3_context ctx;
+    ctx.req = S3_REQ_MULTIPART;
+    ctx.iov = iov;
+    ctx.iov_cnt = iov_cnt;
+    size_t len = ctx.bytes_wanted = iov_sum(iov, iov_cnt);
+
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+
+    do {
+        ctx.begin();
+        S3_upload_part(&bkt_ctx,
+		       key.c_str(),
+		       NULL,     /* putProperties */
+		       &h,
+		       n,
+		       upload_id.c_str(),
+		       len,
+		       0,        /* requestContext */
+		       0,        /* timeoutMs */
+		       (void*)&ctx);
+        ctx.end();
+    } while (ctx.should_retry());
+
+    etag = ctx.etag;
+    return ctx.status;
+}
+
+// part @n is @len bytes at @offset in @src, copied by the server
+//
+S3Status s3_target::mp_copy(std::string key, std::string upload_id, int n,
+			    std::string src, size_t offset, size_t len,
+			    std::string &etag)
+{
+    S3ResponseHandler h;
+    h.propertiesCallback = response_properties;
+    h.completeCallback = response_complete;
+
+    s3_context ctx;
+    ctx.req = S3_REQ_MULTIPART;
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+    char etag_buf[256];
+    int64_t last_modified;
+
+    do {
+	etag_buf[0] = 0;
+        ctx.begin();
+        S3_copy_object_range(&bkt_ctx,
+			     src.c_str(),
+			     bucket.c_str(),
+			     key.c_str(),
+			     n,
+			     upload_id.c_str(),
+			     offset,
+			     len,
+			     NULL,     /* putProperties */
+			     &last_modified,
+			     sizeof(etag_buf),
+			     etag_buf,
+			     0,        /* requestContext */
+			     0,        /* timeoutMs */
+			     &h,
+			     (void*)&ctx);
+        ctx.end();
+    } while (ctx.should_retry());
+
+    etag = etag_buf;
+    if (ctx.status == S3StatusOK && etag == "")
+	return S3StatusHttpErrorUnknown;
+    return ctx.status;
+}
+
+S3Status s3_target::mp_complete(std::string key, std::string upload_id,
+				std::vector<std::string> &etags)
+{
+    S3MultipartCommitHandler h;
+    h.responseHandler.propertiesCallback = response_properties;
+    h.responseHandler.completeCallback = response_complete;
+    h.putObjectDataCallback = put_data_callback;
+    h.responseXmlCallback = commit_callback;
+
+    std::ostringstream out;
+    out << "<CompleteMultipartUpload>";
+    for (size_t i = 0; i < etags.size(); i++)
+	out << "<Part><PartNumber>" << i+1 << "</PartNumber><ETag>"
+	    << etags[i] << "</ETag></Part>";
+    out << "</CompleteMultipartUpload>";
+    std::string body = out.str();
+
+    struct iovec iov = {(void*)body.data(), body.length()};
+    s3_context ctx;
+    ctx.req = S3_REQ_MULTIPART;
+    ctx.iov = &iov;
+    ctx.iov_cnt = 1;
+    ctx.bytes_wanted = body.length();
+
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+
+    do {
+        ctx.begin();
+        S3_complete_multipart_upload(&bkt_ctx,
+				     key.c_str(),
+				     &h,
+				     upload_id.c_str(),
+				     body.length(),
+				     0,        /* requestContext */
+				     0,        /* timeoutMs */
+				     (void*)&ctx);
+        ctx.end();
+    } while (ctx.should_retry());
+
     return ctx.status;
 }
 
+// best effort - libs3 doesn't give us the status
+//
+void s3_target::mp_abort(std::string key, std::string upload_id)
+{
+    S3AbortMultipartUploadHandler h = {{NULL, NULL}};
+    S3BucketContext bkt_ctx = { host.c_str(), bucket.c_str(), protocol,
+				S3UriStylePath, access.c_str(), secret.c_str(),
+				0,   /* security token */
+				0 }; /* authRegion */    
+    s3_context ctx;
+    ctx.req = S3_REQ_MULTIPART;
+    ctx.begin();
+    S3_abort_multipart_upload(&bkt_ctx, key.c_str(), upload_id.c_str(), 0, &h);
+    ctx.end();
+}
+
+// S3 limits: every part but the last is at least part_min, no part
+// is over part_max. Data going through the client is sent in parts of
+// about part_flush.
+//
+static const size_t part_min = 5 * 1024 * 1024;
+static const size_t part_max = (size_t)5 * 1024 * 1024 * 1024;
+static const size_t part_flush = 16 * 1024 * 1024;
+
+static std::mutex copy_mutex;
+static struct s3_copy_stats copy_totals;
+
+void s3_relocation_stats(struct s3_copy_stats *st)
+{
+    std::unique_lock lk(copy_mutex);
+    *st = copy_totals;
+}
+
+/* Write @key as the concatenation of @pieces (e.g. the live extents of
+ * objects being cleaned, plus a new header). Spans of an existing
+ * object that can make a part of their own are copied on the server
+ * with upload-part-copy; everything else is read into a buffer and
+ * uploaded from here. A short buffer in front of a large span is
+ * topped up from the head of the span, if what's left is still big
+ * enough to copy. If nothing is worth copying it's a single PUT.
+ */
+S3Status s3_target::s3_assemble(std::string key, std::vector<s3_piece> &pieces,
+				struct s3_copy_stats *st)
+{
+    struct s3_copy_stats s = {};
+    s.objects = 1;
+    std::vector<char> buf;
+    S3Status status = S3StatusOK;
+
+    // append @len bytes of @src at @offset to the buffer
+    auto fetch = [&](std::string &src, size_t offset, size_t len) {
+	size_t n = buf.size();
+	buf.resize(n + len);
+	struct iovec iov = {(void*)&buf[n], len};
+	s.downloaded += len;
+	return s3_get(src, offset, len, &iov, 1);
+    };
+    auto append = [&](struct iovec *iov, int iov_cnt) {
+	size_t n = buf.size(), len = iov_sum(iov, iov_cnt);
+	buf.resize(n + len);
+	memcpy_from_iov(iov, iov_cnt, 0, (void*)&buf[n], len);
+    };
+
+    bool any_copy = false;
+    for (auto &p : pieces)
+	if (p.src != "" && p.len >= part_min)
+	    any_copy = true;
+
+    if (!any_copy) {
+	for (auto &p : pieces) {
+	    if (p.src == "")
+		append(p.iov, p.iov_cnt);
+	    else {
+		s.relocated += p.len;
+		if ((status = fetch(p.src, p.offset, p.len)) != S3StatusOK)
+		    return status;
+	    }
+	}
+	struct iovec iov = {(void*)buf.data(), buf.size()};
+	if ((status = s3_put(key, &iov, 1)) != S3StatusOK)
+	    return status;
+	s.uploaded += buf.size();
+    }
+    else {
+	std::string upload_id;
+	if ((status = mp_begin(key, upload_id)) != S3StatusOK)
+	    return status;
+
+	std::vector<std::string> etags;
+	auto flush = [&]() {
+	    if (buf.empty())
+		return S3StatusOK;
+	    struct iovec iov = {(void*)buf.data(), buf.size()};
+	    std::string etag;
+	    S3Status st = mp_part(key, upload_id, etags.size()+1, &iov, 1, etag);
+	    s.uploaded += buf.size();
+	    buf.clear();
+	    etags.push_back(etag);
+	    return st;
+	};
+
+	for (auto &p : pieces) {
+	    if (p.src == "")
+		append(p.iov, p.iov_cnt);
+	    else {
+		size_t offset = p.offset, len = p.len;
+		s.relocated += len;
+		if (!buf.empty() && buf.size() < part_min && len >= part_min &&
+		    len - (part_min - buf.size()) >= part_min) {
+		    size_t n = part_min - buf.size();
+		    if ((status = fetch(p.src, offset, n)) != S3StatusOK)
+			break;
+		    offset += n;
+		    len -= n;
+		}
+		if (len >= part_min && (buf.empty() || buf.size() >= part_min)) {
+		    if ((status = flush()) != S3StatusOK)
+			break;
+		    while (len > 0) {
+			size_t n = std::min(len, part_max);
+			if (len > n && len - n < part_min)
+			    n = len - part_min;
+			std::string etag;
+			status = mp_copy(key, upload_id, etags.size()+1,
+					 p.src, offset, n, etag);
+			if (status != S3StatusOK)
+			    break;
+			etags.push_back(etag);
+			s.copied += n;
+			offset += n;
+			len -= n;
+		    }
+		    if (status != S3StatusOK)
+			break;
+		}
+		else if ((status = fetch(p.src, offset, len)) != S3StatusOK)
+		    break;
+	    }
+	    if (buf.size() >= part_flush && (status = flush()) != S3StatusOK)
+		break;
+	}
+	if (status == S3StatusOK)
+	    status = flush();
+	if (status == S3StatusOK)
+	    status = mp_complete(key, upload_id, etags);
+	if (status != S3StatusOK) {
+	    mp_abort(key, upload_id);
+	    return status;
+	}
+    }
+
+    std::unique_lock lk(copy_mutex);
+    copy_totals.objects += s.objects;
+    copy_totals.relocated += s.relocated;
+    copy_totals.copied += s.copied;
+    copy_totals.downloaded += s.downloaded;
+    copy_totals.uploaded += s.uploaded;
+    if (st != nullptr)
+	*st = s;
+    return S3StatusOK;
+}
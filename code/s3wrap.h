@@ -6,10 +6,113 @@
 #ifndef __S3WRAP_H__
 #define __S3WRAP_H__
 
+#include "objstats.h"
+
+/* state of the adaptive limit on requests in flight (see s3wrap.cc)
+ */
+struct s3_limit_stats {
+    double   limit;
+    int      inflight;
+    uint64_t requests;
+    uint64_t throttles;         /* SlowDown / 503 responses */
+    uint64_t latency_cuts;      /* latency over 2x baseline */
+    uint64_t decreases;         /* times the limit was actually cut */
+};
+
+/* I/O classes, highest priority first. Each thread's requests go in
+ * the class it last set with s3_set_io_class() (default S3_IO_READ),
+ * which returns the previous class, or -1 and changes nothing if @cls
+ * is out of range. Default WFQ weights are 16, 8, 4, 2, 1.
+ */
+enum {
+    S3_IO_READ = 0,             /* foreground reads */
+    S3_IO_FSYNC,                /* flush that someone is waiting for */
+    S3_IO_FLUSH,                /* background flush */
+    S3_IO_PREFETCH,
+    S3_IO_GC,                   /* cleaning, compaction */
+    S3_IO_NCLASSES
+};
+
+struct s3_io_stats {
+    uint64_t requests;
+    uint64_t bytes;
+    double   queue_ms;          /* total queueing delay */
+    double   max_queue_ms;
+    int      queued;            /* waiting now */
+};
+
+/* bytes moved by s3_assemble(). For an object made only of relocated
+ * data, client traffic per relocated byte is (downloaded + uploaded) /
+ * relocated: 2.0 if it all goes through the client, near 0 if it's all
+ * copied on the server.
+ */
+struct s3_copy_stats {
+    uint64_t objects;
+    uint64_t relocated;         /* bytes taken from existing objects */
+    uint64_t copied;            /*   - copied by the server */
+    uint64_t downloaded;        /*   - read by the client */
+    uint64_t uploaded;          /* sent by the client, incl. new data */
+};
+
+/* HTTP requests by type, from all threads since the process started.
+ * A retried request counts once per try; bytes are what was actually
+ * sent or received.
+ */
+enum {
+    S3_REQ_GET = 0,
+    S3_REQ_PUT,
+    S3_REQ_HEAD,
+    S3_REQ_LIST,
+    S3_REQ_DELETE,
+    S3_REQ_MULTIPART,           /* initiate, part, copy, complete, abort */
+    S3_REQ_NTYPES
+};
+
+struct s3_req_stats {
+    uint64_t bytes;
+    uint64_t retries;
+    uint64_t errors;            /* tries that failed, retried or not */
+    struct lat_hist lat;
+};
+
 #ifdef __cplusplus
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class s3_context;
+
+/* piece of an object built by s3_target::s3_assemble(): @len bytes at
+ * @offset in existing object @src (on the same target), or if @src is
+ * empty, client data in @iov
+ */
+struct s3_piece {
+    std::string   src;
+    size_t        offset, len;
+    struct iovec *iov;
+    int           iov_cnt;
+};
+
 class s3_target {
     std::string     host, bucket, access, secret;
     S3Protocol      protocol;
+    std::atomic<bool> no_multi_delete {false};
+
+    S3Status list_pages(std::string prefix, s3_context *ctx, int maxkeys, bool one_page);
+    int64_t probe_index(std::string prefix, uint32_t i);
+    S3Status list_ranges(std::string prefix, int nthreads,
+			 std::function<void(int, s3_context*)> setup);
+    S3Status mp_begin(std::string key, std::string &upload_id);
+    S3Status mp_part(std::string key, std::string upload_id, int n,
+		     struct iovec *iov, int iov_cnt, std::string &etag);
+    S3Status mp_copy(std::string key, std::string upload_id, int n,
+		     std::string src, size_t offset, size_t len, std::string &etag);
+    S3Status mp_complete(std::string key, std::string upload_id,
+			 std::vector<std::string> &etags);
+    void mp_abort(std::string key, std::string upload_id);
     
 public:
     s3_target(const char *_host, const char *_bucket, const char *_access,
@@ -20,15 +123,57 @@ public:
 
     S3Status s3_get(std::string key, ssize_t offset, ssize_t len,
 		     struct iovec *iov, int iov_cnt);
-    S3Status s3_put(std::string key, struct iovec *iov, int iov_cnt);
+    // returns at once; @done is called from an event loop thread, so it
+    // shouldn't block for long
+    void s3_get_async(std::string key, ssize_t offset, ssize_t len,
+		      struct iovec *iov, int iov_cnt,
+		      std::function<void(S3Status)> done);
+    S3Status s3_put(std::string key, struct iovec *iov, int iov_cnt,
+		    const uint32_t *crc32c = nullptr);
     S3Status s3_head(std::string key, ssize_t *p_len);
+    S3Status s3_delete(std::string key);
+    S3Status s3_delete(std::vector<std::string> &keys);
     S3Status s3_list(std::string prefix, std::list<std::string> &keys);
+    S3Status s3_list(std::string prefix, std::function<void(const char*)> fn,
+		     int nthreads = 1);
+    S3Status s3_list_indexes(std::string prefix, std::vector<uint32_t> &indexes,
+			     int nthreads = 1);
+    S3Status s3_assemble(std::string key, std::vector<s3_piece> &pieces,
+			 struct s3_copy_stats *st = nullptr);
+};
+
+class s3_deleter {
+    s3_target              *target;
+    int                     delay_ms;
+    std::mutex              m;
+    std::condition_variable cv, done_cv;
+    std::vector<std::string> pending;
+    bool                    busy = false, flush_now = false, stop = false;
+    std::thread             thread;
+    void worker(void);
+
+public:
+    struct {
+	uint64_t requests, deleted, failed;
+    } stats = {};
+
+    s3_deleter(s3_target *_target, int _delay_ms = 1000);
+    ~s3_deleter();
+    void retire(std::string key);
+    void drain(void);
 };
 
 extern "C" void *s3_init(char *bucket, char *host, char *access, char *secret);
 extern "C" S3Status s3_read(void *_t, char *key, ssize_t offset, ssize_t len, struct iovec *iov, int iov_cnt);
 extern "C" S3Status s3_write(void *_t, char *key, struct iovec *iov, int iov_cnt);
 extern "C" S3Status s3_len(void *_t, char *key, ssize_t *p_len);
+extern "C" void s3_concurrency_limits(int min, int max);
+extern "C" void s3_concurrency_stats(struct s3_limit_stats *st);
+extern "C" int s3_set_io_class(int cls);
+extern "C" void s3_io_class_limits(int cls, double weight, double bytes_sec, double iops);
+extern "C" void s3_io_class_stats(int cls, struct s3_io_stats *st);
+extern "C" void s3_relocation_stats(struct s3_copy_stats *st);
+extern "C" void s3_request_stats(int type, struct s3_req_stats *st);
 
 #else
 
@@ -38,6 +183,13 @@ void *s3_init(char *bucket, char *host, char *access, char *secret);
 S3Status s3_read(void *_t, char *key, ssize_t offset, ssize_t len, struct iovec *iov, int iov_cnt);
 S3Status s3_write(void *_t, char *key, struct iovec *iov, int iov_cnt);
 S3Status s3_len(void *_t, char *key, ssize_t *p_len);
+void s3_concurrency_limits(int min, int max);
+void s3_concurrency_stats(struct s3_limit_stats *st);
+int s3_set_io_class(int cls);
+void s3_io_class_limits(int cls, double weight, double bytes_sec, double iops);
+void s3_io_class_stats(int cls, struct s3_io_stats *st);
+void s3_relocation_stats(struct s3_copy_stats *st);
+void s3_request_stats(int type, struct s3_req_stats *st);
 
 #endif
 
@@ -0,0 +1,169 @@
+//
+// file:        stripe.cc
+// description: placement of log objects across multiple S3 targets
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <list>
+#include <string>
+#include <sstream>
+#include <libs3.h>
+
+#include "s3wrap.h"
+#include "stripe.h"
+
+// integer mix (murmur3 finalizer) so that consecutive indexes land on
+// unrelated targets and shards
+//
+static uint32_t mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// targets passed in belong to the caller
+//
+void s3_stripe::add_target(s3_target *t, std::string host, std::string bucket)
+{
+    targets.push_back(t);
+    deleters.push_back(nullptr);
+    names.push_back(std::make_pair(host, bucket));
+}
+
+void s3_stripe::add_target(std::string host, std::string bucket,
+			   const char *access, const char *secret)
+{
+    created.push_back(new s3_target(host.c_str(), bucket.c_str(), access, secret, false));
+    add_target(created.back(), host, bucket);
+}
+
+// the deleters finish what's been retired and stop
+//
+s3_stripe::~s3_stripe()
+{
+    for (auto d : deleters)
+	delete d;
+    for (auto t : created)
+	delete t;
+}
+
+int s3_stripe::slot(uint32_t index)
+{
+    uint32_t n = targets.size();
+    return (hashed ? mix(index) : index) % n;
+}
+
+s3_target *s3_stripe::target(uint32_t index)
+{
+    return targets[slot(index)];
+}
+
+// objects no longer needed (after cleaning) are deleted in batches by
+// each target's deleter thread, started the first time it's needed
+//
+void s3_stripe::retire(uint32_t index)
+{
+    int i = slot(index);
+    std::unique_lock lk(m);
+    if (deleters[i] == nullptr)
+	deleters[i] = new s3_deleter(targets[i]);
+    s3_deleter *d = deleters[i];
+    lk.unlock();
+    d->retire(key(index));
+}
+
+void s3_stripe::drain(void)
+{
+    std::unique_lock lk(m);
+    std::vector<s3_deleter*> v = deleters;
+    lk.unlock();
+    for (auto d : v)
+	if (d != nullptr)
+	    d->drain();
+}
+
+// shard prefix uses a different hash from placement, otherwise with
+// hashed placement each target would only see a fraction of the shards
+//
+std::string s3_stripe::key(uint32_t index, const char *suffix)
+{
+    char _key[1024];
+    if (shards > 0)
+	snprintf(_key, sizeof(_key), "%x/%s.%08x%s",
+		 mix(index ^ 0x5bd1e995) % shards, prefix.c_str(), index, suffix);
+    else
+	snprintf(_key, sizeof(_key), "%s.%08x%s", prefix.c_str(), index, suffix);
+    return std::string(_key);
+}
+
+// prefixes to list (on every target) to find all the objects
+//
+std::vector<std::string> s3_stripe::list_prefixes(void)
+{
+    std::vector<std::string> v;
+    if (shards == 0)
+	v.push_back(prefix + ".");
+    for (int i = 0; i < shards; i++) {
+	char tmp[16];
+	snprintf(tmp, sizeof(tmp), "%x/", i);
+	v.push_back(tmp + prefix + ".");
+    }
+    return v;
+}
+
+/* layout object:
+ *   hashed=0|1
+ *   shards=N
+ *   target=HOST BUCKET     (one line per target, in order)
+ */
+std::string s3_stripe::layout(void)
+{
+    std::ostringstream out;
+    out << "hashed=" << (hashed ? 1 : 0) << "\n";
+    out << "shards=" << shards << "\n";
+    for (auto [host, bucket] : names)
+	out << "target=" << host << " " << bucket << "\n";
+    return out.str();
+}
+
+bool s3_stripe::parse_layout(std::string text, const char *access, const char *secret)
+{
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+	char host[256], bucket[256];
+	int val;
+	if (sscanf(line.c_str(), "hashed=%d", &val) == 1)
+	    hashed = (val != 0);
+	else if (sscanf(line.c_str(), "shards=%d", &val) == 1)
+	    shards = val;
+	else if (sscanf(line.c_str(), "target=%255s %255s", host, bucket) == 2)
+	    add_target(host, bucket, access, secret);
+	else if (line != "")
+	    return false;
+    }
+    return !targets.empty();
+}
+
+// config string is "HOST/BUCKET,HOST/BUCKET,..."
+//
+bool s3_stripe::parse_config(const char *config, const char *access, const char *secret)
+{
+    std::istringstream in(config);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+	auto slash = item.find('/');
+	if (slash == std::string::npos || slash == 0 || slash+1 == item.length())
+	    return false;
+	add_target(item.substr(0, slash), item.substr(slash+1), access, secret);
+    }
+    return !targets.empty();
+}
@@ -0,0 +1,50 @@
+//
+// file:        stripe.h
+// description: placement of log objects across multiple S3 targets
+//
+
+#ifndef __STRIPE_H__
+#define __STRIPE_H__
+
+#ifdef __cplusplus
+
+/* Objects are assigned to one of a list of (host, bucket) targets by
+ * index, either round-robin or by a hash of the index. Optionally the
+ * key gets a hashed shard prefix ("3/prefix.0000001c") so that
+ * sequential indexes spread across the store's index partitions.
+ *
+ * The layout is saved as a small text object "<prefix>.stripe" next to
+ * the first object, so a mount can recover it without any options.
+ */
+struct s3_stripe {
+    std::vector<s3_target*> targets;
+    std::vector<s3_deleter*> deleters;	// one per target, on first retire()
+    std::vector<s3_target*> created;	// targets we made, so delete
+    std::mutex              m;
+    std::vector<std::pair<std::string,std::string>> names; // host, bucket
+    std::string prefix;
+    bool        hashed;		// place by hash, not round-robin
+    int         shards;		// 0 = no shard prefix
+
+    s3_stripe(std::string _prefix) : prefix(_prefix), hashed(false), shards(0) {}
+    ~s3_stripe();
+
+    void add_target(std::string host, std::string bucket,
+		    const char *access, const char *secret);
+    void add_target(s3_target *t, std::string host, std::string bucket);
+    int slot(uint32_t index);		// which target
+    s3_target *target(uint32_t index);
+    std::string key(uint32_t index, const char *suffix = "");
+    std::vector<std::string> list_prefixes(void);
+
+    void retire(uint32_t index);	// delete in the background
+    void drain(void);
+
+    std::string layout(void);
+    bool parse_layout(std::string text, const char *access, const char *secret);
+    bool parse_config(const char *targets, const char *access, const char *secret);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+//
+// file:        test-blkstore.cc
+// description: blkstore write / replay / checkpoint round trip
+//
+// test-blkstore [-n writes] bucket/prefix
+//
+// Writes go to a fresh prefix "<prefix>-<pid>" on the S3 target from
+// S3_HOSTNAME, S3_ACCESS_KEY_ID and S3_SECRET_ACCESS_KEY. Every sector
+// written holds its LBA and a generation number, and a model of the
+// device says what each read should return:
+//   1. random writes, read back before and after a flush; close
+//      (which saves a checkpoint)
+//   2. reopen - the map comes from the checkpoint; more writes with
+//      the read cache on, flush, and leave it open without a close
+//   3. open it again read-only, as after a crash - checkpoint plus the
+//      data objects after it
+//   4. close the writer (second checkpoint), open read-only again
+// Prints OK or FAILED.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <libs3.h>
+#include "s3wrap.h"
+#include "blkstore.h"
+
+static const int64_t sectors = 65536;	// 32MB device
+static const int max_write = 256;	// sectors
+static std::vector<uint32_t> model(sectors);	// generation, 0 = never written
+static uint32_t generation;
+static int failures;
+
+static void fill_sector(char *p, int64_t lba, uint32_t gen)
+{
+    if (gen == 0) {
+	memset(p, 0, 512);
+	return;
+    }
+    uint64_t x = lba * 0x9e3779b97f4a7c15ull + gen;
+    for (int i = 0; i < 512; i += 8) {
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	memcpy(p + i, &x, 8);
+    }
+    memcpy(p, &lba, 8);
+    memcpy(p + 8, &gen, 4);
+}
+
+static void do_write(void *bs, int64_t lba, int n)
+{
+    std::vector<char> buf(n * 512);
+    generation++;
+    for (int i = 0; i < n; i++) {
+	fill_sector(&buf[i * 512], lba + i, generation);
+	model[lba + i] = generation;
+    }
+    // split in two iovecs, to check they're gathered right
+    size_t half = (n / 2) * 512;
+    struct iovec iov[2] = {{buf.data(), half}, {buf.data() + half, buf.size() - half}};
+    int rv = blk_write(bs, lba * 512, n * 512, iov, 2);
+    if (rv != 0) {
+	printf("write %ld+%d: %d\n", (long)lba, n, rv);
+	failures++;
+    }
+}
+
+static void random_writes(void *bs, int n)
+{
+    for (int i = 0; i < n; i++) {
+	int len = 1 + random() % max_write;
+	do_write(bs, random() % (sectors - len), len);
+    }
+}
+
+// the whole device, in pieces of varying size, against the model
+//
+static void verify(void *bs, const char *what)
+{
+    int bad = 0;
+    std::vector<char> buf(max_write * 4 * 512), expected(512);
+    for (int64_t lba = 0; lba < sectors; ) {
+	int n = std::min(sectors - lba, (int64_t)(1 + random() % (max_write * 4)));
+	struct iovec iov = {buf.data(), (size_t)n * 512};
+	int rv = blk_read(bs, lba * 512, n * 512, &iov, 1);
+	if (rv != 0) {
+	    printf("%s: read %ld+%d: %d\n", what, (long)lba, n, rv);
+	    failures++;
+	    return;
+	}
+	for (int i = 0; i < n; i++) {
+	    fill_sector(expected.data(), lba + i, model[lba + i]);
+	    if (memcmp(&buf[i * 512], expected.data(), 512) != 0 && bad++ < 5) {
+		int64_t got_lba;
+		uint32_t got_gen;
+		memcpy(&got_lba, &buf[i * 512], 8);
+		memcpy(&got_gen, &buf[i * 512 + 8], 4);
+		printf("%s: sector %ld: lba %ld gen %u (should be gen %u)\n", what,
+		       (long)(lba + i), (long)got_lba, got_gen, model[lba + i]);
+	    }
+	}
+	lba += n;
+    }
+    if (bad > 0) {
+	printf("%s: %d bad sectors\n", what, bad);
+	failures++;
+    }
+}
+
+static void usage(void)
+{
+    printf("usage: test-blkstore [-n writes] bucket/prefix\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int n_writes = 400, opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+	switch (opt) {
+	case 'n': n_writes = atoi(optarg); break;
+	default: usage();
+	}
+    }
+    char *bucket, *_prefix;
+    if (optind + 1 != argc || n_writes < 1 ||
+	sscanf(argv[optind], "%m[^/]/%ms", &bucket, &_prefix) != 2)
+	usage();
+
+    const char *host = getenv("S3_HOSTNAME");
+    const char *access = getenv("S3_ACCESS_KEY_ID");
+    const char *secret = getenv("S3_SECRET_ACCESS_KEY");
+    if (!host || !access || !secret) {
+	printf("need S3_HOSTNAME, S3_ACCESS_KEY_ID, S3_SECRET_ACCESS_KEY\n");
+	exit(1);
+    }
+    s3_target *s3 = new s3_target(host, bucket, access, secret, false);
+    std::string prefix = std::string(_prefix) + "-" + std::to_string(getpid());
+    srandom(getpid());
+
+    // 1. write, flush, close
+    void *bs = blk_open(s3, prefix.c_str(), sectors, true, 0);
+    if (bs == NULL) {
+	printf("%s/%s: open failed\n", bucket, prefix.c_str());
+	exit(1);
+    }
+    verify(bs, "empty");
+    random_writes(bs, n_writes);
+    verify(bs, "before flush");
+    if (blk_flush(bs) != 0) {
+	printf("flush failed\n");
+	failures++;
+    }
+    verify(bs, "after flush");
+    blk_close(bs);
+
+    // 2. replay from the checkpoint, write more through the cache
+    bs = blk_open(s3, prefix.c_str(), sectors, true, 8 * 1024 * 1024);
+    if (bs == NULL) {
+	printf("reopen failed\n");
+	exit(1);
+    }
+    verify(bs, "reopened");
+    random_writes(bs, n_writes / 2);
+    verify(bs, "cached");
+    random_writes(bs, n_writes / 2);
+    if (blk_flush(bs) != 0) {
+	printf("flush failed\n");
+	failures++;
+    }
+    verify(bs, "cached, after flush");
+
+    // 3. without the writer's close: checkpoint + the objects after it
+    void *ro = blk_open(s3, prefix.c_str(), sectors, false, 0);
+    if (ro == NULL) {
+	printf("read-only open failed\n");
+	exit(1);
+    }
+    verify(ro, "replayed");
+    blk_close(ro);
+
+    // 4. the writer closes, and the new checkpoint has it all
+    blk_close(bs);
+    ro = blk_open(s3, prefix.c_str(), sectors, false, 0);
+    if (ro == NULL) {
+	printf("read-only open failed\n");
+	exit(1);
+    }
+    verify(ro, "second checkpoint");
+    blk_close(ro);
+
+    printf("%s/%s: %u writes: %s\n", bucket, prefix.c_str(), generation,
+	   failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
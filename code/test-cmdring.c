@@ -0,0 +1,147 @@
+/*
+ * file:        test-cmdring.c
+ * description: multi-threaded put/get stress test for cmdring.h
+ *
+ * test-cmdring [producers consumers per_producer ring_size]
+ *
+ * Producers put commands tagged (producer, sequence) into one small
+ * ring, spinning when it's full. Consumers take batches of random size
+ * up to 16. Every command has to come out exactly once, and each
+ * consumer has to see any one producer's commands in the order they
+ * were put. A lost command stalls the ring, so no progress for 10
+ * seconds is a failure too. Prints OK or FAILED.
+ *
+ * gcc -O2 -o test-cmdring test-cmdring.c -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cmdring.h"
+
+#define MAX_THREADS 64
+#define MAX_BATCH 16
+
+static int n_producers = 4, n_consumers = 4;
+static long per_producer = 1000000;
+static int ring_size = 16;
+
+static struct cmd_ring ring;
+static _Atomic(unsigned char) *seen;    /* per command: times taken */
+static _Atomic long taken;
+static _Atomic int errors;
+
+static void *producer(void *arg)
+{
+    long p = (long)arg;
+    for (long i = 0; i < per_producer; i++) {
+        struct ring_cmd c = {.op = OP_WRITE, .cmd = (void*)p, .iov = NULL,
+                             .iov_cnt = 0, .length = i, .offset = p};
+        while (!ring_put(&ring, &c))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    long last[MAX_THREADS];
+    for (int i = 0; i < n_producers; i++)
+        last[i] = -1;
+    unsigned int seed = (long)arg;
+    long total = n_producers * per_producer;
+    struct ring_cmd batch[MAX_BATCH];
+
+    while (atomic_load(&taken) < total) {
+        int n = ring_get(&ring, batch, 1 + rand_r(&seed) % MAX_BATCH);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            long p = batch[i].offset, seq = batch[i].length;
+            if (p < 0 || p >= n_producers || (long)batch[i].cmd != p ||
+                seq < 0 || seq >= per_producer) {
+                if (atomic_fetch_add(&errors, 1) < 10)
+                    printf("bad command: producer %ld seq %ld\n", p, seq);
+                continue;
+            }
+            if (seq <= last[p] && atomic_fetch_add(&errors, 1) < 10)
+                printf("producer %ld: %ld after %ld\n", p, seq, last[p]);
+            last[p] = seq;
+            if (atomic_fetch_add(&seen[p * per_producer + seq], 1) != 0 &&
+                atomic_fetch_add(&errors, 1) < 10)
+                printf("producer %ld seq %ld taken twice\n", p, seq);
+        }
+        atomic_fetch_add(&taken, n);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && argc != 5) {
+        printf("usage: test-cmdring [producers consumers per_producer ring_size]\n");
+        exit(1);
+    }
+    if (argc == 5) {
+        n_producers = atoi(argv[1]);
+        n_consumers = atoi(argv[2]);
+        per_producer = atol(argv[3]);
+        ring_size = atoi(argv[4]);
+    }
+    if (n_producers < 1 || n_producers > MAX_THREADS || n_consumers < 1 ||
+        n_consumers > MAX_THREADS || per_producer < 1 ||
+        ring_size < 2 || (ring_size & (ring_size - 1)) != 0) {
+        printf("bad arguments (ring_size must be a power of 2)\n");
+        exit(1);
+    }
+
+    ring_init(&ring, ring_size);
+    seen = calloc(n_producers * per_producer, 1);
+
+    pthread_t th[2 * MAX_THREADS];
+    for (long i = 0; i < n_consumers; i++)
+        pthread_create(&th[i], NULL, consumer, (void*)(i + 1));
+    for (long i = 0; i < n_producers; i++)
+        pthread_create(&th[n_consumers + i], NULL, producer, (void*)i);
+
+    long total = n_producers * per_producer, prev = -1;
+    for (int stalled = 0; atomic_load(&taken) < total; ) {
+        sleep(1);
+        long now = atomic_load(&taken);
+        stalled = (now == prev) ? stalled + 1 : 0;
+        prev = now;
+        if (stalled == 10) {
+            printf("stuck after %ld of %ld commands: FAILED\n", now, total);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n_consumers + n_producers; i++)
+        pthread_join(th[i], NULL);
+
+    long missing = 0;
+    for (long i = 0; i < n_producers * per_producer; i++)
+        if (atomic_load(&seen[i]) == 0)
+            missing++;
+    if (missing > 0) {
+        printf("%ld commands never taken\n", missing);
+        errors++;
+    }
+    struct ring_cmd c;
+    if (ring_get(&ring, &c, 1) != 0 || ring_count(&ring) != 0) {
+        printf("ring not empty at the end\n");
+        errors++;
+    }
+    ring_free(&ring);
+    free(seen);
+
+    printf("%ld commands, %d producers, %d consumers, ring of %d: %s\n",
+           n_producers * per_producer, n_producers, n_consumers, ring_size,
+           errors ? "FAILED" : "OK");
+    return errors ? 1 : 0;
+}
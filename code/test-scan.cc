@@ -0,0 +1,353 @@
+//
+// file:        test-scan.cc
+// description: objfs-scan replay of hand-built log objects (objfs-log.h)
+//
+// test-scan [-k]
+//
+// Writes log objects into a temporary directory and replays them with
+// objfs_scan in local mode, the way objfs-fsck and objfs-export do.
+// First a well-formed log - creates, writes, overwrites, a rename
+// across directories, truncate, symlink, delete, chmod - that has to
+// come out as the expected tree and file contents with nothing
+// reported. Then a table of damaged logs, each of which has to be
+// reported at the right severity. -k keeps the directory.
+// Prints OK or FAILED.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include "objfs-scan.h"
+
+static int failures;
+
+#define check(cond, ...) do {						\
+	if (!(cond)) {							\
+	    printf("%s:%d: ", __FILE__, __LINE__);			\
+	    printf(__VA_ARGS__);					\
+	    printf("\n");						\
+	    failures++;							\
+	}								\
+    } while (0)
+
+// -------------- report() hook for objfs-scan
+
+static std::vector<std::pair<int,std::string>> reports;
+
+void report(int sev, int64_t index, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    reports.push_back({sev, buf});
+}
+
+// -------------- building objects
+
+struct obj_builder {
+    std::vector<char> meta, data;
+
+    void rec(int type, const void *p, size_t len) {
+	log_record r = {};
+	r.type = type;
+	r.len = len;
+	meta.insert(meta.end(), (char*)&r, (char*)&r + sizeof(r));
+	meta.insert(meta.end(), (char*)p, (char*)p + len);
+    }
+    // fixed part, then names
+    template<typename T> void rec(int type, T &fixed, std::string names = "") {
+	std::vector<char> buf((char*)&fixed, (char*)&fixed + sizeof(fixed));
+	buf.insert(buf.end(), names.begin(), names.end());
+	rec(type, buf.data(), buf.size());
+    }
+    void inode(uint32_t inum, uint32_t mode) {
+	log_inode in = {inum, mode, 1000, 1000, 0, {1700000000, 0}};
+	rec(LOG_INODE, in);
+    }
+    void create(uint32_t parent, uint32_t inum, std::string name) {
+	log_create c = {parent, inum, (uint8_t)name.length()};
+	rec(LOG_CREATE, c, name);
+    }
+    void remove(uint32_t parent, uint32_t inum, std::string name) {
+	log_delete d = {parent, inum, (uint8_t)name.length()};
+	rec(LOG_DELETE, d, name);
+    }
+    void write(uint32_t inum, int64_t offset, std::string bytes, int64_t size) {
+	log_data d = {inum, (uint32_t)data.size(), offset, size, (uint32_t)bytes.length()};
+	rec(LOG_DATA, d);
+	data.insert(data.end(), bytes.begin(), bytes.end());
+    }
+    void trunc(uint32_t inum, int64_t size) {
+	log_trunc t = {inum, size};
+	rec(LOG_TRUNC, t);
+    }
+    void symlink(uint32_t inum, std::string target) {
+	log_symlink s = {inum, (uint8_t)target.length()};
+	rec(LOG_SYMLNK, s, target);
+    }
+    void rename(uint32_t inum, uint32_t p1, std::string n1, uint32_t p2, std::string n2) {
+	log_rename r = {inum, p1, p2, (uint8_t)n1.length(), (uint8_t)n2.length()};
+	rec(LOG_RENAME, r, n1 + n2);
+    }
+    std::string bytes(uint32_t index, int32_t magic = OBJFS_MAGIC) {
+	obj_header h = {magic, 1, 1, (int32_t)(sizeof(h) + meta.size()), (int32_t)index};
+	std::string s((char*)&h, sizeof(h));
+	s.append(meta.begin(), meta.end());
+	s.append(data.begin(), data.end());
+	return s;
+    }
+};
+
+static std::string dir;
+
+static void put(std::string prefix, uint32_t index, std::string bytes)
+{
+    char name[32];
+    snprintf(name, sizeof(name), ".%08x", index);
+    std::string path = dir + "/" + prefix + name;
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == NULL || fwrite(bytes.data(), 1, bytes.size(), fp) != bytes.size()) {
+	perror(path.c_str());
+	exit(1);
+    }
+    fclose(fp);
+}
+
+// list and replay, the way objfs-fsck does
+//
+static bool replay(objfs_scan &scan, std::string prefix)
+{
+    reports.clear();
+    if (!scan.open((dir + "/" + prefix).c_str(), true, 2))
+	return false;
+    std::vector<std::pair<uint32_t,int>> found;
+    if (!scan.list(found))
+	return false;
+    for (auto [index, t] : found) {
+	scan.obj_pos[index] = scan.objs.size();
+	scan.objs.push_back({.index = index, .target = t});
+    }
+    scan.replay(2, false);
+    return true;
+}
+
+// file contents, from the extents
+//
+static std::string contents(objfs_scan &scan, node *n)
+{
+    std::string s(n->size, 0);
+    for (auto [offset, e] : n->extents) {
+	auto &o = scan.objs[scan.obj_pos[e.objnum]];
+	size_t got;
+	std::string error;
+	if (!scan.read(o, o.hdr_len + e.offset, &s[offset], e.len, &got, error) ||
+	    got != e.len)
+	    return "read failed: " + error;
+    }
+    return s;
+}
+
+// -------------- a good log
+
+static void test_good(void)
+{
+    obj_builder o0, o1, o2;
+    o0.inode(1, S_IFDIR | 0755);
+    o0.inode(2, S_IFREG | 0644);
+    o0.create(1, 2, "a");
+    o0.write(2, 0, "hello world", 11);
+    o0.inode(3, S_IFDIR | 0755);
+    o0.create(1, 3, "d");
+    o0.inode(5, S_IFLNK | 0777);
+    o0.symlink(5, "a");
+    o0.create(1, 5, "l");
+    put("good", 0, o0.bytes(0));
+
+    o1.write(2, 6, "WORLD!", 12);
+    o1.rename(2, 1, "a", 3, "c");
+    o1.inode(4, S_IFREG | 0644);
+    o1.create(3, 4, "b");
+    o1.write(4, 0, "0123456789", 10);
+    o1.trunc(4, 4);
+    put("good", 1, o1.bytes(1));
+
+    o2.inode(6, S_IFREG | 0644);
+    o2.create(1, 6, "gone");
+    o2.remove(1, 6, "gone");
+    o2.inode(2, S_IFREG | 0600);
+    put("good", 2, o2.bytes(2));
+
+    objfs_scan scan;
+    check(replay(scan, "good"), "good: open/list failed");
+    check(scan.objs.size() == 3, "good: %zu objects", scan.objs.size());
+    for (auto &[sev, msg] : reports)
+	check(false, "good: reported (%d): %s", sev, msg.c_str());
+
+    node *root = scan.find(1), *d = scan.find(3), *a = scan.find(2),
+	*b = scan.find(4), *l = scan.find(5);
+    check(root && d && a && b && l, "good: missing inodes");
+    check(scan.find(6) == nullptr, "good: deleted inode 6 is still there");
+    if (!root || !d || !a || !b || !l)
+	return;
+    check(root->dirents == (std::map<std::string,uint32_t>{{"d", 3}, {"l", 5}}),
+	  "good: root has %zu entries", root->dirents.size());
+    check(d->dirents == (std::map<std::string,uint32_t>{{"b", 4}, {"c", 2}}),
+	  "good: d has %zu entries", d->dirents.size());
+    check(a->mode == (S_IFREG | 0600), "good: mode %o", a->mode);
+    check(a->size == 12, "good: c is %ld bytes", (long)a->size);
+    check(contents(scan, a) == "hello WORLD!", "good: c is '%s'", contents(scan, a).c_str());
+    check(a->extents.size() == 2, "good: c has %zu extents", a->extents.size());
+    check(b->size == 4 && contents(scan, b) == "0123", "good: b is %ld bytes, '%s'",
+	  (long)b->size, contents(scan, b).c_str());
+    check(b->born == 1 && a->born == 0, "good: born %u %u", a->born, b->born);
+    check(l->target == "a", "good: symlink to '%s'", l->target.c_str());
+    check(scan.objs[1].data_bytes == 16, "good: object 1 has %lu data bytes",
+	  (unsigned long)scan.objs[1].data_bytes);
+}
+
+// -------------- damaged logs
+//
+// object 0 is a root directory with a file "f" (inode 2, 4 bytes) in
+// it; each case adds object 1, or mangles its bytes
+
+struct bad_case {
+    const char *name;
+    int         severity;	// expected, at least once
+    const char *message;	// in the report
+    std::function<void(obj_builder&)> build;
+    std::function<std::string(std::string)> mangle;
+};
+
+static std::string same(std::string s) { return s; }
+
+static bad_case bad_cases[] = {
+    {"magic", P_FATAL, "bad header",
+     [](obj_builder &o) { o.inode(3, S_IFREG | 0644); },
+     [](std::string s) { s[0] ^= 1; return s; }},
+    {"short", P_FATAL, "only",
+     [](obj_builder &o) {},
+     [](std::string s) { return s.substr(0, 6); }},
+    {"past header", P_FATAL, "runs past the header",
+     [](obj_builder &o) { o.create(1, 3, "x"); },
+     [](std::string s) {
+	 obj_header h;
+	 memcpy(&h, s.data(), sizeof(h));
+	 h.hdr_len -= 1;
+	 memcpy(&s[0], &h, sizeof(h));
+	 return s; }},
+    {"record type", P_FATAL, "bad record type",
+     [](obj_builder &o) { char x[4] = {}; o.rec(0, x, 4); }, same},
+    {"truncate up", P_FATAL, "up to",
+     [](obj_builder &o) { o.trunc(2, 100); }, same},
+    {"truncate missing", P_FATAL, "truncate of missing inode",
+     [](obj_builder &o) { o.trunc(9, 0); }, same},
+    {"rename missing", P_FATAL, "has no such entry",
+     [](obj_builder &o) { o.rename(2, 1, "nope", 1, "g"); }, same},
+    {"rename onto", P_FATAL, "onto existing",
+     [](obj_builder &o) {
+	 o.inode(3, S_IFREG | 0644);
+	 o.create(1, 3, "g");
+	 o.rename(2, 1, "f", 1, "g"); }, same},
+    {"data offset", P_ERROR, "expected",
+     [](obj_builder &o) {
+	 log_data d = {2, 100, 0, 4, 4};
+	 o.rec(LOG_DATA, d);
+	 o.data.insert(o.data.end(), 4, 'x'); }, same},
+    {"data past size", P_ERROR, "past its size",
+     [](obj_builder &o) { o.write(2, 0, "abcdefgh", 4); }, same},
+    {"object size", P_ERROR, "records account for",
+     [](obj_builder &o) { o.write(2, 0, "abcd", 4); },
+     [](std::string s) { return s + "extra"; }},
+    {"type change", P_ERROR, "changes type",
+     [](obj_builder &o) { o.inode(2, S_IFDIR | 0755); }, same},
+    {"delete wrong", P_ERROR, "names another inode",
+     [](obj_builder &o) {
+	 o.inode(3, S_IFREG | 0644);
+	 o.remove(1, 3, "f"); }, same},
+    {"create twice", P_ERROR, "replaces inode",
+     [](obj_builder &o) {
+	 o.inode(3, S_IFREG | 0644);
+	 o.create(1, 3, "f"); }, same},
+    {"create first", P_WARN, "before inode",
+     [](obj_builder &o) {
+	 o.create(1, 3, "g");
+	 o.inode(3, S_IFREG | 0644); }, same},
+    {"delete untruncated", P_WARN, "without truncating",
+     [](obj_builder &o) { o.remove(1, 2, "f"); }, same},
+};
+
+static void test_bad(void)
+{
+    obj_builder o0;
+    o0.inode(1, S_IFDIR | 0755);
+    o0.inode(2, S_IFREG | 0644);
+    o0.create(1, 2, "f");
+    o0.write(2, 0, "abcd", 4);
+
+    int n = 0;
+    for (auto &c : bad_cases) {
+	std::string prefix = "bad" + std::to_string(n++);
+	put(prefix, 0, o0.bytes(0));
+	obj_builder o1;
+	c.build(o1);
+	put(prefix, 1, c.mangle(o1.bytes(1)));
+
+	objfs_scan scan;
+	if (!replay(scan, prefix)) {
+	    check(false, "%s: open/list failed", c.name);
+	    continue;
+	}
+	bool found = false;
+	for (auto &[sev, msg] : reports)
+	    if (sev == c.severity && msg.find(c.message) != std::string::npos)
+		found = true;
+	check(found, "%s: no %s report containing \"%s\" (%zu reports)", c.name,
+	      c.severity == P_FATAL ? "fatal" : c.severity == P_ERROR ? "error" : "warning",
+	      c.message, reports.size());
+	if (!found)
+	    for (auto &[sev, msg] : reports)
+		printf("    (%d) %s\n", sev, msg.c_str());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool keep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "k")) != -1) {
+	if (opt != 'k') {
+	    printf("usage: test-scan [-k]\n");
+	    exit(1);
+	}
+	keep = true;
+    }
+
+    char tmpl[] = "/tmp/test-scan.XXXXXX";
+    if (mkdtemp(tmpl) == NULL) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    dir = tmpl;
+
+    test_good();
+    test_bad();
+
+    if (keep)
+	printf("log objects in %s\n", dir.c_str());
+    else
+	system(("rm -rf " + dir).c_str());
+
+    printf("%zu damaged logs: %s\n", sizeof(bad_cases) / sizeof(bad_cases[0]),
+	   failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}